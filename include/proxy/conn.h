@@ -29,6 +29,7 @@
 #include "proxy/session.h"
 
 struct proxy_conn;
+struct proxy_conn_connect;
 
 void proxy_conn_clear_username(const struct proxy_conn *pconn);
 void proxy_conn_clear_password(const struct proxy_conn *pconn);
@@ -41,10 +42,44 @@ const char *proxy_conn_get_hostport(const struct proxy_conn *pconn);
 int proxy_conn_get_port(const struct proxy_conn *pconn);
 conn_t *proxy_conn_get_server_conn(pool *p, struct proxy_session *proxy_sess,
   const pr_netaddr_t *remote_addr);
+
+/* Starts nonblocking connects to the addresses of the given backend, so that
+ * they proceed while the session does other work.  The addresses are raced
+ * in the style of RFC 8305: attempts alternate between address families,
+ * starting with the family which last won for the backend's host, and are
+ * started one after the other, a short delay apart.
+ *
+ * Use proxy_conn_connect_finish() to wait for the first attempt to complete
+ * and obtain its control connection (setting the session's dst_addr), or
+ * proxy_conn_connect_abort() to give up.  Either call releases the started
+ * connects.  The session's connect timeout runs from the call to
+ * proxy_conn_connect_finish(); an attempt which has already connected by
+ * then is used, however long ago it was started.
+ */
+struct proxy_conn_connect *proxy_conn_connect_start(pool *p,
+  struct proxy_session *proxy_sess, const struct proxy_conn *pconn);
+conn_t *proxy_conn_connect_finish(pool *p, struct proxy_session *proxy_sess,
+  struct proxy_conn_connect *pcc);
+void proxy_conn_connect_abort(struct proxy_conn_connect *pcc);
+
+/* Allocates the table of preferred address families, shared with the
+ * session processes.  Called by the daemon process.
+ */
+int proxy_conn_prefs_init(pool *p);
+int proxy_conn_prefs_free(pool *p);
+
 const char *proxy_conn_get_uri(const struct proxy_conn *pconn);
 const char *proxy_conn_get_username(const struct proxy_conn *pconn);
 const char *proxy_conn_get_password(const struct proxy_conn *pconn);
 int proxy_conn_get_tls(const struct proxy_conn *pconn);
+
+/* Returns the weight of the backend, as configured using the "weight" URI
+ * parameter, e.g. "ftp://host:21?weight=4"; the default weight is 1.
+ */
+unsigned int proxy_conn_get_weight(const struct proxy_conn *pconn);
+#define PROXY_CONN_DEFAULT_WEIGHT		1
+#define PROXY_CONN_MAX_WEIGHT			100
+
 int proxy_conn_send_proxy_v1(pool *p, conn_t *conn);
 int proxy_conn_send_proxy_v2(pool *p, conn_t *conn);
 void proxy_conn_free(const struct proxy_conn *pconn);
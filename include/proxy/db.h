@@ -48,6 +48,7 @@ struct proxy_dbh *proxy_db_open_with_version(pool *p, const char *table_path,
 #define PROXY_DB_OPEN_FL_INTEGRITY_CHECK			0x004
 #define PROXY_DB_OPEN_FL_VACUUM					0x008
 #define PROXY_DB_OPEN_FL_SKIP_VACUUM				0x010
+#define PROXY_DB_OPEN_FL_USE_WAL				0x020
 
 /* Close the database. */
 int proxy_db_close(pool *p, struct proxy_dbh *dbh);
@@ -71,6 +72,18 @@ int proxy_db_exec_stmt(pool *p, struct proxy_dbh *dbh, const char *stmt,
 array_header *proxy_db_exec_prepared_stmt(pool *p, struct proxy_dbh *dbh,
   const char *stmt, const char **errstr);
 
+/* Transactions, for grouping several writes into one.  The write lock is
+ * taken at the start of the transaction.
+ */
+int proxy_db_begin(pool *p, struct proxy_dbh *dbh);
+
+/* Begins a transaction as above, but without waiting for a database locked
+ * by another process; fails with EAGAIN instead.
+ */
+int proxy_db_try_begin(pool *p, struct proxy_dbh *dbh);
+int proxy_db_commit(pool *p, struct proxy_dbh *dbh);
+int proxy_db_rollback(pool *p, struct proxy_dbh *dbh);
+
 /* Rebuild the named index. */
 int proxy_db_reindex(pool *p, struct proxy_dbh *dbh, const char *index_name,
   const char **errstr);
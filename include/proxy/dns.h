@@ -0,0 +1,60 @@
+/*
+ * ProFTPD - mod_proxy DNS cache API
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_PROXY_DNS_H
+#define MOD_PROXY_DNS_H
+
+#include "mod_proxy.h"
+
+/* Default number of seconds for which resolved addresses are cached. */
+#define PROXY_DNS_DEFAULT_TTL		60
+
+/* Allocates the resolution cache, shared with the session processes, and
+ * starts the worker process which refreshes its entries before they expire.
+ * A TTL of zero disables the cache.  Called by the daemon process.
+ */
+int proxy_dns_init(pool *p, int ttl);
+int proxy_dns_free(pool *p);
+
+/* Called by each session process: releases the daemon's worker resources. */
+int proxy_dns_sess_init(void);
+
+/* Resolves the given name now, and caches the resolved addresses. */
+int proxy_dns_add(pool *p, const char *name);
+
+/* Caches the given addresses, already resolved for the given name, e.g. by
+ * proxy_conn_create() before the cache was allocated.
+ */
+int proxy_dns_add_addrs(pool *p, const char *name, const pr_netaddr_t *addr,
+  array_header *addrs);
+
+/* Returns the addresses for the given name, from the cache if possible,
+ * otherwise from the resolver (caching the result).  The semantics are those
+ * of pr_netaddr_get_addr(): the first address is returned, and any others
+ * are provided in the optional array.
+ */
+const pr_netaddr_t *proxy_dns_get_addr(pool *p, const char *name,
+  array_header **addrs);
+
+#endif /* MOD_PROXY_DNS_H */
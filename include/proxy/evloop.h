@@ -0,0 +1,91 @@
+/*
+ * ProFTPD - mod_proxy event loop API
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_PROXY_EVLOOP_H
+#define MOD_PROXY_EVLOOP_H
+
+#include "mod_proxy.h"
+
+struct proxy_evloop;
+
+struct proxy_evloop_event {
+  int fd;
+  int events;
+  void *data;
+};
+
+/* Readiness events, for registering interest and for reporting. */
+#define PROXY_EVLOOP_EV_READ		0x0001
+#define PROXY_EVLOOP_EV_WRITE		0x0002
+
+/* Reported only: error or hangup on the fd. */
+#define PROXY_EVLOOP_EV_ERROR		0x0004
+
+/* Registration only: report readiness edge-triggered, i.e. only when the
+ * fd becomes ready again after the caller has read/written until EAGAIN.
+ * When poll(2) is used, readiness is reported level-triggered instead; callers
+ * written for edge-triggered readiness work unchanged with that.
+ */
+#define PROXY_EVLOOP_EV_EDGE		0x0100
+
+/* Create a new event loop, using epoll(7) where available, and poll(2)
+ * otherwise.  The loop is destroyed along with the given pool.
+ */
+struct proxy_evloop *proxy_evloop_create(pool *p, int flags);
+#define PROXY_EVLOOP_FL_USE_POLL	0x0001
+
+int proxy_evloop_destroy(struct proxy_evloop *loop);
+
+/* Returns the name of the mechanism, e.g. "epoll" or "poll", used by the loop.
+ */
+const char *proxy_evloop_get_name(struct proxy_evloop *loop);
+
+/* Register/modify/unregister interest in events for the given fd.  Note that
+ * an fd registered with no events will still have errors reported only if
+ * it was registered as edge-triggered, and then only once.  Closing an fd
+ * implicitly unregisters it; adding an fd which is already registered
+ * replaces that registration.
+ */
+int proxy_evloop_add(struct proxy_evloop *loop, int fd, int events,
+  void *data);
+int proxy_evloop_modify(struct proxy_evloop *loop, int fd, int events,
+  void *data);
+int proxy_evloop_remove(struct proxy_evloop *loop, int fd);
+
+/* Unregister all fds from the loop. */
+int proxy_evloop_clear(struct proxy_evloop *loop);
+
+/* Wait up to the given timeout (in millisecs; -1 for no timeout) for events,
+ * filling in up to `max_events` events.  Returns the number of events, zero
+ * on timeout, or -1 on error (including EINTR).
+ */
+int proxy_evloop_wait(struct proxy_evloop *loop,
+  struct proxy_evloop_event *events, unsigned int max_events, int timeout_ms);
+
+/* Check the single given fd for readiness, without needing a loop.  Returns
+ * the ready events, zero on timeout, or -1 on error.
+ */
+int proxy_evloop_poll_fd(int fd, int events, int timeout_ms);
+
+#endif /* MOD_PROXY_EVLOOP_H */
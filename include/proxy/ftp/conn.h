@@ -34,4 +34,17 @@ conn_t *proxy_ftp_conn_connect(pool *p, const pr_netaddr_t *local_addr,
 conn_t *proxy_ftp_conn_listen(pool *p, const pr_netaddr_t *bind_addr,
   int frontend_data);
 
+/* Returns the socket buffer size to use for data connections, given the
+ * configured size.  For PROXY_FTP_CONN_XFER_BUFSZ_AUTO, the size is derived
+ * from the round-trip time observed on the given control connection.  Zero
+ * means that the default sizes should be used.
+ */
+size_t proxy_ftp_conn_get_xfer_bufsz(conn_t *ctrl_conn, size_t bufsz);
+#define PROXY_FTP_CONN_XFER_BUFSZ_AUTO		((size_t) -1)
+
+/* The largest configurable size; the relay buffers of each transfer take up
+ * to twice this.
+ */
+#define PROXY_FTP_CONN_XFER_MAX_BUFSZ		(8 * 1024 * 1024)
+
 #endif /* MOD_PROXY_FTP_CONN_H */
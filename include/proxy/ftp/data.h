@@ -31,4 +31,53 @@ pr_buffer_t *proxy_ftp_data_recv(pool *p, conn_t *conn, int frontend_data);
 int proxy_ftp_data_send(pool *p, conn_t *conn, pr_buffer_t *pbuf,
   int frontend_data);
 
+/* Use a buffer of the given size for reading data from the connection in
+ * proxy_ftp_data_recv(), rather than the default TransferBufferSize-based
+ * size.
+ */
+int proxy_ftp_data_set_bufsz(conn_t *conn, size_t bufsz);
+
+/* Fixed-size ring buffer of data read from a source data connection, and
+ * not yet written to the destination data connection.
+ */
+struct proxy_ftp_data_ring;
+
+struct proxy_ftp_data_ring *proxy_ftp_data_ring_alloc(pool *p, size_t size);
+
+/* Returns the number of buffered bytes, and the available space, in bytes. */
+size_t proxy_ftp_data_ring_len(struct proxy_ftp_data_ring *ring);
+size_t proxy_ftp_data_ring_space(struct proxy_ftp_data_ring *ring);
+
+/* Copy the data from the given buffer into the ring, after generating the
+ * "mod_proxy.data-write" event for it.  If the ring does not have enough
+ * space for all of the data (e.g. because a listener grew them), the ring
+ * is grown.
+ */
+int proxy_ftp_data_ring_put(struct proxy_ftp_data_ring *ring,
+  pr_buffer_t *pbuf);
+
+/* Write the buffered data to the given data connection.  Returns the number
+ * of bytes written.  With the NONBLOCKING flag, only the data which can be
+ * written without waiting are written, and the function fails with EAGAIN
+ * if no data could be written.  As the data are then written directly to
+ * the socket, that flag is ignored (and the data written via the NetIO API)
+ * if the data connection uses any NetIO other than the default, e.g. for TLS.
+ */
+int proxy_ftp_data_ring_send(pool *p, conn_t *conn,
+  struct proxy_ftp_data_ring *ring, int frontend_data, int flags);
+#define PROXY_FTP_DATA_FL_NONBLOCKING		0x001
+
+/* Zero-copy relaying of data between data connections, via splice(2).
+ * The pipe used for splicing is allocated from, and closed along with, the
+ * given pool.  These functions fail with ENOSYS on platforms without
+ * splice(2) support.
+ *
+ * proxy_ftp_data_splice() returns the number of bytes relayed, zero on EOF
+ * from the source connection, or -1 on error (including EAGAIN when no data
+ * were yet available from the source connection).
+ */
+int *proxy_ftp_data_splice_open(pool *p);
+int proxy_ftp_data_splice(pool *p, conn_t *src_conn, conn_t *dst_conn,
+  int *pipe_fds);
+
 #endif /* MOD_PROXY_FTP_DATA_H */
@@ -29,6 +29,12 @@
 #include "proxy/session.h"
 
 int proxy_ftp_sess_get_feat(pool *, const struct proxy_session *proxy_sess);
+
+/* Parses the given FEAT response text, e.g. as obtained earlier on another
+ * connection to the same backend, into the backend features.
+ */
+int proxy_ftp_sess_set_feat(pool *p, const struct proxy_session *proxy_sess,
+  const char *text);
 int proxy_ftp_sess_send_auth_tls(pool *p,
   const struct proxy_session *proxy_sess);
 int proxy_ftp_sess_send_host(pool *, const struct proxy_session *proxy_sess);
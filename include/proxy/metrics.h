@@ -0,0 +1,134 @@
+/*
+ * ProFTPD - mod_proxy transfer metrics API
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_PROXY_METRICS_H
+#define MOD_PROXY_METRICS_H
+
+#include "mod_proxy.h"
+
+/* Metrics for a single data transfer, collected between
+ * proxy_metrics_xfer_start() and proxy_metrics_xfer_finish().
+ */
+struct proxy_metrics_xfer {
+  /* The transfer command, e.g. "RETR", and its direction: PR_NETIO_IO_RD for
+   * data read from the backend, PR_NETIO_IO_WR for data written to it.
+   */
+  const char *cmd;
+  int direction;
+
+  /* Backend server, as a URI.  May be null. */
+  const char *backend_uri;
+
+  struct timeval start_time;
+
+  /* Millisecs from the start of the transfer until the first data byte was
+   * read from the backend (-1 if none were), and until the transfer
+   * finished.
+   */
+  long ttfb_ms;
+  long elapsed_ms;
+
+  /* Data bytes read from/written to the frontend and backend. */
+  off_t frontend_bytes_in;
+  off_t frontend_bytes_out;
+  off_t backend_bytes_in;
+  off_t backend_bytes_out;
+
+  /* Number of read/write system calls made for the data connections, and
+   * of those calls which failed with EAGAIN.
+   */
+  unsigned long read_calls;
+  unsigned long write_calls;
+  unsigned long eagain_count;
+
+  /* Millisecs spent waiting for the frontend/backend data connection, with
+   * nothing to do until it was ready.
+   */
+  unsigned long frontend_stall_ms;
+  unsigned long backend_stall_ms;
+
+  /* Bytes read/written by TLS for the backend data connection, in addition
+   * to the data bytes, e.g. for record headers and handshakes.
+   */
+  off_t tls_overhead_in;
+  off_t tls_overhead_out;
+
+  /* Whether the TLS handshake for the backend data connection resumed a
+   * previous session (TRUE/FALSE, or -1 if there was no handshake), and the
+   * millisecs taken by that handshake (-1 if none).
+   */
+  int tls_resumed;
+  long tls_handshake_ms;
+
+  /* Zero if the transfer succeeded, the errno value otherwise. */
+  int xerrno;
+};
+
+/* Start collecting metrics for a new transfer, allocated from the given pool;
+ * any metrics currently being collected are discarded.
+ */
+int proxy_metrics_xfer_start(pool *p, const char *cmd, int direction,
+  const char *backend_uri);
+
+/* Returns the metrics for the current transfer, or null (with ENOENT) if
+ * there is none.
+ */
+const struct proxy_metrics_xfer *proxy_metrics_xfer_get(void);
+
+/* Add to a counter of the current transfer, if any; this is a no-op when
+ * there is no current transfer.  Fails with EINVAL for unknown counters.
+ */
+int proxy_metrics_xfer_incr(int counter, off_t incr);
+#define PROXY_METRICS_XFER_FRONTEND_BYTES_IN	1
+#define PROXY_METRICS_XFER_FRONTEND_BYTES_OUT	2
+#define PROXY_METRICS_XFER_BACKEND_BYTES_IN	3
+#define PROXY_METRICS_XFER_BACKEND_BYTES_OUT	4
+#define PROXY_METRICS_XFER_READ_CALLS		5
+#define PROXY_METRICS_XFER_WRITE_CALLS		6
+#define PROXY_METRICS_XFER_EAGAIN		7
+#define PROXY_METRICS_XFER_FRONTEND_STALL_MS	8
+#define PROXY_METRICS_XFER_BACKEND_STALL_MS	9
+#define PROXY_METRICS_XFER_TLS_OVERHEAD_IN	10
+#define PROXY_METRICS_XFER_TLS_OVERHEAD_OUT	11
+
+/* Record the TLS handshake of the backend data connection for the current
+ * transfer, if any; this is a no-op when there is no current transfer.
+ */
+int proxy_metrics_xfer_set_tls_handshake(int resumed, long handshake_ms);
+
+/* Finish the current transfer, generating the "mod_proxy.data-xfer-metrics"
+ * event with its metrics, and logging them to the ProxyLog as JSON if
+ * requested.
+ */
+int proxy_metrics_xfer_finish(pool *p, int xerrno, int flags);
+#define PROXY_METRICS_FL_LOG_JSON		0x001
+
+/* Returns the metrics as a JSON text. */
+char *proxy_metrics_xfer_to_json(pool *p,
+  const struct proxy_metrics_xfer *metrics);
+
+/* Returns the millisecs elapsed since the given time. */
+unsigned long proxy_metrics_elapsed_ms(const struct timeval *since);
+
+#endif /* MOD_PROXY_METRICS_H */
@@ -26,6 +26,7 @@
 #define MOD_PROXY_REVERSE_H
 
 #include "mod_proxy.h"
+#include "json.h"
 #include "proxy/session.h"
 
 int proxy_reverse_init(pool *p, const char *tables_dir, int flags);
@@ -42,8 +43,19 @@ int proxy_reverse_handle_user(cmd_rec *cmd, struct proxy_session *proxy_sess,
 int proxy_reverse_handle_pass(cmd_rec *cmd, struct proxy_session *proxy_sess,
   int *successful, int *block_responses);
 
+/* Reads the JSON array in the given file, subject to the same permissions
+ * and size checks as for ProxyReverseServers files.
+ */
+pr_json_array_t *proxy_reverse_json_read_array(pool *p, const char *path);
+
 array_header *proxy_reverse_json_parse_uris(pool *p, const char *path);
 
+/* Returns the backends configured for the given vhost via
+ * ProxyReverseServers, excluding any which are resolved per-user/group or
+ * via SQL at session time.
+ */
+array_header *proxy_reverse_vhost_backends(pool *p, server_rec *s);
+
 /* Connect policy API */
 #define PROXY_REVERSE_CONNECT_POLICY_RANDOM			1
 #define PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN		2
@@ -53,6 +65,10 @@ array_header *proxy_reverse_json_parse_uris(pool *p, const char *path);
 #define PROXY_REVERSE_CONNECT_POLICY_PER_USER			6
 #define PROXY_REVERSE_CONNECT_POLICY_PER_GROUP			7
 #define PROXY_REVERSE_CONNECT_POLICY_PER_HOST			8
+#define PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_ROUND_ROBIN	9
+#define PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_RANDOM		10
+#define PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH		11
+#define PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS		12
 
 /* Return the policy ID for the given string, or -1 if the given policy
  * is not recognized/supported.
@@ -71,6 +87,176 @@ const char *proxy_reverse_policy_name(int policy_id);
 array_header *proxy_reverse_pername_backends(pool *p, const char *name,
   int per_user);
 
+/* Weighted policies API.  The weight of each backend is given by its URI;
+ * see proxy_conn_get_weight().
+ */
+
+/* Returns the smooth weighted round-robin schedule (as used by nginx) for the
+ * given backends: an array of backend IDs, whose length is the sum of the
+ * weights, in which each backend appears as often as its weight, interleaved
+ * as evenly as possible.  Since the schedule depends only on the backends, the
+ * datastores only need to share the position in it.
+ */
+array_header *proxy_reverse_wrr_schedule(pool *p, array_header *backends);
+
+/* Returns the schedule for the given backends, computing it only if their
+ * weights differ from those of the previous call.  The returned schedule is
+ * shared, and must not be modified.
+ *
+ * Each selection claims exactly one turn in the schedule.  If the backend
+ * whose turn it is is unhealthy, the turn goes to one of the healthy backends,
+ * chosen at random in proportion to their weights (as for WeightedRandom), so
+ * that the healthy backends keep their relative shares.
+ */
+array_header *proxy_reverse_wrr_get_schedule(array_header *backends);
+
+/* Chooses a backend ID at random, in proportion to the weights of the given
+ * backends.  If a usable array is given, the backends whose entries are FALSE
+ * are skipped, unless none of them are usable.  Returns -1 if there are no
+ * backends.
+ */
+int proxy_reverse_weighted_random(array_header *backends, const int *usable);
+
+/* Backend latency API.  For each backend, the datastores track an
+ * exponentially weighted moving average (EWMA), and a small fixed-bucket
+ * histogram, of the latencies for each of these phases.
+ */
+#define PROXY_REVERSE_LATENCY_CONNECT		1
+#define PROXY_REVERSE_LATENCY_BANNER		2
+#define PROXY_REVERSE_LATENCY_LOGIN		3
+
+/* The number of histogram buckets; the last bucket has no upper bound. */
+#define PROXY_REVERSE_LATENCY_BUCKET_COUNT	8
+
+/* The weight given to each new sample, in the moving average. */
+#define PROXY_REVERSE_LATENCY_EWMA_WEIGHT	0.25
+
+/* Returns a textual name for the given latency phase. */
+const char *proxy_reverse_latency_name(int phase);
+
+/* Returns the index of the histogram bucket for the given latency. */
+unsigned int proxy_reverse_latency_bucket(long latency_ms);
+
+/* Returns the upper bound (in millisecs) of the given histogram bucket, or
+ * -1 for the last, unbounded bucket.
+ */
+long proxy_reverse_latency_bucket_max(unsigned int bucket);
+
+/* Returns the new moving average for the given sample, given the previous
+ * average and its number of samples.
+ */
+double proxy_reverse_latency_ewma(double ewma_ms, unsigned long nsamples,
+  long latency_ms);
+
+/* The load of a backend, as used by the LeastResponseTime policy. */
+struct proxy_reverse_backend_load {
+  int backend_id;
+  int usable;
+  long conn_count;
+
+  /* The sum of the latency averages for the measured phases; zero if the
+   * backend has no latency samples yet.
+   */
+  double latency_ms;
+};
+
+/* Chooses a backend using the "power of two choices": two of the usable
+ * backends are picked at random, and the one with the lower expected response
+ * time, i.e. (conn_count + 1) * latency, is chosen.  Backends without any
+ * latency samples are preferred, so that they are measured.  If no backends
+ * are usable, all of them are considered.  Returns the index into the given
+ * loads of the chosen backend, or -1 if there are none.
+ */
+int proxy_reverse_latency_choose(struct proxy_reverse_backend_load *loads,
+  unsigned int count);
+
+/* Data transfer API.  mod_proxy reports the data transfers of each session
+ * as they start, progress, and end; the datastores track, for each backend,
+ * the number of transfers in flight, and the bytes transferred in recent
+ * windows of time.
+ */
+
+/* The length of the windows in which transferred bytes are counted. */
+#define PROXY_REVERSE_XFER_WINDOW_MS		10000
+
+/* How often, at most, the progress of a transfer is reported. */
+#define PROXY_REVERSE_XFER_REPORT_INTERVAL_MS	1000
+
+/* Called by proxy_data() as a data transfer starts, as it progresses (with
+ * the bytes transferred so far), and as it ends.  These are no-ops unless
+ * the LeastTransfers policy is used.  Progress is reported from within the
+ * transfer, so a datastore which is busy fails it with EAGAIN, rather than
+ * waiting; its bytes are then reported later.
+ *
+ * Transfers made with the UseDirectDataTransfers ProxyOption do not go
+ * through proxy_data(), and so are never counted.
+ */
+int proxy_reverse_xfer_start(pool *p);
+int proxy_reverse_xfer_progress(pool *p, off_t xfer_bytes);
+int proxy_reverse_xfer_end(pool *p, off_t xfer_bytes);
+
+/* Returns the number of the window containing the given time. */
+uint64_t proxy_reverse_xfer_window(uint64_t now_ms);
+
+/* Estimates the recent transfer rate (in bytes/sec) of a backend, given the
+ * window in which its bytes were last counted, the bytes counted in that
+ * window, and those counted in the window before it.  The bytes of the
+ * previous window are weighted by how much of it still overlaps the sliding
+ * window ending now.
+ */
+double proxy_reverse_xfer_rate(uint64_t now_ms, uint64_t window,
+  uint64_t window_bytes, uint64_t prev_bytes);
+
+/* The transfer load of a backend, as used by the LeastTransfers policy. */
+struct proxy_reverse_backend_xfers {
+  int backend_id;
+  int usable;
+  long conn_count;
+  long xfer_count;
+  double xfer_rate;
+};
+
+/* Chooses the backend with the fewest transfers in flight; ties are broken by
+ * the lower recent transfer rate, and then by the fewer connections.  If no
+ * backends are usable, all of them are considered.  Returns the index into
+ * the given loads of the chosen backend, or -1 if there are none.
+ */
+int proxy_reverse_xfer_choose(struct proxy_reverse_backend_xfers *xfers,
+  unsigned int count);
+
+/* Backend connection leases.  Rather than bare counters, the datastores track
+ * the connections to each backend as leases held by session processes; a
+ * lease is identified by the process ID and the process start time, so that
+ * a reused process ID does not keep the lease of an earlier process.  Leases
+ * whose holders are no longer running (e.g. sessions which crashed, or were
+ * killed, before they could release their leases) are reclaimed periodically,
+ * so that the connection counts reflect the live connections.
+ */
+struct proxy_reverse_lease {
+  pid_t pid;
+
+  /* Process start time, in clock ticks since boot; zero if not known. */
+  uint64_t start;
+};
+
+/* How often the leases of a vhost are checked for dead holders. */
+#define PROXY_REVERSE_LEASE_RECLAIM_INTERVAL_MS		30000
+
+/* Fills in the lease for the current process. */
+int proxy_reverse_lease_get(struct proxy_reverse_lease *lease);
+
+/* Returns TRUE if the holder of the given lease is still running, FALSE
+ * otherwise.  If this cannot be determined, the holder is assumed to be
+ * running.
+ */
+int proxy_reverse_lease_is_live(const struct proxy_reverse_lease *lease);
+
+/* Formats the lease as "pid:start", and parses that text back. */
+const char *proxy_reverse_lease_text(pool *p,
+  const struct proxy_reverse_lease *lease);
+int proxy_reverse_lease_parse(const char *text,
+  struct proxy_reverse_lease *lease);
+
 /* Returns TRUE if the Reverse API is using proxy auth, FALSE otherwise. */
 int proxy_reverse_use_proxy_auth(void);
 
@@ -87,6 +273,28 @@ struct proxy_reverse_datastore {
   int (*policy_update_backend)(pool *p, void *dsh, int policy_id,
     unsigned int vhost_id, int backend_id, int conn_incr, long connect_ms);
 
+  /* Marks the given backend as unhealthy until the given time (in millisecs
+   * since the epoch), or as healthy if the time is zero.  The balancing
+   * policies do not select unhealthy backends, unless all of them are
+   * unhealthy; once that time has passed, the backend is selected again as a
+   * probe of its health.
+   */
+  int (*policy_health_backend)(pool *p, void *dsh, int policy_id,
+    unsigned int vhost_id, int backend_id, uint64_t unhealthy_until_ms);
+
+  /* Records a latency sample (in millisecs), for the given phase (one of the
+   * PROXY_REVERSE_LATENCY values), for the given backend.
+   */
+  int (*policy_latency_backend)(pool *p, void *dsh, int policy_id,
+    unsigned int vhost_id, int backend_id, int phase, long latency_ms);
+
+  /* Records the data transfers of a session to the given backend: the change
+   * in its transfers in flight (1 as a transfer starts, -1 as it ends, and 0
+   * as it progresses), and the bytes transferred since its last report.
+   */
+  int (*policy_xfer_backend)(pool *p, void *dsh, int policy_id,
+    unsigned int vhost_id, int backend_id, int xfer_incr, off_t xfer_bytes);
+
   void *(*init)(pool *p, const char *path, int flags);
   void *(*open)(pool *p, const char *path, array_header *backends);
   int (*close)(pool *p, void *dsh);
@@ -0,0 +1,118 @@
+/*
+ * ProFTPD - mod_proxy consistent hashing API
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_PROXY_REVERSE_CHASH_H
+#define MOD_PROXY_REVERSE_CHASH_H
+
+#include "mod_proxy.h"
+#include "proxy/conn.h"
+
+/* What the ConsistentHash policy hashes, to select a backend. */
+#define PROXY_REVERSE_CHASH_KEY_HOST		1
+#define PROXY_REVERSE_CHASH_KEY_USER		2
+#define PROXY_REVERSE_CHASH_KEY_GROUP		3
+
+/* Returns the key type for the given name ("host", "user", or "group"), or
+ * -1 if the name is not recognized.
+ */
+int proxy_reverse_chash_get_key(const char *name);
+
+/* Returns a textual name for the given key type. */
+const char *proxy_reverse_chash_key_name(int key_type);
+
+/* The number of points ("virtual nodes") on the ring for each unit of backend
+ * weight.
+ */
+#define PROXY_REVERSE_CHASH_POINTS_PER_WEIGHT	100
+
+/* How far above its share of the current connections a backend may be loaded,
+ * before keys are passed on to the next backend on the ring ("consistent
+ * hashing with bounded loads").
+ */
+#define PROXY_REVERSE_CHASH_LOAD_FACTOR		0.25
+
+/* The most connections, per vhost, counted towards the load bounds; the
+ * connections of any further sessions are not counted.
+ */
+#define PROXY_REVERSE_CHASH_MAX_LEASES		2048
+
+struct proxy_reverse_chash_point {
+  uint32_t hash;
+  int backend_id;
+};
+
+/* The ring is computed only from the URIs and weights of the backends, so
+ * adding or removing a backend only moves the keys which hash next to its
+ * points.
+ */
+struct proxy_reverse_chash_ring {
+  unsigned int backend_count;
+  unsigned int *weights;
+  unsigned int total_weight;
+
+  /* Sorted by hash. */
+  struct proxy_reverse_chash_point *points;
+  unsigned int point_count;
+};
+
+struct proxy_reverse_chash_ring *proxy_reverse_chash_ring_create(pool *p,
+  array_header *backends);
+
+/* Returns the backend ID for the given key.  Walking the ring from the key's
+ * point, the first backend which is usable (if usable is not NULL), and whose
+ * connection count is within its bound (if conn_counts is not NULL), is
+ * chosen.  If no backend qualifies, the load bounds, and then the usability,
+ * are ignored.  Returns -1 if the ring is empty.
+ */
+int proxy_reverse_chash_ring_lookup(pool *p,
+  const struct proxy_reverse_chash_ring *ring, const char *key,
+  const long *conn_counts, const int *usable);
+
+/* Computes the rings, and allocates the shared load/health table, for all
+ * vhosts using the ConsistentHash policy.  Called by the daemon process, so
+ * that the sessions inherit them, and need no datastore to select a backend.
+ */
+int proxy_reverse_chash_init(pool *p);
+int proxy_reverse_chash_free(pool *p);
+
+/* Selects the backend of the given vhost for the given key. */
+const struct proxy_conn *proxy_reverse_chash_next_backend(pool *p,
+  unsigned int vhost_id, array_header *backends, const char *key,
+  int *backend_id);
+
+/* Adjusts the connection count of the given backend, by taking (conn_incr > 0)
+ * or dropping (conn_incr < 0) a lease on it for the current session.  The
+ * leases of sessions which die without dropping them are reclaimed, so that
+ * they do not count against the load bounds indefinitely.
+ */
+int proxy_reverse_chash_update_backend(unsigned int vhost_id, int backend_id,
+  int conn_incr);
+
+/* Marks the given backend as unhealthy until the given time (in millisecs
+ * since the epoch), or as healthy if the time is zero.
+ */
+int proxy_reverse_chash_health_backend(unsigned int vhost_id, int backend_id,
+  uint64_t unhealthy_until_ms);
+
+#endif /* MOD_PROXY_REVERSE_CHASH_H */
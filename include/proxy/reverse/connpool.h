@@ -0,0 +1,78 @@
+/*
+ * ProFTPD - mod_proxy reverse connection pool
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_PROXY_REVERSE_CONNPOOL_H
+#define MOD_PROXY_REVERSE_CONNPOOL_H
+
+#include "mod_proxy.h"
+#include "proxy/conn.h"
+
+/* A pooled backend control connection, as handed to a session process. */
+struct proxy_reverse_connpool_conn {
+  conn_t *ctrl_conn;
+
+  /* The banner sent by the backend when the connection was opened. */
+  pr_response_t *banner;
+  unsigned int banner_nlines;
+
+  /* The FEAT response text of the backend, or NULL if not known. */
+  const char *feats;
+
+  /* The USER and PASS responses, if the connection has already been logged
+   * in using the credentials of the backend URI; NULL otherwise.
+   */
+  pr_response_t *user_resp;
+  unsigned int user_nlines;
+  pr_response_t *pass_resp;
+  unsigned int pass_nlines;
+
+  /* The times taken to connect, and then to receive the banner, in millisecs.
+   */
+  long connect_ms;
+  long banner_ms;
+};
+
+/* Default number of seconds which a pooled connection may stay idle. */
+#define PROXY_REVERSE_CONNPOOL_DEFAULT_MAX_IDLE		30
+
+/* Starts the pool keeper process, for all vhosts configured with
+ * ProxyReverseConnectionPool.
+ */
+int proxy_reverse_connpool_init(pool *p);
+int proxy_reverse_connpool_free(pool *p);
+
+/* Called by each session process: releases the daemon's pool resources, and,
+ * if pooling is configured for the session's vhost, registers a private
+ * channel with the keeper.
+ */
+int proxy_reverse_connpool_sess_init(void);
+
+/* Obtains a pooled connection to the given backend of the given vhost.
+ * Returns NULL, with errno set to ENOENT, if no pooled connection is
+ * available; the caller is then expected to connect as usual.
+ */
+struct proxy_reverse_connpool_conn *proxy_reverse_connpool_get(pool *p,
+  unsigned int vhost_id, const struct proxy_conn *pconn);
+
+#endif /* MOD_PROXY_REVERSE_CONNPOOL_H */
@@ -0,0 +1,68 @@
+/*
+ * ProFTPD - mod_proxy Reverse health check API
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_PROXY_REVERSE_HEALTH_H
+#define MOD_PROXY_REVERSE_HEALTH_H
+
+#include "mod_proxy.h"
+#include "proxy/conn.h"
+#include "proxy/reverse.h"
+
+/* Starts the health check worker process, if any vhosts have
+ * ProxyReverseHealthCheck configured.  The worker periodically checks each
+ * of the backends of those vhosts, and publishes their health, and banner
+ * latency, to the given datastore.  Called by the daemon process.
+ */
+int proxy_reverse_health_init(pool *p, const char *tables_dir,
+  struct proxy_reverse_datastore *ds);
+
+/* Stops the health check worker process, if running. */
+int proxy_reverse_health_free(pool *p);
+
+/* Releases any daemon-only health check resources inherited by a session
+ * process.
+ */
+int proxy_reverse_health_sess_init(void);
+
+/* Connects to the given backend, from the given source address (if any),
+ * and reads its banner, all within the given timeout (in seconds).  Returns
+ * the control connection if the banner is positive, filling in the banner and
+ * the times taken to connect, and then to receive the banner (in millisecs);
+ * returns NULL otherwise.
+ */
+conn_t *proxy_reverse_health_open_backend(pool *p,
+  const struct proxy_conn *pconn, const pr_netaddr_t *src_addr, int timeout,
+  pr_response_t **banner, unsigned int *banner_nlines, long *connect_ms,
+  long *banner_ms);
+
+/* Checks the given backend: connects, reads its banner, and optionally sends
+ * the given command (e.g. NOOP or FEAT), all within the given timeout (in
+ * seconds).  Returns zero if the backend is healthy, filling in the times
+ * taken to connect, and then to receive the banner (in millisecs); returns -1
+ * otherwise.
+ */
+int proxy_reverse_health_check_backend(pool *p, const struct proxy_conn *pconn,
+  int timeout, const char *cmd, long *connect_ms, long *banner_ms);
+
+#endif /* MOD_PROXY_REVERSE_HEALTH_H */
@@ -0,0 +1,103 @@
+/*
+ * ProFTPD - mod_proxy PerHost prefix API
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_PROXY_REVERSE_PERHOST_H
+#define MOD_PROXY_REVERSE_PERHOST_H
+
+#include "mod_proxy.h"
+#include "proxy/conn.h"
+
+/* An address prefix ("CIDR"), and the backend to which it is mapped. */
+struct proxy_reverse_perhost_prefix {
+  int family;
+  unsigned char addr[16];
+
+  /* Prefix length, in bits. */
+  unsigned int len;
+
+  const struct proxy_conn *pconn;
+};
+
+/* Parses the given "addr/len" text; a bare address is a full-length prefix.
+ * Any host bits beyond the prefix length are cleared.
+ */
+int proxy_reverse_perhost_parse_prefix(const char *text,
+  struct proxy_reverse_perhost_prefix *prefix);
+
+/* Returns the prefixes, and their backends, found in the given JSON file, an
+ * array of objects with "prefix" and "uri" keys, e.g.:
+ *
+ *  [ { "prefix": "203.0.113.0/24", "uri": "ftp://10.0.0.1:2121" } ]
+ *
+ * Malformed entries are skipped.
+ */
+array_header *proxy_reverse_perhost_json_parse(pool *p, const char *path);
+
+/* A binary radix tree of address prefixes, for longest-prefix matching; a
+ * lookup visits at most one node per bit of the address.
+ */
+struct proxy_reverse_perhost_tree;
+
+struct proxy_reverse_perhost_tree *proxy_reverse_perhost_tree_create(pool *p);
+
+/* Adds the given prefix; a prefix already in the tree is replaced. */
+int proxy_reverse_perhost_tree_add(pool *p,
+  struct proxy_reverse_perhost_tree *tree,
+  const struct proxy_reverse_perhost_prefix *prefix);
+
+/* Returns the longest prefix in the tree containing the given address, or
+ * NULL (with ENOENT) if there is none.  IPv4-mapped IPv6 addresses are looked
+ * up as IPv4 addresses.
+ */
+const struct proxy_reverse_perhost_prefix *proxy_reverse_perhost_tree_lookup(
+  pool *p, const struct proxy_reverse_perhost_tree *tree,
+  const pr_netaddr_t *addr);
+
+/* Returns the text for the given address truncated to the given prefix
+ * lengths, e.g. "203.0.113.0/24", by which the PerHost policy remembers the
+ * backend of a client.  For full-length prefixes, this is just the address.
+ */
+const char *proxy_reverse_perhost_key(pool *p, const pr_netaddr_t *addr,
+  unsigned int ipv4_len, unsigned int ipv6_len);
+
+/* Builds the trees of the ProxyReversePerHostMap prefixes for all vhosts
+ * using the PerHost policy.  Called by the daemon process, so that the
+ * sessions inherit them.
+ */
+int proxy_reverse_perhost_init(pool *p);
+int proxy_reverse_perhost_free(pool *p);
+
+/* Returns the backend to which the given client address is mapped, for the
+ * given vhost, or NULL (with ENOENT) if it is not mapped.
+ */
+const struct proxy_conn *proxy_reverse_perhost_next_backend(pool *p,
+  unsigned int vhost_id, const pr_netaddr_t *addr);
+
+/* Returns the key for the given client address, per the
+ * ProxyReversePerHostPrefix of the given vhost.
+ */
+const char *proxy_reverse_perhost_get_key(pool *p, unsigned int vhost_id,
+  const pr_netaddr_t *addr);
+
+#endif /* MOD_PROXY_REVERSE_PERHOST_H */
@@ -28,6 +28,7 @@
 #include "mod_proxy.h"
 
 struct proxy_conn;
+struct proxy_evloop;
 
 struct proxy_session {
   struct pool_rec *pool;
@@ -63,10 +64,20 @@ struct proxy_session {
   /* Data transfer policy: PASV, EPSV, PORT, EPRT, or client. */
   int dataxfer_policy;
 
+  /* Data transfer buffer size; zero for the defaults, or
+   * PROXY_FTP_CONN_XFER_BUFSZ_AUTO.
+   */
+  size_t dataxfer_bufsz;
+
   /* Directory list policy: LIST, or client. */
   int dirlist_policy;
   unsigned long dirlist_opts;
   void *dirlist_ctx;
+
+  /* Event loop for multiplexing the control/data connections during data
+   * transfers.  Created on first use, from the session pool.
+   */
+  struct proxy_evloop *evloop;
 };
 
 /* Zero indicates "do what the client does". */
@@ -45,6 +45,13 @@
 #  include <openssl/ec.h>
 #  include <openssl/ecdh.h>
 # endif /* PR_USE_OPENSSL_ECC */
+
+/* Kernel TLS offload requires OpenSSL 3.x, built with KTLS support. */
+# if defined(SSL_OP_ENABLE_KTLS) && \
+     defined(BIO_get_ktls_send) && \
+     !defined(OPENSSL_NO_KTLS)
+#  define PROXY_TLS_HAVE_KTLS	1
+# endif
 #endif
 
 /* ProxyTLSEngine values */
@@ -57,6 +64,8 @@
 #define PROXY_TLS_OPT_NO_SESSION_CACHE		0x0002
 #define PROXY_TLS_OPT_NO_SESSION_TICKETS	0x0004
 #define PROXY_TLS_OPT_ALLOW_WEAK_SECURITY	0x0008
+#define PROXY_TLS_OPT_REUSE_DATA_SSL		0x0010
+#define PROXY_TLS_OPT_ENABLE_KTLS		0x0020
 
 /* ProxyTLSProtocol handling */
 #define PROXY_TLS_PROTO_SSL_V3		0x0001
@@ -98,12 +107,39 @@ int proxy_tls_set_tls(int);
 /* Returns the ProxyTLSEngine value; see above. */
 int proxy_tls_using_tls(void);
 
+#ifdef PR_USE_OPENSSL
+/* Returns the trust store (CA certificates and CRLs) loaded by
+ * proxy_tls_init() for the given vhost, with a reference for the caller.
+ * Vhosts with the same CA/CRL locations share the same store.  Returns NULL,
+ * with ENOENT, if no store was loaded for the vhost.
+ */
+X509_STORE *proxy_tls_get_trust_store(unsigned int sid);
+
+/* Per-record overhead (header, explicit nonce, AEAD tag, inner content type)
+ * of TLS records, as encrypted by the kernel when using kTLS.
+ */
+# define PROXY_TLS_KTLS_TLS12_RECORD_OVERHEAD		29
+# define PROXY_TLS_KTLS_TLS13_RECORD_OVERHEAD		22
+
+/* Returns the estimated TLS record overhead, in bytes, of the given number of
+ * plaintext bytes moved through a kTLS socket, for the given protocol version
+ * (e.g. TLS1_3_VERSION).
+ */
+int proxy_tls_ktls_overhead(int version, size_t len);
+#endif /* PR_USE_OPENSSL */
+
 /* Defines the datastore interface. */
 struct proxy_tls_datastore {
 #ifdef PR_USE_OPENSSL
   int (*add_sess)(pool *p, void *dsh, const char *key, SSL_SESSION *sess);
   int (*remove_sess)(pool *p, void *dsh, const char *key);
   SSL_SESSION *(*get_sess)(pool *p, void *dsh, const char *key);
+
+  /* Gets and removes the session for the given key, as one claim: of
+   * several callers taking the same session, only one gets it, and the
+   * others fail with ENOENT.  Used for single-use sessions.
+   */
+  SSL_SESSION *(*take_sess)(pool *p, void *dsh, const char *key);
   int (*count_sess)(pool *p, void *dsh);
 #endif /* PR_USE_OPENSSL */
   int (*init)(pool *p, const char *path, int flags);
@@ -29,12 +29,18 @@
 #endif /* HAVE_SYS_UIO_H */
 
 #include "proxy/conn.h"
+#include "proxy/dns.h"
 #include "proxy/netio.h"
 #include "proxy/inet.h"
+#include "proxy/evloop.h"
 #include "proxy/session.h"
 #include "proxy/tls.h"
 #include "proxy/uri.h"
 
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS	MAP_ANON
+#endif
+
 struct proxy_conn {
   pool *pconn_pool;
 
@@ -44,6 +50,7 @@ struct proxy_conn {
   const char *pconn_hostport;
   int pconn_port;
   int pconn_tls;
+  unsigned int pconn_weight;
 
   /* Note that these are deliberately NOT 'const', so that they can be
    * scrubbed in the per-session memory space, once backend authentication
@@ -56,6 +63,58 @@ struct proxy_conn {
   array_header *pconn_addrs;
 };
 
+/* A connection attempt to one of the candidate addresses of a backend. */
+struct conn_attempt {
+  const pr_netaddr_t *addr;
+  conn_t *server_conn;
+  int state;
+};
+
+#define CONN_ATTEMPT_ST_PENDING		0
+#define CONN_ATTEMPT_ST_CONNECTING	1
+#define CONN_ATTEMPT_ST_CONNECTED	2
+#define CONN_ATTEMPT_ST_FAILED		3
+
+/* A set of nonblocking connects to the addresses of a backend, raced in the
+ * style of RFC 8305 ("Happy Eyeballs"), and possibly started ahead of when
+ * the connection is needed.
+ */
+struct proxy_conn_connect {
+  pool *pool;
+  const char *name;
+
+  struct conn_attempt *attempts;
+  unsigned int nattempts;
+  unsigned int next_attempt;
+
+  /* When we started waiting for the attempts, in proxy_conn_connect_finish();
+   * the connect timeout runs from then, not from when the attempts were
+   * started, which may be long before (e.g. at session start).
+   */
+  uint64_t waiting_ms;
+  uint64_t attempted_ms;
+  int xerrno;
+};
+
+/* Delay between starting successive connection attempts; see RFC 8305,
+ * Section 5.
+ */
+#define CONN_ATTEMPT_DELAY_MS		250
+
+/* The address family which most recently won a race for a given host name,
+ * shared among all session processes, so that later sessions try that
+ * family first.
+ */
+struct conn_family_pref {
+  volatile uint32_t key;
+  volatile int family;
+};
+
+#define CONN_FAMILY_PREF_COUNT		256
+
+static struct conn_family_pref *conn_family_prefs = NULL;
+static size_t conn_family_prefs_sz = 0;
+
 static const char *supported_protocols[] = {
   "ftp",
   "ftps",
@@ -116,10 +175,63 @@ int proxy_conn_connect_timeout_cb(CALLBACK_FRAME) {
   return 0;
 }
 
+/* Parses any parameters following the authority of the URI, e.g.
+ * "ftp://host:21?weight=4", and returns the URI without them.
+ */
+static const char *conn_parse_params(pool *p, const char *uri,
+    unsigned int *weight) {
+  char *ptr, *params, *param;
+
+  /* Note that any userinfo may itself contain a '?'. */
+  ptr = strrchr(uri, '@');
+  ptr = strchr(ptr != NULL ? ptr : uri, '?');
+  if (ptr == NULL) {
+    return uri;
+  }
+
+  params = pstrdup(p, ptr + 1);
+  while ((param = pr_str_get_token(&params, "&")) != NULL) {
+    pr_signals_handle();
+
+    if (*param == '\0') {
+      continue;
+    }
+
+    if (strncmp(param, "weight=", 7) == 0) {
+      char *endp = NULL;
+      long val;
+
+      val = strtol(param + 7, &endp, 10);
+      if (endp == NULL ||
+          endp == param + 7 ||
+          *endp != '\0' ||
+          val < 1 ||
+          val > PROXY_CONN_MAX_WEIGHT) {
+        pr_trace_msg(trace_channel, 4,
+          "invalid weight '%s' (must be 1-%d) in URI '%.100s'", param + 7,
+          PROXY_CONN_MAX_WEIGHT, uri);
+        errno = EINVAL;
+        return NULL;
+      }
+
+      *weight = (unsigned int) val;
+      continue;
+    }
+
+    pr_trace_msg(trace_channel, 4,
+      "unsupported parameter '%s' in URI '%.100s'", param, uri);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return pstrndup(p, uri, ptr - uri);
+}
+
 const struct proxy_conn *proxy_conn_create(pool *p, const char *uri) {
   int res, use_tls = PROXY_TLS_ENGINE_AUTO;
   char hostport[512], *proto, *remote_host, *username = NULL, *password = NULL;
-  unsigned int remote_port;
+  const char *base_uri;
+  unsigned int remote_port, weight = PROXY_CONN_DEFAULT_WEIGHT;
   struct proxy_conn *pconn;
   pool *pconn_pool;
   pr_netaddr_t *pconn_addr;
@@ -130,8 +242,13 @@ const struct proxy_conn *proxy_conn_create(pool *p, const char *uri) {
     return NULL;
   }
 
-  res = proxy_uri_parse(p, uri, &proto, &remote_host, &remote_port, &username,
-    &password);
+  base_uri = conn_parse_params(p, uri, &weight);
+  if (base_uri == NULL) {
+    return NULL;
+  }
+
+  res = proxy_uri_parse(p, base_uri, &proto, &remote_host, &remote_port,
+    &username, &password);
   if (res < 0) {
     return NULL;
   }
@@ -167,9 +284,14 @@ const struct proxy_conn *proxy_conn_create(pool *p, const char *uri) {
   pconn->pconn_host = pstrdup(pconn_pool, remote_host);
   pconn->pconn_port = remote_port;
   pconn->pconn_hostport = pstrdup(pconn_pool, hostport);
-  pconn->pconn_uri = pstrdup(pconn_pool, uri);
+  /* The URI, less any parameters, identifies the backend, e.g. in the
+   * datastores and logs; changing its weight does not make it another
+   * backend.
+   */
+  pconn->pconn_uri = pstrdup(pconn_pool, base_uri);
   pconn->pconn_proto = pstrdup(pconn_pool, proto);
   pconn->pconn_tls = use_tls;
+  pconn->pconn_weight = weight;
   if (username != NULL) {
     pconn->pconn_username = pstrdup(pconn_pool, username);
   }
@@ -177,7 +299,7 @@ const struct proxy_conn *proxy_conn_create(pool *p, const char *uri) {
     pconn->pconn_password = pstrdup(pconn_pool, password);
   }
 
-  pconn_addr = (pr_netaddr_t *) pr_netaddr_get_addr(pconn_pool, remote_host,
+  pconn_addr = (pr_netaddr_t *) proxy_dns_get_addr(pconn_pool, remote_host,
     &(pconn->pconn_addrs));
   if (pconn_addr == NULL) {
     pr_trace_msg(trace_channel, 2, "unable to resolve '%s' from URI '%s': %s",
@@ -203,6 +325,17 @@ const struct proxy_conn *proxy_conn_create(pool *p, const char *uri) {
     return NULL;
   }
 
+  if (pconn->pconn_addrs != NULL) {
+    register unsigned int i;
+    pr_netaddr_t **other_addrs;
+
+    /* The other addresses are tried as well, so they need the port, too. */
+    other_addrs = pconn->pconn_addrs->elts;
+    for (i = 0; i < pconn->pconn_addrs->nelts; i++) {
+      (void) pr_netaddr_set_port2(other_addrs[i], remote_port);
+    }
+  }
+
   pconn->pconn_addr = pconn_addr;
   return pconn;
 }
@@ -321,31 +454,23 @@ int proxy_conn_get_tls(const struct proxy_conn *pconn) {
   return pconn->pconn_tls;
 }
 
-conn_t *proxy_conn_get_server_conn(pool *p, struct proxy_session *proxy_sess,
-    const pr_netaddr_t *remote_addr) {
-  const pr_netaddr_t *bind_addr = NULL, *local_addr = NULL;
-  const char *remote_ipstr = NULL;
-  unsigned int remote_port;
-  conn_t *server_conn, *ctrl_conn;
-  int res;
-
-  if (proxy_sess->connect_timeout > 0) {
-    const char *notes_key = "mod_proxy.proxy-connect-address";
-
-    proxy_sess->connect_timerno = pr_timer_add(proxy_sess->connect_timeout,
-      -1, &proxy_module, proxy_conn_connect_timeout_cb, "ProxyTimeoutConnect");
+unsigned int proxy_conn_get_weight(const struct proxy_conn *pconn) {
+  if (pconn == NULL) {
+    return PROXY_CONN_DEFAULT_WEIGHT;
+  }
 
-    (void) pr_table_remove(session.notes, notes_key, NULL);
+  return pconn->pconn_weight;
+}
 
-    if (pr_table_add(session.notes, notes_key, remote_addr,
-        sizeof(pr_netaddr_t)) < 0) {
-      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-        "error stashing proxy connect address note: %s", strerror(errno));
-    }
-  }
+/* Determine the local address from which to connect to the given remote
+ * address.
+ */
+static const pr_netaddr_t *conn_get_bind_addr(pool *p,
+    struct proxy_session *proxy_sess, const pr_netaddr_t *remote_addr) {
+  const pr_netaddr_t *bind_addr = NULL, *local_addr = NULL;
+  const char *remote_ipstr = NULL;
 
   remote_ipstr = pr_netaddr_get_ipstr(remote_addr);
-  remote_port = ntohs(pr_netaddr_get_port(remote_addr));
 
   /* Check the family of the retrieved address vs what we'll be using
    * to connect.  If there's a mismatch, we need to get an addr with the
@@ -436,6 +561,37 @@ conn_t *proxy_conn_get_server_conn(pool *p, struct proxy_session *proxy_sess,
     }
   }
 
+  return bind_addr;
+}
+
+conn_t *proxy_conn_get_server_conn(pool *p, struct proxy_session *proxy_sess,
+    const pr_netaddr_t *remote_addr) {
+  const pr_netaddr_t *bind_addr = NULL;
+  const char *remote_ipstr = NULL;
+  unsigned int remote_port;
+  conn_t *server_conn, *ctrl_conn;
+  int res;
+
+  if (proxy_sess->connect_timeout > 0) {
+    const char *notes_key = "mod_proxy.proxy-connect-address";
+
+    proxy_sess->connect_timerno = pr_timer_add(proxy_sess->connect_timeout,
+      -1, &proxy_module, proxy_conn_connect_timeout_cb, "ProxyTimeoutConnect");
+
+    (void) pr_table_remove(session.notes, notes_key, NULL);
+
+    if (pr_table_add(session.notes, notes_key, remote_addr,
+        sizeof(pr_netaddr_t)) < 0) {
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error stashing proxy connect address note: %s", strerror(errno));
+    }
+  }
+
+  remote_ipstr = pr_netaddr_get_ipstr(remote_addr);
+  remote_port = ntohs(pr_netaddr_get_port(remote_addr));
+
+  bind_addr = conn_get_bind_addr(p, proxy_sess, remote_addr);
+
   server_conn = pr_inet_create_conn(p, -1, bind_addr, INPORT_ANY, FALSE);
   if (server_conn == NULL) {
     int xerrno = errno;
@@ -601,6 +757,526 @@ conn_t *proxy_conn_get_server_conn(pool *p, struct proxy_session *proxy_sess,
   return ctrl_conn;
 }
 
+int proxy_conn_prefs_init(pool *p) {
+  struct conn_family_pref *prefs;
+  size_t prefssz;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (conn_family_prefs != NULL) {
+    return 0;
+  }
+
+  prefssz = sizeof(struct conn_family_pref) * CONN_FAMILY_PREF_COUNT;
+  prefs = mmap(NULL, prefssz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS,
+    -1, 0);
+  if (prefs == MAP_FAILED) {
+    int xerrno = errno;
+
+    pr_log_pri(PR_LOG_NOTICE, MOD_PROXY_VERSION
+      ": error allocating %lu bytes of shared memory: %s",
+      (unsigned long) prefssz, strerror(xerrno));
+    errno = xerrno;
+    return -1;
+  }
+
+  memset(prefs, 0, prefssz);
+  conn_family_prefs = prefs;
+  conn_family_prefs_sz = prefssz;
+
+  return 0;
+}
+
+int proxy_conn_prefs_free(pool *p) {
+  (void) p;
+
+  if (conn_family_prefs != NULL) {
+    (void) munmap((void *) conn_family_prefs, conn_family_prefs_sz);
+    conn_family_prefs = NULL;
+    conn_family_prefs_sz = 0;
+  }
+
+  return 0;
+}
+
+static uint32_t conn_family_pref_key(const char *name) {
+  const unsigned char *ptr;
+  uint32_t key = 2166136261U;
+
+  /* FNV-1a */
+  for (ptr = (const unsigned char *) name; *ptr; ptr++) {
+    key ^= *ptr;
+    key *= 16777619U;
+  }
+
+  /* A key of zero marks an unused slot. */
+  if (key == 0) {
+    key = 1;
+  }
+
+  return key;
+}
+
+static int conn_get_family_pref(const char *name) {
+  struct conn_family_pref *pref;
+  uint32_t key;
+  int family;
+
+  if (conn_family_prefs == NULL ||
+      name == NULL) {
+    return 0;
+  }
+
+  key = conn_family_pref_key(name);
+  pref = &(conn_family_prefs[key % CONN_FAMILY_PREF_COUNT]);
+
+  family = pref->family;
+  __sync_synchronize();
+  if (pref->key != key) {
+    return 0;
+  }
+
+  return family;
+}
+
+static void conn_set_family_pref(const char *name, int family) {
+  struct conn_family_pref *pref;
+  uint32_t key;
+
+  if (conn_family_prefs == NULL ||
+      name == NULL) {
+    return;
+  }
+
+  key = conn_family_pref_key(name);
+  pref = &(conn_family_prefs[key % CONN_FAMILY_PREF_COUNT]);
+
+  if (pref->key == key &&
+      pref->family == family) {
+    return;
+  }
+
+  /* Racing writers may briefly leave a key paired with another writer's
+   * family; that only changes which address gets tried first.
+   */
+  pref->family = family;
+  __sync_synchronize();
+  pref->key = key;
+
+  pr_trace_msg(trace_channel, 15, "recorded preferred family %s for '%s'",
+    family == AF_INET ? "IPv4" : "IPv6", name);
+}
+
+/* Orders the candidate addresses per RFC 8305, Section 4: alternating
+ * between address families, starting with the preferred family, and
+ * otherwise keeping the resolver's order.
+ */
+static void conn_order_attempts(struct proxy_conn_connect *pcc,
+    const pr_netaddr_t *remote_addr, array_header *other_addrs,
+    int preferred_family) {
+  const pr_netaddr_t **addrs;
+  unsigned int naddrs, i, j, k;
+
+  naddrs = 1 + (other_addrs != NULL ? other_addrs->nelts : 0);
+  addrs = palloc(pcc->pool, sizeof(pr_netaddr_t *) * naddrs);
+  addrs[0] = remote_addr;
+  for (i = 1; i < naddrs; i++) {
+    addrs[i] = ((const pr_netaddr_t **) other_addrs->elts)[i-1];
+  }
+
+  if (preferred_family == 0) {
+    preferred_family = pr_netaddr_get_family(remote_addr);
+  }
+
+  pcc->attempts = pcalloc(pcc->pool, sizeof(struct conn_attempt) * naddrs);
+  pcc->nattempts = naddrs;
+
+  /* i indexes the preferred family, j the others, k the attempts. */
+  i = j = k = 0;
+  while (k < naddrs) {
+    while (i < naddrs &&
+           pr_netaddr_get_family(addrs[i]) != preferred_family) {
+      i++;
+    }
+
+    if (i < naddrs) {
+      pcc->attempts[k++].addr = addrs[i++];
+    }
+
+    while (j < naddrs &&
+           pr_netaddr_get_family(addrs[j]) == preferred_family) {
+      j++;
+    }
+
+    if (j < naddrs) {
+      pcc->attempts[k++].addr = addrs[j++];
+    }
+  }
+}
+
+static void conn_attempt_close(struct proxy_conn_connect *pcc,
+    struct conn_attempt *attempt, int xerrno) {
+  if (attempt->server_conn != NULL) {
+    pr_inet_close(pcc->pool, attempt->server_conn);
+    attempt->server_conn = NULL;
+  }
+
+  attempt->state = CONN_ATTEMPT_ST_FAILED;
+  if (xerrno != 0) {
+    pcc->xerrno = xerrno;
+  }
+}
+
+/* Starts the next pending connection attempt.  Attempts which fail
+ * immediately (e.g. due to ENETUNREACH) are skipped over, so that the next
+ * address is tried without waiting.  Returns the number of attempts started.
+ */
+static int conn_attempt_next(struct proxy_conn_connect *pcc,
+    struct proxy_session *proxy_sess) {
+  while (pcc->next_attempt < pcc->nattempts) {
+    struct conn_attempt *attempt;
+    const pr_netaddr_t *bind_addr;
+    int res;
+
+    attempt = &(pcc->attempts[pcc->next_attempt++]);
+    bind_addr = conn_get_bind_addr(pcc->pool, proxy_sess, attempt->addr);
+
+    attempt->server_conn = pr_inet_create_conn(pcc->pool, -1, bind_addr,
+      INPORT_ANY, FALSE);
+    if (attempt->server_conn == NULL) {
+      int xerrno = errno;
+
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error creating connection to %s: %s",
+        pr_netaddr_get_ipstr(bind_addr), strerror(xerrno));
+      conn_attempt_close(pcc, attempt, xerrno);
+      continue;
+    }
+
+    pr_trace_msg(trace_channel, 12,
+      "starting connect to backend address %s#%u from %s#%u",
+      pr_netaddr_get_ipstr(attempt->addr),
+      ntohs(pr_netaddr_get_port(attempt->addr)),
+      pr_netaddr_get_ipstr(bind_addr), ntohs(pr_netaddr_get_port(bind_addr)));
+
+    pr_gettimeofday_millis(&(pcc->attempted_ms));
+    res = pr_inet_connect_nowait(pcc->pool, attempt->server_conn,
+      attempt->addr, ntohs(pr_netaddr_get_port(attempt->addr)));
+    if (res < 0) {
+      int xerrno = errno;
+
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error starting connect to %s#%u: %s",
+        pr_netaddr_get_ipstr(attempt->addr),
+        ntohs(pr_netaddr_get_port(attempt->addr)), strerror(xerrno));
+      conn_attempt_close(pcc, attempt, xerrno);
+      continue;
+    }
+
+    attempt->state = (res == 1 ? CONN_ATTEMPT_ST_CONNECTED :
+      CONN_ATTEMPT_ST_CONNECTING);
+    return 1;
+  }
+
+  return 0;
+}
+
+struct proxy_conn_connect *proxy_conn_connect_start(pool *p,
+    struct proxy_session *proxy_sess, const struct proxy_conn *pconn) {
+  pool *sub_pool;
+  struct proxy_conn_connect *pcc;
+  const pr_netaddr_t *remote_addr;
+  array_header *other_addrs = NULL;
+  int xerrno;
+
+  if (p == NULL ||
+      proxy_sess == NULL ||
+      pconn == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  remote_addr = proxy_conn_get_addr(pconn, &other_addrs);
+  if (remote_addr == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  sub_pool = make_sub_pool(p);
+  pr_pool_tag(sub_pool, "Proxy Connect Pool");
+
+  pcc = pcalloc(sub_pool, sizeof(struct proxy_conn_connect));
+  pcc->pool = sub_pool;
+  pcc->name = pstrdup(sub_pool, proxy_conn_get_hostport(pconn));
+
+  conn_order_attempts(pcc, remote_addr, other_addrs,
+    conn_get_family_pref(pcc->name));
+
+  if (conn_attempt_next(pcc, proxy_sess) == 0) {
+    xerrno = pcc->xerrno;
+
+    destroy_pool(sub_pool);
+    errno = xerrno;
+    return NULL;
+  }
+
+  return pcc;
+}
+
+/* Waits for the first of the started attempts to connect, starting the
+ * remaining attempts in turn, every CONN_ATTEMPT_DELAY_MS or as soon as
+ * an earlier attempt fails.  Returns the winning attempt, or NULL.
+ */
+static struct conn_attempt *conn_race_attempts(struct proxy_conn_connect *pcc,
+    struct proxy_session *proxy_sess) {
+  struct proxy_evloop *evloop;
+  struct proxy_evloop_event events[8];
+  struct conn_attempt *winner = NULL;
+  uint64_t deadline_ms = 0;
+  int expired = FALSE;
+
+  if (proxy_sess->connect_timeout > 0) {
+    deadline_ms = pcc->waiting_ms +
+      ((uint64_t) proxy_sess->connect_timeout * 1000);
+  }
+
+  evloop = proxy_evloop_create(pcc->pool, PROXY_EVLOOP_FL_USE_POLL);
+  if (evloop == NULL) {
+    pcc->xerrno = errno;
+    return NULL;
+  }
+
+  while (winner == NULL) {
+    register unsigned int i;
+    unsigned int nconnecting = 0;
+    uint64_t now_ms;
+    int timeout_ms = -1, nevents;
+
+    for (i = 0; i < pcc->next_attempt; i++) {
+      struct conn_attempt *attempt;
+
+      attempt = &(pcc->attempts[i]);
+      if (attempt->state == CONN_ATTEMPT_ST_CONNECTED) {
+        winner = attempt;
+        break;
+      }
+
+      if (attempt->state == CONN_ATTEMPT_ST_CONNECTING) {
+        nconnecting++;
+      }
+    }
+
+    if (winner != NULL) {
+      break;
+    }
+
+    if (expired == TRUE) {
+      pcc->xerrno = ETIMEDOUT;
+      break;
+    }
+
+    pr_gettimeofday_millis(&now_ms);
+
+    if (deadline_ms > 0 &&
+        now_ms >= deadline_ms) {
+      /* Poll the pending attempts once more, without waiting, so that an
+       * attempt which has already connected is not thrown away.
+       */
+      expired = TRUE;
+    }
+
+    if (expired == FALSE &&
+        pcc->next_attempt < pcc->nattempts) {
+      uint64_t attempt_ms;
+
+      attempt_ms = pcc->attempted_ms + CONN_ATTEMPT_DELAY_MS;
+      if (nconnecting == 0 ||
+          now_ms >= attempt_ms) {
+        pr_trace_msg(trace_channel, 8,
+          "attempting to connect to other address #%u (%s) for '%.100s'",
+          pcc->next_attempt, pr_netaddr_get_ipstr(
+            pcc->attempts[pcc->next_attempt].addr), pcc->name);
+        (void) conn_attempt_next(pcc, proxy_sess);
+        continue;
+      }
+
+      timeout_ms = (int) (attempt_ms - now_ms);
+
+    } else if (nconnecting == 0) {
+      /* Every attempt has failed, or we have run out of time. */
+      if (expired == TRUE) {
+        pcc->xerrno = ETIMEDOUT;
+      }
+
+      break;
+    }
+
+    if (expired == TRUE) {
+      timeout_ms = 0;
+
+    } else if (deadline_ms > 0 &&
+        (timeout_ms < 0 ||
+         (uint64_t) timeout_ms > (deadline_ms - now_ms))) {
+      timeout_ms = (int) (deadline_ms - now_ms);
+    }
+
+    for (i = 0; i < pcc->next_attempt; i++) {
+      struct conn_attempt *attempt;
+
+      attempt = &(pcc->attempts[i]);
+      if (attempt->state == CONN_ATTEMPT_ST_CONNECTING) {
+        (void) proxy_evloop_add(evloop, attempt->server_conn->listen_fd,
+          PROXY_EVLOOP_EV_WRITE, attempt);
+      }
+    }
+
+    nevents = proxy_evloop_wait(evloop, events, 8, timeout_ms);
+    if (nevents < 0) {
+      if (errno == EINTR) {
+        pr_signals_handle();
+        nevents = 0;
+
+      } else {
+        pcc->xerrno = errno;
+        break;
+      }
+    }
+
+    for (i = 0; i < (unsigned int) nevents; i++) {
+      struct conn_attempt *attempt;
+      socklen_t errlen;
+      int xerrno = 0;
+
+      attempt = events[i].data;
+      errlen = sizeof(xerrno);
+      if (getsockopt(attempt->server_conn->listen_fd, SOL_SOCKET, SO_ERROR,
+          &xerrno, &errlen) < 0) {
+        xerrno = errno;
+      }
+
+      (void) proxy_evloop_remove(evloop, attempt->server_conn->listen_fd);
+
+      if (xerrno != 0) {
+        (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+          "error connecting to %s#%u: %s", pr_netaddr_get_ipstr(attempt->addr),
+          ntohs(pr_netaddr_get_port(attempt->addr)), strerror(xerrno));
+        conn_attempt_close(pcc, attempt, xerrno);
+        continue;
+      }
+
+      attempt->server_conn->mode = CM_OPEN;
+      attempt->state = CONN_ATTEMPT_ST_CONNECTED;
+    }
+  }
+
+  proxy_evloop_destroy(evloop);
+  return winner;
+}
+
+conn_t *proxy_conn_connect_finish(pool *p, struct proxy_session *proxy_sess,
+    struct proxy_conn_connect *pcc) {
+  register unsigned int i;
+  struct conn_attempt *winner;
+  conn_t *server_conn, *ctrl_conn;
+  const char *remote_ipstr;
+  unsigned int remote_port;
+  int xerrno = 0;
+
+  if (p == NULL ||
+      proxy_sess == NULL ||
+      pcc == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  pr_gettimeofday_millis(&(pcc->waiting_ms));
+  winner = conn_race_attempts(pcc, proxy_sess);
+  if (winner == NULL) {
+    xerrno = pcc->xerrno;
+    if (xerrno == 0) {
+      xerrno = ECONNREFUSED;
+    }
+
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error connecting to '%s': %s", pcc->name, strerror(xerrno));
+    proxy_conn_connect_abort(pcc);
+
+    errno = xerrno;
+    return NULL;
+  }
+
+  /* Cancel the attempts which lost the race. */
+  for (i = 0; i < pcc->next_attempt; i++) {
+    if (&(pcc->attempts[i]) != winner) {
+      conn_attempt_close(pcc, &(pcc->attempts[i]), 0);
+    }
+  }
+
+  server_conn = winner->server_conn;
+  remote_ipstr = pr_netaddr_get_ipstr(winner->addr);
+  remote_port = ntohs(pr_netaddr_get_port(winner->addr));
+
+  if (pr_inet_get_conn_info(server_conn, server_conn->listen_fd) < 0) {
+    xerrno = errno;
+
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error obtaining local socket info on fd %d: %s",
+      server_conn->listen_fd, strerror(xerrno));
+    proxy_conn_connect_abort(pcc);
+
+    errno = xerrno;
+    return NULL;
+  }
+
+  pr_trace_msg(trace_channel, 5,
+    "successfully connected to %s#%u from %s#%d", remote_ipstr, remote_port,
+    pr_netaddr_get_ipstr(server_conn->local_addr),
+    ntohs(pr_netaddr_get_port(server_conn->local_addr)));
+
+  ctrl_conn = proxy_inet_openrw(p, server_conn, NULL, PR_NETIO_STRM_CTRL, -1,
+    -1, -1, FALSE);
+  if (ctrl_conn == NULL) {
+    xerrno = errno;
+
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "unable to open control connection to %s#%u: %s", remote_ipstr,
+      remote_port, strerror(xerrno));
+    proxy_conn_connect_abort(pcc);
+
+    errno = xerrno;
+    return NULL;
+  }
+
+  if (pcc->nattempts > 1) {
+    conn_set_family_pref(pcc->name, pr_netaddr_get_family(winner->addr));
+  }
+
+  proxy_sess->dst_addr = ctrl_conn->remote_addr;
+
+  /* The control connection now owns the socket. */
+  server_conn->listen_fd = -1;
+  destroy_pool(pcc->pool);
+
+  return ctrl_conn;
+}
+
+void proxy_conn_connect_abort(struct proxy_conn_connect *pcc) {
+  register unsigned int i;
+
+  if (pcc == NULL) {
+    return;
+  }
+
+  for (i = 0; i < pcc->next_attempt; i++) {
+    conn_attempt_close(pcc, &(pcc->attempts[i]), 0);
+  }
+
+  destroy_pool(pcc->pool);
+}
+
 const char *proxy_conn_get_uri(const struct proxy_conn *pconn) {
   if (pconn == NULL) {
     errno = EINVAL;
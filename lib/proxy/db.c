@@ -38,34 +38,53 @@ static const char *current_schema = NULL;
 
 static const char *trace_channel = "proxy.db";
 
-#define PROXY_DB_SQLITE_MAX_RETRY_COUNT		4
+/* When the database is busy, i.e. locked by another process, we retry with
+ * an exponentially increasing delay, starting at the minimum and capped at
+ * the maximum, for at most the given number of times; that is, delays of
+ * 2, 4, 8, ..., 128 msecs, then 250 msecs for the remaining three retries
+ * (about 1.0 secs in all).
+ */
+#define PROXY_DB_SQLITE_MAX_RETRY_COUNT		10
+#define PROXY_DB_SQLITE_MIN_RETRY_DELAY_MS	2
 #define PROXY_DB_SQLITE_MAX_RETRY_DELAY_MS	250
 
 #define PROXY_DB_SQLITE_TRACE_LEVEL		17
 
 static int db_busy(void *user_data, int busy_count) {
   int retry = FALSE;
+  unsigned long delay_ms = PROXY_DB_SQLITE_MAX_RETRY_DELAY_MS;
 
   /* How many retries do we want to allow? */
-  if (busy_count <= PROXY_DB_SQLITE_MAX_RETRY_COUNT) {
+  if (busy_count < PROXY_DB_SQLITE_MAX_RETRY_COUNT) {
     retry = TRUE;
   }
 
   if (current_schema != NULL) {
-    pr_trace_msg(trace_channel, 1,
+    pr_trace_msg(trace_channel, 3,
       "(sqlite3): schema '%s': busy count = %d, retry = %s", current_schema,
       busy_count, retry ? "true" : "false");
 
   } else {
-    pr_trace_msg(trace_channel, 1, "(sqlite3): busy count = %d, retry = %s",
+    pr_trace_msg(trace_channel, 3, "(sqlite3): busy count = %d, retry = %s",
       busy_count, retry ? "true" : "false");
   }
 
+  if (retry == FALSE) {
+    return retry;
+  }
+
   /* If we're busy, then sleep for a short while, on the assumption that the
-   * other process will finish its business with our tables.
+   * other process will finish its business with our tables.  Each retry
+   * doubles the delay, up to the maximum.
    */
-  (void) pr_timer_usleep(PROXY_DB_SQLITE_MAX_RETRY_DELAY_MS);
+  if (busy_count < 8) {
+    delay_ms = PROXY_DB_SQLITE_MIN_RETRY_DELAY_MS << busy_count;
+    if (delay_ms > PROXY_DB_SQLITE_MAX_RETRY_DELAY_MS) {
+      delay_ms = PROXY_DB_SQLITE_MAX_RETRY_DELAY_MS;
+    }
+  }
 
+  (void) pr_timer_usleep(delay_ms * 1000);
   return retry;
 }
 
@@ -428,7 +447,7 @@ int proxy_db_bind_stmt(pool *p, struct proxy_dbh *dbh, const char *stmt,
       }
 
       l = *((long *) data);
-      res = sqlite3_bind_int(pstmt, idx, l);
+      res = sqlite3_bind_int64(pstmt, idx, (sqlite3_int64) l);
       if (res != SQLITE_OK) {
         pr_trace_msg(trace_channel, 4,
           "error binding parameter %d of '%s' to LONG %ld: %s", idx, stmt, l,
@@ -631,10 +650,137 @@ array_header *proxy_db_exec_prepared_stmt(pool *p, struct proxy_dbh *dbh,
   return results;
 }
 
+/* Transactions */
+
+int proxy_db_begin(pool *p, struct proxy_dbh *dbh) {
+  if (dbh == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Take the write lock now, rather than at the first write, so that a busy
+   * database is handled by our busy handler, rather than failing the
+   * transaction midway with SQLITE_BUSY.
+   */
+  return proxy_db_exec_stmt(p, dbh, "BEGIN IMMEDIATE;", NULL);
+}
+
+int proxy_db_try_begin(pool *p, struct proxy_dbh *dbh) {
+  int res;
+  char *ptr = NULL;
+
+  if (dbh == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pr_trace_msg(trace_channel, 10, "schema '%s': executing statement '%s'",
+    dbh->schema, "BEGIN IMMEDIATE;");
+
+  /* Without a busy handler, a locked database fails at once with
+   * SQLITE_BUSY; our caller must not wait for it.
+   */
+  sqlite3_busy_handler(dbh->db, NULL, NULL);
+  res = sqlite3_exec(dbh->db, "BEGIN IMMEDIATE;", NULL, NULL, &ptr);
+  sqlite3_busy_handler(dbh->db, db_busy, (void *) dbh->schema);
+
+  if (res != SQLITE_OK) {
+    pr_trace_msg(trace_channel, 3,
+      "schema '%s': unable to begin transaction: (%d) %s", dbh->schema, res,
+      ptr ? ptr : sqlite3_errmsg(dbh->db));
+    sqlite3_free(ptr);
+
+    errno = (res == SQLITE_BUSY) ? EAGAIN : EPERM;
+    return -1;
+  }
+
+  return 0;
+}
+
+int proxy_db_commit(pool *p, struct proxy_dbh *dbh) {
+  if (dbh == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return proxy_db_exec_stmt(p, dbh, "COMMIT;", NULL);
+}
+
+int proxy_db_rollback(pool *p, struct proxy_dbh *dbh) {
+  if (dbh == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return proxy_db_exec_stmt(p, dbh, "ROLLBACK;", NULL);
+}
+
 /* Database opening/closing. */
 
+static int journal_mode_cb(void *v, int ncols, char **cols, char **col_names) {
+  char *journal_mode;
+
+  journal_mode = v;
+  if (ncols > 0 &&
+      cols[0] != NULL) {
+    sstrncpy(journal_mode, cols[0], 16);
+  }
+
+  return 0;
+}
+
+/* Switches the database to WAL mode, returning 0 if it is now in WAL mode,
+ * or -1 otherwise (e.g. when the filesystem does not support the shared
+ * memory WAL index).
+ */
+static int db_use_wal(pool *p, struct proxy_dbh *dbh, const char *table_path) {
+  int res;
+  char journal_mode[16];
+  char *errmsg = NULL;
+
+  memset(journal_mode, '\0', sizeof(journal_mode));
+  res = sqlite3_exec(dbh->db, "PRAGMA journal_mode = WAL;", journal_mode_cb,
+    journal_mode, &errmsg);
+  if (res != SQLITE_OK ||
+      strcasecmp(journal_mode, "wal") != 0) {
+    pr_trace_msg(trace_channel, 2,
+      "unable to use WAL journal mode for SQLite database '%s': %s",
+      table_path, errmsg ? errmsg : *journal_mode ? journal_mode : "unknown");
+    if (errmsg != NULL) {
+      sqlite3_free(errmsg);
+    }
+
+    errno = EPERM;
+    return -1;
+  }
+
+  /* With WAL, NORMAL synchronization is still safe from corruption. */
+  (void) proxy_db_exec_stmt(p, dbh, "PRAGMA synchronous = NORMAL;", NULL);
+
+  /* Read from the database now, so that the WAL and WAL index files are
+   * opened before any chroot(2), and stay open for the life of this handle.
+   */
+  res = proxy_db_exec_stmt(p, dbh, "SELECT COUNT(*) FROM sqlite_master;",
+    NULL);
+  if (res < 0) {
+    return -1;
+  }
+
+  pr_trace_msg(trace_channel, 9, "using WAL journal mode for '%s'",
+    table_path);
+  return 0;
+}
+
+static struct proxy_dbh *db_open(pool *p, const char *table_path,
+    const char *schema_name, int open_flags);
+
 struct proxy_dbh *proxy_db_open(pool *p, const char *table_path,
     const char *schema_name) {
+  return db_open(p, table_path, schema_name, 0);
+}
+
+static struct proxy_dbh *db_open(pool *p, const char *table_path,
+    const char *schema_name, int open_flags) {
   int res, flags;
   pool *sub_pool;
   const char *stmt;
@@ -669,9 +815,12 @@ struct proxy_dbh *proxy_db_open(pool *p, const char *table_path,
     return NULL;
   }
 
-  if (pr_trace_get_level(trace_channel) >= PROXY_DB_SQLITE_TRACE_LEVEL) {
-    sqlite3_busy_handler(db, db_busy, (void *) schema_name);
+  /* Always handle a busy database, i.e. one locked by another session
+   * process, by retrying with backoff, rather than failing immediately.
+   */
+  sqlite3_busy_handler(db, db_busy, (void *) schema_name);
 
+  if (pr_trace_get_level(trace_channel) >= PROXY_DB_SQLITE_TRACE_LEVEL) {
 #if defined(HAVE_SQLITE3_TRACE_V2)
     sqlite3_trace_v2(db, SQLITE_TRACE_STMT|SQLITE_TRACE_PROFILE|SQLITE_TRACE_ROW|SQLITE_TRACE_CLOSE,
       db_trace2, (void *) schema_name);
@@ -698,14 +847,19 @@ struct proxy_dbh *proxy_db_open(pool *p, const char *table_path,
   /* Tell SQLite to only use in-memory journals.  This is necessary for
    * working properly when a chroot is used.  Note that the MEMORY journal mode
    * of SQLite is supported only for SQLite-3.6.5 and later.
+   *
+   * If requested, use WAL mode instead, which lets readers and a writer
+   * proceed concurrently; its files are opened here, before any chroot.
    */
-
-  stmt = "PRAGMA journal_mode = MEMORY;";
-  res = proxy_db_exec_stmt(p, dbh, stmt, NULL);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 2,
-      "error setting MEMORY journal mode on SQLite database '%s': %s",
-      table_path, sqlite3_errmsg(dbh->db));
+  if (!(open_flags & PROXY_DB_OPEN_FL_USE_WAL) ||
+      db_use_wal(p, dbh, table_path) < 0) {
+    stmt = "PRAGMA journal_mode = MEMORY;";
+    res = proxy_db_exec_stmt(p, dbh, stmt, NULL);
+    if (res < 0) {
+      pr_trace_msg(trace_channel, 2,
+        "error setting MEMORY journal mode on SQLite database '%s': %s",
+        table_path, sqlite3_errmsg(dbh->db));
+    }
   }
 
   dbh->prepared_stmts = pr_table_nalloc(dbh->pool, 0, 4);
@@ -853,7 +1007,7 @@ struct proxy_dbh *proxy_db_open_with_version(pool *p, const char *table_path,
   int res = 0, xerrno = 0;
   unsigned int current_version = 0;
 
-  dbh = proxy_db_open(p, table_path, schema_name);
+  dbh = db_open(p, table_path, schema_name, flags);
   if (dbh == NULL) {
     return NULL;
   }
@@ -910,7 +1064,11 @@ struct proxy_dbh *proxy_db_open_with_version(pool *p, const char *table_path,
         ": error deleting '%s': %s", table_path, strerror(errno));
     }
 
-    dbh = proxy_db_open(p, table_path, schema_name);
+    /* Any WAL files belong to the deleted database, too. */
+    (void) unlink(pstrcat(tmp_pool, table_path, "-wal", NULL));
+    (void) unlink(pstrcat(tmp_pool, table_path, "-shm", NULL));
+
+    dbh = db_open(p, table_path, schema_name, flags);
     if (dbh == NULL) {
       xerrno = errno;
 
@@ -0,0 +1,662 @@
+/*
+ * ProFTPD - mod_proxy DNS cache
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_proxy.h"
+
+#include "proxy/dns.h"
+#include "proxy/evloop.h"
+
+#include <signal.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+/* The cache is a fixed-size table, shared by the daemon, the refresh worker,
+ * and the session processes.  A name hashes to a set of DNS_CACHE_WAYS
+ * entries; when the set is full, the least recently used entry is replaced.
+ *
+ * Each entry is guarded by a sequence number: writers make it odd while
+ * updating the entry (and give up, rather than wait, if another writer holds
+ * it), and readers retry if it changed while they were copying the entry.
+ * Thus no process ever blocks on another.
+ */
+
+#define DNS_CACHE_SETS			64
+#define DNS_CACHE_WAYS			4
+#define DNS_CACHE_ENTRY_COUNT		(DNS_CACHE_SETS * DNS_CACHE_WAYS)
+
+#define DNS_MAX_NAMELEN			256
+#define DNS_MAX_ADDRS			8
+
+struct dns_entry {
+  volatile uint32_t seqno;
+
+  /* When the addresses need to have been refreshed, and when the entry was
+   * last looked up, in millisecs since the epoch.
+   */
+  volatile uint64_t expires_ms;
+  volatile uint64_t used_ms;
+
+  char name[DNS_MAX_NAMELEN];
+  unsigned int naddrs;
+  struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+};
+
+static struct dns_entry *dns_cache = NULL;
+static size_t dns_cachesz = 0;
+static uint64_t dns_ttl_ms = 0;
+
+/* The worker refreshes entries once this fraction of their TTL remains. */
+#define DNS_REFRESH_AHEAD_DIVISOR	4
+
+/* Entries which have not been looked up for this many TTLs are dropped,
+ * rather than refreshed.
+ */
+#define DNS_MAX_IDLE_TTLS		10
+
+/* How long the worker waits before retrying a failed refresh. */
+#define DNS_RETRY_INTERVAL_MS		5000
+
+static pid_t dns_pid = 0;
+
+/* The worker watches the read end of this pipe; when the daemon closes the
+ * write end (or exits), the worker exits as well.
+ */
+static int dns_fds[2] = { -1, -1 };
+
+static const char *trace_channel = "proxy.dns";
+
+static unsigned int dns_hash(const char *name) {
+  const unsigned char *ptr;
+  uint32_t h = 2166136261U;
+
+  /* FNV-1a, case-insensitively, as DNS names are. */
+  for (ptr = (const unsigned char *) name; *ptr; ptr++) {
+    h ^= tolower((int) *ptr);
+    h *= 16777619U;
+  }
+
+  return (unsigned int) (h % DNS_CACHE_SETS);
+}
+
+/* Copies out a consistent snapshot of the given entry.  Returns -1 if the
+ * entry is being written, and did not settle.
+ */
+static int dns_read_entry(struct dns_entry *entry, struct dns_entry *copy) {
+  register unsigned int i;
+
+  for (i = 0; i < 3; i++) {
+    uint32_t seqno;
+
+    seqno = entry->seqno;
+    if (seqno & 1) {
+      continue;
+    }
+
+    __sync_synchronize();
+    memcpy(copy, (void *) entry, sizeof(struct dns_entry));
+    __sync_synchronize();
+
+    if (entry->seqno == seqno) {
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+static int dns_lock_entry(struct dns_entry *entry, uint32_t *seqno) {
+  uint32_t current;
+
+  current = entry->seqno;
+  if (current & 1) {
+    return -1;
+  }
+
+  if (!__sync_bool_compare_and_swap(&(entry->seqno), current, current + 1)) {
+    return -1;
+  }
+
+  *seqno = current + 2;
+  return 0;
+}
+
+static void dns_unlock_entry(struct dns_entry *entry, uint32_t seqno) {
+  __sync_synchronize();
+  entry->seqno = seqno;
+}
+
+/* Finds the entry for the given name, copying it out.  Returns the index of
+ * the entry, or -1 if there is none.
+ */
+static int dns_find_entry(const char *name, struct dns_entry *copy) {
+  register unsigned int i;
+  unsigned int set;
+
+  set = dns_hash(name);
+
+  for (i = 0; i < DNS_CACHE_WAYS; i++) {
+    unsigned int idx;
+
+    idx = (set * DNS_CACHE_WAYS) + i;
+    if (dns_read_entry(&(dns_cache[idx]), copy) < 0) {
+      continue;
+    }
+
+    if (copy->name[0] != '\0' &&
+        strcasecmp(copy->name, name) == 0) {
+      return (int) idx;
+    }
+  }
+
+  return -1;
+}
+
+/* The cached addresses are those of the name, not of any one service. */
+static void dns_clear_port(struct sockaddr_storage *ss) {
+  switch (ss->ss_family) {
+    case AF_INET:
+      ((struct sockaddr_in *) ss)->sin_port = 0;
+      break;
+
+#ifdef PR_USE_IPV6
+    case AF_INET6:
+      ((struct sockaddr_in6 *) ss)->sin6_port = 0;
+      break;
+#endif /* PR_USE_IPV6 */
+
+    default:
+      break;
+  }
+}
+
+static int dns_store_entry(const char *name, const pr_netaddr_t *addr,
+    array_header *addrs) {
+  register unsigned int i;
+  struct dns_entry *entry = NULL;
+  unsigned int set, naddrs = 0;
+  uint64_t now_ms, oldest_ms = 0;
+  uint32_t seqno;
+
+  set = dns_hash(name);
+
+  /* Prefer the existing entry for this name, then an unused entry, then the
+   * least recently used one.
+   */
+  for (i = 0; i < DNS_CACHE_WAYS; i++) {
+    struct dns_entry *candidate;
+
+    candidate = &(dns_cache[(set * DNS_CACHE_WAYS) + i]);
+    if (strncasecmp(candidate->name, name, DNS_MAX_NAMELEN) == 0) {
+      entry = candidate;
+      break;
+    }
+
+    if (candidate->name[0] == '\0') {
+      if (entry == NULL ||
+          entry->name[0] != '\0') {
+        entry = candidate;
+      }
+
+      continue;
+    }
+
+    if (entry == NULL ||
+        (entry->name[0] != '\0' &&
+         candidate->used_ms < oldest_ms)) {
+      entry = candidate;
+      oldest_ms = candidate->used_ms;
+    }
+  }
+
+  if (dns_lock_entry(entry, &seqno) < 0) {
+    /* Someone else is updating this entry right now; let them. */
+    errno = EAGAIN;
+    return -1;
+  }
+
+  pr_gettimeofday_millis(&now_ms);
+
+  sstrncpy(entry->name, name, sizeof(entry->name));
+  memcpy(&(entry->addrs[naddrs]), pr_netaddr_get_sockaddr(addr),
+    pr_netaddr_get_sockaddr_len(addr));
+  dns_clear_port(&(entry->addrs[naddrs++]));
+
+  if (addrs != NULL) {
+    for (i = 0; i < addrs->nelts && naddrs < DNS_MAX_ADDRS; i++) {
+      const pr_netaddr_t *other_addr;
+
+      other_addr = ((const pr_netaddr_t **) addrs->elts)[i];
+      memcpy(&(entry->addrs[naddrs]), pr_netaddr_get_sockaddr(other_addr),
+        pr_netaddr_get_sockaddr_len(other_addr));
+      dns_clear_port(&(entry->addrs[naddrs++]));
+    }
+  }
+
+  entry->naddrs = naddrs;
+  entry->expires_ms = now_ms + dns_ttl_ms;
+  if (entry->used_ms == 0) {
+    entry->used_ms = now_ms;
+  }
+
+  dns_unlock_entry(entry, seqno);
+
+  pr_trace_msg(trace_channel, 15, "cached %u %s for '%s'", naddrs,
+    naddrs != 1 ? "addresses" : "address", name);
+  return 0;
+}
+
+static void dns_drop_entry(struct dns_entry *entry) {
+  uint32_t seqno;
+
+  if (dns_lock_entry(entry, &seqno) < 0) {
+    return;
+  }
+
+  entry->name[0] = '\0';
+  entry->naddrs = 0;
+  entry->expires_ms = entry->used_ms = 0;
+
+  dns_unlock_entry(entry, seqno);
+}
+
+static const pr_netaddr_t *dns_resolve(pool *p, const char *name,
+    array_header **addrs) {
+  const pr_netaddr_t *addr;
+
+  addr = pr_netaddr_get_addr(p, name, addrs);
+  if (addr == NULL) {
+    return NULL;
+  }
+
+  if (dns_cache != NULL &&
+      strlen(name) < DNS_MAX_NAMELEN) {
+    (void) dns_store_entry(name, addr, addrs != NULL ? *addrs : NULL);
+  }
+
+  return addr;
+}
+
+static int dns_is_literal(const char *name) {
+  return (pr_netaddr_is_v4(name) == TRUE || pr_netaddr_is_v6(name) == TRUE);
+}
+
+int proxy_dns_add(pool *p, const char *name) {
+  array_header *addrs = NULL;
+
+  if (p == NULL ||
+      name == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (dns_cache == NULL ||
+      dns_is_literal(name)) {
+    return 0;
+  }
+
+  if (dns_resolve(p, name, &addrs) == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int proxy_dns_add_addrs(pool *p, const char *name, const pr_netaddr_t *addr,
+    array_header *addrs) {
+  if (p == NULL ||
+      name == NULL ||
+      addr == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (dns_cache == NULL ||
+      dns_is_literal(name) ||
+      strlen(name) >= DNS_MAX_NAMELEN) {
+    return 0;
+  }
+
+  return dns_store_entry(name, addr, addrs);
+}
+
+static const pr_netaddr_t *dns_entry_get_addr(pool *p, struct dns_entry *entry,
+    array_header **addrs) {
+  register unsigned int i;
+  pr_netaddr_t *addr = NULL;
+
+  if (addrs != NULL) {
+    *addrs = NULL;
+  }
+
+  for (i = 0; i < entry->naddrs; i++) {
+    pr_netaddr_t *na;
+
+    na = pr_netaddr_alloc(p);
+    pr_netaddr_set_family(na, entry->addrs[i].ss_family);
+    pr_netaddr_set_sockaddr(na, (struct sockaddr *) &(entry->addrs[i]));
+
+    if (addr == NULL) {
+      addr = na;
+      continue;
+    }
+
+    if (addrs == NULL) {
+      break;
+    }
+
+    if (*addrs == NULL) {
+      *addrs = make_array(p, entry->naddrs - 1, sizeof(pr_netaddr_t *));
+    }
+
+    *((pr_netaddr_t **) push_array(*addrs)) = na;
+  }
+
+  return addr;
+}
+
+const pr_netaddr_t *proxy_dns_get_addr(pool *p, const char *name,
+    array_header **addrs) {
+  struct dns_entry entry;
+  const pr_netaddr_t *addr;
+  uint64_t now_ms;
+  int idx;
+
+  if (p == NULL ||
+      name == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (dns_cache == NULL ||
+      dns_is_literal(name)) {
+    return pr_netaddr_get_addr(p, name, addrs);
+  }
+
+  idx = dns_find_entry(name, &entry);
+  if (idx >= 0 &&
+      entry.naddrs > 0) {
+    pr_gettimeofday_millis(&now_ms);
+    dns_cache[idx].used_ms = now_ms;
+
+    if (entry.expires_ms > now_ms) {
+      pr_trace_msg(trace_channel, 17, "cache hit for '%s' (%u %s)", name,
+        entry.naddrs, entry.naddrs != 1 ? "addresses" : "address");
+      return dns_entry_get_addr(p, &entry, addrs);
+    }
+  }
+
+  pr_trace_msg(trace_channel, 17, "cache miss for '%s', resolving", name);
+  addr = dns_resolve(p, name, addrs);
+  if (addr == NULL &&
+      idx >= 0 &&
+      entry.naddrs > 0) {
+    /* Better to use the expired addresses than none at all. */
+    pr_trace_msg(trace_channel, 8,
+      "unable to resolve '%s' (%s), using expired cached addresses", name,
+      strerror(errno));
+    addr = dns_entry_get_addr(p, &entry, addrs);
+  }
+
+  return addr;
+}
+
+static void dns_worker(pool *p) {
+  uint64_t *retry_ms;
+  config_rec *c;
+
+  /* The signal handlers of the daemon do not apply to us. */
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGUSR2, SIG_IGN);
+
+  /* The ProxyLog is otherwise only opened by session processes. */
+  c = find_config(main_server->conf, CONF_PARAM, "ProxyLog", FALSE);
+  if (c != NULL &&
+      proxy_logfd < 0) {
+    char *logname;
+
+    logname = c->argv[0];
+    if (strncasecmp(logname, "none", 5) != 0) {
+      if (pr_log_openfile(logname, &proxy_logfd, PR_LOG_SYSTEM_MODE) < 0) {
+        proxy_logfd = -1;
+      }
+    }
+  }
+
+  pr_trace_msg(trace_channel, 5, "DNS cache worker (PID %lu) started",
+    (unsigned long) getpid());
+
+  retry_ms = pcalloc(p, sizeof(uint64_t) * DNS_CACHE_ENTRY_COUNT);
+
+  while (TRUE) {
+    register unsigned int i;
+    uint64_t now_ms, next_ms;
+    int res, timeout_ms = 0;
+
+    pr_gettimeofday_millis(&now_ms);
+    next_ms = now_ms + dns_ttl_ms;
+
+    for (i = 0; i < DNS_CACHE_ENTRY_COUNT; i++) {
+      struct dns_entry entry;
+      uint64_t refresh_ms;
+
+      if (dns_read_entry(&(dns_cache[i]), &entry) < 0 ||
+          entry.name[0] == '\0') {
+        continue;
+      }
+
+      if (entry.used_ms + (dns_ttl_ms * DNS_MAX_IDLE_TTLS) <= now_ms) {
+        pr_trace_msg(trace_channel, 15, "dropping unused entry for '%s'",
+          entry.name);
+        dns_drop_entry(&(dns_cache[i]));
+        continue;
+      }
+
+      refresh_ms = entry.expires_ms - (dns_ttl_ms / DNS_REFRESH_AHEAD_DIVISOR);
+      if (retry_ms[i] > refresh_ms) {
+        refresh_ms = retry_ms[i];
+      }
+
+      if (refresh_ms <= now_ms) {
+        pool *tmp_pool;
+        array_header *addrs = NULL;
+        const pr_netaddr_t *addr;
+
+        tmp_pool = make_sub_pool(p);
+
+        /* Make sure that we ask the resolver, not the Core API's own cache. */
+        pr_netaddr_clear_cache();
+
+        addr = pr_netaddr_get_addr(tmp_pool, entry.name, &addrs);
+        if (addr != NULL) {
+          (void) dns_store_entry(entry.name, addr, addrs);
+          retry_ms[i] = 0;
+          refresh_ms = now_ms + dns_ttl_ms -
+            (dns_ttl_ms / DNS_REFRESH_AHEAD_DIVISOR);
+
+        } else {
+          (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+            "unable to refresh cached addresses for '%s': %s", entry.name,
+            strerror(errno));
+          retry_ms[i] = now_ms + DNS_RETRY_INTERVAL_MS;
+          refresh_ms = retry_ms[i];
+        }
+
+        destroy_pool(tmp_pool);
+      }
+
+      if (refresh_ms < next_ms) {
+        next_ms = refresh_ms;
+      }
+    }
+
+    pr_gettimeofday_millis(&now_ms);
+    if (next_ms > now_ms) {
+      timeout_ms = (int) (next_ms - now_ms);
+    }
+
+    /* Sessions may add new entries at any time; look for them at least once
+     * a second.
+     */
+    if (timeout_ms > 1000) {
+      timeout_ms = 1000;
+    }
+
+    /* Sleep until the next refresh is due, or until the daemon goes away. */
+    res = proxy_evloop_poll_fd(dns_fds[0], PROXY_EVLOOP_EV_READ, timeout_ms);
+    if (res < 0 &&
+        errno == EINTR) {
+      continue;
+    }
+
+    if (res != 0) {
+      break;
+    }
+  }
+
+  pr_trace_msg(trace_channel, 5, "DNS cache worker (PID %lu) exiting",
+    (unsigned long) getpid());
+  _exit(0);
+}
+
+int proxy_dns_init(pool *p, int ttl) {
+  struct dns_entry *cache;
+  size_t cachesz;
+  pid_t pid;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (ttl <= 0) {
+    pr_trace_msg(trace_channel, 9, "DNS cache disabled");
+    return 0;
+  }
+
+  if (dns_cache != NULL) {
+    return 0;
+  }
+
+  cachesz = sizeof(struct dns_entry) * DNS_CACHE_ENTRY_COUNT;
+  cache = mmap(NULL, cachesz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS,
+    -1, 0);
+  if (cache == MAP_FAILED) {
+    int xerrno = errno;
+
+    pr_log_pri(PR_LOG_NOTICE, MOD_PROXY_VERSION
+      ": error allocating %lu bytes of shared memory: %s",
+      (unsigned long) cachesz, strerror(xerrno));
+    errno = xerrno;
+    return -1;
+  }
+
+  memset(cache, 0, cachesz);
+  dns_cache = cache;
+  dns_cachesz = cachesz;
+  dns_ttl_ms = (uint64_t) ttl * 1000;
+
+  /* Each inetd-run session process is its own daemon; without a worker,
+   * sessions simply resolve expired entries themselves.
+   */
+  if (ServerType == SERVER_INETD) {
+    return 0;
+  }
+
+  if (pipe(dns_fds) < 0) {
+    return -1;
+  }
+
+  pid = fork();
+  switch (pid) {
+    case -1: {
+      int xerrno = errno;
+
+      (void) close(dns_fds[0]);
+      (void) close(dns_fds[1]);
+      dns_fds[0] = dns_fds[1] = -1;
+
+      errno = xerrno;
+      return -1;
+    }
+
+    case 0:
+      (void) close(dns_fds[1]);
+      dns_fds[1] = -1;
+
+      dns_worker(p);
+
+      /* Not reached. */
+      _exit(0);
+
+    default:
+      (void) close(dns_fds[0]);
+      dns_fds[0] = -1;
+
+      dns_pid = pid;
+      break;
+  }
+
+  pr_trace_msg(trace_channel, 7, "started DNS cache worker (PID %lu)",
+    (unsigned long) dns_pid);
+  return 0;
+}
+
+int proxy_dns_free(pool *p) {
+  if (dns_fds[1] >= 0) {
+    (void) close(dns_fds[1]);
+    dns_fds[1] = -1;
+  }
+
+  if (dns_pid > 0) {
+    pr_trace_msg(trace_channel, 7, "stopping DNS cache worker (PID %lu)",
+      (unsigned long) dns_pid);
+    (void) kill(dns_pid, SIGTERM);
+    dns_pid = 0;
+  }
+
+  if (dns_cache != NULL) {
+    (void) munmap((void *) dns_cache, dns_cachesz);
+    dns_cache = NULL;
+    dns_cachesz = 0;
+  }
+
+  return 0;
+}
+
+int proxy_dns_sess_init(void) {
+  /* Only the daemon keeps the worker alive, and stops it. */
+  if (dns_fds[1] >= 0) {
+    (void) close(dns_fds[1]);
+    dns_fds[1] = -1;
+  }
+
+  dns_pid = 0;
+  return 0;
+}
@@ -0,0 +1,493 @@
+/*
+ * ProFTPD - mod_proxy event loop implementation
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_proxy.h"
+#include "proxy/evloop.h"
+
+#include <poll.h>
+
+#if defined(HAVE_SYS_EPOLL_H)
+# include <sys/epoll.h>
+#endif /* HAVE_SYS_EPOLL_H */
+
+struct evloop_fd {
+  int fd;
+  int events;
+  void *data;
+};
+
+struct proxy_evloop {
+  pool *pool;
+
+  /* The epoll(7) fd; -1 if using poll(2). */
+  int epfd;
+
+  /* Registered fds; there are only ever a handful of these. */
+  array_header *fds;
+
+  /* Scratch space for the results from epoll_wait(2)/poll(2). */
+  void *results;
+  unsigned int resultsz;
+};
+
+static const char *trace_channel = "proxy.evloop";
+
+static struct evloop_fd *evloop_get_fd(struct proxy_evloop *loop, int fd,
+    unsigned int *idx) {
+  register unsigned int i;
+  struct evloop_fd *efds;
+
+  efds = loop->fds->elts;
+  for (i = 0; i < loop->fds->nelts; i++) {
+    if (efds[i].fd == fd) {
+      if (idx != NULL) {
+        *idx = i;
+      }
+
+      return &(efds[i]);
+    }
+  }
+
+  errno = ENOENT;
+  return NULL;
+}
+
+#if defined(HAVE_SYS_EPOLL_H)
+static uint32_t evloop_get_epoll_events(int events) {
+  uint32_t ep_events = 0;
+
+  if (events & PROXY_EVLOOP_EV_READ) {
+    ep_events |= EPOLLIN;
+  }
+
+  if (events & PROXY_EVLOOP_EV_WRITE) {
+    ep_events |= EPOLLOUT;
+  }
+
+  if (events & PROXY_EVLOOP_EV_EDGE) {
+    ep_events |= EPOLLET;
+  }
+
+  return ep_events;
+}
+
+static int evloop_epoll_ctl(struct proxy_evloop *loop, int op, int fd,
+    int events) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = evloop_get_epoll_events(events);
+  ev.data.fd = fd;
+
+  return epoll_ctl(loop->epfd, op, fd, &ev);
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+static void evloop_cleanup_cb(void *data) {
+  struct proxy_evloop *loop;
+
+  loop = data;
+  if (loop->epfd >= 0) {
+    (void) close(loop->epfd);
+    loop->epfd = -1;
+  }
+}
+
+static void evloop_ensure_results(struct proxy_evloop *loop,
+    unsigned int count, size_t elt_size) {
+  if (loop->resultsz >= count) {
+    return;
+  }
+
+  loop->resultsz = count * 2;
+  loop->results = palloc(loop->pool, loop->resultsz * elt_size);
+}
+
+struct proxy_evloop *proxy_evloop_create(pool *p, int flags) {
+  pool *loop_pool;
+  struct proxy_evloop *loop;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  loop_pool = make_sub_pool(p);
+  pr_pool_tag(loop_pool, "Proxy Event Loop Pool");
+
+  loop = pcalloc(loop_pool, sizeof(struct proxy_evloop));
+  loop->pool = loop_pool;
+  loop->epfd = -1;
+  loop->fds = make_array(loop_pool, 4, sizeof(struct evloop_fd));
+
+#if defined(HAVE_SYS_EPOLL_H)
+  if (!(flags & PROXY_EVLOOP_FL_USE_POLL)) {
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+      pr_trace_msg(trace_channel, 3,
+        "error creating epoll fd, using poll(2) instead: %s", strerror(errno));
+    }
+  }
+#endif /* HAVE_SYS_EPOLL_H */
+
+  register_cleanup(loop_pool, loop, evloop_cleanup_cb, evloop_cleanup_cb);
+
+  pr_trace_msg(trace_channel, 17, "created event loop using %s",
+    proxy_evloop_get_name(loop));
+  return loop;
+}
+
+int proxy_evloop_destroy(struct proxy_evloop *loop) {
+  if (loop == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  destroy_pool(loop->pool);
+  return 0;
+}
+
+const char *proxy_evloop_get_name(struct proxy_evloop *loop) {
+  if (loop == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (loop->epfd >= 0) {
+    return "epoll";
+  }
+
+  return "poll";
+}
+
+int proxy_evloop_add(struct proxy_evloop *loop, int fd, int events,
+    void *data) {
+  struct evloop_fd *efd;
+
+  if (loop == NULL ||
+      fd < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* If we already know about this fd, it is most likely a stale entry, for
+   * an fd which was closed (and thus implicitly unregistered) and since
+   * reused.
+   */
+  if (evloop_get_fd(loop, fd, NULL) != NULL) {
+    (void) proxy_evloop_remove(loop, fd);
+  }
+
+#if defined(HAVE_SYS_EPOLL_H)
+  if (loop->epfd >= 0) {
+    if (evloop_epoll_ctl(loop, EPOLL_CTL_ADD, fd, events) < 0) {
+      int xerrno = errno;
+
+      pr_trace_msg(trace_channel, 3, "error adding fd %d to epoll fd %d: %s",
+        fd, loop->epfd, strerror(xerrno));
+
+      errno = xerrno;
+      return -1;
+    }
+  }
+#endif /* HAVE_SYS_EPOLL_H */
+
+  efd = push_array(loop->fds);
+  efd->fd = fd;
+  efd->events = events;
+  efd->data = data;
+
+  pr_trace_msg(trace_channel, 19, "added fd %d (events %#x) to event loop",
+    fd, events);
+  return 0;
+}
+
+int proxy_evloop_modify(struct proxy_evloop *loop, int fd, int events,
+    void *data) {
+  struct evloop_fd *efd;
+
+  if (loop == NULL ||
+      fd < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  efd = evloop_get_fd(loop, fd, NULL);
+  if (efd == NULL) {
+    return -1;
+  }
+
+#if defined(HAVE_SYS_EPOLL_H)
+  if (loop->epfd >= 0) {
+    if (evloop_epoll_ctl(loop, EPOLL_CTL_MOD, fd, events) < 0) {
+      int xerrno = errno;
+
+      pr_trace_msg(trace_channel, 3, "error modifying fd %d in epoll fd %d: %s",
+        fd, loop->epfd, strerror(xerrno));
+
+      errno = xerrno;
+      return -1;
+    }
+  }
+#endif /* HAVE_SYS_EPOLL_H */
+
+  efd->events = events;
+  efd->data = data;
+  return 0;
+}
+
+int proxy_evloop_remove(struct proxy_evloop *loop, int fd) {
+  unsigned int idx = 0;
+  struct evloop_fd *efds;
+
+  if (loop == NULL ||
+      fd < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (evloop_get_fd(loop, fd, &idx) == NULL) {
+    return -1;
+  }
+
+#if defined(HAVE_SYS_EPOLL_H)
+  if (loop->epfd >= 0) {
+    /* If the fd has already been closed, the kernel will already have
+     * removed it from the epoll set, so ignore any errors here.
+     */
+    (void) evloop_epoll_ctl(loop, EPOLL_CTL_DEL, fd, 0);
+  }
+#endif /* HAVE_SYS_EPOLL_H */
+
+  /* Fill the hole with the last entry. */
+  efds = loop->fds->elts;
+  efds[idx] = efds[loop->fds->nelts - 1];
+  loop->fds->nelts--;
+
+  pr_trace_msg(trace_channel, 19, "removed fd %d from event loop", fd);
+  return 0;
+}
+
+int proxy_evloop_clear(struct proxy_evloop *loop) {
+  if (loop == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  while (loop->fds->nelts > 0) {
+    struct evloop_fd *efds;
+
+    efds = loop->fds->elts;
+    (void) proxy_evloop_remove(loop, efds[0].fd);
+  }
+
+  return 0;
+}
+
+#if defined(HAVE_SYS_EPOLL_H)
+static int evloop_epoll_wait(struct proxy_evloop *loop,
+    struct proxy_evloop_event *events, unsigned int max_events,
+    int timeout_ms) {
+  register int i;
+  int count = 0, res;
+  struct epoll_event *ep_events;
+
+  evloop_ensure_results(loop, max_events, sizeof(struct epoll_event));
+  ep_events = loop->results;
+
+  res = epoll_wait(loop->epfd, ep_events, (int) max_events, timeout_ms);
+  if (res <= 0) {
+    return res;
+  }
+
+  for (i = 0; i < res; i++) {
+    struct evloop_fd *efd;
+
+    efd = evloop_get_fd(loop, ep_events[i].data.fd, NULL);
+    if (efd == NULL) {
+      continue;
+    }
+
+    events[count].fd = efd->fd;
+    events[count].data = efd->data;
+    events[count].events = 0;
+
+    if (ep_events[i].events & EPOLLIN) {
+      events[count].events |= PROXY_EVLOOP_EV_READ;
+    }
+
+    if (ep_events[i].events & EPOLLOUT) {
+      events[count].events |= PROXY_EVLOOP_EV_WRITE;
+    }
+
+    if (ep_events[i].events & (EPOLLERR|EPOLLHUP)) {
+      events[count].events |= PROXY_EVLOOP_EV_ERROR;
+    }
+
+    count++;
+  }
+
+  return count;
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+static int evloop_poll_wait(struct proxy_evloop *loop,
+    struct proxy_evloop_event *events, unsigned int max_events,
+    int timeout_ms) {
+  register unsigned int i;
+  int count = 0, res;
+  struct evloop_fd *efds;
+  struct pollfd *pfds;
+
+  evloop_ensure_results(loop, loop->fds->nelts, sizeof(struct pollfd));
+  pfds = loop->results;
+
+  efds = loop->fds->elts;
+  for (i = 0; i < loop->fds->nelts; i++) {
+    /* Ignore fds with no registered interest; otherwise poll(2) would
+     * keep reporting any hangup on them.
+     */
+    pfds[i].fd = -1;
+    pfds[i].events = 0;
+    pfds[i].revents = 0;
+
+    if (efds[i].events & (PROXY_EVLOOP_EV_READ|PROXY_EVLOOP_EV_WRITE)) {
+      pfds[i].fd = efds[i].fd;
+    }
+
+    if (efds[i].events & PROXY_EVLOOP_EV_READ) {
+      pfds[i].events |= POLLIN;
+    }
+
+    if (efds[i].events & PROXY_EVLOOP_EV_WRITE) {
+      pfds[i].events |= POLLOUT;
+    }
+  }
+
+  res = poll(pfds, loop->fds->nelts, timeout_ms);
+  if (res <= 0) {
+    return res;
+  }
+
+  for (i = 0; i < loop->fds->nelts && (unsigned int) count < max_events; i++) {
+    if (pfds[i].revents == 0) {
+      continue;
+    }
+
+    if (pfds[i].revents & POLLNVAL) {
+      /* The fd was closed without being unregistered; emulate epoll(7),
+       * and quietly forget about it.
+       */
+      pr_trace_msg(trace_channel, 19,
+        "fd %d closed, removing from event loop", pfds[i].fd);
+      efds[i].events = 0;
+      continue;
+    }
+
+    events[count].fd = efds[i].fd;
+    events[count].data = efds[i].data;
+    events[count].events = 0;
+
+    if (pfds[i].revents & POLLIN) {
+      events[count].events |= PROXY_EVLOOP_EV_READ;
+    }
+
+    if (pfds[i].revents & POLLOUT) {
+      events[count].events |= PROXY_EVLOOP_EV_WRITE;
+    }
+
+    if (pfds[i].revents & (POLLERR|POLLHUP)) {
+      events[count].events |= PROXY_EVLOOP_EV_ERROR;
+    }
+
+    count++;
+  }
+
+  return count;
+}
+
+int proxy_evloop_wait(struct proxy_evloop *loop,
+    struct proxy_evloop_event *events, unsigned int max_events,
+    int timeout_ms) {
+  if (loop == NULL ||
+      events == NULL ||
+      max_events == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#if defined(HAVE_SYS_EPOLL_H)
+  if (loop->epfd >= 0) {
+    return evloop_epoll_wait(loop, events, max_events, timeout_ms);
+  }
+#endif /* HAVE_SYS_EPOLL_H */
+
+  return evloop_poll_wait(loop, events, max_events, timeout_ms);
+}
+
+int proxy_evloop_poll_fd(int fd, int events, int timeout_ms) {
+  int res, ready = 0;
+  struct pollfd pfd;
+
+  if (fd < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pfd.fd = fd;
+  pfd.events = 0;
+  pfd.revents = 0;
+
+  if (events & PROXY_EVLOOP_EV_READ) {
+    pfd.events |= POLLIN;
+  }
+
+  if (events & PROXY_EVLOOP_EV_WRITE) {
+    pfd.events |= POLLOUT;
+  }
+
+  res = poll(&pfd, 1, timeout_ms);
+  if (res <= 0) {
+    return res;
+  }
+
+  if (pfd.revents & POLLNVAL) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (pfd.revents & POLLIN) {
+    ready |= PROXY_EVLOOP_EV_READ;
+  }
+
+  if (pfd.revents & POLLOUT) {
+    ready |= PROXY_EVLOOP_EV_WRITE;
+  }
+
+  if (pfd.revents & (POLLERR|POLLHUP)) {
+    ready |= PROXY_EVLOOP_EV_ERROR;
+  }
+
+  return ready;
+}
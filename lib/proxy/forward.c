@@ -156,44 +156,22 @@ static int forward_connect(pool *p, struct proxy_session *proxy_sess,
     pr_response_t **resp, unsigned int *resp_nlines) {
   conn_t *server_conn = NULL;
   int banner_ok = TRUE, use_tls, xerrno = 0;
-  const pr_netaddr_t *dst_addr;
-  array_header *other_addrs = NULL;
+  struct proxy_conn_connect *pcc;
 
-  dst_addr = proxy_sess->dst_addr;
-  other_addrs = proxy_sess->other_addrs;
+  /* Race the connects to all of the IP addresses for the requested name. */
+  pcc = proxy_conn_connect_start(p, proxy_sess, proxy_sess->dst_pconn);
+  if (pcc != NULL) {
+    server_conn = proxy_conn_connect_finish(p, proxy_sess, pcc);
+  }
 
-  server_conn = proxy_conn_get_server_conn(p, proxy_sess, dst_addr);
   if (server_conn == NULL) {
     xerrno = errno;
 
-    if (other_addrs != NULL) {
-      register unsigned int i;
-
-      /* Try the other IP addresses for the requested name (if any) as well. */
-      for (i = 0; i < other_addrs->nelts; i++) {
-        dst_addr = ((pr_netaddr_t **) other_addrs->elts)[i];
-
-        pr_trace_msg(trace_channel, 8,
-          "attempting to connect to other address #%u (%s) for requested "
-          "URI '%.100s'", i+1, pr_netaddr_get_ipstr(dst_addr),
-          proxy_conn_get_uri(proxy_sess->dst_pconn));
-        server_conn = proxy_conn_get_server_conn(p, proxy_sess, dst_addr);
-        if (server_conn != NULL) {
-          proxy_sess->dst_addr = dst_addr;
-          break;
-        }
-      }
-    }
-
-    if (server_conn == NULL) {
-      xerrno = errno;
-
-      /* EINVALs lead to strange-looking error responses; change them to
-       * EPERM.
-       */
-      if (xerrno == EINVAL) {
-        xerrno = EPERM;
-      }
+    /* EINVALs lead to strange-looking error responses; change them to
+     * EPERM.
+     */
+    if (xerrno == EINVAL) {
+      xerrno = EPERM;
     }
 
     errno = xerrno;
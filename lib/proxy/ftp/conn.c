@@ -26,10 +26,70 @@
 
 #include "include/proxy/inet.h"
 #include "include/proxy/netio.h"
+#include "include/proxy/session.h"
 #include "include/proxy/ftp/conn.h"
 
+/* For "auto" data transfer buffer sizes, the buffers are sized to hold the
+ * bandwidth-delay product for this bandwidth (10 Gbps), within these limits.
+ */
+#define PROXY_FTP_CONN_AUTO_BYTES_PER_SEC	1250000000ULL
+#define PROXY_FTP_CONN_AUTO_MIN_BUFSZ		(128 * 1024)
+#define PROXY_FTP_CONN_AUTO_MAX_BUFSZ		(16 * 1024 * 1024)
+
 static const char *trace_channel = "proxy.ftp.conn";
 
+/* Returns the socket buffer size configured for backend data connections,
+ * if any.
+ */
+static int get_backend_xfer_bufsz(void) {
+  const struct proxy_session *proxy_sess;
+  size_t bufsz;
+
+  proxy_sess = pr_table_get(session.notes, "mod_proxy.proxy-session", NULL);
+  if (proxy_sess == NULL ||
+      proxy_sess->dataxfer_bufsz == 0) {
+    return 0;
+  }
+
+  bufsz = proxy_ftp_conn_get_xfer_bufsz(proxy_sess->backend_ctrl_conn,
+    proxy_sess->dataxfer_bufsz);
+  if (bufsz > INT_MAX) {
+    bufsz = INT_MAX;
+  }
+
+  return (int) bufsz;
+}
+
+static void set_socket_opts(conn_t *conn, int frontend_data) {
+  int bufsz = 0;
+
+  if (frontend_data == FALSE) {
+    bufsz = get_backend_xfer_bufsz();
+  }
+
+  if (bufsz > 0) {
+    /* We relay data in both directions on backend data connections, thus
+     * we size both buffers.
+     */
+    pr_trace_msg(trace_channel, 17,
+      "setting %d byte socket buffers for backend data connection", bufsz);
+    pr_inet_set_socket_opts(conn->pool, conn, bufsz, bufsz,
+      main_server->tcp_keepalive);
+    return;
+  }
+
+  if (session.xfer.direction == PR_NETIO_IO_RD) {
+    pr_inet_set_socket_opts(conn->pool, conn,
+      (main_server->tcp_rcvbuf_override ? main_server->tcp_rcvbuf_len : 0), 0,
+      main_server->tcp_keepalive);
+
+  } else {
+    pr_inet_set_socket_opts(conn->pool, conn,
+      0, (main_server->tcp_sndbuf_override ? main_server->tcp_sndbuf_len : 0),
+      main_server->tcp_keepalive);
+  }
+}
+
 conn_t *proxy_ftp_conn_accept(pool *p, conn_t *data_conn, conn_t *ctrl_conn,
     int frontend_data) {
   conn_t *conn;
@@ -43,17 +103,7 @@ conn_t *proxy_ftp_conn_accept(pool *p, conn_t *data_conn, conn_t *ctrl_conn,
   }
 
   reverse_dns = pr_netaddr_set_reverse_dns(ServerUseReverseDNS);
-
-  if (session.xfer.direction == PR_NETIO_IO_RD) {
-    pr_inet_set_socket_opts(data_conn->pool, data_conn,
-      (main_server->tcp_rcvbuf_override ? main_server->tcp_rcvbuf_len : 0), 0,
-      main_server->tcp_keepalive);
-
-  } else {
-    pr_inet_set_socket_opts(data_conn->pool, data_conn,
-      0, (main_server->tcp_sndbuf_override ? main_server->tcp_sndbuf_len : 0),
-      main_server->tcp_keepalive);
-  }
+  set_socket_opts(data_conn, frontend_data);
 
   if (frontend_data) {
     conn = pr_inet_accept(session.pool, data_conn, ctrl_conn, -1, -1, TRUE);
@@ -105,17 +155,7 @@ conn_t *proxy_ftp_conn_connect(pool *p, const pr_netaddr_t *bind_addr,
   conn = pr_inet_create_conn(session.pool, -1, bind_addr, INPORT_ANY, TRUE);
 
   reverse_dns = pr_netaddr_set_reverse_dns(ServerUseReverseDNS);
-
-  if (session.xfer.direction == PR_NETIO_IO_RD) {
-    pr_inet_set_socket_opts(conn->pool, conn,
-      (main_server->tcp_rcvbuf_override ? main_server->tcp_rcvbuf_len : 0), 0,
-      main_server->tcp_keepalive);
-
-  } else {
-    pr_inet_set_socket_opts(conn->pool, conn,
-      0, (main_server->tcp_sndbuf_override ? main_server->tcp_sndbuf_len : 0),
-      main_server->tcp_keepalive);
-  }
+  set_socket_opts(conn, frontend_data);
 
   pr_inet_set_proto_opts(session.pool, conn,
     main_server->tcp_mss_len, 1, IPTOS_THROUGHPUT, 1);
@@ -233,8 +273,20 @@ conn_t *proxy_ftp_conn_listen(pool *p, const pr_netaddr_t *bind_addr,
   }
 
   /* Make sure that necessary socket options are set on the socket prior
-   * to the call to listen(2).
+   * to the call to listen(2).  Backend data connection buffer sizes need
+   * to be set here, so that the TCP window scaling negotiated for the
+   * accepted connection reflects them.
    */
+  if (frontend_data == FALSE) {
+    int bufsz;
+
+    bufsz = get_backend_xfer_bufsz();
+    if (bufsz > 0) {
+      pr_inet_set_socket_opts(conn->pool, conn, bufsz, bufsz,
+        main_server->tcp_keepalive);
+    }
+  }
+
   pr_inet_set_proto_opts(session.pool, conn, main_server->tcp_mss_len, 1,
     IPTOS_THROUGHPUT, 1);
   pr_inet_generate_socket_event("proxy.data-listen", main_server,
@@ -283,3 +335,59 @@ conn_t *proxy_ftp_conn_listen(pool *p, const pr_netaddr_t *bind_addr,
   return conn;
 }
 
+
+size_t proxy_ftp_conn_get_xfer_bufsz(conn_t *ctrl_conn, size_t bufsz) {
+#if defined(TCP_INFO)
+  struct tcp_info info;
+  socklen_t infolen;
+  unsigned long long auto_bufsz;
+#endif /* TCP_INFO */
+
+  if (bufsz != PROXY_FTP_CONN_XFER_BUFSZ_AUTO) {
+    return bufsz;
+  }
+
+  if (ctrl_conn == NULL ||
+      ctrl_conn->rfd < 0) {
+    return 0;
+  }
+
+#if defined(TCP_INFO)
+  memset(&info, 0, sizeof(info));
+  infolen = sizeof(info);
+
+  if (getsockopt(ctrl_conn->rfd, IPPROTO_TCP, TCP_INFO, &info,
+      &infolen) < 0) {
+    pr_trace_msg(trace_channel, 3,
+      "error obtaining TCP_INFO for control connection: %s", strerror(errno));
+    return 0;
+  }
+
+  if (info.tcpi_rtt == 0) {
+    pr_trace_msg(trace_channel, 9,
+      "no RTT observed for control connection, using default data transfer "
+      "buffer sizes");
+    return 0;
+  }
+
+  /* The tcpi_rtt value is in microseconds. */
+  auto_bufsz = ((unsigned long long) info.tcpi_rtt *
+    PROXY_FTP_CONN_AUTO_BYTES_PER_SEC) / 1000000ULL;
+
+  if (auto_bufsz < PROXY_FTP_CONN_AUTO_MIN_BUFSZ) {
+    auto_bufsz = PROXY_FTP_CONN_AUTO_MIN_BUFSZ;
+
+  } else if (auto_bufsz > PROXY_FTP_CONN_AUTO_MAX_BUFSZ) {
+    auto_bufsz = PROXY_FTP_CONN_AUTO_MAX_BUFSZ;
+  }
+
+  pr_trace_msg(trace_channel, 15,
+    "using %llu byte data transfer buffers for control connection RTT of "
+    "%u usecs", auto_bufsz, (unsigned int) info.tcpi_rtt);
+  return (size_t) auto_bufsz;
+#else
+  pr_trace_msg(trace_channel, 9,
+    "TCP_INFO not supported, using default data transfer buffer sizes");
+  return 0;
+#endif /* TCP_INFO */
+}
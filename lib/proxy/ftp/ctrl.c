@@ -24,6 +24,7 @@
 
 #include "mod_proxy.h"
 
+#include "proxy/evloop.h"
 #include "proxy/netio.h"
 #include "proxy/ftp/ctrl.h"
 
@@ -446,22 +447,14 @@ int proxy_ftp_ctrl_handle_async(pool *p, conn_t *backend_conn,
   }
 
   while (TRUE) {
-    fd_set rfds;
-    struct timeval tv;
     int ctrlfd, res, xerrno = 0;
 
-    /* By using a timeout of zero, we effect a poll on the fd. */
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
-
     pr_signals_handle();
 
-    FD_ZERO(&rfds);
-
     ctrlfd = PR_NETIO_FD(backend_conn->instrm);
-    FD_SET(ctrlfd, &rfds);
 
-    res = select(ctrlfd + 1, &rfds, NULL, NULL, &tv);
+    /* By using a timeout of zero, we effect a poll on the fd. */
+    res = proxy_evloop_poll_fd(ctrlfd, PROXY_EVLOOP_EV_READ, 0);
     if (res < 0) {
       xerrno = errno;
 
@@ -471,7 +464,7 @@ int proxy_ftp_ctrl_handle_async(pool *p, conn_t *backend_conn,
       }
 
       (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-        "error calling select(2) on backend control connection (fd %d): %s",
+        "error polling backend control connection (fd %d): %s",
         ctrlfd, strerror(xerrno));
       return 0;
     }
@@ -482,10 +475,10 @@ int proxy_ftp_ctrl_handle_async(pool *p, conn_t *backend_conn,
     }
 
     pr_trace_msg(trace_channel, 19,
-      "select(2) reported %d for backend %s (fd %d)", res,
+      "poll reported events %#x for backend %s (fd %d)", res,
       backend_conn->remote_name, ctrlfd);
 
-    if (FD_ISSET(ctrlfd, &rfds)) {
+    if (res & (PROXY_EVLOOP_EV_READ|PROXY_EVLOOP_EV_ERROR)) {
       unsigned int resp_nlines = 0;
       pr_response_t *resp;
 
@@ -22,13 +22,109 @@
  * source distribution.
  */
 
+/* For splice(2), and its SPLICE_F_* flags. */
+#if !defined(_GNU_SOURCE)
+# define _GNU_SOURCE
+#endif /* !_GNU_SOURCE */
+
 #include "mod_proxy.h"
 
+#include "proxy/evloop.h"
+#include "proxy/metrics.h"
 #include "proxy/netio.h"
 #include "proxy/ftp/data.h"
 
+#if defined(HAVE_SPLICE) && defined(SPLICE_F_MOVE)
+# define PROXY_FTP_DATA_USE_SPLICE	1
+# include <poll.h>
+#endif /* HAVE_SPLICE and SPLICE_F_MOVE */
+
+/* Maximum number of bytes to move through the pipe per splice(2) call;
+ * this matches the default pipe capacity on Linux.
+ */
+#define PROXY_FTP_DATA_SPLICE_MAX_LEN	(64 * 1024)
+
+struct proxy_ftp_data_ring {
+  pool *pool;
+  char *buf;
+  size_t size;
+
+  /* Offset of the first buffered byte, and number of buffered bytes. */
+  size_t head;
+  size_t len;
+};
+
 static const char *trace_channel = "proxy.ftp.data";
 
+/* Write the given data using the NetIO API, which waits for writability
+ * before writing, and which writes all of the data.
+ */
+static int data_write(conn_t *data_conn, char *buf, size_t buflen,
+    int frontend_data) {
+  int nwrote;
+
+  while (TRUE) {
+    int xerrno;
+
+    if (frontend_data) {
+      nwrote = pr_netio_write(data_conn->outstrm, buf, buflen);
+
+    } else {
+      nwrote = proxy_netio_write(data_conn->outstrm, buf, buflen);
+    }
+
+    (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_WRITE_CALLS, 1);
+
+    if (nwrote >= 0) {
+      break;
+    }
+
+    xerrno = errno;
+    if (xerrno == EAGAIN) {
+      struct timeval wait_start;
+      int res;
+
+      /* Since our socket is in non-blocking mode, write(2) can return
+       * EAGAIN if there is not enough room for our data yet.  Handle
+       * this by waiting until the socket is writable, then trying again.
+       */
+      (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_EAGAIN, 1);
+      pr_signals_handle();
+
+      gettimeofday(&wait_start, NULL);
+      res = proxy_evloop_poll_fd(PR_NETIO_FD(data_conn->outstrm),
+        PROXY_EVLOOP_EV_WRITE, 1000);
+      xerrno = errno;
+
+      (void) proxy_metrics_xfer_incr(frontend_data ?
+        PROXY_METRICS_XFER_FRONTEND_STALL_MS :
+        PROXY_METRICS_XFER_BACKEND_STALL_MS,
+        proxy_metrics_elapsed_ms(&wait_start));
+
+      if (res < 0 &&
+          xerrno != EINTR) {
+        errno = xerrno;
+        return -1;
+      }
+
+      continue;
+    }
+
+    errno = xerrno;
+    return -1;
+  }
+
+  (void) proxy_metrics_xfer_incr(frontend_data ?
+    PROXY_METRICS_XFER_FRONTEND_BYTES_OUT :
+    PROXY_METRICS_XFER_BACKEND_BYTES_OUT, nwrote);
+
+  pr_timer_reset(PR_TIMER_NOXFER, ANY_MODULE);
+  pr_timer_reset(PR_TIMER_STALLED, ANY_MODULE);
+  pr_timer_reset(PR_TIMER_IDLE, ANY_MODULE);
+
+  return nwrote;
+}
+
 pr_buffer_t *proxy_ftp_data_recv(pool *p, conn_t *data_conn,
     int frontend_data) {
   int nread;
@@ -63,7 +159,13 @@ pr_buffer_t *proxy_ftp_data_recv(pool *p, conn_t *data_conn,
         pbuf->remaining, 1);
     }
 
+    (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_READ_CALLS, 1);
+
     if (nread < 0) {
+      if (errno == EAGAIN) {
+        (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_EAGAIN, 1);
+      }
+
       return NULL;
     }
 
@@ -79,6 +181,9 @@ pr_buffer_t *proxy_ftp_data_recv(pool *p, conn_t *data_conn,
     pr_timer_reset(PR_TIMER_IDLE, ANY_MODULE);
 
     pr_trace_msg(trace_channel, 15, "received %d bytes of data", nread);
+    (void) proxy_metrics_xfer_incr(frontend_data ?
+      PROXY_METRICS_XFER_FRONTEND_BYTES_IN :
+      PROXY_METRICS_XFER_BACKEND_BYTES_IN, nread);
 
     pbuf->current += nread;
     pbuf->remaining -= nread;
@@ -97,9 +202,39 @@ pr_buffer_t *proxy_ftp_data_recv(pool *p, conn_t *data_conn,
   return pbuf;
 }
 
+int proxy_ftp_data_set_bufsz(conn_t *data_conn, size_t bufsz) {
+  pr_netio_stream_t *nstrm;
+  pr_buffer_t *pbuf;
+
+  if (data_conn == NULL ||
+      data_conn->instrm == NULL ||
+      bufsz == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  nstrm = data_conn->instrm;
+
+  pbuf = nstrm->strm_buf;
+  if (pbuf != NULL &&
+      pbuf->buflen == bufsz) {
+    return 0;
+  }
+
+  pbuf = pcalloc(nstrm->strm_pool, sizeof(pr_buffer_t));
+  pbuf->buf = palloc(nstrm->strm_pool, bufsz);
+  pbuf->buflen = bufsz;
+  pbuf->current = pbuf->buf;
+  pbuf->remaining = bufsz;
+  nstrm->strm_buf = pbuf;
+
+  pr_trace_msg(trace_channel, 17, "using %lu byte buffer for reading data",
+    (unsigned long) bufsz);
+  return 0;
+}
+
 int proxy_ftp_data_send(pool *p, conn_t *data_conn, pr_buffer_t *pbuf,
     int frontend_data) {
-  int nwrote;
   char *buf;
   size_t buflen;
 
@@ -113,14 +248,9 @@ int proxy_ftp_data_send(pool *p, conn_t *data_conn, pr_buffer_t *pbuf,
 
   pr_event_generate("mod_proxy.data-write", pbuf);
 
-  /* Currently, we make the conn_t nonblocking (via pr_inet_set_nonblocking),
-   * BUT that does NOT set the nonblocking flag on the contained stream.
-   * Thus this write is actually a BLOCKING write -- which means that we will
-   * not need to worry about short writes here.
-   *
-   * In the future, we may want to make the streams nonblocking, but that
-   * makes mod_proxy a little more sensitive to the slow producer/consumer
-   * problem.
+  /* Note that this write is a BLOCKING write, in that we wait until all of
+   * the data have been written.  For writes which do not wait for a slow
+   * peer, see proxy_ftp_data_ring_send().
    */
 
   buf = pbuf->buf;
@@ -130,41 +260,397 @@ int proxy_ftp_data_send(pool *p, conn_t *data_conn, pr_buffer_t *pbuf,
     (unsigned long) buflen,
     frontend_data ? "frontend client" : "backend server");
 
+  return data_write(data_conn, buf, buflen, frontend_data);
+}
+
+struct proxy_ftp_data_ring *proxy_ftp_data_ring_alloc(pool *p, size_t size) {
+  struct proxy_ftp_data_ring *ring;
+
+  if (p == NULL ||
+      size == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  ring = pcalloc(p, sizeof(struct proxy_ftp_data_ring));
+  ring->pool = p;
+  ring->buf = palloc(p, size);
+  ring->size = size;
+
+  return ring;
+}
+
+size_t proxy_ftp_data_ring_len(struct proxy_ftp_data_ring *ring) {
+  if (ring == NULL) {
+    return 0;
+  }
+
+  return ring->len;
+}
+
+size_t proxy_ftp_data_ring_space(struct proxy_ftp_data_ring *ring) {
+  if (ring == NULL) {
+    return 0;
+  }
+
+  return ring->size - ring->len;
+}
+
+/* Copy the buffered data into a larger buffer, unwrapped. */
+static void ring_grow(struct proxy_ftp_data_ring *ring, size_t size) {
+  char *buf;
+  size_t len;
+
+  buf = palloc(ring->pool, size);
+
+  len = ring->size - ring->head;
+  if (len > ring->len) {
+    len = ring->len;
+  }
+
+  memcpy(buf, ring->buf + ring->head, len);
+  if (len < ring->len) {
+    memcpy(buf + len, ring->buf, ring->len - len);
+  }
+
+  pr_trace_msg(trace_channel, 19, "grew data ring from %lu to %lu bytes",
+    (unsigned long) ring->size, (unsigned long) size);
+
+  ring->buf = buf;
+  ring->size = size;
+  ring->head = 0;
+}
+
+int proxy_ftp_data_ring_put(struct proxy_ftp_data_ring *ring,
+    pr_buffer_t *pbuf) {
+  char *buf;
+  size_t buflen, tail, len;
+
+  if (ring == NULL ||
+      pbuf == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Listeners may modify the data before we buffer it for writing. */
+  pr_event_generate("mod_proxy.data-write", pbuf);
+
+  buf = pbuf->buf;
+  buflen = pbuf->current - pbuf->buf;
+
+  if (buflen > ring->size - ring->len) {
+    size_t size;
+
+    /* Listeners may have grown the data beyond the space we had for it. */
+    size = ring->size * 2;
+    if (size < ring->len + buflen) {
+      size = ring->len + buflen;
+    }
+
+    ring_grow(ring, size);
+  }
+
+  /* Copy up to the end of the ring, then wrap around to the start. */
+  tail = (ring->head + ring->len) % ring->size;
+  len = ring->size - tail;
+  if (len > buflen) {
+    len = buflen;
+  }
+
+  memcpy(ring->buf + tail, buf, len);
+  if (len < buflen) {
+    memcpy(ring->buf, buf + len, buflen - len);
+  }
+
+  ring->len += buflen;
+  return (int) buflen;
+}
+
+/* Returns TRUE if the data connection on the given side uses the default
+ * NetIO, i.e. if writing directly to its socket is the same as writing via
+ * the NetIO API.  Any other NetIO (e.g. for TLS) may need to see, and
+ * transform, every write.
+ */
+static int data_uses_default_netio(int frontend_data) {
+  pr_netio_t *netio = NULL;
+
   if (frontend_data) {
-    nwrote = pr_netio_write(data_conn->outstrm, buf, buflen);
+    netio = pr_get_netio(PR_NETIO_STRM_DATA);
 
   } else {
-    nwrote = proxy_netio_write(data_conn->outstrm, buf, buflen);
+    if (proxy_netio_using(PR_NETIO_STRM_DATA, &netio) < 0) {
+      return FALSE;
+    }
   }
 
-  while (nwrote < 0) {
-    int xerrno = errno;
+  return netio == NULL ? TRUE : FALSE;
+}
 
-    if (xerrno == EAGAIN) {
-      /* Since our socket is in non-blocking mode, write(2) can return
-       * EAGAIN if there is not enough from for our data yet.  Handle
-       * this by delaying temporarily, then trying again.
-       */
-      errno = EINTR;
-      pr_signals_handle();
+int proxy_ftp_data_ring_send(pool *p, conn_t *data_conn,
+    struct proxy_ftp_data_ring *ring, int frontend_data, int flags) {
+  int total = 0;
+
+  if (p == NULL ||
+      data_conn == NULL ||
+      data_conn->outstrm == NULL ||
+      ring == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if ((flags & PROXY_FTP_DATA_FL_NONBLOCKING) &&
+      data_uses_default_netio(frontend_data) != TRUE) {
+    pr_trace_msg(trace_channel, 19,
+      "%s data connection uses a NetIO, writing via NetIO API",
+      frontend_data ? "frontend" : "backend");
+    flags &= ~PROXY_FTP_DATA_FL_NONBLOCKING;
+  }
+
+  while (ring->len > 0) {
+    int nwrote;
+    size_t len;
+    char *buf;
 
-      if (frontend_data) {
-        nwrote = pr_netio_write(data_conn->outstrm, buf, buflen);
+    /* Write the contiguous data from the head of the ring. */
+    buf = ring->buf + ring->head;
+    len = ring->size - ring->head;
+    if (len > ring->len) {
+      len = ring->len;
+    }
+
+#if defined(MSG_DONTWAIT)
+    if (flags & PROXY_FTP_DATA_FL_NONBLOCKING) {
+      nwrote = send(PR_NETIO_FD(data_conn->outstrm), buf, len, MSG_DONTWAIT);
+      (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_WRITE_CALLS, 1);
+
+      if (nwrote < 0) {
+        int xerrno = errno;
+
+        if (xerrno == EINTR) {
+          pr_signals_handle();
+          continue;
+        }
+
+        if (xerrno == EAGAIN ||
+            xerrno == EWOULDBLOCK) {
+          (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_EAGAIN, 1);
+
+          if (total > 0) {
+            break;
+          }
+
+          xerrno = EAGAIN;
+        }
 
-      } else {
-        nwrote = proxy_netio_write(data_conn->outstrm, buf, buflen);
+        errno = xerrno;
+        return -1;
       }
 
+      session.total_raw_out += nwrote;
+      (void) proxy_metrics_xfer_incr(frontend_data ?
+        PROXY_METRICS_XFER_FRONTEND_BYTES_OUT :
+        PROXY_METRICS_XFER_BACKEND_BYTES_OUT, nwrote);
+
+      pr_timer_reset(PR_TIMER_NOXFER, ANY_MODULE);
+      pr_timer_reset(PR_TIMER_STALLED, ANY_MODULE);
+      pr_timer_reset(PR_TIMER_IDLE, ANY_MODULE);
+
+    } else {
+      nwrote = data_write(data_conn, buf, len, frontend_data);
+    }
+#else
+    nwrote = data_write(data_conn, buf, len, frontend_data);
+#endif /* MSG_DONTWAIT */
+
+    if (nwrote < 0) {
+      return -1;
+    }
+
+    pr_trace_msg(trace_channel, 25, "wrote %d bytes of data to %s", nwrote,
+      frontend_data ? "frontend client" : "backend server");
+
+    ring->head = (ring->head + nwrote) % ring->size;
+    ring->len -= nwrote;
+    total += nwrote;
+
+    if (ring->len == 0) {
+      /* Start from the beginning again, for larger contiguous writes. */
+      ring->head = 0;
+    }
+  }
+
+  return total;
+}
+
+#if defined(PROXY_FTP_DATA_USE_SPLICE)
+static void splice_pipe_cleanup_cb(void *data) {
+  int *pipe_fds;
+
+  pipe_fds = data;
+  if (pipe_fds[0] >= 0) {
+    (void) close(pipe_fds[0]);
+    pipe_fds[0] = -1;
+  }
+
+  if (pipe_fds[1] >= 0) {
+    (void) close(pipe_fds[1]);
+    pipe_fds[1] = -1;
+  }
+}
+
+/* Wait for the destination fd to become writable again, rather than
+ * busy-looping on EAGAIN.
+ */
+static int splice_wait_writable(int fd) {
+  while (TRUE) {
+    int res;
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+
+    res = poll(&pfd, 1, 1000);
+    if (res < 0) {
+      if (errno == EINTR) {
+        pr_signals_handle();
+        continue;
+      }
+
+      return -1;
+    }
+
+    if (res == 0) {
+      pr_signals_handle();
       continue;
     }
 
+    if (pfd.revents & (POLLERR|POLLHUP|POLLNVAL)) {
+      errno = EPIPE;
+      return -1;
+    }
+
+    return 0;
+  }
+}
+#endif /* PROXY_FTP_DATA_USE_SPLICE */
+
+int *proxy_ftp_data_splice_open(pool *p) {
+#if defined(PROXY_FTP_DATA_USE_SPLICE)
+  int *pipe_fds;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  pipe_fds = palloc(p, 2 * sizeof(int));
+  if (pipe(pipe_fds) < 0) {
+    int xerrno = errno;
+
+    pr_trace_msg(trace_channel, 3, "error opening splice pipe: %s",
+      strerror(xerrno));
+
     errno = xerrno;
+    return NULL;
+  }
+
+  /* Note that only the pipe is nonblocking; we still want writes to the
+   * destination socket to complete, as for proxy_ftp_data_send().
+   */
+  (void) fcntl(pipe_fds[0], F_SETFL, fcntl(pipe_fds[0], F_GETFL) | O_NONBLOCK);
+  (void) fcntl(pipe_fds[1], F_SETFL, fcntl(pipe_fds[1], F_GETFL) | O_NONBLOCK);
+
+  register_cleanup(p, pipe_fds, splice_pipe_cleanup_cb, splice_pipe_cleanup_cb);
+  return pipe_fds;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif /* PROXY_FTP_DATA_USE_SPLICE */
+}
+
+int proxy_ftp_data_splice(pool *p, conn_t *src_conn, conn_t *dst_conn,
+    int *pipe_fds) {
+#if defined(PROXY_FTP_DATA_USE_SPLICE)
+  int src_fd, dst_fd;
+  ssize_t nread;
+  size_t nwrote = 0;
+
+  if (p == NULL ||
+      src_conn == NULL ||
+      src_conn->instrm == NULL ||
+      dst_conn == NULL ||
+      dst_conn->outstrm == NULL ||
+      pipe_fds == NULL) {
+    errno = EINVAL;
     return -1;
   }
 
+  src_fd = PR_NETIO_FD(src_conn->instrm);
+  dst_fd = PR_NETIO_FD(dst_conn->outstrm);
+
+  nread = splice(src_fd, NULL, pipe_fds[1], NULL, PROXY_FTP_DATA_SPLICE_MAX_LEN,
+    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+  (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_READ_CALLS, 1);
+
+  if (nread < 0) {
+    if (errno == EAGAIN) {
+      (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_EAGAIN, 1);
+    }
+
+    return -1;
+  }
+
+  if (nread == 0) {
+    return 0;
+  }
+
+  pr_trace_msg(trace_channel, 15, "spliced %ld bytes of data from source",
+    (long) nread);
+  session.total_raw_in += nread;
+
+  /* Drain everything we just moved into the pipe, so that the pipe is empty
+   * for the next call.
+   */
+  while (nwrote < (size_t) nread) {
+    ssize_t res;
+
+    res = splice(pipe_fds[0], NULL, dst_fd, NULL, nread - nwrote,
+      SPLICE_F_MOVE|SPLICE_F_MORE);
+    (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_WRITE_CALLS, 1);
+
+    if (res < 0) {
+      int xerrno = errno;
+
+      if (xerrno == EINTR) {
+        pr_signals_handle();
+        continue;
+      }
+
+      if (xerrno == EAGAIN) {
+        (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_EAGAIN, 1);
+        if (splice_wait_writable(dst_fd) < 0) {
+          return -1;
+        }
+
+        continue;
+      }
+
+      errno = xerrno;
+      return -1;
+    }
+
+    nwrote += res;
+    session.total_raw_out += res;
+  }
+
   pr_timer_reset(PR_TIMER_NOXFER, ANY_MODULE);
   pr_timer_reset(PR_TIMER_STALLED, ANY_MODULE);
   pr_timer_reset(PR_TIMER_IDLE, ANY_MODULE);
 
-  return nwrote;
+  return (int) nread;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* PROXY_FTP_DATA_USE_SPLICE */
 }
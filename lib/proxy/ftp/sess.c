@@ -104,8 +104,6 @@ int proxy_ftp_sess_get_feat(pool *p, const struct proxy_session *proxy_sess) {
   cmd_rec *cmd;
   pr_response_t *resp;
   unsigned int resp_nlines = 0;
-  char *feats, *token;
-  size_t token_len = 0;
 
   if (p == NULL ||
       proxy_sess == NULL) {
@@ -165,9 +163,29 @@ int proxy_ftp_sess_get_feat(pool *p, const struct proxy_session *proxy_sess) {
     return -1;
   }
 
+  res = proxy_ftp_sess_set_feat(p, proxy_sess, resp->msg);
+  xerrno = errno;
+
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+int proxy_ftp_sess_set_feat(pool *p, const struct proxy_session *proxy_sess,
+    const char *text) {
+  char *feats, *token;
+  size_t token_len = 0;
+
+  if (p == NULL ||
+      proxy_sess == NULL ||
+      text == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
   ((struct proxy_session *) proxy_sess)->backend_features = pr_table_nalloc(p, 0, 4);
 
-  feats = (char *) resp->msg;
+  feats = pstrdup(p, text);
   token = pr_str_get_token2(&feats, (char *) feat_crlf, &token_len);
   while (token != NULL) {
     pr_signals_handle();
@@ -198,7 +216,6 @@ int proxy_ftp_sess_get_feat(pool *p, const struct proxy_session *proxy_sess) {
     token = pr_str_get_token2(&feats, (char *) feat_crlf, &token_len);
   }
 
-  destroy_pool(tmp_pool);
   return 0;
 }
 
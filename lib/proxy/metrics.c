@@ -0,0 +1,284 @@
+/*
+ * ProFTPD - mod_proxy transfer metrics
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_proxy.h"
+#include "json.h"
+#include "proxy/metrics.h"
+
+static struct proxy_metrics_xfer *xfer_metrics = NULL;
+
+static const char *trace_channel = "proxy.metrics";
+
+unsigned long proxy_metrics_elapsed_ms(const struct timeval *since) {
+  struct timeval now;
+  long elapsed_ms;
+
+  if (since == NULL) {
+    return 0;
+  }
+
+  gettimeofday(&now, NULL);
+  elapsed_ms = ((now.tv_sec - since->tv_sec) * 1000L) +
+    ((now.tv_usec - since->tv_usec) / 1000L);
+
+  /* Guard against the clock stepping backwards. */
+  if (elapsed_ms < 0) {
+    elapsed_ms = 0;
+  }
+
+  return (unsigned long) elapsed_ms;
+}
+
+int proxy_metrics_xfer_start(pool *p, const char *cmd, int direction,
+    const char *backend_uri) {
+  struct proxy_metrics_xfer *metrics;
+
+  if (p == NULL ||
+      cmd == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  metrics = pcalloc(p, sizeof(struct proxy_metrics_xfer));
+  metrics->cmd = pstrdup(p, cmd);
+  metrics->direction = direction;
+  if (backend_uri != NULL) {
+    metrics->backend_uri = pstrdup(p, backend_uri);
+  }
+
+  metrics->ttfb_ms = -1;
+  metrics->tls_resumed = -1;
+  metrics->tls_handshake_ms = -1;
+  gettimeofday(&(metrics->start_time), NULL);
+
+  xfer_metrics = metrics;
+  return 0;
+}
+
+const struct proxy_metrics_xfer *proxy_metrics_xfer_get(void) {
+  if (xfer_metrics == NULL) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  return xfer_metrics;
+}
+
+int proxy_metrics_xfer_incr(int counter, off_t incr) {
+  if (xfer_metrics == NULL) {
+    /* No transfer in progress; nothing to do.  Note that we deliberately
+     * leave errno alone, as callers use this in their error paths.
+     */
+    return 0;
+  }
+
+  switch (counter) {
+    case PROXY_METRICS_XFER_FRONTEND_BYTES_IN:
+      xfer_metrics->frontend_bytes_in += incr;
+      break;
+
+    case PROXY_METRICS_XFER_FRONTEND_BYTES_OUT:
+      xfer_metrics->frontend_bytes_out += incr;
+      break;
+
+    case PROXY_METRICS_XFER_BACKEND_BYTES_IN:
+      if (xfer_metrics->ttfb_ms < 0 &&
+          incr > 0) {
+        xfer_metrics->ttfb_ms = (long) proxy_metrics_elapsed_ms(
+          &(xfer_metrics->start_time));
+        pr_trace_msg(trace_channel, 15,
+          "first data byte for %s read from backend after %ld ms",
+          xfer_metrics->cmd, xfer_metrics->ttfb_ms);
+      }
+
+      xfer_metrics->backend_bytes_in += incr;
+      break;
+
+    case PROXY_METRICS_XFER_BACKEND_BYTES_OUT:
+      xfer_metrics->backend_bytes_out += incr;
+      break;
+
+    case PROXY_METRICS_XFER_READ_CALLS:
+      xfer_metrics->read_calls += incr;
+      break;
+
+    case PROXY_METRICS_XFER_WRITE_CALLS:
+      xfer_metrics->write_calls += incr;
+      break;
+
+    case PROXY_METRICS_XFER_EAGAIN:
+      xfer_metrics->eagain_count += incr;
+      break;
+
+    case PROXY_METRICS_XFER_FRONTEND_STALL_MS:
+      xfer_metrics->frontend_stall_ms += incr;
+      break;
+
+    case PROXY_METRICS_XFER_BACKEND_STALL_MS:
+      xfer_metrics->backend_stall_ms += incr;
+      break;
+
+    case PROXY_METRICS_XFER_TLS_OVERHEAD_IN:
+      xfer_metrics->tls_overhead_in += incr;
+      break;
+
+    case PROXY_METRICS_XFER_TLS_OVERHEAD_OUT:
+      xfer_metrics->tls_overhead_out += incr;
+      break;
+
+    default:
+      errno = EINVAL;
+      return -1;
+  }
+
+  return 0;
+}
+
+int proxy_metrics_xfer_set_tls_handshake(int resumed, long handshake_ms) {
+  if (xfer_metrics == NULL) {
+    return 0;
+  }
+
+  if (handshake_ms < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  xfer_metrics->tls_resumed = resumed ? TRUE : FALSE;
+  xfer_metrics->tls_handshake_ms = handshake_ms;
+  return 0;
+}
+
+char *proxy_metrics_xfer_to_json(pool *p,
+    const struct proxy_metrics_xfer *metrics) {
+  pr_json_object_t *json;
+  char *text;
+
+  if (p == NULL ||
+      metrics == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  json = pr_json_object_alloc(p);
+
+  (void) pr_json_object_set_string(p, json, "command", metrics->cmd);
+  (void) pr_json_object_set_string(p, json, "direction",
+    metrics->direction == PR_NETIO_IO_RD ? "download" : "upload");
+  if (metrics->backend_uri != NULL) {
+    (void) pr_json_object_set_string(p, json, "backend",
+      metrics->backend_uri);
+  }
+
+  (void) pr_json_object_set_number(p, json, "ttfb_ms",
+    (double) metrics->ttfb_ms);
+  (void) pr_json_object_set_number(p, json, "elapsed_ms",
+    (double) metrics->elapsed_ms);
+  (void) pr_json_object_set_number(p, json, "frontend_bytes_in",
+    (double) metrics->frontend_bytes_in);
+  (void) pr_json_object_set_number(p, json, "frontend_bytes_out",
+    (double) metrics->frontend_bytes_out);
+  (void) pr_json_object_set_number(p, json, "backend_bytes_in",
+    (double) metrics->backend_bytes_in);
+  (void) pr_json_object_set_number(p, json, "backend_bytes_out",
+    (double) metrics->backend_bytes_out);
+  (void) pr_json_object_set_number(p, json, "read_calls",
+    (double) metrics->read_calls);
+  (void) pr_json_object_set_number(p, json, "write_calls",
+    (double) metrics->write_calls);
+  (void) pr_json_object_set_number(p, json, "eagain_count",
+    (double) metrics->eagain_count);
+  (void) pr_json_object_set_number(p, json, "frontend_stall_ms",
+    (double) metrics->frontend_stall_ms);
+  (void) pr_json_object_set_number(p, json, "backend_stall_ms",
+    (double) metrics->backend_stall_ms);
+  (void) pr_json_object_set_number(p, json, "tls_overhead_in",
+    (double) metrics->tls_overhead_in);
+  (void) pr_json_object_set_number(p, json, "tls_overhead_out",
+    (double) metrics->tls_overhead_out);
+
+  if (metrics->tls_resumed >= 0) {
+    (void) pr_json_object_set_bool(p, json, "tls_resumed",
+      metrics->tls_resumed);
+    (void) pr_json_object_set_number(p, json, "tls_handshake_ms",
+      (double) metrics->tls_handshake_ms);
+  }
+
+  if (metrics->xerrno != 0) {
+    (void) pr_json_object_set_string(p, json, "error",
+      strerror(metrics->xerrno));
+  }
+
+  text = pr_json_object_to_text(p, json, "");
+  (void) pr_json_object_free(json);
+
+  return text;
+}
+
+int proxy_metrics_xfer_finish(pool *p, int xerrno, int flags) {
+  struct proxy_metrics_xfer *metrics;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (xfer_metrics == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  metrics = xfer_metrics;
+  xfer_metrics = NULL;
+
+  metrics->elapsed_ms = (long) proxy_metrics_elapsed_ms(
+    &(metrics->start_time));
+  metrics->xerrno = xerrno;
+
+  pr_trace_msg(trace_channel, 9,
+    "%s transfer metrics: elapsed %ld ms, TTFB %ld ms, frontend %lu/%lu "
+    "bytes in/out, backend %lu/%lu bytes in/out, %lu reads, %lu writes, "
+    "%lu EAGAIN, frontend/backend stalls %lu/%lu ms", metrics->cmd,
+    metrics->elapsed_ms, metrics->ttfb_ms,
+    (unsigned long) metrics->frontend_bytes_in,
+    (unsigned long) metrics->frontend_bytes_out,
+    (unsigned long) metrics->backend_bytes_in,
+    (unsigned long) metrics->backend_bytes_out, metrics->read_calls,
+    metrics->write_calls, metrics->eagain_count, metrics->frontend_stall_ms,
+    metrics->backend_stall_ms);
+
+  pr_event_generate("mod_proxy.data-xfer-metrics", metrics);
+
+  if (flags & PROXY_METRICS_FL_LOG_JSON) {
+    char *text;
+
+    text = proxy_metrics_xfer_to_json(p, metrics);
+    if (text != NULL) {
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "transfer metrics: %s", text);
+    }
+  }
+
+  return 0;
+}
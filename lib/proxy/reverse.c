@@ -27,11 +27,17 @@
 
 #include "proxy/db.h"
 #include "proxy/conn.h"
+#include "proxy/dns.h"
 #include "proxy/netio.h"
 #include "proxy/inet.h"
 #include "proxy/reverse.h"
 #include "proxy/reverse/db.h"
 #include "proxy/reverse/redis.h"
+#include "proxy/reverse/shm.h"
+#include "proxy/reverse/health.h"
+#include "proxy/reverse/connpool.h"
+#include "proxy/reverse/chash.h"
+#include "proxy/reverse/perhost.h"
 #include "proxy/random.h"
 #include "proxy/tls.h"
 #include "proxy/ftp/ctrl.h"
@@ -47,9 +53,34 @@ static int reverse_backend_updated = FALSE;
 static int reverse_connect_policy = PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN;
 static unsigned long reverse_flags = 0UL;
 static int reverse_retry_count = PROXY_DEFAULT_RETRY_COUNT;
+static int reverse_health_cooldown = PROXY_DEFAULT_HEALTH_COOLDOWN;
+
+/* What the ConsistentHash policy hashes; see proxy_reverse_chash_next_backend.
+ * That policy selects its backends without using the datastore.
+ */
+static int reverse_chash_key = PROXY_REVERSE_CHASH_KEY_HOST;
+
+/* Whether a data transfer is in flight, and how much of it (and when) was
+ * last reported to the datastore; see proxy_reverse_xfer_start().
+ */
+static int reverse_xfer_active = FALSE;
+static off_t reverse_xfer_reported = 0;
+static uint64_t reverse_xfer_reported_ms = 0;
 
 static struct proxy_reverse_datastore reverse_ds;
 
+/* A pooled backend connection which was already logged in; its USER and PASS
+ * responses are replayed to the client.
+ */
+static struct proxy_reverse_connpool_conn *reverse_pooled_login = NULL;
+
+/* A connect to the backend, started at session init when the backend can be
+ * selected before the client logs in (UseSpeculativeConnect ProxyOption).
+ */
+static struct proxy_conn_connect *reverse_speculative_connect = NULL;
+static const struct proxy_conn *reverse_speculative_pconn = NULL;
+static int reverse_speculative_backend_id = -1;
+
 /* Flag that indicates that we should select/connect to the backend server
  * at session init time, i.e. when proxy auth is not required, and we're using
  * a balancing policy.
@@ -594,307 +625,1245 @@ int proxy_reverse_policy_is_sticky(int policy_id) {
   return sticky;
 }
 
-const char *proxy_reverse_policy_name(int policy_id) {
-  const char *name;
+/* Weighted policies */
 
-  switch (policy_id) {
-    case PROXY_REVERSE_CONNECT_POLICY_RANDOM:
-      name = "Random";
-      break;
+array_header *proxy_reverse_wrr_schedule(pool *p, array_header *backends) {
+  register unsigned int i, j;
+  struct proxy_conn **conns;
+  int *weights, *current, total = 0;
+  array_header *schedule;
 
-    case PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN:
-      name = "RoundRobin";
-      break;
+  if (p == NULL ||
+      backends == NULL ||
+      backends->nelts == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
 
-    case PROXY_REVERSE_CONNECT_POLICY_SHUFFLE:
-      name = "Shuffle";
-      break;
+  conns = backends->elts;
+  weights = palloc(p, backends->nelts * sizeof(int));
+  current = pcalloc(p, backends->nelts * sizeof(int));
 
-    case PROXY_REVERSE_CONNECT_POLICY_PER_USER:
-      name = "PerUser";
-      break;
+  for (i = 0; i < backends->nelts; i++) {
+    weights[i] = (int) proxy_conn_get_weight(conns[i]);
+    total += weights[i];
+  }
 
-    case PROXY_REVERSE_CONNECT_POLICY_PER_GROUP:
-      name = "PerGroup";
-      break;
+  schedule = make_array(p, total, sizeof(int));
 
-    case PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS:
-      name = "LeastConns";
-      break;
+  /* For each turn, every backend's current weight grows by its weight; the
+   * backend with the highest current weight is selected, and its current
+   * weight reduced by the total.
+   */
+  for (i = 0; i < (unsigned int) total; i++) {
+    int best = 0;
 
-    case PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME:
-      name = "LeastResponseTime";
-      break;
+    for (j = 0; j < backends->nelts; j++) {
+      current[j] += weights[j];
 
-    case PROXY_REVERSE_CONNECT_POLICY_PER_HOST:
-      name = "PerHost";
-      break;
+      if (current[j] > current[best]) {
+        best = j;
+      }
+    }
 
-    default:
-      name = "unknown/unsupported";
-      break;
+    current[best] -= total;
+    *((int *) push_array(schedule)) = best;
   }
 
-  return name;
+  return schedule;
 }
 
-static int reverse_connect_index_used(pool *p, unsigned int vhost_id,
-    int idx, long connect_ms) {
-  int res;
+/* The schedule depends only on the weights of the backends, thus the last
+ * one computed is kept, for as long as those weights are unchanged.  A session
+ * only ever selects from the backends of its vhost, so one is enough.
+ */
+struct reverse_wrr_cache {
+  pool *pool;
+  unsigned int nweights;
+  unsigned int *weights;
+  array_header *schedule;
+};
 
-  if (reverse_backends != NULL &&
-      reverse_backends->nelts == 1) {
-    return 0;
+static struct reverse_wrr_cache *reverse_wrr_cache = NULL;
+
+static void reverse_wrr_cache_cleanup_cb(void *data) {
+  if (reverse_wrr_cache == data) {
+    reverse_wrr_cache = NULL;
   }
+}
 
-  res = (reverse_ds.policy_update_backend)(p, reverse_ds.dsh,
-    reverse_connect_policy, vhost_id, idx, 1, connect_ms);
-  if (res < 0) {
-    int xerrno = errno;
+static int reverse_wrr_cache_matches(const struct reverse_wrr_cache *cache,
+    array_header *backends) {
+  register unsigned int i;
+  struct proxy_conn **conns;
 
-    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-      "error updating database entry for backend ID %d: %s", idx,
-      strerror(xerrno));
+  if (cache->nweights != backends->nelts) {
+    return FALSE;
+  }
 
-    errno = xerrno;
-    return -1;
+  conns = backends->elts;
+  for (i = 0; i < backends->nelts; i++) {
+    if (cache->weights[i] != proxy_conn_get_weight(conns[i])) {
+      return FALSE;
+    }
   }
 
-  reverse_backend_updated = TRUE;
+  return TRUE;
+}
 
-  res = (reverse_ds.policy_used_backend)(p, reverse_ds.dsh,
-    reverse_connect_policy, vhost_id, idx);
-  if (res < 0) {
-    int xerrno = errno;
+array_header *proxy_reverse_wrr_get_schedule(array_header *backends) {
+  register unsigned int i;
+  pool *cache_pool;
+  struct reverse_wrr_cache *cache;
+  struct proxy_conn **conns;
 
-    errno = xerrno;
-    return -1;
+  if (backends == NULL ||
+      backends->nelts == 0) {
+    errno = EINVAL;
+    return NULL;
   }
 
-  return 0;
-}
+  if (reverse_wrr_cache != NULL &&
+      reverse_wrr_cache_matches(reverse_wrr_cache, backends) == TRUE) {
+    return reverse_wrr_cache->schedule;
+  }
 
-static const struct proxy_conn *get_reverse_server_conn(pool *p,
-    struct proxy_session *proxy_sess, int *backend_id,
-    const void *policy_data) {
-  const struct proxy_conn *pconn;
+  if (reverse_wrr_cache != NULL) {
+    destroy_pool(reverse_wrr_cache->pool);
+  }
 
-  pconn = (reverse_ds.policy_next_backend)(p, reverse_ds.dsh,
-    reverse_connect_policy, main_server->sid, default_backends, policy_data,
-    backend_id);
-  if (pconn == NULL) {
+  cache_pool = make_sub_pool(permanent_pool);
+  pr_pool_tag(cache_pool, "Proxy WeightedRoundRobin schedule pool");
+
+  cache = pcalloc(cache_pool, sizeof(struct reverse_wrr_cache));
+  cache->pool = cache_pool;
+  cache->nweights = backends->nelts;
+  cache->weights = palloc(cache_pool, backends->nelts * sizeof(unsigned int));
+
+  conns = backends->elts;
+  for (i = 0; i < backends->nelts; i++) {
+    cache->weights[i] = proxy_conn_get_weight(conns[i]);
+  }
+
+  cache->schedule = proxy_reverse_wrr_schedule(cache_pool, backends);
+  if (cache->schedule == NULL) {
     int xerrno = errno;
 
-    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-      "error selecting backend server: %s", strerror(xerrno));
+    destroy_pool(cache_pool);
     errno = xerrno;
     return NULL;
   }
 
-  (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-    "selected backend server '%s'", proxy_conn_get_uri(pconn));
+  register_cleanup(cache_pool, cache, reverse_wrr_cache_cleanup_cb,
+    reverse_wrr_cache_cleanup_cb);
+  reverse_wrr_cache = cache;
 
-  reverse_backend_id = *backend_id;
-  return pconn;
+  pr_trace_msg(trace_channel, 17,
+    "computed WeightedRoundRobin schedule of %u turns for %u backends",
+    cache->schedule->nelts, backends->nelts);
+  return cache->schedule;
 }
 
-static int reverse_try_connect(pool *p, struct proxy_session *proxy_sess,
-    const void *connect_data) {
-  int backend_id = -1, use_tls, xerrno = 0;
-  conn_t *server_conn = NULL;
-  pr_response_t *resp = NULL;
-  unsigned int resp_nlines = 0;
-  const struct proxy_conn *pconn;
-  const pr_netaddr_t *dst_addr;
-  array_header *other_addrs = NULL;
-  uint64_t connecting_ms, connected_ms;
+int proxy_reverse_weighted_random(array_header *backends, const int *usable) {
+  register unsigned int i;
+  struct proxy_conn **conns;
+  unsigned int total = 0;
+  int use_all = TRUE;
+  long r;
 
-  pconn = get_reverse_server_conn(p, proxy_sess, &backend_id, connect_data);
-  if (pconn == NULL) {
+  if (backends == NULL ||
+      backends->nelts == 0) {
+    errno = EINVAL;
     return -1;
   }
 
-  dst_addr = proxy_conn_get_addr(pconn, &other_addrs);
-  proxy_sess->dst_addr = dst_addr;
-  proxy_sess->dst_pconn = pconn;
-  proxy_sess->other_addrs = other_addrs;
-
-  pr_gettimeofday_millis(&connecting_ms);
-  server_conn = proxy_conn_get_server_conn(p, proxy_sess, dst_addr);
-  if (server_conn == NULL) {
-    xerrno = errno;
-
-    if (other_addrs != NULL) {
-      register unsigned int i;
-
-      /* Try the other IP addresses for the configured name (if any) as well. */
-      for (i = 0; i < other_addrs->nelts; i++) {
-        dst_addr = ((pr_netaddr_t **) other_addrs->elts)[i];
+  conns = backends->elts;
 
-        pr_gettimeofday_millis(&connecting_ms);
-
-        pr_trace_msg(trace_channel, 8,
-          "attempting to connect to other address #%u (%s) for requested "
-          "URI '%.100s'", i+1, pr_netaddr_get_ipstr(dst_addr),
-          proxy_conn_get_uri(proxy_sess->dst_pconn));
-        server_conn = proxy_conn_get_server_conn(p, proxy_sess, dst_addr);
-        if (server_conn != NULL) {
-          proxy_sess->dst_addr = dst_addr;
-          break;
-        }
+  if (usable != NULL) {
+    for (i = 0; i < backends->nelts; i++) {
+      if (usable[i] == TRUE) {
+        use_all = FALSE;
+        break;
       }
     }
+  }
 
-    if (server_conn == NULL) {
-      xerrno = errno;
-
-      /* TODO: Under what errno values will we mark this backend/idx as
-       * "unhealthy"?  When we do, how will that unhealthy flag be taken into
-       * account with the existing queries?  JOIN the index on the backend table
-       * to get that unhealthy flag?
-       */
-
-      if (reverse_connect_index_used(p, main_server->sid, backend_id, -1) < 0) {
-        (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-          "error updating database for backend server index %d: %s", backend_id,
-          strerror(errno));
-      }
+  for (i = 0; i < backends->nelts; i++) {
+    if (use_all == TRUE ||
+        usable[i] == TRUE) {
+      total += proxy_conn_get_weight(conns[i]);
     }
- 
-    errno = xerrno;
-    return -1;
   }
 
-  if (proxy_opts & PROXY_OPT_USE_PROXY_PROTOCOL_V1) {
-    pr_trace_msg(trace_channel, 17,
-      "sending PROXY V1 protocol message to %s#%u",
-      pr_netaddr_get_ipstr(server_conn->remote_addr),
-      ntohs(pr_netaddr_get_port(server_conn->remote_addr)));
+  r = proxy_random_next(0, total - 1);
 
-    if (proxy_conn_send_proxy_v1(p, server_conn) < 0) {
-      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-        "error sending PROXY V1 message to %s#%u: %s",
-        pr_netaddr_get_ipstr(server_conn->remote_addr),
-        ntohs(pr_netaddr_get_port(server_conn->remote_addr)),
-        strerror(errno));
-    }
+  for (i = 0; i < backends->nelts; i++) {
+    unsigned int weight;
 
-  } else if (proxy_opts & PROXY_OPT_USE_PROXY_PROTOCOL_V2) {
-    pr_trace_msg(trace_channel, 17,
-      "sending PROXY V2 protocol message to %s#%u",
-      pr_netaddr_get_ipstr(server_conn->remote_addr),
-      ntohs(pr_netaddr_get_port(server_conn->remote_addr)));
+    if (use_all == FALSE &&
+        usable[i] != TRUE) {
+      continue;
+    }
 
-    if (proxy_conn_send_proxy_v2(p, server_conn) < 0) {
-      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-        "error sending PROXY V2 message to %s#%u: %s",
-        pr_netaddr_get_ipstr(server_conn->remote_addr),
-        ntohs(pr_netaddr_get_port(server_conn->remote_addr)),
-        strerror(errno));
+    weight = proxy_conn_get_weight(conns[i]);
+    if (r < (long) weight) {
+      return (int) i;
     }
-  }
 
-  /* XXX Support/send a CLNT command of our own?  Configurable via e.g.
-   * "UserAgent" string?
-   */
+    r -= weight;
+  }
 
-  proxy_sess->frontend_ctrl_conn = session.c;
-  proxy_sess->backend_ctrl_conn = server_conn;
+  /* Not reached. */
+  return (int) backends->nelts - 1;
+}
 
-  use_tls = proxy_tls_using_tls();
+/* Connection leases */
 
-  resp = proxy_ftp_ctrl_recv_resp(p, server_conn, &resp_nlines, 0);
-  if (resp == NULL) {
-    xerrno = errno;
+/* Reads the start time of the given process, i.e. field 22 of
+ * /proc/<pid>/stat, in clock ticks since boot.  Returns zero if not available,
+ * e.g. when there is no /proc, or when chrooted.
+ */
+static uint64_t reverse_lease_proc_start(pid_t pid) {
+  register unsigned int i;
+  int fd;
+  ssize_t len;
+  char path[64], buf[1024], *ptr;
 
-    pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-      "unable to read banner from server %s:%u: %s",
-      pr_netaddr_get_ipstr(server_conn->remote_addr),
-      ntohs(pr_netaddr_get_port(server_conn->remote_addr)), strerror(xerrno));
+  memset(path, '\0', sizeof(path));
+  snprintf(path, sizeof(path)-1, "/proc/%lu/stat", (unsigned long) pid);
 
-    errno = xerrno;
-    return -1;
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
 
-  } else {
-    int banner_ok = TRUE;
+  len = read(fd, buf, sizeof(buf)-1);
+  (void) close(fd);
 
-    pr_gettimeofday_millis(&connected_ms);
+  if (len <= 0) {
+    return 0;
+  }
 
-    if (resp->num[0] != '2') {
-      banner_ok = FALSE;
-    }
+  buf[len] = '\0';
 
-    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-      "received banner from backend %s:%u%s: %s %s",
-      pr_netaddr_get_ipstr(server_conn->remote_addr),
-      ntohs(pr_netaddr_get_port(server_conn->remote_addr)),
-      banner_ok ? "" : ", DISCONNECTING", resp->num, resp->msg);
+  /* The command name (field 2) may itself contain spaces, thus we start
+   * after its closing parenthesis.
+   */
+  ptr = strrchr(buf, ')');
+  if (ptr == NULL) {
+    return 0;
+  }
 
-    if (banner_ok == FALSE) {
-      pr_inet_close(p, server_conn);
-      proxy_sess->backend_ctrl_conn = NULL;
-      errno = EPERM;
-      return -1;
+  for (i = 3; i <= 22; i++) {
+    ptr = strchr(ptr, ' ');
+    if (ptr == NULL) {
+      return 0;
     }
+
+    ptr++;
   }
 
-  pr_trace_msg(trace_channel, 8,
-    "connected to backend '%.100s' in %ld ms",
-    proxy_conn_get_uri(proxy_sess->dst_pconn),
-    (long) (connected_ms - connecting_ms));
+  return (uint64_t) strtoull(ptr, NULL, 10);
+}
 
-  if (reverse_connect_index_used(p, main_server->sid, backend_id,
-      (long) (connected_ms - connecting_ms)) < 0) {
-    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-      "error updating database for backend server index %d: %s", backend_id,
-      strerror(errno));
+static struct proxy_reverse_lease reverse_lease;
+
+int proxy_reverse_lease_get(struct proxy_reverse_lease *lease) {
+  pid_t pid;
+
+  if (lease == NULL) {
+    errno = EINVAL;
+    return -1;
   }
 
-  /* Get the features supported by the backend server. */
-  if (proxy_ftp_sess_get_feat(p, proxy_sess) < 0) {
-    if (errno != EPERM) {
-      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-        "unable to determine features of backend server: %s", strerror(errno));
-    }
+  /* Note that we look up our start time once, as the session starts, before
+   * any chroot; see proxy_reverse_sess_init().
+   */
+  pid = getpid();
+  if (reverse_lease.pid != pid) {
+    reverse_lease.pid = pid;
+    reverse_lease.start = reverse_lease_proc_start(pid);
   }
 
-  pr_response_block(TRUE);
+  lease->pid = reverse_lease.pid;
+  lease->start = reverse_lease.start;
+  return 0;
+}
 
-  if (use_tls != PROXY_TLS_ENGINE_OFF) {
-    if (proxy_ftp_sess_send_auth_tls(p, proxy_sess) < 0 &&
-        errno != ENOSYS) {
-      xerrno = errno;
+int proxy_reverse_lease_is_live(const struct proxy_reverse_lease *lease) {
+  uint64_t start;
 
-      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-        "error enabling TLS on control connection to backend server: %s",
-        strerror(xerrno));
-      pr_inet_close(p, server_conn);
-      proxy_sess->backend_ctrl_conn = NULL;
+  if (lease == NULL ||
+      lease->pid <= 0) {
+    return FALSE;
+  }
 
-      pr_response_block(FALSE);
-      errno = xerrno;
-      return -1;
-    }
+  /* Note that a session process running as a different user yields EPERM,
+   * which means that the process exists.
+   */
+  if (kill(lease->pid, 0) < 0 &&
+      errno == ESRCH) {
+    return FALSE;
+  }
 
-    use_tls = proxy_tls_using_tls();
+  if (lease->start == 0) {
+    return TRUE;
   }
 
-  if (proxy_netio_postopen(server_conn->instrm) < 0) {
-    xerrno = errno;
+  /* Has this process ID been reused by another process, since the lease was
+   * taken?
+   */
+  start = reverse_lease_proc_start(lease->pid);
+  if (start != 0 &&
+      start != lease->start) {
+    return FALSE;
+  }
 
-    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-      "postopen error for backend control connection input stream: %s",
-      strerror(xerrno));
-    proxy_inet_close(session.pool, server_conn);
-    proxy_sess->backend_ctrl_conn = NULL;
+  return TRUE;
+}
 
-    pr_response_block(FALSE);
+const char *proxy_reverse_lease_text(pool *p,
+    const struct proxy_reverse_lease *lease) {
+  char *text;
+  size_t textsz = 64;
 
-    /* Note that we explicitly return EINVAL here, to indicate to the calling
-     * code in mod_proxy that it should return e.g. "Login incorrect."
-     */
+  if (p == NULL ||
+      lease == NULL) {
     errno = EINVAL;
-    return -1;
+    return NULL;
+  }
+
+  text = pcalloc(p, textsz);
+  snprintf(text, textsz-1, "%lu:%llu", (unsigned long) lease->pid,
+    (unsigned long long) lease->start);
+  return text;
+}
+
+int proxy_reverse_lease_parse(const char *text,
+    struct proxy_reverse_lease *lease) {
+  char *ptr = NULL;
+  unsigned long pid;
+  unsigned long long start;
+
+  if (text == NULL ||
+      lease == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pid = strtoul(text, &ptr, 10);
+  if (ptr == NULL ||
+      ptr == text ||
+      *ptr != ':' ||
+      pid == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  text = ptr + 1;
+  start = strtoull(text, &ptr, 10);
+  if (ptr == text ||
+      *ptr != '\0') {
+    errno = EINVAL;
+    return -1;
+  }
+
+  lease->pid = (pid_t) pid;
+  lease->start = (uint64_t) start;
+  return 0;
+}
+
+const char *proxy_reverse_policy_name(int policy_id) {
+  const char *name;
+
+  switch (policy_id) {
+    case PROXY_REVERSE_CONNECT_POLICY_RANDOM:
+      name = "Random";
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN:
+      name = "RoundRobin";
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_SHUFFLE:
+      name = "Shuffle";
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_PER_USER:
+      name = "PerUser";
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_PER_GROUP:
+      name = "PerGroup";
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS:
+      name = "LeastConns";
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME:
+      name = "LeastResponseTime";
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_PER_HOST:
+      name = "PerHost";
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_ROUND_ROBIN:
+      name = "WeightedRoundRobin";
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_RANDOM:
+      name = "WeightedRandom";
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH:
+      name = "ConsistentHash";
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS:
+      name = "LeastTransfers";
+      break;
+
+    default:
+      name = "unknown/unsupported";
+      break;
+  }
+
+  return name;
+}
+
+/* Backend latency */
+
+/* Upper bounds (in millisecs) of the latency histogram buckets; the last
+ * bucket catches everything slower.
+ */
+static const long reverse_latency_buckets[PROXY_REVERSE_LATENCY_BUCKET_COUNT-1] = {
+  10, 50, 100, 250, 500, 1000, 5000
+};
+
+const char *proxy_reverse_latency_name(int phase) {
+  const char *name;
+
+  switch (phase) {
+    case PROXY_REVERSE_LATENCY_CONNECT:
+      name = "connect";
+      break;
+
+    case PROXY_REVERSE_LATENCY_BANNER:
+      name = "banner";
+      break;
+
+    case PROXY_REVERSE_LATENCY_LOGIN:
+      name = "login";
+      break;
+
+    default:
+      name = "unknown/unsupported";
+      break;
+  }
+
+  return name;
+}
+
+unsigned int proxy_reverse_latency_bucket(long latency_ms) {
+  register unsigned int i;
+
+  for (i = 0; i < PROXY_REVERSE_LATENCY_BUCKET_COUNT-1; i++) {
+    if (latency_ms <= reverse_latency_buckets[i]) {
+      return i;
+    }
+  }
+
+  return PROXY_REVERSE_LATENCY_BUCKET_COUNT-1;
+}
+
+long proxy_reverse_latency_bucket_max(unsigned int bucket) {
+  if (bucket >= PROXY_REVERSE_LATENCY_BUCKET_COUNT-1) {
+    return -1;
+  }
+
+  return reverse_latency_buckets[bucket];
+}
+
+double proxy_reverse_latency_ewma(double ewma_ms, unsigned long nsamples,
+    long latency_ms) {
+
+  /* The first sample seeds the average. */
+  if (nsamples == 0) {
+    return (double) latency_ms;
+  }
+
+  return ewma_ms +
+    (((double) latency_ms - ewma_ms) * PROXY_REVERSE_LATENCY_EWMA_WEIGHT);
+}
+
+/* Returns a negative number if the first backend is the better choice,
+ * positive if the second is, and zero otherwise.
+ */
+static int reverse_latency_cmp(const struct proxy_reverse_backend_load *a,
+    const struct proxy_reverse_backend_load *b) {
+
+  if (a->latency_ms > 0.0 &&
+      b->latency_ms > 0.0) {
+    double a_score, b_score;
+
+    a_score = (a->conn_count + 1) * a->latency_ms;
+    b_score = (b->conn_count + 1) * b->latency_ms;
+
+    if (a_score < b_score) {
+      return -1;
+    }
+
+    if (a_score > b_score) {
+      return 1;
+    }
+
+  } else if (a->latency_ms > 0.0) {
+    /* Prefer the unmeasured backend. */
+    return 1;
+
+  } else if (b->latency_ms > 0.0) {
+    return -1;
+  }
+
+  if (a->conn_count < b->conn_count) {
+    return -1;
+  }
+
+  if (a->conn_count > b->conn_count) {
+    return 1;
+  }
+
+  return 0;
+}
+
+int proxy_reverse_latency_choose(struct proxy_reverse_backend_load *loads,
+    unsigned int count) {
+  register unsigned int i;
+  unsigned int nusable = 0;
+  int all_usable = FALSE, first_idx = -1, second_idx = -1;
+  long n, first, second;
+
+  if (loads == NULL ||
+      count == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (loads[i].usable == TRUE) {
+      nusable++;
+    }
+  }
+
+  if (nusable == 0) {
+    all_usable = TRUE;
+    nusable = count;
+  }
+
+  if (nusable == 1) {
+    for (i = 0; i < count; i++) {
+      if (all_usable == TRUE ||
+          loads[i].usable == TRUE) {
+        return (int) i;
+      }
+    }
+  }
+
+  /* Pick two distinct usable backends at random. */
+  first = proxy_random_next(0, nusable-1);
+  second = proxy_random_next(0, nusable-2);
+  if (second >= first) {
+    second++;
+  }
+
+  for (i = 0, n = 0; i < count; i++) {
+    if (all_usable == FALSE &&
+        loads[i].usable != TRUE) {
+      continue;
+    }
+
+    if (n == first) {
+      first_idx = i;
+
+    } else if (n == second) {
+      second_idx = i;
+    }
+
+    n++;
+  }
+
+  pr_trace_msg(trace_channel, 17,
+    "comparing backend ID %d (%ld conns, %0.2f ms) with backend ID %d "
+    "(%ld conns, %0.2f ms)", loads[first_idx].backend_id,
+    loads[first_idx].conn_count, loads[first_idx].latency_ms,
+    loads[second_idx].backend_id, loads[second_idx].conn_count,
+    loads[second_idx].latency_ms);
+
+  if (reverse_latency_cmp(&(loads[second_idx]), &(loads[first_idx])) < 0) {
+    return second_idx;
+  }
+
+  return first_idx;
+}
+
+/* Backend data transfers */
+
+uint64_t proxy_reverse_xfer_window(uint64_t now_ms) {
+  return now_ms / PROXY_REVERSE_XFER_WINDOW_MS;
+}
+
+double proxy_reverse_xfer_rate(uint64_t now_ms, uint64_t window,
+    uint64_t window_bytes, uint64_t prev_bytes) {
+  uint64_t curr_window, elapsed_ms;
+  double curr = 0.0, prev = 0.0;
+
+  curr_window = proxy_reverse_xfer_window(now_ms);
+  if (window == curr_window) {
+    curr = (double) window_bytes;
+    prev = (double) prev_bytes;
+
+  } else if (window + 1 == curr_window) {
+    prev = (double) window_bytes;
+
+  } else if (window > curr_window) {
+    /* Counted by a process whose clock is slightly ahead of ours. */
+    curr = (double) window_bytes;
+  }
+
+  elapsed_ms = now_ms % PROXY_REVERSE_XFER_WINDOW_MS;
+  prev *= ((double) (PROXY_REVERSE_XFER_WINDOW_MS - elapsed_ms) /
+    (double) PROXY_REVERSE_XFER_WINDOW_MS);
+
+  return (curr + prev) / ((double) PROXY_REVERSE_XFER_WINDOW_MS / 1000.0);
+}
+
+static int reverse_xfer_cmp(const struct proxy_reverse_backend_xfers *a,
+    const struct proxy_reverse_backend_xfers *b) {
+  if (a->xfer_count != b->xfer_count) {
+    return a->xfer_count < b->xfer_count ? -1 : 1;
+  }
+
+  if (a->xfer_rate != b->xfer_rate) {
+    return a->xfer_rate < b->xfer_rate ? -1 : 1;
+  }
+
+  if (a->conn_count != b->conn_count) {
+    return a->conn_count < b->conn_count ? -1 : 1;
+  }
+
+  return 0;
+}
+
+int proxy_reverse_xfer_choose(struct proxy_reverse_backend_xfers *xfers,
+    unsigned int count) {
+  register unsigned int i;
+  int all_usable = TRUE, idx = -1;
+
+  if (xfers == NULL ||
+      count == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (xfers[i].usable == TRUE) {
+      all_usable = FALSE;
+      break;
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    if (all_usable == FALSE &&
+        xfers[i].usable != TRUE) {
+      continue;
+    }
+
+    if (idx < 0 ||
+        reverse_xfer_cmp(&(xfers[i]), &(xfers[idx])) < 0) {
+      idx = i;
+    }
+  }
+
+  pr_trace_msg(trace_channel, 17,
+    "chose backend ID %d (%ld transfers, %0.2f bytes/sec, %ld conns)",
+    xfers[idx].backend_id, xfers[idx].xfer_count, xfers[idx].xfer_rate,
+    xfers[idx].conn_count);
+  return idx;
+}
+
+static int reverse_xfer_report(pool *p, int xfer_incr, off_t xfer_bytes) {
+  int res;
+
+  if (reverse_ds.dsh == NULL) {
+    return 0;
+  }
+
+  res = (reverse_ds.policy_xfer_backend)(p, reverse_ds.dsh,
+    reverse_connect_policy, main_server->sid, reverse_backend_id, xfer_incr,
+    xfer_bytes);
+  if (res < 0) {
+    int xerrno = errno;
+
+    if (xerrno != EAGAIN) {
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error recording transfer for backend ID %d: %s", reverse_backend_id,
+        strerror(xerrno));
+    }
+
+    errno = xerrno;
+    return -1;
+  }
+
+  return 0;
+}
+
+int proxy_reverse_xfer_start(pool *p) {
+  if (reverse_connect_policy != PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS ||
+      reverse_ds.dsh == NULL ||
+      reverse_ds.policy_xfer_backend == NULL ||
+      reverse_backend_id < 0 ||
+      reverse_backend_updated == FALSE ||
+      reverse_xfer_active == TRUE) {
+    return 0;
+  }
+
+  if (reverse_xfer_report(p, 1, 0) < 0) {
+    return -1;
+  }
+
+  reverse_xfer_active = TRUE;
+  reverse_xfer_reported = 0;
+  pr_gettimeofday_millis(&reverse_xfer_reported_ms);
+  return 0;
+}
+
+int proxy_reverse_xfer_progress(pool *p, off_t xfer_bytes) {
+  uint64_t now_ms;
+
+  if (reverse_xfer_active == FALSE ||
+      xfer_bytes <= reverse_xfer_reported) {
+    return 0;
+  }
+
+  pr_gettimeofday_millis(&now_ms);
+  if (now_ms < reverse_xfer_reported_ms + PROXY_REVERSE_XFER_REPORT_INTERVAL_MS) {
+    return 0;
+  }
+
+  /* Whether or not this report is written, the next one waits for another
+   * interval; unwritten bytes are carried over to it.
+   */
+  reverse_xfer_reported_ms = now_ms;
+
+  if (reverse_xfer_report(p, 0, xfer_bytes - reverse_xfer_reported) < 0) {
+    return -1;
+  }
+
+  reverse_xfer_reported = xfer_bytes;
+  return 0;
+}
+
+int proxy_reverse_xfer_end(pool *p, off_t xfer_bytes) {
+  off_t unreported = 0;
+
+  if (reverse_xfer_active == FALSE) {
+    return 0;
+  }
+
+  reverse_xfer_active = FALSE;
+  if (xfer_bytes > reverse_xfer_reported) {
+    unreported = xfer_bytes - reverse_xfer_reported;
+  }
+
+  return reverse_xfer_report(p, -1, unreported);
+}
+
+static int reverse_connect_index_used(pool *p, unsigned int vhost_id,
+    int idx, long connect_ms) {
+  int res;
+
+  if (reverse_backends != NULL &&
+      reverse_backends->nelts == 1) {
+    return 0;
+  }
+
+  if (reverse_connect_policy == PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH) {
+    res = proxy_reverse_chash_update_backend(vhost_id, idx, 1);
+    if (res == 0) {
+      reverse_backend_updated = TRUE;
+    }
+
+    return res;
+  }
+
+  res = (reverse_ds.policy_update_backend)(p, reverse_ds.dsh,
+    reverse_connect_policy, vhost_id, idx, 1, connect_ms);
+  if (res < 0) {
+    int xerrno = errno;
+
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error updating database entry for backend ID %d: %s", idx,
+      strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  reverse_backend_updated = TRUE;
+
+  res = (reverse_ds.policy_used_backend)(p, reverse_ds.dsh,
+    reverse_connect_policy, vhost_id, idx);
+  if (res < 0) {
+    int xerrno = errno;
+
+    errno = xerrno;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Marks the given backend as unhealthy, for the configured cool-down, so that
+ * the balancing policies will not select it in the meantime.
+ */
+static int reverse_connect_index_unhealthy(pool *p, unsigned int vhost_id,
+    int idx, const char *reason) {
+  int res;
+  uint64_t now_ms, until_ms;
+
+  if (idx < 0 ||
+      reverse_health_cooldown <= 0) {
+    return 0;
+  }
+
+  /* With only one backend, there is nothing else to select. */
+  if (reverse_backends != NULL &&
+      reverse_backends->nelts == 1) {
+    return 0;
+  }
+
+  if (reverse_connect_policy != PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH &&
+      reverse_ds.policy_health_backend == NULL) {
+    return 0;
+  }
+
+  pr_gettimeofday_millis(&now_ms);
+  until_ms = now_ms + ((uint64_t) reverse_health_cooldown * 1000);
+
+  (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+    "marking backend server index %d as unhealthy for %d %s: %s", idx,
+    reverse_health_cooldown, reverse_health_cooldown != 1 ? "secs" : "sec",
+    reason);
+
+  if (reverse_connect_policy == PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH) {
+    res = proxy_reverse_chash_health_backend(vhost_id, idx, until_ms);
+
+  } else {
+    res = (reverse_ds.policy_health_backend)(p, reverse_ds.dsh,
+      reverse_connect_policy, vhost_id, idx, until_ms);
+  }
+
+  if (res < 0) {
+    int xerrno = errno;
+
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error updating health for backend ID %d: %s", idx, strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Records a latency sample for the given backend, for the balancing policies
+ * (e.g. LeastResponseTime) which use them.
+ */
+static int reverse_connect_index_latency(pool *p, unsigned int vhost_id,
+    int idx, int phase, long latency_ms) {
+  int res;
+
+  if (idx < 0 ||
+      latency_ms < 0 ||
+      reverse_ds.policy_latency_backend == NULL ||
+      reverse_connect_policy == PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH) {
+    return 0;
+  }
+
+  if (reverse_backends != NULL &&
+      reverse_backends->nelts == 1) {
+    return 0;
+  }
+
+  pr_trace_msg(trace_channel, 17, "backend index %d %s latency: %ld ms", idx,
+    proxy_reverse_latency_name(phase), latency_ms);
+
+  res = (reverse_ds.policy_latency_backend)(p, reverse_ds.dsh,
+    reverse_connect_policy, vhost_id, idx, phase, latency_ms);
+  if (res < 0) {
+    int xerrno = errno;
+
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error recording %s latency for backend ID %d: %s",
+      proxy_reverse_latency_name(phase), idx, strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  return 0;
+}
+
+static const struct proxy_conn *get_reverse_server_conn(pool *p,
+    struct proxy_session *proxy_sess, int *backend_id,
+    const void *policy_data) {
+  const struct proxy_conn *pconn;
+
+  if (reverse_connect_policy == PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH) {
+    const char *key = policy_data;
+
+    if (reverse_chash_key == PROXY_REVERSE_CHASH_KEY_HOST) {
+      key = pr_netaddr_get_ipstr(session.c->remote_addr);
+    }
+
+    if (key == NULL) {
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error selecting backend server: no %s key for ConsistentHash policy",
+        proxy_reverse_chash_key_name(reverse_chash_key));
+      errno = EINVAL;
+      return NULL;
+    }
+
+    pconn = proxy_reverse_chash_next_backend(p, main_server->sid,
+      default_backends, key, backend_id);
+
+  } else if (reverse_connect_policy == PROXY_REVERSE_CONNECT_POLICY_PER_HOST) {
+    /* Clients in a ProxyReversePerHostMap prefix are mapped without any
+     * datastore lookups; the others are remembered, in the datastore, by
+     * their ProxyReversePerHostPrefix.
+     */
+    pconn = proxy_reverse_perhost_next_backend(p, main_server->sid,
+      session.c->remote_addr);
+    if (pconn != NULL) {
+      *backend_id = -1;
+
+    } else {
+      const char *key;
+
+      key = proxy_reverse_perhost_get_key(p, main_server->sid,
+        session.c->remote_addr);
+      pconn = (reverse_ds.policy_next_backend)(p, reverse_ds.dsh,
+        reverse_connect_policy, main_server->sid, default_backends, key,
+        backend_id);
+    }
+
+  } else {
+    pconn = (reverse_ds.policy_next_backend)(p, reverse_ds.dsh,
+      reverse_connect_policy, main_server->sid, default_backends, policy_data,
+      backend_id);
+  }
+  if (pconn == NULL) {
+    int xerrno = errno;
+
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error selecting backend server: %s", strerror(xerrno));
+    errno = xerrno;
+    return NULL;
+  }
+
+  (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+    "selected backend server '%s'", proxy_conn_get_uri(pconn));
+
+  reverse_backend_id = *backend_id;
+  return pconn;
+}
+
+/* Connects to the selected backend, sending any PROXY protocol message, and
+ * reads its banner.
+ */
+static conn_t *reverse_open_backend(pool *p, struct proxy_session *proxy_sess,
+    int backend_id, pr_response_t **banner, unsigned int *banner_nlines,
+    long *connect_ms, long *banner_ms) {
+  int xerrno = 0, speculative = FALSE;
+  conn_t *server_conn = NULL;
+  pr_response_t *resp = NULL;
+  unsigned int resp_nlines = 0;
+  struct proxy_conn_connect *pcc;
+  uint64_t connecting_ms, established_ms, connected_ms;
+
+  pr_gettimeofday_millis(&connecting_ms);
+
+  if (reverse_speculative_connect != NULL) {
+    /* The connect was started earlier; the connection (and maybe even the
+     * banner) is likely already waiting for us.
+     */
+    pcc = reverse_speculative_connect;
+    reverse_speculative_connect = NULL;
+    reverse_speculative_pconn = NULL;
+    speculative = TRUE;
+
+  } else {
+    /* Race the connects to all of the IP addresses for the configured name. */
+    pcc = proxy_conn_connect_start(p, proxy_sess, proxy_sess->dst_pconn);
+  }
+
+  if (pcc != NULL) {
+    server_conn = proxy_conn_connect_finish(p, proxy_sess, pcc);
+  }
+
+  if (server_conn == NULL) {
+    xerrno = errno;
+
+    /* Any failure to connect marks the backend as unhealthy.  Note that
+     * we do not count this as a connection to the backend, as no session
+     * exit will decrement it.
+     */
+    (void) reverse_connect_index_unhealthy(p, main_server->sid, backend_id,
+      strerror(xerrno));
+
+    if (backend_id >= 0 &&
+        reverse_connect_policy != PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH) {
+      (void) (reverse_ds.policy_used_backend)(p, reverse_ds.dsh,
+        reverse_connect_policy, main_server->sid, backend_id);
+    }
+
+    errno = xerrno;
+    return NULL;
+  }
+
+  pr_gettimeofday_millis(&established_ms);
+
+  if (proxy_opts & PROXY_OPT_USE_PROXY_PROTOCOL_V1) {
+    pr_trace_msg(trace_channel, 17,
+      "sending PROXY V1 protocol message to %s#%u",
+      pr_netaddr_get_ipstr(server_conn->remote_addr),
+      ntohs(pr_netaddr_get_port(server_conn->remote_addr)));
+
+    if (proxy_conn_send_proxy_v1(p, server_conn) < 0) {
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error sending PROXY V1 message to %s#%u: %s",
+        pr_netaddr_get_ipstr(server_conn->remote_addr),
+        ntohs(pr_netaddr_get_port(server_conn->remote_addr)),
+        strerror(errno));
+    }
+
+  } else if (proxy_opts & PROXY_OPT_USE_PROXY_PROTOCOL_V2) {
+    pr_trace_msg(trace_channel, 17,
+      "sending PROXY V2 protocol message to %s#%u",
+      pr_netaddr_get_ipstr(server_conn->remote_addr),
+      ntohs(pr_netaddr_get_port(server_conn->remote_addr)));
+
+    if (proxy_conn_send_proxy_v2(p, server_conn) < 0) {
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error sending PROXY V2 message to %s#%u: %s",
+        pr_netaddr_get_ipstr(server_conn->remote_addr),
+        ntohs(pr_netaddr_get_port(server_conn->remote_addr)),
+        strerror(errno));
+    }
+  }
+
+  /* XXX Support/send a CLNT command of our own?  Configurable via e.g.
+   * "UserAgent" string?
+   */
+
+  proxy_sess->frontend_ctrl_conn = session.c;
+  proxy_sess->backend_ctrl_conn = server_conn;
+
+  resp = proxy_ftp_ctrl_recv_resp(p, server_conn, &resp_nlines, 0);
+  if (resp == NULL) {
+    xerrno = errno;
+
+    pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "unable to read banner from server %s:%u: %s",
+      pr_netaddr_get_ipstr(server_conn->remote_addr),
+      ntohs(pr_netaddr_get_port(server_conn->remote_addr)), strerror(xerrno));
+
+    (void) reverse_connect_index_unhealthy(p, main_server->sid, backend_id,
+      "unable to read banner");
+
+    errno = xerrno;
+    return NULL;
+
+  } else {
+    int banner_ok = TRUE;
+
+    pr_gettimeofday_millis(&connected_ms);
+
+    if (resp->num[0] != '2') {
+      banner_ok = FALSE;
+    }
+
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "received banner from backend %s:%u%s: %s %s",
+      pr_netaddr_get_ipstr(server_conn->remote_addr),
+      ntohs(pr_netaddr_get_port(server_conn->remote_addr)),
+      banner_ok ? "" : ", DISCONNECTING", resp->num, resp->msg);
+
+    if (banner_ok == FALSE) {
+      (void) reverse_connect_index_unhealthy(p, main_server->sid, backend_id,
+        pstrcat(p, "received banner ", resp->num, NULL));
+
+      pr_inet_close(p, server_conn);
+      proxy_sess->backend_ctrl_conn = NULL;
+      errno = EPERM;
+      return NULL;
+    }
+  }
+
+  *banner = resp;
+  *banner_nlines = resp_nlines;
+
+  if (speculative == TRUE) {
+    /* These times would only tell how long the connection waited for us. */
+    *connect_ms = *banner_ms = -1;
+
+  } else {
+    *connect_ms = (long) (established_ms - connecting_ms);
+    *banner_ms = (long) (connected_ms - established_ms);
+  }
+
+  return server_conn;
+}
+
+static int reverse_try_connect(pool *p, struct proxy_session *proxy_sess,
+    const void *connect_data) {
+  int backend_id = -1, use_tls, xerrno = 0;
+  conn_t *server_conn = NULL;
+  pr_response_t *resp = NULL;
+  unsigned int resp_nlines = 0;
+  const struct proxy_conn *pconn;
+  array_header *other_addrs = NULL;
+  struct proxy_reverse_connpool_conn *pooled = NULL;
+  long connect_ms = 0, banner_ms = 0, total_ms = -1;
+
+  if (reverse_speculative_connect != NULL) {
+    /* Use the backend already selected for the speculative connect. */
+    pconn = reverse_speculative_pconn;
+    backend_id = reverse_backend_id = reverse_speculative_backend_id;
+
+  } else {
+    pconn = get_reverse_server_conn(p, proxy_sess, &backend_id, connect_data);
+    if (pconn == NULL) {
+      return -1;
+    }
+  }
+
+  proxy_sess->dst_addr = proxy_conn_get_addr(pconn, &other_addrs);
+  proxy_sess->dst_pconn = pconn;
+  proxy_sess->other_addrs = other_addrs;
+
+  reverse_pooled_login = NULL;
+
+  /* Prefer an already established connection, if pooled. */
+  if (reverse_speculative_connect == NULL) {
+    pooled = proxy_reverse_connpool_get(p, main_server->sid, pconn);
+  }
+
+  if (pooled != NULL) {
+    server_conn = pooled->ctrl_conn;
+    resp = pooled->banner;
+    resp_nlines = pooled->banner_nlines;
+    connect_ms = pooled->connect_ms;
+    banner_ms = pooled->banner_ms;
+
+    proxy_sess->dst_addr = server_conn->remote_addr;
+    proxy_sess->frontend_ctrl_conn = session.c;
+    proxy_sess->backend_ctrl_conn = server_conn;
+
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "using pooled connection to backend %s:%u: %s %s",
+      pr_netaddr_get_ipstr(server_conn->remote_addr),
+      ntohs(pr_netaddr_get_port(server_conn->remote_addr)), resp->num,
+      resp->msg);
+
+    if (pooled->pass_resp != NULL) {
+      reverse_pooled_login = pooled;
+    }
+
+  } else {
+    server_conn = reverse_open_backend(p, proxy_sess, backend_id, &resp,
+      &resp_nlines, &connect_ms, &banner_ms);
+    if (server_conn == NULL) {
+      return -1;
+    }
+  }
+
+  use_tls = proxy_tls_using_tls();
+
+  if (connect_ms >= 0 &&
+      banner_ms >= 0) {
+    total_ms = connect_ms + banner_ms;
+
+    pr_trace_msg(trace_channel, 8,
+      "connected to backend '%.100s' in %ld ms",
+      proxy_conn_get_uri(proxy_sess->dst_pconn), total_ms);
+  }
+
+  if (reverse_connect_index_used(p, main_server->sid, backend_id,
+      total_ms) < 0) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error updating database for backend server index %d: %s", backend_id,
+      strerror(errno));
+  }
+
+  (void) reverse_connect_index_latency(p, main_server->sid, backend_id,
+    PROXY_REVERSE_LATENCY_CONNECT, connect_ms);
+  (void) reverse_connect_index_latency(p, main_server->sid, backend_id,
+    PROXY_REVERSE_LATENCY_BANNER, banner_ms);
+
+  /* Get the features supported by the backend server, unless already known
+   * from when the pooled connection was opened.
+   */
+  if (pooled != NULL &&
+      pooled->feats != NULL) {
+    (void) proxy_ftp_sess_set_feat(p, proxy_sess, pooled->feats);
+
+  } else if (proxy_ftp_sess_get_feat(p, proxy_sess) < 0) {
+    if (errno != EPERM) {
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "unable to determine features of backend server: %s", strerror(errno));
+    }
+  }
+
+  pr_response_block(TRUE);
+
+  if (use_tls != PROXY_TLS_ENGINE_OFF) {
+    if (proxy_ftp_sess_send_auth_tls(p, proxy_sess) < 0 &&
+        errno != ENOSYS) {
+      xerrno = errno;
+
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error enabling TLS on control connection to backend server: %s",
+        strerror(xerrno));
+      pr_inet_close(p, server_conn);
+      proxy_sess->backend_ctrl_conn = NULL;
+
+      pr_response_block(FALSE);
+      errno = xerrno;
+      return -1;
+    }
+
+    use_tls = proxy_tls_using_tls();
+  }
+
+  if (proxy_netio_postopen(server_conn->instrm) < 0) {
+    xerrno = errno;
+
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "postopen error for backend control connection input stream: %s",
+      strerror(xerrno));
+    proxy_inet_close(session.pool, server_conn);
+    proxy_sess->backend_ctrl_conn = NULL;
+
+    pr_response_block(FALSE);
+
+    /* Note that we explicitly return EINVAL here, to indicate to the calling
+     * code in mod_proxy that it should return e.g. "Login incorrect."
+     */
+    errno = EINVAL;
+    return -1;
   }
 
   if (proxy_netio_postopen(server_conn->outstrm) < 0) {
@@ -931,14 +1900,54 @@ static int reverse_try_connect(pool *p, struct proxy_session *proxy_sess,
       "unable to send banner to client: %s", strerror(errno));
   }
 
-  if (reverse_flags == PROXY_REVERSE_FL_CONNECT_AT_SESS_INIT) {
-    pr_response_block(TRUE);
+  if (reverse_flags == PROXY_REVERSE_FL_CONNECT_AT_SESS_INIT) {
+    pr_response_block(TRUE);
+  }
+
+  (void) proxy_ftp_sess_send_host(p, proxy_sess);
+
+  proxy_sess_state |= PROXY_SESS_STATE_CONNECTED;
+  return 0;
+}
+
+/* Starts connecting to the backend right away, so that the connect overlaps
+ * with the client's login to the proxy.  This is only possible when the
+ * backend selection does not depend on the USER name.
+ */
+static void reverse_speculative_connect_start(pool *p,
+    struct proxy_session *proxy_sess) {
+  const struct proxy_conn *pconn;
+  int backend_id = -1;
+
+  if (reverse_connect_policy == PROXY_REVERSE_CONNECT_POLICY_PER_USER ||
+      reverse_connect_policy == PROXY_REVERSE_CONNECT_POLICY_PER_GROUP ||
+      (reverse_connect_policy == PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH &&
+       reverse_chash_key != PROXY_REVERSE_CHASH_KEY_HOST)) {
+    pr_trace_msg(trace_channel, 9,
+      "%s policy requires USER name, not connecting speculatively",
+      proxy_reverse_policy_name(reverse_connect_policy));
+    return;
+  }
+
+  pconn = get_reverse_server_conn(p, proxy_sess, &backend_id, NULL);
+  if (pconn == NULL) {
+    return;
+  }
+
+  reverse_speculative_connect = proxy_conn_connect_start(p, proxy_sess,
+    pconn);
+  if (reverse_speculative_connect == NULL) {
+    pr_trace_msg(trace_channel, 4,
+      "error starting speculative connect to '%.100s': %s",
+      proxy_conn_get_uri(pconn), strerror(errno));
+    return;
   }
 
-  (void) proxy_ftp_sess_send_host(p, proxy_sess);
+  reverse_speculative_pconn = pconn;
+  reverse_speculative_backend_id = backend_id;
 
-  proxy_sess_state |= PROXY_SESS_STATE_CONNECTED;
-  return 0;
+  pr_trace_msg(trace_channel, 9, "started speculative connect to '%.100s'",
+    proxy_conn_get_uri(pconn));
 }
 
 static int reverse_connect(pool *p, struct proxy_session *proxy_sess) {
@@ -969,6 +1978,68 @@ int proxy_reverse_use_proxy_auth(void) {
   return FALSE;
 }
 
+array_header *proxy_reverse_vhost_backends(pool *p, server_rec *s) {
+  config_rec *c;
+  array_header *backends = NULL;
+
+  if (p == NULL ||
+      s == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  c = find_config(s->conf, CONF_PARAM, "ProxyReverseServers", FALSE);
+  while (c != NULL) {
+    const char *uri;
+
+    pr_signals_handle();
+
+    uri = c->argv[1];
+    if (uri != NULL) {
+      int defer = FALSE;
+
+      /* Handling of sql:// URIs is done later, in the session init
+       * call, assuming we've connected to a SQL server.
+       */
+      if (strncmp(uri, "sql:/", 5) == 0) {
+        defer = TRUE;
+      }
+
+      /* Skip any %U- or %g-bearing URIs. */
+      if (defer == FALSE &&
+          (strstr(uri, "%U") != NULL ||
+           strstr(uri, "%g") != NULL)) {
+        defer = TRUE;
+      }
+
+      if (defer) {
+        c = find_config_next(c, c->next, CONF_PARAM, "ProxyReverseServers",
+          FALSE);
+        continue;
+      }
+    }
+
+    /* Note that we copy the configured backends, rather than appending
+     * to the first configured list, which would otherwise grow each time
+     * we are called.
+     */
+    if (backends == NULL) {
+      backends = make_array(p, 0, sizeof(struct proxy_conn *));
+    }
+
+    array_cat(backends, c->argv[0]);
+
+    c = find_config_next(c, c->next, CONF_PARAM, "ProxyReverseServers",
+      FALSE);
+  }
+
+  if (backends == NULL) {
+    errno = ENOENT;
+  }
+
+  return backends;
+}
+
 int proxy_reverse_init(pool *p, const char *tables_dir, int flags) {
   const char *ds_name = "(unknown/unsupported)";
   int res, xerrno;
@@ -998,6 +2069,13 @@ int proxy_reverse_init(pool *p, const char *tables_dir, int flags) {
       xerrno = errno;
       break;
 
+    case PROXY_DATASTORE_SHM:
+      ds_name = "SHM";
+      res = proxy_reverse_shm_as_datastore(&reverse_ds, proxy_datastore_data,
+        proxy_datastore_datasz);
+      xerrno = errno;
+      break;
+
     default:
       res = -1;
       xerrno = errno = EINVAL;
@@ -1022,46 +2100,26 @@ int proxy_reverse_init(pool *p, const char *tables_dir, int flags) {
     int connect_policy = reverse_connect_policy;
     unsigned long opts = 0UL;
 
-    c = find_config(s->conf, CONF_PARAM, "ProxyReverseServers", FALSE);
-    while (c != NULL) {
-      const char *uri;
-
-      pr_signals_handle();
-
-      uri = c->argv[1];
-      if (uri != NULL) {
-        int defer = FALSE;
-
-        /* Handling of sql:// URIs is done later, in the session init
-         * call, assuming we've connected to a SQL server.
-         */
-        if (strncmp(uri, "sql:/", 5) == 0) {
-          defer = TRUE;
-        }
-
-        /* Skip any %U- or %g-bearing URIs. */
-        if (defer == FALSE &&
-            (strstr(uri, "%U") != NULL ||
-             strstr(uri, "%g") != NULL)) {
-          defer = TRUE;
-        }
+    backends = proxy_reverse_vhost_backends(p, s);
+    if (backends != NULL) {
+      register unsigned int i;
+      const struct proxy_conn **pconns;
 
-        if (defer) {
-          c = find_config_next(c, c->next, CONF_PARAM, "ProxyReverseServers",
-            FALSE);
-          continue;
+      /* Seed the DNS cache with the configured backends.  These were
+       * resolved when the config was parsed, before the cache existed, so
+       * use those addresses rather than resolving the names again.
+       */
+      pconns = backends->elts;
+      for (i = 0; i < backends->nelts; i++) {
+        const pr_netaddr_t *addr;
+        array_header *other_addrs = NULL;
+
+        addr = proxy_conn_get_addr(pconns[i], &other_addrs);
+        if (addr != NULL) {
+          (void) proxy_dns_add_addrs(p, proxy_conn_get_host(pconns[i]), addr,
+            other_addrs);
         }
       }
-
-      if (backends == NULL) {
-        backends = c->argv[0];
-
-      } else {
-        array_cat(backends, c->argv[0]);
-      }
-
-      c = find_config_next(c, c->next, CONF_PARAM, "ProxyReverseServers",
-        FALSE);
     }
 
     c = find_config(s->conf, CONF_PARAM, "ProxyReverseConnectPolicy", FALSE);
@@ -1069,6 +2127,11 @@ int proxy_reverse_init(pool *p, const char *tables_dir, int flags) {
       connect_policy = *((int *) c->argv[0]);
     }
 
+    if (connect_policy == PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH) {
+      /* The rings are computed below; the datastore is not used. */
+      continue;
+    }
+
     c = find_config(s->conf, CONF_PARAM, "ProxyOptions", FALSE);
     while (c != NULL) {
       unsigned long o;
@@ -1096,6 +2159,38 @@ int proxy_reverse_init(pool *p, const char *tables_dir, int flags) {
     return -1;
   }
 
+  /* Note that this needs to happen before the health check worker is
+   * started, so that the worker shares the backend health for the
+   * ConsistentHash policy.
+   */
+  if (proxy_reverse_chash_init(p) < 0) {
+    xerrno = errno;
+
+    pr_log_pri(PR_LOG_NOTICE, MOD_PROXY_VERSION
+      ": error computing ConsistentHash rings: %s", strerror(xerrno));
+    errno = xerrno;
+    return -1;
+  }
+
+  if (proxy_reverse_perhost_init(p) < 0) {
+    xerrno = errno;
+
+    pr_log_pri(PR_LOG_NOTICE, MOD_PROXY_VERSION
+      ": error building PerHost prefix maps: %s", strerror(xerrno));
+    errno = xerrno;
+    return -1;
+  }
+
+  if (proxy_reverse_health_init(p, tables_dir, &reverse_ds) < 0) {
+    pr_log_pri(PR_LOG_NOTICE, MOD_PROXY_VERSION
+      ": unable to start backend health checks: %s", strerror(errno));
+  }
+
+  if (proxy_reverse_connpool_init(p) < 0) {
+    pr_log_pri(PR_LOG_NOTICE, MOD_PROXY_VERSION
+      ": unable to start backend connection pool: %s", strerror(errno));
+  }
+
   return 0;
 }
 
@@ -1106,7 +2201,10 @@ int proxy_reverse_free(pool *p) {
     return -1;
   }
 
-  /* TODO: Implement any necessary cleanup */
+  (void) proxy_reverse_health_free(p);
+  (void) proxy_reverse_connpool_free(p);
+  (void) proxy_reverse_chash_free(p);
+  (void) proxy_reverse_perhost_free(p);
 
   if (reverse_ds.dsh != NULL) {
     (void) (reverse_ds.close)(p, reverse_ds.dsh);
@@ -1117,17 +2215,34 @@ int proxy_reverse_free(pool *p) {
 }
 
 int proxy_reverse_sess_exit(pool *p) {
-  if (reverse_backends != NULL &&
+  if (reverse_connect_policy == PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH) {
+    if (reverse_backend_id >= 0 &&
+        reverse_backend_updated == TRUE) {
+      if (proxy_reverse_chash_update_backend(main_server->sid,
+          reverse_backend_id, -1) < 0) {
+        (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+          "error updating backend ID %d: %s", reverse_backend_id,
+          strerror(errno));
+      }
+    }
+
+    return 0;
+  }
+
+  /* A session ended by e.g. a timeout, in the middle of a transfer. */
+  (void) proxy_reverse_xfer_end(p, reverse_xfer_reported);
+
+  if (reverse_ds.dsh != NULL &&
       reverse_backend_id >= 0) {
     if (reverse_backend_updated == TRUE) {
       int res;
 
       res = (reverse_ds.policy_update_backend)(p, reverse_ds.dsh,
-        reverse_connect_policy, main_server->sid, reverse_ds.backend_id,
+        reverse_connect_policy, main_server->sid, reverse_backend_id,
         -1, -1);
       if (res < 0) {
         (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-          "error updating backend ID %d: %s", reverse_ds.backend_id,
+          "error updating backend ID %d: %s", reverse_backend_id,
           strerror(errno));
       }
     }
@@ -1155,6 +2270,19 @@ static int set_reverse_flags(void) {
       errno = EINVAL;
       return -1;
 
+    } else if (reverse_connect_policy == PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH &&
+               reverse_chash_key == PROXY_REVERSE_CHASH_KEY_USER) {
+      reverse_flags = PROXY_REVERSE_FL_CONNECT_AT_USER;
+
+    } else if (reverse_connect_policy == PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH &&
+               reverse_chash_key == PROXY_REVERSE_CHASH_KEY_GROUP) {
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "ReverseProxyConnectPolicy ConsistentHash group requires the UseReverseProxyAuth ProxyOption, rejecting connection due to incompatible configuration");
+      pr_log_pri(PR_LOG_NOTICE, MOD_PROXY_VERSION
+        ": ReverseProxyConnectPolicy ConsistentHash group requires the UseReverseProxyAuth ProxyOption, rejecting connection due to incompatible configuration");
+      errno = EINVAL;
+      return -1;
+
     } else {
       reverse_flags = PROXY_REVERSE_FL_CONNECT_AT_SESS_INIT;
     }
@@ -1166,11 +2294,20 @@ static int set_reverse_flags(void) {
 int proxy_reverse_sess_free(pool *p, struct proxy_session *proxy_sess) {
   /* Reset any state. */
 
+  if (reverse_speculative_connect != NULL) {
+    proxy_conn_connect_abort(reverse_speculative_connect);
+    reverse_speculative_connect = NULL;
+    reverse_speculative_pconn = NULL;
+  }
+
+  reverse_pooled_login = NULL;
   reverse_backends = NULL;
   reverse_backend_id = -1;
   reverse_connect_policy = PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN;
+  reverse_chash_key = PROXY_REVERSE_CHASH_KEY_HOST;
   reverse_flags = 0UL;
   reverse_retry_count = PROXY_DEFAULT_RETRY_COUNT;
+  reverse_health_cooldown = PROXY_DEFAULT_HEALTH_COOLDOWN;
 
   if (reverse_ds.dsh != NULL) {
     (void) (reverse_ds.close)(p, reverse_ds.dsh);
@@ -1196,6 +2333,12 @@ int proxy_reverse_sess_init(pool *p, const char *tables_dir,
     reverse_retry_count = *((int *) c->argv[0]);
   }
 
+  c = find_config(main_server->conf, CONF_PARAM, "ProxyReverseHealthCooldown",
+    FALSE);
+  if (c != NULL) {
+    reverse_health_cooldown = *((int *) c->argv[0]);
+  }
+
   c = find_config(main_server->conf, CONF_PARAM, "ProxyReverseServers",
     FALSE);
   if (c == NULL) {
@@ -1233,14 +2376,47 @@ int proxy_reverse_sess_init(pool *p, const char *tables_dir,
     FALSE);
   if (c != NULL) {
     reverse_connect_policy = *((int *) c->argv[0]);
+
+    if (reverse_connect_policy ==
+        PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH) {
+      reverse_chash_key = *((int *) c->argv[1]);
+    }
   }
 
-  dsh = (reverse_ds.open)(p, tables_dir, default_backends);
-  if (dsh == NULL) {
-    return -1;
+  if (reverse_connect_policy ==
+        PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_ROUND_ROBIN &&
+      default_backends != NULL) {
+    /* Compute the schedule once, now, rather than on the first selection. */
+    (void) proxy_reverse_wrr_get_schedule(default_backends);
   }
 
-  reverse_ds.dsh = dsh;
+  if (reverse_connect_policy == PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH) {
+    struct proxy_reverse_lease lease;
+
+    /* The backends are selected using the ring computed at startup, and
+     * their loads tracked in shared memory; no datastore is needed.
+     */
+    pr_trace_msg(trace_channel, 9, "using ConsistentHash policy, keyed by %s",
+      proxy_reverse_chash_key_name(reverse_chash_key));
+
+    /* Look up our lease now, while /proc is still visible to us. */
+    (void) proxy_reverse_lease_get(&lease);
+
+  } else {
+    if (proxy_reverse_policy_is_sticky(reverse_connect_policy) != TRUE) {
+      struct proxy_reverse_lease lease;
+
+      /* Look up our lease now, while /proc is still visible to us. */
+      (void) proxy_reverse_lease_get(&lease);
+    }
+
+    dsh = (reverse_ds.open)(p, tables_dir, default_backends);
+    if (dsh == NULL) {
+      return -1;
+    }
+
+    reverse_ds.dsh = dsh;
+  }
 
   if (set_reverse_flags() < 0) {
     return -1;
@@ -1251,6 +2427,10 @@ int proxy_reverse_sess_init(pool *p, const char *tables_dir,
     if (res < 0) {
       return -1;
     }
+
+  } else if (reverse_flags == PROXY_REVERSE_FL_CONNECT_AT_PASS &&
+             (proxy_opts & PROXY_OPT_USE_SPECULATIVE_CONNECT)) {
+    reverse_speculative_connect_start(p, proxy_sess);
   }
 
   return 0;
@@ -1330,13 +2510,58 @@ static pr_json_array_t *read_json_array(pool *p, pr_fh_t *fh, off_t filesz) {
   return json;
 }
 
-array_header *proxy_reverse_json_parse_uris(pool *p, const char *path) {
-  register unsigned int i, nelts;
-  int count = 0, reached_eol = TRUE, res, xerrno = 0;
+static int reverse_json_get_weighted_uri(pool *p, pr_json_array_t *json,
+    unsigned int idx, char **uri) {
+  int res;
+  double weight = 0.0;
+  char *text = NULL;
+  pr_json_object_t *obj = NULL;
+
+  res = pr_json_array_get_object(p, json, idx, &obj);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = pr_json_object_get_string(p, obj, "uri", &text);
+  if (res < 0) {
+    int xerrno = errno;
+
+    (void) pr_json_object_free(obj);
+    errno = xerrno;
+    return -1;
+  }
+
+  if (pr_json_object_get_number(p, obj, "weight", &weight) == 0) {
+    char param[32];
+
+    /* Check the range (which also rejects NaN) before converting; not every
+     * double fits in an int.
+     */
+    if (!(weight >= 1.0 && weight <= (double) PROXY_CONN_MAX_WEIGHT) ||
+        weight != (double) ((int) weight)) {
+      pr_trace_msg(trace_channel, 4,
+        "invalid weight %g (must be an integer 1-%d) for URI '%.100s'",
+        weight, PROXY_CONN_MAX_WEIGHT, text);
+      (void) pr_json_object_free(obj);
+      errno = EINVAL;
+      return -1;
+    }
+
+    memset(param, '\0', sizeof(param));
+    snprintf(param, sizeof(param)-1, "weight=%d", (int) weight);
+    text = pstrcat(p, text, strchr(text, '?') != NULL ? "&" : "?", param,
+      NULL);
+  }
+
+  (void) pr_json_object_free(obj);
+  *uri = text;
+  return 0;
+}
+
+pr_json_array_t *proxy_reverse_json_read_array(pool *p, const char *path) {
+  int res, xerrno = 0;
   pr_fh_t *fh;
-  array_header *uris = NULL;
   struct stat st;
-  pool *tmp_pool;
   pr_json_array_t *json = NULL;
 
   if (p == NULL ||
@@ -1364,8 +2589,7 @@ array_header *proxy_reverse_json_parse_uris(pool *p, const char *path) {
     xerrno = errno;
 
     pr_trace_msg(trace_channel, 7,
-      "error opening ProxyReverseServers file '%s': %s", path,
-      strerror(xerrno));
+      "error opening JSON file '%s': %s", path, strerror(xerrno));
 
     errno = xerrno;
     return NULL;
@@ -1392,8 +2616,7 @@ array_header *proxy_reverse_json_parse_uris(pool *p, const char *path) {
       "found no items in empty file '%s'", fh->fh_path);
 
     (void) pr_fsio_close(fh);
-    uris = make_array(p, 1, sizeof(struct proxy_conn *));
-    return uris;
+    return pr_json_array_from_text(p, "[]");
   }
 
   if (st.st_size > PROXY_REVERSE_JSON_MAX_FILE_SIZE) {
@@ -1408,8 +2631,7 @@ array_header *proxy_reverse_json_parse_uris(pool *p, const char *path) {
 
   fh->fh_iosz = st.st_blksize;
 
-  tmp_pool = make_sub_pool(p);
-  json = read_json_array(tmp_pool, fh, st.st_size);
+  json = read_json_array(p, fh, st.st_size);
   xerrno = errno;
 
   (void) pr_fsio_close(fh);
@@ -1417,6 +2639,29 @@ array_header *proxy_reverse_json_parse_uris(pool *p, const char *path) {
   if (json == NULL) {
     pr_trace_msg(trace_channel, 1,
       "unable to read JSON array from '%s': %s", path, strerror(xerrno));
+  }
+
+  errno = xerrno;
+  return json;
+}
+
+array_header *proxy_reverse_json_parse_uris(pool *p, const char *path) {
+  register unsigned int i, nelts;
+  int count = 0, reached_eol = TRUE;
+  array_header *uris = NULL;
+  pool *tmp_pool;
+  pr_json_array_t *json = NULL;
+
+  if (p == NULL ||
+      path == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  json = proxy_reverse_json_read_array(tmp_pool, path);
+  if (json == NULL) {
+    int xerrno = errno;
 
     destroy_pool(tmp_pool);
     errno = xerrno;
@@ -1443,7 +2688,9 @@ array_header *proxy_reverse_json_parse_uris(pool *p, const char *path) {
 
     pr_signals_handle();
 
-    if (pr_json_array_get_string(p, json, i, &uri) == 0) {
+    /* Each item is either a URI, or an object with "uri" and "weight". */
+    if (pr_json_array_get_string(p, json, i, &uri) == 0 ||
+        reverse_json_get_weighted_uri(p, json, i, &uri) == 0) {
       pconn = proxy_conn_create(p, uri);
       if (pconn == NULL) {
         pr_trace_msg(trace_channel, 9,
@@ -1503,6 +2750,18 @@ int proxy_reverse_connect_get_policy(const char *policy) {
 
   } else if (strncasecmp(policy, "LeastResponseTime", 18) == 0) {
     return PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME;
+
+  } else if (strncasecmp(policy, "WeightedRoundRobin", 19) == 0) {
+    return PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_ROUND_ROBIN;
+
+  } else if (strncasecmp(policy, "WeightedRandom", 15) == 0) {
+    return PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_RANDOM;
+
+  } else if (strncasecmp(policy, "ConsistentHash", 15) == 0) {
+    return PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH;
+
+  } else if (strncasecmp(policy, "LeastTransfers", 15) == 0) {
+    return PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS;
   }
 
   errno = ENOENT;
@@ -1529,30 +2788,40 @@ static int send_user(struct proxy_session *proxy_sess, cmd_rec *cmd,
     cmd->argv[1] = cmd->arg = pstrdup(cmd->pool, uri_user);
   }
 
-  res = proxy_ftp_ctrl_send_cmd(cmd->tmp_pool, proxy_sess->backend_ctrl_conn,
-    cmd);
-  cmd->argv[1] = cmd->arg = orig_user;
+  if (reverse_pooled_login != NULL) {
+    /* The pooled connection already sent this USER; replay its response. */
+    resp = pcalloc(cmd->tmp_pool, sizeof(pr_response_t));
+    resp->num = reverse_pooled_login->user_resp->num;
+    resp->msg = reverse_pooled_login->user_resp->msg;
+    resp_nlines = reverse_pooled_login->user_nlines;
+    cmd->argv[1] = cmd->arg = orig_user;
 
-  if (res < 0) {
-    xerrno = errno;
-    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-      "error sending %s to backend: %s", (char *) cmd->argv[0],
-      strerror(xerrno));
+  } else {
+    res = proxy_ftp_ctrl_send_cmd(cmd->tmp_pool, proxy_sess->backend_ctrl_conn,
+      cmd);
+    cmd->argv[1] = cmd->arg = orig_user;
 
-    errno = xerrno;
-    return -1;
-  }
+    if (res < 0) {
+      xerrno = errno;
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error sending %s to backend: %s", (char *) cmd->argv[0],
+        strerror(xerrno));
 
-  resp = proxy_ftp_ctrl_recv_resp(cmd->tmp_pool, proxy_sess->backend_ctrl_conn,
-    &resp_nlines, 0);
-  if (resp == NULL) {
-    xerrno = errno;
-    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-      "error receiving %s response from backend: %s", (char *) cmd->argv[0],
-      strerror(xerrno));
+      errno = xerrno;
+      return -1;
+    }
 
-    errno = xerrno;
-    return -1;
+    resp = proxy_ftp_ctrl_recv_resp(cmd->tmp_pool,
+      proxy_sess->backend_ctrl_conn, &resp_nlines, 0);
+    if (resp == NULL) {
+      xerrno = errno;
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error receiving %s response from backend: %s", (char *) cmd->argv[0],
+        strerror(xerrno));
+
+      errno = xerrno;
+      return -1;
+    }
   }
 
   /* Note that the response message may contain the per-URI user name we
@@ -1659,6 +2928,7 @@ static int send_pass(struct proxy_session *proxy_sess, cmd_rec *cmd,
   unsigned int resp_nlines = 0;
   const char *uri_user, *uri_pass;
   char *orig_pass;
+  uint64_t sending_ms, received_ms;
 
   if (proxy_sess == NULL ||
       proxy_sess->backend_ctrl_conn == NULL) {
@@ -1685,38 +2955,56 @@ static int send_pass(struct proxy_session *proxy_sess, cmd_rec *cmd,
     }
   }
 
-  res = proxy_ftp_ctrl_send_cmd(cmd->tmp_pool, proxy_sess->backend_ctrl_conn,
-    cmd);
-  cmd->argv[1] = cmd->arg = orig_pass;
+  if (reverse_pooled_login != NULL) {
+    /* The pooled connection already sent this PASS; replay its response.
+     * There was no round-trip to measure.
+     */
+    resp = pcalloc(cmd->tmp_pool, sizeof(pr_response_t));
+    resp->num = reverse_pooled_login->pass_resp->num;
+    resp->msg = reverse_pooled_login->pass_resp->msg;
+    resp_nlines = reverse_pooled_login->pass_nlines;
+    cmd->argv[1] = cmd->arg = orig_pass;
 
-  if (res < 0) {
-    xerrno = errno;
-    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-      "error sending %s to backend: %s", (char *) cmd->argv[0],
-      strerror(xerrno));
+    reverse_pooled_login = NULL;
+    sending_ms = received_ms = 0;
 
-    errno = xerrno;
-    return -1;
-  }
+  } else {
+    pr_gettimeofday_millis(&sending_ms);
+    res = proxy_ftp_ctrl_send_cmd(cmd->tmp_pool, proxy_sess->backend_ctrl_conn,
+      cmd);
+    cmd->argv[1] = cmd->arg = orig_pass;
 
-  resp = proxy_ftp_ctrl_recv_resp(cmd->tmp_pool, proxy_sess->backend_ctrl_conn,
-    &resp_nlines, 0);
-  if (resp == NULL) {
-    xerrno = errno;
-    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-      "error receiving %s response from backend: %s", (char *) cmd->argv[0],
-      strerror(xerrno));
+    if (res < 0) {
+      xerrno = errno;
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error sending %s to backend: %s", (char *) cmd->argv[0],
+        strerror(xerrno));
 
-    /* If we receive an EPERM here, it is probably because the backend
-     * closed its control connection, yielding an EOF.  To better indicate
-     * this situation, propagate the error using EPIPE.
-     */
-    if (xerrno == EPERM) {
-      xerrno = EPIPE;
+      errno = xerrno;
+      return -1;
     }
 
-    errno = xerrno;
-    return -1;
+    resp = proxy_ftp_ctrl_recv_resp(cmd->tmp_pool,
+      proxy_sess->backend_ctrl_conn, &resp_nlines, 0);
+    if (resp == NULL) {
+      xerrno = errno;
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error receiving %s response from backend: %s", (char *) cmd->argv[0],
+        strerror(xerrno));
+
+      /* If we receive an EPERM here, it is probably because the backend
+       * closed its control connection, yielding an EOF.  To better indicate
+       * this situation, propagate the error using EPIPE.
+       */
+      if (xerrno == EPERM) {
+        xerrno = EPIPE;
+      }
+
+      errno = xerrno;
+      return -1;
+    }
+
+    pr_gettimeofday_millis(&received_ms);
   }
 
   /* Note that the response message may contain the per-URI user name we
@@ -1742,6 +3030,12 @@ static int send_pass(struct proxy_session *proxy_sess, cmd_rec *cmd,
     proxy_sess_state |= PROXY_SESS_STATE_BACKEND_AUTHENTICATED;
     clear_user_creds();
     pr_timer_remove(PR_TIMER_LOGIN, ANY_MODULE); 
+
+    if (received_ms > 0) {
+      (void) reverse_connect_index_latency(cmd->tmp_pool, main_server->sid,
+        reverse_backend_id, PROXY_REVERSE_LATENCY_LOGIN,
+        (long) (received_ms - sending_ms));
+    }
   }
 
   res = proxy_ftp_ctrl_send_resp(cmd->tmp_pool, proxy_sess->frontend_ctrl_conn,
@@ -1809,6 +3103,16 @@ int proxy_reverse_handle_pass(cmd_rec *cmd, struct proxy_session *proxy_sess,
             connect_name = session.group;
           }
         }
+
+      } else if (reverse_connect_policy ==
+                   PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH &&
+                 reverse_chash_key != PROXY_REVERSE_CHASH_KEY_HOST) {
+        user = connect_name = pr_table_get(session.notes, "mod_auth.orig-user",
+          NULL);
+
+        if (reverse_chash_key == PROXY_REVERSE_CHASH_KEY_GROUP) {
+          connect_name = session.group;
+        }
       }
 
       for (i = 0; i < reverse_retry_count; i++) {
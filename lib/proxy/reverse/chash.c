@@ -0,0 +1,725 @@
+/*
+ * ProFTPD - mod_proxy consistent hashing implementation
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_proxy.h"
+
+#include "proxy/conn.h"
+#include "proxy/reverse.h"
+#include "proxy/reverse/chash.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+extern xaset_t *server_list;
+
+/* The health of each backend, and the connection leases of each vhost, shared
+ * by the session processes.  As for the SHM datastore, these are updated using
+ * the GCC __sync atomic builtins.
+ */
+struct chash_backend {
+  /* The time (in millisecs since the epoch) until which this backend is not
+   * selected, or zero if healthy.
+   */
+  volatile unsigned long long unhealthy_until_ms;
+};
+
+/* A connection to a backend, held by a session.  The connection counts are
+ * computed from the leases, rather than kept as counters, so that a session
+ * which dies without releasing its lease only counts until the lease is
+ * reclaimed.
+ *
+ * A lease is free when its pid is zero; a session claims it by moving the pid
+ * from zero to its own, then fills in the rest.  The lease only counts once
+ * its backend ID is set, and its backend ID is unset before it is freed.
+ */
+struct chash_lease {
+  volatile pid_t pid;
+  volatile unsigned long long start;
+  volatile int backend_id;
+};
+
+struct chash_leases {
+  /* The time (in millisecs since the epoch) when the leases were last checked
+   * for dead holders; the session which moves this on does the check.
+   */
+  volatile unsigned long long reclaim_ms;
+
+  struct chash_lease leases[PROXY_REVERSE_CHASH_MAX_LEASES];
+};
+
+struct chash_vhost {
+  struct proxy_reverse_chash_ring *ring;
+
+  /* Our backends and leases, in the shared table. */
+  struct chash_backend *backends;
+  struct chash_leases *leases;
+};
+
+/* Indexed by server ID; NULL rings for vhosts not using ConsistentHash. */
+static struct chash_vhost *chash_vhosts = NULL;
+static unsigned int chash_vhost_count = 0;
+
+static void *chash_table = NULL;
+static size_t chash_tablesz = 0;
+
+static const char *trace_channel = "proxy.reverse.chash";
+
+static uint32_t chash_hash_update(uint32_t h, const char *data,
+    size_t datasz) {
+  register size_t i;
+
+  /* FNV-1a */
+  for (i = 0; i < datasz; i++) {
+    h ^= (unsigned char) data[i];
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+static uint32_t chash_hash_final(uint32_t h) {
+  /* FNV-1a alone leaves similar keys (e.g. "uri#1", "uri#2") close together;
+   * this finalizer (from MurmurHash3) spreads them across the ring.
+   */
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+
+  return h;
+}
+
+static uint32_t chash_hash(const char *data, size_t datasz) {
+  return chash_hash_final(chash_hash_update(2166136261U, data, datasz));
+}
+
+static int chash_point_cmp(const void *a, const void *b) {
+  const struct proxy_reverse_chash_point *pa, *pb;
+
+  pa = a;
+  pb = b;
+
+  if (pa->hash != pb->hash) {
+    return pa->hash < pb->hash ? -1 : 1;
+  }
+
+  /* Keep the order of colliding points deterministic. */
+  return pa->backend_id - pb->backend_id;
+}
+
+int proxy_reverse_chash_get_key(const char *name) {
+  if (name == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (strcasecmp(name, "host") == 0) {
+    return PROXY_REVERSE_CHASH_KEY_HOST;
+  }
+
+  if (strcasecmp(name, "user") == 0) {
+    return PROXY_REVERSE_CHASH_KEY_USER;
+  }
+
+  if (strcasecmp(name, "group") == 0) {
+    return PROXY_REVERSE_CHASH_KEY_GROUP;
+  }
+
+  errno = ENOENT;
+  return -1;
+}
+
+const char *proxy_reverse_chash_key_name(int key_type) {
+  const char *name;
+
+  switch (key_type) {
+    case PROXY_REVERSE_CHASH_KEY_HOST:
+      name = "host";
+      break;
+
+    case PROXY_REVERSE_CHASH_KEY_USER:
+      name = "user";
+      break;
+
+    case PROXY_REVERSE_CHASH_KEY_GROUP:
+      name = "group";
+      break;
+
+    default:
+      errno = ENOENT;
+      name = NULL;
+  }
+
+  return name;
+}
+
+struct proxy_reverse_chash_ring *proxy_reverse_chash_ring_create(pool *p,
+    array_header *backends) {
+  register unsigned int i;
+  struct proxy_reverse_chash_ring *ring;
+  const struct proxy_conn **conns;
+  unsigned int npoints = 0;
+
+  if (p == NULL ||
+      backends == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  ring = pcalloc(p, sizeof(struct proxy_reverse_chash_ring));
+  ring->backend_count = backends->nelts;
+  if (ring->backend_count == 0) {
+    return ring;
+  }
+
+  conns = backends->elts;
+  ring->weights = pcalloc(p, backends->nelts * sizeof(unsigned int));
+  for (i = 0; i < backends->nelts; i++) {
+    ring->weights[i] = proxy_conn_get_weight(conns[i]);
+    ring->total_weight += ring->weights[i];
+  }
+
+  ring->point_count = ring->total_weight *
+    PROXY_REVERSE_CHASH_POINTS_PER_WEIGHT;
+  ring->points = palloc(p,
+    ring->point_count * sizeof(struct proxy_reverse_chash_point));
+
+  for (i = 0; i < backends->nelts; i++) {
+    register unsigned int j;
+    const char *uri;
+    uint32_t uri_hash;
+
+    /* The points of a backend are derived from its URI (which does not
+     * include any parameters), so that they do not depend on its position in
+     * the list, or on its weight: changing the weight only adds or removes
+     * points.
+     */
+    uri = proxy_conn_get_uri(conns[i]);
+    uri_hash = chash_hash_update(2166136261U, uri, strlen(uri));
+
+    for (j = 0; j < ring->weights[i] * PROXY_REVERSE_CHASH_POINTS_PER_WEIGHT;
+        j++) {
+      char suffix[32];
+      int suffixlen;
+
+      suffixlen = pr_snprintf(suffix, sizeof(suffix), "#%u", j);
+
+      ring->points[npoints].hash = chash_hash_final(
+        chash_hash_update(uri_hash, suffix, suffixlen));
+      ring->points[npoints].backend_id = i;
+      npoints++;
+    }
+  }
+
+  qsort(ring->points, ring->point_count,
+    sizeof(struct proxy_reverse_chash_point), chash_point_cmp);
+
+  return ring;
+}
+
+/* Returns the index of the first point at or after the given hash, wrapping
+ * around to the first point.
+ */
+static unsigned int chash_ring_find(const struct proxy_reverse_chash_ring *ring,
+    uint32_t hash) {
+  unsigned int lo = 0, hi = ring->point_count;
+
+  while (lo < hi) {
+    unsigned int mid;
+
+    mid = lo + ((hi - lo) / 2);
+    if (ring->points[mid].hash < hash) {
+      lo = mid + 1;
+
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo < ring->point_count ? lo : 0;
+}
+
+int proxy_reverse_chash_ring_lookup(pool *p,
+    const struct proxy_reverse_chash_ring *ring, const char *key,
+    const long *conn_counts, const int *usable) {
+  register unsigned int i;
+  unsigned int start, seen = 0;
+  int *visited, fallback_id = -1;
+  long total_conns = 0;
+  double scale = 0.0;
+
+  if (p == NULL ||
+      ring == NULL ||
+      key == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (ring->point_count == 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  start = chash_ring_find(ring, chash_hash(key, strlen(key)));
+
+  if (conn_counts != NULL) {
+    for (i = 0; i < ring->backend_count; i++) {
+      if (conn_counts[i] > 0) {
+        total_conns += conn_counts[i];
+      }
+    }
+
+    /* The bound for each backend is its share, by weight, of the connections
+     * (including this new one), plus the allowed overflow.
+     */
+    scale = ((1.0 + PROXY_REVERSE_CHASH_LOAD_FACTOR) * (total_conns + 1)) /
+      ring->total_weight;
+  }
+
+  visited = pcalloc(p, ring->backend_count * sizeof(int));
+
+  for (i = 0; i < ring->point_count && seen < ring->backend_count; i++) {
+    int backend_id;
+
+    backend_id = ring->points[(start + i) % ring->point_count].backend_id;
+    if (visited[backend_id] == TRUE) {
+      continue;
+    }
+
+    visited[backend_id] = TRUE;
+    seen++;
+
+    if (usable != NULL &&
+        usable[backend_id] != TRUE) {
+      continue;
+    }
+
+    if (fallback_id < 0) {
+      fallback_id = backend_id;
+    }
+
+    if (conn_counts != NULL &&
+        (double) conn_counts[backend_id] >=
+          scale * ring->weights[backend_id]) {
+      pr_trace_msg(trace_channel, 17,
+        "backend ID %d is at its load bound (%ld connections), skipping",
+        backend_id, conn_counts[backend_id]);
+      continue;
+    }
+
+    return backend_id;
+  }
+
+  if (fallback_id >= 0) {
+    return fallback_id;
+  }
+
+  /* None of the backends are usable; use the key's own backend. */
+  return ring->points[start].backend_id;
+}
+
+int proxy_reverse_chash_init(pool *p) {
+  unsigned int backend_count = 0, backend_idx = 0, vhost_count = 0;
+  register unsigned int i;
+  unsigned int ring_count = 0, ring_idx = 0;
+  struct proxy_reverse_chash_ring **rings;
+  struct chash_leases *leases = NULL;
+  struct chash_backend *backends = NULL;
+  void *table = NULL;
+  size_t tablesz;
+  server_rec *s;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    if (s->sid >= vhost_count) {
+      vhost_count = s->sid + 1;
+    }
+  }
+
+  rings = pcalloc(p, vhost_count * sizeof(struct proxy_reverse_chash_ring *));
+
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    config_rec *c;
+    array_header *backends;
+
+    c = find_config(s->conf, CONF_PARAM, "ProxyReverseConnectPolicy", FALSE);
+    if (c == NULL ||
+        *((int *) c->argv[0]) != PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH) {
+      continue;
+    }
+
+    backends = proxy_reverse_vhost_backends(p, s);
+    if (backends == NULL) {
+      continue;
+    }
+
+    rings[s->sid] = proxy_reverse_chash_ring_create(p, backends);
+    if (rings[s->sid] == NULL) {
+      return -1;
+    }
+
+    backend_count += rings[s->sid]->backend_count;
+    ring_count++;
+
+    pr_trace_msg(trace_channel, 9,
+      "computed ring of %u points for %u backends of vhost '%s'",
+      rings[s->sid]->point_count, rings[s->sid]->backend_count,
+      s->ServerName);
+  }
+
+  /* The leases, for each vhost, followed by the backends, for each vhost. */
+  tablesz = (ring_count * sizeof(struct chash_leases)) +
+    (backend_count * sizeof(struct chash_backend));
+  if (tablesz > 0) {
+    /* An anonymous shared mapping, created before any session processes are
+     * forked, is inherited by all of them.
+     */
+    table = mmap(NULL, tablesz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS,
+      -1, 0);
+    if (table == MAP_FAILED) {
+      int xerrno = errno;
+
+      pr_log_pri(PR_LOG_NOTICE, MOD_PROXY_VERSION
+        ": error allocating %lu bytes of shared memory: %s",
+        (unsigned long) tablesz, strerror(xerrno));
+      errno = xerrno;
+      return -1;
+    }
+
+    leases = table;
+    backends = (struct chash_backend *) &(leases[ring_count]);
+
+    /* The mapping is zero-filled, i.e. all leases are free, and all backends
+     * are healthy; free leases have no backend.
+     */
+    for (i = 0; i < ring_count; i++) {
+      register unsigned int j;
+
+      for (j = 0; j < PROXY_REVERSE_CHASH_MAX_LEASES; j++) {
+        leases[i].leases[j].backend_id = -1;
+      }
+    }
+  }
+
+  if (chash_table != NULL) {
+    /* Any existing sessions keep using their existing mapping. */
+    (void) munmap(chash_table, chash_tablesz);
+  }
+
+  chash_table = table;
+  chash_tablesz = tablesz;
+
+  chash_vhosts = pcalloc(p, vhost_count * sizeof(struct chash_vhost));
+  chash_vhost_count = vhost_count;
+
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    struct chash_vhost *vhost;
+
+    if (rings[s->sid] == NULL) {
+      continue;
+    }
+
+    vhost = &(chash_vhosts[s->sid]);
+    vhost->ring = rings[s->sid];
+    vhost->leases = &(leases[ring_idx++]);
+    vhost->backends = &(backends[backend_idx]);
+    backend_idx += vhost->ring->backend_count;
+  }
+
+  return 0;
+}
+
+int proxy_reverse_chash_free(pool *p) {
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Note that we do not unmap the table here, as any session processes
+   * still need it; it is replaced on the next init.
+   */
+  chash_vhosts = NULL;
+  chash_vhost_count = 0;
+
+  return 0;
+}
+
+static struct chash_vhost *chash_get_vhost(unsigned int vhost_id) {
+  if (chash_vhosts == NULL ||
+      vhost_id >= chash_vhost_count ||
+      chash_vhosts[vhost_id].ring == NULL) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  return &(chash_vhosts[vhost_id]);
+}
+
+/* Frees the leases of sessions which are no longer running.  At most one
+ * session does this, every PROXY_REVERSE_LEASE_RECLAIM_INTERVAL_MS.
+ */
+static void chash_reclaim_leases(struct chash_vhost *vhost, uint64_t now_ms) {
+  register unsigned int i;
+  unsigned long long reclaim_ms;
+  int reclaimed = 0;
+
+  reclaim_ms = vhost->leases->reclaim_ms;
+  if (now_ms < reclaim_ms + PROXY_REVERSE_LEASE_RECLAIM_INTERVAL_MS) {
+    return;
+  }
+
+  if (!__sync_bool_compare_and_swap(&(vhost->leases->reclaim_ms), reclaim_ms,
+      (unsigned long long) now_ms)) {
+    /* Another session got there first. */
+    return;
+  }
+
+  for (i = 0; i < PROXY_REVERSE_CHASH_MAX_LEASES; i++) {
+    struct chash_lease *lease;
+    struct proxy_reverse_lease holder;
+
+    lease = &(vhost->leases->leases[i]);
+    holder.pid = lease->pid;
+    if (holder.pid <= 0 ||
+        lease->backend_id < 0) {
+      continue;
+    }
+
+    holder.start = lease->start;
+    if (proxy_reverse_lease_is_live(&holder) == TRUE) {
+      continue;
+    }
+
+    pr_trace_msg(trace_channel, 9,
+      "reclaiming lease of dead session (PID %lu) for backend ID %d",
+      (unsigned long) holder.pid, lease->backend_id);
+
+    lease->backend_id = -1;
+    __sync_synchronize();
+    (void) __sync_bool_compare_and_swap(&(lease->pid), holder.pid, 0);
+    reclaimed++;
+  }
+
+  if (reclaimed > 0) {
+    pr_trace_msg(trace_channel, 5, "reclaimed %d %s of dead sessions",
+      reclaimed, reclaimed != 1 ? "leases" : "lease");
+  }
+}
+
+static int chash_take_lease(struct chash_vhost *vhost, int backend_id) {
+  register unsigned int i;
+  struct proxy_reverse_lease holder;
+  unsigned int start;
+
+  if (proxy_reverse_lease_get(&holder) < 0) {
+    return -1;
+  }
+
+  /* Start looking at a point particular to this process, so that sessions
+   * mostly do not contend for the same leases.
+   */
+  start = ((unsigned int) holder.pid) % PROXY_REVERSE_CHASH_MAX_LEASES;
+
+  for (i = 0; i < PROXY_REVERSE_CHASH_MAX_LEASES; i++) {
+    struct chash_lease *lease;
+
+    lease = &(vhost->leases->leases[(start + i) % PROXY_REVERSE_CHASH_MAX_LEASES]);
+    if (lease->pid != 0 ||
+        !__sync_bool_compare_and_swap(&(lease->pid), 0, holder.pid)) {
+      continue;
+    }
+
+    lease->start = holder.start;
+    __sync_synchronize();
+    lease->backend_id = backend_id;
+    return 0;
+  }
+
+  pr_trace_msg(trace_channel, 3,
+    "no free lease for backend ID %d (all %u in use), not counting connection",
+    backend_id, (unsigned int) PROXY_REVERSE_CHASH_MAX_LEASES);
+  errno = ENOSPC;
+  return -1;
+}
+
+static int chash_drop_lease(struct chash_vhost *vhost, int backend_id) {
+  register unsigned int i;
+  struct proxy_reverse_lease holder;
+
+  if (proxy_reverse_lease_get(&holder) < 0) {
+    return -1;
+  }
+
+  for (i = 0; i < PROXY_REVERSE_CHASH_MAX_LEASES; i++) {
+    struct chash_lease *lease;
+
+    lease = &(vhost->leases->leases[i]);
+    if (lease->pid != holder.pid ||
+        lease->backend_id != backend_id) {
+      continue;
+    }
+
+    lease->backend_id = -1;
+    __sync_synchronize();
+    (void) __sync_bool_compare_and_swap(&(lease->pid), holder.pid, 0);
+    return 0;
+  }
+
+  errno = ENOENT;
+  return -1;
+}
+
+const struct proxy_conn *proxy_reverse_chash_next_backend(pool *p,
+    unsigned int vhost_id, array_header *backends, const char *key,
+    int *backend_id) {
+  register unsigned int i;
+  struct chash_vhost *vhost;
+  const struct proxy_conn **conns;
+  long *conn_counts;
+  int idx, *usable;
+  uint64_t now_ms;
+
+  if (p == NULL ||
+      backends == NULL ||
+      key == NULL ||
+      backend_id == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  vhost = chash_get_vhost(vhost_id);
+  if (vhost == NULL) {
+    return NULL;
+  }
+
+  if (vhost->ring->backend_count != backends->nelts) {
+    pr_trace_msg(trace_channel, 3,
+      "ring for vhost ID %u has %u backends, but session has %u", vhost_id,
+      vhost->ring->backend_count, backends->nelts);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  conn_counts = palloc(p, backends->nelts * sizeof(long));
+  usable = palloc(p, backends->nelts * sizeof(int));
+
+  pr_gettimeofday_millis(&now_ms);
+
+  chash_reclaim_leases(vhost, now_ms);
+
+  memset(conn_counts, 0, backends->nelts * sizeof(long));
+  for (i = 0; i < PROXY_REVERSE_CHASH_MAX_LEASES; i++) {
+    int lease_backend_id;
+
+    lease_backend_id = vhost->leases->leases[i].backend_id;
+    if (vhost->leases->leases[i].pid > 0 &&
+        lease_backend_id >= 0 &&
+        (unsigned int) lease_backend_id < backends->nelts) {
+      conn_counts[lease_backend_id]++;
+    }
+  }
+
+  for (i = 0; i < backends->nelts; i++) {
+    usable[i] = (vhost->backends[i].unhealthy_until_ms <= now_ms);
+  }
+
+  idx = proxy_reverse_chash_ring_lookup(p, vhost->ring, key, conn_counts, usable);
+  if (idx < 0) {
+    return NULL;
+  }
+
+  pr_trace_msg(trace_channel, 11, "%s key '%s' maps to backend ID %d",
+    proxy_reverse_policy_name(PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH),
+    key, idx);
+
+  conns = backends->elts;
+  *backend_id = idx;
+  return conns[idx];
+}
+
+int proxy_reverse_chash_update_backend(unsigned int vhost_id, int backend_id,
+    int conn_incr) {
+  struct chash_vhost *vhost;
+
+  vhost = chash_get_vhost(vhost_id);
+  if (vhost == NULL) {
+    return -1;
+  }
+
+  if (backend_id < 0 ||
+      (unsigned int) backend_id >= vhost->ring->backend_count) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (conn_incr > 0) {
+    if (chash_take_lease(vhost, backend_id) < 0) {
+      pr_trace_msg(trace_channel, 3,
+        "error taking lease for backend ID %d: %s", backend_id,
+        strerror(errno));
+    }
+
+  } else if (conn_incr < 0) {
+    if (chash_drop_lease(vhost, backend_id) < 0) {
+      pr_trace_msg(trace_channel, 3,
+        "error dropping lease for backend ID %d: %s", backend_id,
+        strerror(errno));
+    }
+  }
+
+  if (conn_incr > 0) {
+    /* A successful connection means the backend is healthy. */
+    (void) __sync_lock_test_and_set(
+      &(vhost->backends[backend_id].unhealthy_until_ms), 0ULL);
+  }
+
+  return 0;
+}
+
+int proxy_reverse_chash_health_backend(unsigned int vhost_id, int backend_id,
+    uint64_t unhealthy_until_ms) {
+  struct chash_vhost *vhost;
+
+  vhost = chash_get_vhost(vhost_id);
+  if (vhost == NULL) {
+    return -1;
+  }
+
+  if (backend_id < 0 ||
+      (unsigned int) backend_id >= vhost->ring->backend_count) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  (void) __sync_lock_test_and_set(
+    &(vhost->backends[backend_id].unhealthy_until_ms),
+    (unsigned long long) unhealthy_until_ms);
+  return 0;
+}
@@ -0,0 +1,1657 @@
+/*
+ * ProFTPD - mod_proxy reverse connection pool
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_proxy.h"
+
+#include "proxy/conn.h"
+#include "proxy/inet.h"
+#include "proxy/evloop.h"
+#include "proxy/tls.h"
+#include "proxy/reverse.h"
+#include "proxy/reverse/health.h"
+#include "proxy/reverse/connpool.h"
+#include "proxy/ftp/ctrl.h"
+
+#include <signal.h>
+#include <sys/socket.h>
+
+extern xaset_t *server_list;
+
+/* Used when ProxyTimeoutConnect is not configured for the vhost. */
+#define CONNPOOL_DEFAULT_TIMEOUT		5
+
+/* How long to wait before trying again to open a connection to a backend
+ * for which opening a connection failed, in millisecs.
+ */
+#define CONNPOOL_RETRY_DELAY_MS			5000
+
+/* How long a session waits for the keeper to answer, in millisecs.  The
+ * keeper only ever hands out connections which it already has, and never
+ * waits on a backend itself (see connpool_filler), so this need not be long.
+ */
+#define CONNPOOL_REPLY_TIMEOUT_MS		500
+
+#define CONNPOOL_MAX_URI_LEN			1024
+#define CONNPOOL_MAX_MSG_LEN			16384
+
+/* Sent by a session, on its private channel, to request a connection. */
+struct connpool_request {
+  uint32_t seqno;
+  uint32_t vhost_id;
+  char uri[CONNPOOL_MAX_URI_LEN];
+};
+
+#define CONNPOOL_MSG_BANNER			0
+#define CONNPOOL_MSG_FEAT			1
+#define CONNPOOL_MSG_USER			2
+#define CONNPOOL_MSG_PASS			3
+#define CONNPOOL_MSG_COUNT			4
+
+/* Sent by the keeper to the filler, to request a new connection to the given
+ * backend of the given vhost (as indices into the keeper's list of vhosts).
+ */
+struct connpool_fill_request {
+  uint32_t seqno;
+  uint32_t vhost_idx;
+  uint32_t backend_idx;
+};
+
+/* Sent by the keeper (or the filler, to the keeper) in reply, followed by the
+ * response texts, and with the connection's fd attached (if any).
+ */
+struct connpool_reply {
+  uint32_t seqno;
+
+  /* Zero if a connection is attached, otherwise an errno value. */
+  int32_t status;
+
+  int32_t connect_ms;
+  int32_t banner_ms;
+
+  /* Response codes, line counts, and text lengths; a zero text length means
+   * the response is not present.
+   */
+  char num[CONNPOOL_MSG_COUNT][4];
+  uint32_t nlines[CONNPOOL_MSG_COUNT];
+  uint32_t msglen[CONNPOOL_MSG_COUNT];
+};
+
+/* A pooled connection: as opened by the filler, with its control connection,
+ * or as idle in the keeper, which only has its fd.
+ */
+struct connpool_idle {
+  pool *pool;
+  conn_t *ctrl_conn;
+  int fd;
+  uint64_t created_ms;
+
+  pr_response_t *resps[CONNPOOL_MSG_COUNT];
+  unsigned int nlines[CONNPOOL_MSG_COUNT];
+
+  long connect_ms;
+  long banner_ms;
+};
+
+struct connpool_backend {
+  const struct proxy_conn *pconn;
+  const char *uri;
+
+  /* Idle connections, oldest first. */
+  struct connpool_idle **idle;
+  int nidle;
+
+  /* Whether to log in using the URI credentials: -1 if not yet known, i.e.
+   * before the backend's features are known.  Only used by the filler.
+   */
+  int login;
+
+  /* The request for a new connection which the filler is working on, if
+   * not zero.
+   */
+  uint32_t fill_seqno;
+
+  uint64_t retry_ms;
+};
+
+struct connpool_vhost {
+  unsigned int vhost_id;
+
+  /* ProxyReverseConnectionPool */
+  int size;
+  int max_idle;
+
+  int timeout;
+  int tls_engine;
+  const pr_netaddr_t *src_addr;
+
+  struct connpool_backend *backends;
+  unsigned int nbackends;
+};
+
+static pid_t connpool_pid = 0;
+
+/* The keeper's channel to the filler, which opens the pooled connections, so
+ * that the keeper itself never blocks on a backend.
+ */
+static int connpool_filler_fd = -1;
+static pid_t connpool_filler_pid = 0;
+static uint32_t connpool_fill_seqno = 0;
+
+/* The daemon's end of this socketpair is inherited by session processes,
+ * which use it once, to send one end of their private channel to the keeper.
+ * When all holders of the daemon's end close it, the keeper exits.
+ */
+static int connpool_fds[2] = { -1, -1 };
+
+/* A session's private channel to the keeper. */
+static int connpool_sess_fd = -1;
+static uint32_t connpool_seqno = 0;
+
+static const char *trace_channel = "proxy.reverse.connpool";
+
+static int connpool_send_fd(int sockfd, const void *data, size_t datasz,
+    int fd) {
+  struct msghdr msg;
+  struct iovec iov;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctrl;
+  ssize_t res;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = (void *) data;
+  iov.iov_len = datasz;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (fd >= 0) {
+    struct cmsghdr *cmsg;
+
+    memset(&ctrl, 0, sizeof(ctrl));
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  res = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+  while (res < 0 &&
+         errno == EINTR) {
+    pr_signals_handle();
+    res = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+  }
+
+  return res < 0 ? -1 : 0;
+}
+
+/* Returns the number of bytes read, zero on EOF, or -1 on error.  Any fd
+ * received is returned via `fd`; any further fds are closed.
+ */
+static ssize_t connpool_recv_fd(int sockfd, void *data, size_t datasz,
+    int *fd) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * 4)];
+  } ctrl;
+  ssize_t res;
+
+  *fd = -1;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = data;
+  iov.iov_len = datasz;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl.buf;
+  msg.msg_controllen = sizeof(ctrl.buf);
+
+  res = recvmsg(sockfd, &msg, MSG_DONTWAIT);
+  while (res < 0 &&
+         errno == EINTR) {
+    pr_signals_handle();
+    res = recvmsg(sockfd, &msg, MSG_DONTWAIT);
+  }
+
+  if (res < 0) {
+    return -1;
+  }
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS) {
+      int *fds;
+      size_t i, nfds;
+
+      fds = (int *) CMSG_DATA(cmsg);
+      nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+      for (i = 0; i < nfds; i++) {
+        if (*fd < 0) {
+          *fd = fds[i];
+
+        } else {
+          (void) close(fds[i]);
+        }
+      }
+    }
+  }
+
+  if (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
+    if (*fd >= 0) {
+      (void) close(*fd);
+      *fd = -1;
+    }
+
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  return res;
+}
+
+static int connpool_has_feat(const char *feats, const char *name) {
+  const char *ptr;
+  size_t namelen;
+
+  if (feats == NULL) {
+    return FALSE;
+  }
+
+  namelen = strlen(name);
+
+  /* Feature lines start with a single space, per RFC 2389. */
+  for (ptr = strchr(feats, ' '); ptr != NULL; ptr = strchr(ptr + 1, ' ')) {
+    if ((ptr == feats || ptr[-1] == '\n') &&
+        strncasecmp(ptr + 1, name, namelen) == 0 &&
+        (ptr[namelen + 1] == '\0' ||
+         ptr[namelen + 1] == ' ' ||
+         ptr[namelen + 1] == '\r' ||
+         ptr[namelen + 1] == '\n')) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static void connpool_close_idle(struct connpool_idle *idle, int send_quit) {
+  if (idle->ctrl_conn == NULL) {
+    /* The keeper only has the fd; it must not block on the backend. */
+    if (send_quit == TRUE) {
+      (void) send(idle->fd, "QUIT\r\n", 6, MSG_DONTWAIT|MSG_NOSIGNAL);
+    }
+
+    (void) close(idle->fd);
+    destroy_pool(idle->pool);
+    return;
+  }
+
+  if (send_quit == TRUE) {
+    /* We do not wait for the QUIT response. */
+    (void) proxy_ftp_ctrl_send_cmd(idle->pool, idle->ctrl_conn,
+      pr_cmd_alloc(idle->pool, 1, C_QUIT));
+  }
+
+  proxy_inet_close(idle->pool, idle->ctrl_conn);
+  destroy_pool(idle->pool);
+}
+
+static pr_response_t *connpool_send_recv(pool *p, conn_t *ctrl_conn,
+    const char *name, const char *arg, unsigned int *nlines) {
+  cmd_rec *cmd;
+
+  if (arg != NULL) {
+    cmd = pr_cmd_alloc(p, 2, pstrdup(p, name), pstrdup(p, arg));
+    cmd->arg = pstrdup(p, arg);
+
+  } else {
+    cmd = pr_cmd_alloc(p, 1, pstrdup(p, name));
+  }
+
+  if (proxy_ftp_ctrl_send_cmd(p, ctrl_conn, cmd) < 0) {
+    return NULL;
+  }
+
+  return proxy_ftp_ctrl_recv_resp(p, ctrl_conn, nlines, 0);
+}
+
+static struct connpool_idle *connpool_open(pool *p, struct connpool_vhost *cv,
+    struct connpool_backend *cb) {
+  pool *idle_pool;
+  struct connpool_idle *idle;
+  pr_response_t *resp;
+  unsigned int resp_nlines = 0;
+  const char *feats = NULL;
+
+  idle_pool = make_sub_pool(p);
+  pr_pool_tag(idle_pool, "Proxy Reverse Pooled Connection Pool");
+
+  idle = pcalloc(idle_pool, sizeof(struct connpool_idle));
+  idle->pool = idle_pool;
+
+  idle->ctrl_conn = proxy_reverse_health_open_backend(idle_pool, cb->pconn,
+    cv->src_addr, cv->timeout, &(idle->resps[CONNPOOL_MSG_BANNER]),
+    &(idle->nlines[CONNPOOL_MSG_BANNER]), &(idle->connect_ms),
+    &(idle->banner_ms));
+  if (idle->ctrl_conn == NULL) {
+    int xerrno = errno;
+
+    pr_trace_msg(trace_channel, 9, "error opening connection to '%.100s': %s",
+      cb->uri, strerror(xerrno));
+    destroy_pool(idle_pool);
+
+    errno = xerrno;
+    return NULL;
+  }
+
+  idle->fd = PR_NETIO_FD(idle->ctrl_conn->instrm);
+  pr_gettimeofday_millis(&(idle->created_ms));
+
+  resp = connpool_send_recv(idle_pool, idle->ctrl_conn, C_FEAT, NULL,
+    &resp_nlines);
+  if (resp == NULL) {
+    int xerrno = errno;
+
+    connpool_close_idle(idle, FALSE);
+    errno = xerrno;
+    return NULL;
+  }
+
+  if (resp->num[0] == '2') {
+    feats = resp->msg;
+    idle->resps[CONNPOOL_MSG_FEAT] = resp;
+    idle->nlines[CONNPOOL_MSG_FEAT] = resp_nlines;
+  }
+
+  if (cb->login < 0) {
+    cb->login = FALSE;
+
+    /* We can only log in ahead of time if nothing needs to happen before
+     * USER, i.e. no AUTH TLS (whose TLS session could not be handed over)
+     * and no HOST.
+     */
+    if (proxy_conn_get_username(cb->pconn) != NULL &&
+        proxy_conn_get_password(cb->pconn) != NULL &&
+        *(proxy_conn_get_password(cb->pconn)) != '\0' &&
+        proxy_conn_get_tls(cb->pconn) != PROXY_TLS_ENGINE_ON &&
+        connpool_has_feat(feats, C_HOST) == FALSE) {
+      if (cv->tls_engine == PROXY_TLS_ENGINE_OFF ||
+          (cv->tls_engine == PROXY_TLS_ENGINE_AUTO &&
+           connpool_has_feat(feats, C_AUTH) == FALSE)) {
+        cb->login = TRUE;
+      }
+    }
+
+    pr_trace_msg(trace_channel, 9, "%s pooled connections to '%.100s'",
+      cb->login ? "logging in" : "not logging in", cb->uri);
+  }
+
+  if (cb->login == TRUE) {
+    resp = connpool_send_recv(idle_pool, idle->ctrl_conn, C_USER,
+      proxy_conn_get_username(cb->pconn), &resp_nlines);
+    if (resp == NULL ||
+        resp->num[0] != '3') {
+      int xerrno = (resp == NULL ? errno : EPERM);
+
+      if (resp != NULL) {
+        (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+          "unable to log in pooled connection to '%.100s': USER: %s %s",
+          cb->uri, resp->num, resp->msg);
+        cb->login = FALSE;
+      }
+
+      connpool_close_idle(idle, resp != NULL);
+      errno = xerrno;
+      return NULL;
+    }
+
+    idle->resps[CONNPOOL_MSG_USER] = resp;
+    idle->nlines[CONNPOOL_MSG_USER] = resp_nlines;
+
+    resp = connpool_send_recv(idle_pool, idle->ctrl_conn, C_PASS,
+      proxy_conn_get_password(cb->pconn), &resp_nlines);
+    if (resp == NULL ||
+        resp->num[0] != '2') {
+      int xerrno = (resp == NULL ? errno : EPERM);
+
+      if (resp != NULL) {
+        (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+          "unable to log in pooled connection to '%.100s': PASS: %s %s",
+          cb->uri, resp->num, resp->msg);
+        cb->login = FALSE;
+      }
+
+      connpool_close_idle(idle, resp != NULL);
+      errno = xerrno;
+      return NULL;
+    }
+
+    idle->resps[CONNPOOL_MSG_PASS] = resp;
+    idle->nlines[CONNPOOL_MSG_PASS] = resp_nlines;
+  }
+
+  return idle;
+}
+
+static pr_response_t *connpool_get_resp(pool *p, struct connpool_reply *reply,
+    const char *payload, size_t *offset, unsigned int idx,
+    unsigned int *nlines) {
+  pr_response_t *resp;
+
+  if (reply->msglen[idx] == 0) {
+    return NULL;
+  }
+
+  resp = pcalloc(p, sizeof(pr_response_t));
+  reply->num[idx][sizeof(reply->num[idx])-1] = '\0';
+  resp->num = pstrdup(p, reply->num[idx]);
+  resp->msg = pstrndup(p, payload + *offset, reply->msglen[idx] - 1);
+  *nlines = reply->nlines[idx];
+
+  *offset += reply->msglen[idx];
+  return resp;
+}
+
+/* Parses the response texts following a reply into the given responses.
+ * Returns -1, with errno set to EINVAL, if the reply is malformed.
+ */
+static int connpool_parse_reply(pool *p, const char *buf, size_t buflen,
+    struct connpool_reply *reply, pr_response_t **resps,
+    unsigned int *nlines) {
+  register unsigned int i;
+  const char *payload;
+  size_t offset, payloadlen;
+
+  payload = buf + sizeof(struct connpool_reply);
+  payloadlen = buflen - sizeof(struct connpool_reply);
+
+  offset = 0;
+  for (i = 0; i < CONNPOOL_MSG_COUNT; i++) {
+    offset += reply->msglen[i];
+  }
+
+  if (offset != payloadlen ||
+      reply->msglen[CONNPOOL_MSG_BANNER] == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  offset = 0;
+  for (i = 0; i < CONNPOOL_MSG_COUNT; i++) {
+    nlines[i] = 0;
+    resps[i] = connpool_get_resp(p, reply, payload, &offset, i, &(nlines[i]));
+  }
+
+  return 0;
+}
+
+static int connpool_send_reply(pool *p, int sockfd, uint32_t seqno,
+    struct connpool_idle *idle, int status) {
+  struct connpool_reply reply;
+  char *buf;
+  size_t buflen;
+  register unsigned int i;
+
+  memset(&reply, 0, sizeof(reply));
+  reply.seqno = seqno;
+  buflen = sizeof(reply);
+
+  if (idle == NULL) {
+    reply.status = status;
+    return connpool_send_fd(sockfd, &reply, sizeof(reply), -1);
+  }
+
+  reply.connect_ms = (int32_t) idle->connect_ms;
+  reply.banner_ms = (int32_t) idle->banner_ms;
+
+  for (i = 0; i < CONNPOOL_MSG_COUNT; i++) {
+    pr_response_t *resp;
+    size_t msglen;
+
+    resp = idle->resps[i];
+    if (resp == NULL) {
+      continue;
+    }
+
+    msglen = strlen(resp->msg);
+    if (buflen + msglen + 1 > CONNPOOL_MAX_MSG_LEN) {
+      if (i == CONNPOOL_MSG_FEAT) {
+        /* The session can ask for the features itself. */
+        continue;
+      }
+
+      reply.status = EMSGSIZE;
+      return connpool_send_fd(sockfd, &reply, sizeof(reply), -1);
+    }
+
+    sstrncpy(reply.num[i], resp->num, sizeof(reply.num[i]));
+    reply.nlines[i] = idle->nlines[i];
+
+    /* Account for the NUL, so that an empty message is still present. */
+    reply.msglen[i] = msglen + 1;
+    buflen += msglen + 1;
+  }
+
+  buf = palloc(p, buflen);
+  memcpy(buf, &reply, sizeof(reply));
+  buflen = sizeof(reply);
+
+  for (i = 0; i < CONNPOOL_MSG_COUNT; i++) {
+    if (reply.msglen[i] > 0) {
+      memcpy(buf + buflen, idle->resps[i]->msg, reply.msglen[i]);
+      buflen += reply.msglen[i];
+    }
+  }
+
+  return connpool_send_fd(sockfd, buf, buflen, idle->fd);
+}
+
+/* Returns TRUE if the idle connection is still usable, i.e. the backend
+ * has neither closed it nor sent anything unsolicited, e.g. a "421 Idle
+ * timeout".
+ */
+static int connpool_idle_usable(struct connpool_idle *idle) {
+  int res;
+
+  res = proxy_evloop_poll_fd(idle->fd, PROXY_EVLOOP_EV_READ, 0);
+  return res == 0 ? TRUE : FALSE;
+}
+
+static void connpool_handle_request(pool *p, int sockfd,
+    array_header *vhosts) {
+  struct connpool_request req;
+  struct connpool_vhost **cvs;
+  struct connpool_idle *idle = NULL;
+  register unsigned int i;
+  ssize_t len;
+  int fd = -1;
+
+  len = connpool_recv_fd(sockfd, &req, sizeof(req), &fd);
+  if (fd >= 0) {
+    /* Sessions do not send us fds on their private channels. */
+    (void) close(fd);
+  }
+
+  if (len != (ssize_t) sizeof(req)) {
+    return;
+  }
+
+  req.uri[sizeof(req.uri)-1] = '\0';
+
+  cvs = vhosts->elts;
+  for (i = 0; i < vhosts->nelts; i++) {
+    register unsigned int j;
+
+    if (cvs[i]->vhost_id != req.vhost_id) {
+      continue;
+    }
+
+    for (j = 0; j < cvs[i]->nbackends; j++) {
+      struct connpool_backend *cb;
+
+      cb = &(cvs[i]->backends[j]);
+      if (strcmp(cb->uri, req.uri) != 0) {
+        continue;
+      }
+
+      while (cb->nidle > 0) {
+        struct connpool_idle *candidate;
+
+        candidate = cb->idle[0];
+        memmove(cb->idle, cb->idle + 1,
+          (cb->nidle - 1) * sizeof(struct connpool_idle *));
+        cb->nidle--;
+
+        if (connpool_idle_usable(candidate) == TRUE) {
+          idle = candidate;
+          break;
+        }
+
+        pr_trace_msg(trace_channel, 9,
+          "discarding unusable pooled connection to '%.100s'", cb->uri);
+        connpool_close_idle(candidate, FALSE);
+      }
+
+      break;
+    }
+
+    break;
+  }
+
+  if (connpool_send_reply(p, sockfd, req.seqno, idle, ENOENT) < 0) {
+    pr_trace_msg(trace_channel, 3,
+      "error handing pooled connection to session: %s", strerror(errno));
+
+    if (idle != NULL) {
+      connpool_close_idle(idle, TRUE);
+    }
+
+    return;
+  }
+
+  if (idle != NULL) {
+    pr_trace_msg(trace_channel, 12,
+      "handed pooled connection to '%.100s' to session", req.uri);
+
+    /* The session now owns the connection; we only close our copy of its
+     * fd, without shutting it down.
+     */
+    (void) close(idle->fd);
+    destroy_pool(idle->pool);
+  }
+}
+
+/* The filler process opens the connections requested by the keeper, one at a
+ * time, and hands each back to the keeper, along with its responses.  Opening
+ * a connection blocks, for as long as the ProxyTimeoutConnect of a dead
+ * backend; the keeper meanwhile keeps answering sessions.
+ */
+static void connpool_filler(pool *p, array_header *vhosts, int sockfd) {
+  struct connpool_vhost **cvs;
+
+  cvs = vhosts->elts;
+
+  while (TRUE) {
+    struct connpool_fill_request req;
+    struct connpool_vhost *cv;
+    struct connpool_backend *cb;
+    struct connpool_idle *idle;
+    ssize_t len;
+    int fd = -1, res;
+    pool *tmp_pool;
+
+    pr_signals_handle();
+
+    res = proxy_evloop_poll_fd(sockfd, PROXY_EVLOOP_EV_READ, -1);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      break;
+    }
+
+    len = connpool_recv_fd(sockfd, &req, sizeof(req), &fd);
+    if (fd >= 0) {
+      (void) close(fd);
+    }
+
+    if (len == 0) {
+      /* The keeper is gone. */
+      break;
+    }
+
+    if (len != (ssize_t) sizeof(req) ||
+        req.vhost_idx >= vhosts->nelts ||
+        req.backend_idx >= cvs[req.vhost_idx]->nbackends) {
+      continue;
+    }
+
+    cv = cvs[req.vhost_idx];
+    cb = &(cv->backends[req.backend_idx]);
+
+    tmp_pool = make_sub_pool(p);
+    idle = connpool_open(p, cv, cb);
+    if (idle == NULL) {
+      int xerrno = errno;
+
+      res = connpool_send_reply(tmp_pool, sockfd, req.seqno, NULL,
+        xerrno != 0 ? xerrno : EPERM);
+
+    } else {
+      res = connpool_send_reply(tmp_pool, sockfd, req.seqno, idle, 0);
+      if (res < 0) {
+        connpool_close_idle(idle, TRUE);
+
+      } else {
+        /* The keeper now owns the connection; we only close our copies of
+         * its fd, without shutting it down.
+         */
+        (void) close(idle->ctrl_conn->rfd);
+        (void) close(idle->ctrl_conn->wfd);
+        destroy_pool(idle->pool);
+      }
+    }
+
+    destroy_pool(tmp_pool);
+
+    if (res < 0) {
+      pr_trace_msg(trace_channel, 3,
+        "error handing pooled connection to keeper: %s", strerror(errno));
+    }
+  }
+
+  _exit(0);
+}
+
+static int connpool_start_filler(pool *p, array_header *vhosts) {
+  int fds[2];
+  pid_t pid;
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) {
+    return -1;
+  }
+
+  pid = fork();
+  switch (pid) {
+    case -1: {
+      int xerrno = errno;
+
+      (void) close(fds[0]);
+      (void) close(fds[1]);
+
+      errno = xerrno;
+      return -1;
+    }
+
+    case 0:
+      /* Only the keeper listens for sessions. */
+      (void) close(connpool_fds[0]);
+      connpool_fds[0] = -1;
+      (void) close(fds[1]);
+
+      signal(SIGTERM, SIG_DFL);
+      connpool_filler(p, vhosts, fds[0]);
+
+      /* Not reached. */
+      _exit(0);
+
+    default:
+      (void) close(fds[0]);
+      break;
+  }
+
+  connpool_filler_fd = fds[1];
+  connpool_filler_pid = pid;
+
+  pr_trace_msg(trace_channel, 7, "started connection pool filler (PID %lu)",
+    (unsigned long) pid);
+  return 0;
+}
+
+static void connpool_stop_filler(void) {
+  if (connpool_filler_fd >= 0) {
+    (void) close(connpool_filler_fd);
+    connpool_filler_fd = -1;
+  }
+
+  if (connpool_filler_pid > 0) {
+    (void) kill(connpool_filler_pid, SIGTERM);
+    (void) waitpid(connpool_filler_pid, NULL, 0);
+    connpool_filler_pid = 0;
+  }
+}
+
+/* Asks the filler for a new connection to the given backend. */
+static int connpool_request_fill(unsigned int vhost_idx,
+    unsigned int backend_idx, struct connpool_backend *cb) {
+  struct connpool_fill_request req;
+  ssize_t res;
+
+  if (connpool_filler_fd < 0) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  /* Zero means no request. */
+  connpool_fill_seqno++;
+  if (connpool_fill_seqno == 0) {
+    connpool_fill_seqno++;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.seqno = connpool_fill_seqno;
+  req.vhost_idx = vhost_idx;
+  req.backend_idx = backend_idx;
+
+  res = send(connpool_filler_fd, &req, sizeof(req), MSG_DONTWAIT|MSG_NOSIGNAL);
+  if (res < 0) {
+    return -1;
+  }
+
+  cb->fill_seqno = req.seqno;
+  return 0;
+}
+
+/* Receives a connection, or the failure to open one, from the filler.
+ * Returns -1 if the filler is gone.
+ */
+static int connpool_handle_fill(pool *p, array_header *vhosts) {
+  struct connpool_vhost **cvs;
+  struct connpool_vhost *cv = NULL;
+  struct connpool_backend *cb = NULL;
+  struct connpool_reply reply;
+  struct connpool_idle *idle;
+  pool *idle_pool;
+  register unsigned int i;
+  char *buf;
+  ssize_t len;
+  uint64_t now_ms;
+  int fd = -1;
+
+  buf = palloc(p, CONNPOOL_MAX_MSG_LEN);
+  len = connpool_recv_fd(connpool_filler_fd, buf, CONNPOOL_MAX_MSG_LEN, &fd);
+  if (len == 0 ||
+      (len < 0 && errno != EAGAIN && errno != EINTR && errno != EMSGSIZE)) {
+    return -1;
+  }
+
+  if (len < (ssize_t) sizeof(reply)) {
+    if (fd >= 0) {
+      (void) close(fd);
+    }
+
+    return 0;
+  }
+
+  memcpy(&reply, buf, sizeof(reply));
+
+  cvs = vhosts->elts;
+  for (i = 0; i < vhosts->nelts && cb == NULL; i++) {
+    register unsigned int j;
+
+    for (j = 0; j < cvs[i]->nbackends; j++) {
+      if (reply.seqno != 0 &&
+          cvs[i]->backends[j].fill_seqno == reply.seqno) {
+        cv = cvs[i];
+        cb = &(cv->backends[j]);
+        break;
+      }
+    }
+  }
+
+  if (cb == NULL) {
+    if (fd >= 0) {
+      (void) close(fd);
+    }
+
+    return 0;
+  }
+
+  cb->fill_seqno = 0;
+  pr_gettimeofday_millis(&now_ms);
+
+  if (reply.status != 0 ||
+      fd < 0) {
+    if (fd >= 0) {
+      (void) close(fd);
+    }
+
+    pr_trace_msg(trace_channel, 9, "error opening connection to '%.100s': %s",
+      cb->uri, strerror(reply.status != 0 ? reply.status : ENOENT));
+    cb->retry_ms = now_ms + CONNPOOL_RETRY_DELAY_MS;
+    return 0;
+  }
+
+  idle_pool = make_sub_pool(p);
+  pr_pool_tag(idle_pool, "Proxy Reverse Pooled Connection Pool");
+
+  idle = pcalloc(idle_pool, sizeof(struct connpool_idle));
+  idle->pool = idle_pool;
+  idle->fd = fd;
+  idle->created_ms = now_ms;
+  idle->connect_ms = reply.connect_ms;
+  idle->banner_ms = reply.banner_ms;
+
+  if (connpool_parse_reply(idle_pool, buf, len, &reply, idle->resps,
+      idle->nlines) < 0 ||
+      cb->nidle >= cv->size) {
+    connpool_close_idle(idle, TRUE);
+    return 0;
+  }
+
+  cb->idle[cb->nidle++] = idle;
+  pr_trace_msg(trace_channel, 12, "pooled new connection to '%.100s' (%d/%d)",
+    cb->uri, cb->nidle, cv->size);
+  return 0;
+}
+
+/* Expires old idle connections, and asks the filler for one new connection
+ * per backend which needs more.  Returns the number of millisecs until there
+ * is work to do again, or -1 if there is none until the filler answers.
+ */
+static int connpool_maintain(unsigned int vhost_idx,
+    struct connpool_vhost *cv) {
+  register unsigned int i;
+  uint64_t now_ms, next_ms = 0;
+  int timeout_ms;
+
+  for (i = 0; i < cv->nbackends; i++) {
+    struct connpool_backend *cb;
+
+    pr_signals_handle();
+
+    cb = &(cv->backends[i]);
+    pr_gettimeofday_millis(&now_ms);
+
+    while (cb->nidle > 0) {
+      struct connpool_idle *idle;
+
+      idle = cb->idle[0];
+      if (idle->created_ms + ((uint64_t) cv->max_idle * 1000) > now_ms &&
+          connpool_idle_usable(idle) == TRUE) {
+        break;
+      }
+
+      memmove(cb->idle, cb->idle + 1,
+        (cb->nidle - 1) * sizeof(struct connpool_idle *));
+      cb->nidle--;
+
+      connpool_close_idle(idle, TRUE);
+    }
+
+    if (cb->nidle < cv->size &&
+        cb->fill_seqno == 0 &&
+        cb->retry_ms <= now_ms) {
+      if (connpool_request_fill(vhost_idx, i, cb) < 0) {
+        cb->retry_ms = now_ms + CONNPOOL_RETRY_DELAY_MS;
+      }
+    }
+
+    if (cb->nidle > 0) {
+      uint64_t expires_ms;
+
+      expires_ms = cb->idle[0]->created_ms + ((uint64_t) cv->max_idle * 1000);
+      if (next_ms == 0 ||
+          expires_ms < next_ms) {
+        next_ms = expires_ms;
+      }
+    }
+
+    if (cb->nidle < cv->size &&
+        cb->fill_seqno == 0) {
+      if (next_ms == 0 ||
+          cb->retry_ms < next_ms) {
+        next_ms = cb->retry_ms;
+      }
+    }
+  }
+
+  if (next_ms == 0) {
+    return -1;
+  }
+
+  pr_gettimeofday_millis(&now_ms);
+  timeout_ms = 0;
+  if (next_ms > now_ms) {
+    timeout_ms = (int) (next_ms - now_ms);
+  }
+
+  return timeout_ms;
+}
+
+static void connpool_keeper_exit_ev(int signo) {
+  (void) signo;
+
+  /* The filler may be blocked on a backend; do not wait for it. */
+  if (connpool_filler_pid > 0) {
+    (void) kill(connpool_filler_pid, SIGTERM);
+  }
+
+  _exit(0);
+}
+
+static void connpool_keeper(pool *p, array_header *vhosts) {
+  struct connpool_vhost **cvs;
+  struct proxy_evloop *loop;
+  struct proxy_evloop_event events[32];
+  config_rec *c;
+
+  /* The signal handlers of the daemon do not apply to us. */
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGUSR2, SIG_IGN);
+
+  /* The ProxyLog is otherwise only opened by session processes. */
+  c = find_config(main_server->conf, CONF_PARAM, "ProxyLog", FALSE);
+  if (c != NULL &&
+      proxy_logfd < 0) {
+    char *logname;
+
+    logname = c->argv[0];
+    if (strncasecmp(logname, "none", 5) != 0) {
+      if (pr_log_openfile(logname, &proxy_logfd, PR_LOG_SYSTEM_MODE) < 0) {
+        proxy_logfd = -1;
+      }
+    }
+  }
+
+  /* Start the filler before we hold any other fds, e.g. of session channels
+   * or pooled connections, which it would otherwise inherit.
+   */
+  if (connpool_start_filler(p, vhosts) < 0) {
+    pr_trace_msg(trace_channel, 1,
+      "unable to start connection pool filler: %s", strerror(errno));
+    _exit(1);
+  }
+
+  signal(SIGTERM, connpool_keeper_exit_ev);
+
+  loop = proxy_evloop_create(p, 0);
+  if (loop == NULL ||
+      proxy_evloop_add(loop, connpool_fds[0], PROXY_EVLOOP_EV_READ,
+        NULL) < 0 ||
+      proxy_evloop_add(loop, connpool_filler_fd, PROXY_EVLOOP_EV_READ,
+        NULL) < 0) {
+    pr_trace_msg(trace_channel, 1,
+      "unable to watch for connection pool requests: %s", strerror(errno));
+    connpool_stop_filler();
+    _exit(1);
+  }
+
+  pr_trace_msg(trace_channel, 5,
+    "connection pool keeper (PID %lu) pooling backends of %d %s",
+    (unsigned long) getpid(), vhosts->nelts,
+    vhosts->nelts != 1 ? "vhosts" : "vhost");
+
+  cvs = vhosts->elts;
+
+  while (TRUE) {
+    register unsigned int i;
+    int nevents, timeout_ms = -1;
+    pool *tmp_pool;
+
+    pr_signals_handle();
+
+    for (i = 0; i < vhosts->nelts; i++) {
+      int res;
+
+      res = connpool_maintain(i, cvs[i]);
+      if (res >= 0 &&
+          (timeout_ms < 0 || res < timeout_ms)) {
+        timeout_ms = res;
+      }
+    }
+
+    nevents = proxy_evloop_wait(loop, events,
+      sizeof(events) / sizeof(events[0]), timeout_ms);
+    if (nevents < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      break;
+    }
+
+    tmp_pool = make_sub_pool(p);
+
+    for (i = 0; i < (unsigned int) nevents; i++) {
+      int fd;
+
+      fd = events[i].fd;
+
+      if (fd == connpool_filler_fd) {
+        if (connpool_handle_fill(tmp_pool, vhosts) < 0) {
+          register unsigned int j;
+
+          /* Sessions will connect to the backends themselves. */
+          (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+            "connection pool filler (PID %lu) went away, no longer pooling "
+            "new connections", (unsigned long) connpool_filler_pid);
+
+          (void) proxy_evloop_remove(loop, fd);
+          connpool_stop_filler();
+
+          for (j = 0; j < vhosts->nelts; j++) {
+            register unsigned int k;
+
+            for (k = 0; k < cvs[j]->nbackends; k++) {
+              cvs[j]->backends[k].fill_seqno = 0;
+            }
+          }
+        }
+
+        continue;
+      }
+
+      if (fd == connpool_fds[0]) {
+        ssize_t len;
+        char data;
+        int client_fd = -1;
+
+        len = connpool_recv_fd(fd, &data, sizeof(data), &client_fd);
+        if (len == 0) {
+          /* The daemon, and all sessions not yet registered, are gone. */
+          destroy_pool(tmp_pool);
+          pr_trace_msg(trace_channel, 5,
+            "connection pool keeper (PID %lu) exiting",
+            (unsigned long) getpid());
+          connpool_stop_filler();
+          _exit(0);
+        }
+
+        if (client_fd >= 0) {
+          if (proxy_evloop_add(loop, client_fd, PROXY_EVLOOP_EV_READ,
+              NULL) < 0) {
+            (void) close(client_fd);
+          }
+        }
+
+        continue;
+      }
+
+      if (events[i].events & PROXY_EVLOOP_EV_READ) {
+        ssize_t len;
+        char data;
+
+        /* Distinguish a request from the session going away. */
+        len = recv(fd, &data, sizeof(data), MSG_PEEK|MSG_DONTWAIT);
+        if (len > 0) {
+          connpool_handle_request(tmp_pool, fd, vhosts);
+          continue;
+        }
+
+        if (len < 0 &&
+            (errno == EAGAIN || errno == EINTR)) {
+          continue;
+        }
+      }
+
+      (void) proxy_evloop_remove(loop, fd);
+      (void) close(fd);
+    }
+
+    destroy_pool(tmp_pool);
+  }
+
+  pr_trace_msg(trace_channel, 5, "connection pool keeper (PID %lu) exiting",
+    (unsigned long) getpid());
+  connpool_stop_filler();
+  _exit(0);
+}
+
+static unsigned long connpool_get_opts(server_rec *s) {
+  config_rec *c;
+  unsigned long opts = 0UL;
+
+  c = find_config(s->conf, CONF_PARAM, "ProxyOptions", FALSE);
+  while (c != NULL) {
+    pr_signals_handle();
+
+    opts |= *((unsigned long *) c->argv[0]);
+    c = find_config_next(c, c->next, CONF_PARAM, "ProxyOptions", FALSE);
+  }
+
+  return opts;
+}
+
+static struct connpool_vhost *connpool_get_vhost(pool *p, server_rec *s) {
+  config_rec *c;
+  struct connpool_vhost *cv;
+  array_header *backends;
+  register unsigned int i;
+  unsigned long opts;
+  int size;
+
+  c = find_config(s->conf, CONF_PARAM, "ProxyEngine", FALSE);
+  if (c == NULL ||
+      *((int *) c->argv[0]) != TRUE) {
+    return NULL;
+  }
+
+  c = find_config(s->conf, CONF_PARAM, "ProxyRole", FALSE);
+  if (c != NULL &&
+      *((int *) c->argv[0]) != PROXY_ROLE_REVERSE) {
+    return NULL;
+  }
+
+  c = find_config(s->conf, CONF_PARAM, "ProxyReverseConnectionPool", FALSE);
+  if (c == NULL) {
+    return NULL;
+  }
+
+  size = *((int *) c->argv[0]);
+  if (size <= 0) {
+    return NULL;
+  }
+
+  /* The PROXY protocol message must be the first thing sent on the
+   * connection, and describes the frontend client; a pooled connection is
+   * opened before there is any client.
+   */
+  opts = connpool_get_opts(s);
+  if ((opts & PROXY_OPT_USE_PROXY_PROTOCOL_V1) ||
+      (opts & PROXY_OPT_USE_PROXY_PROTOCOL_V2)) {
+    pr_log_pri(PR_LOG_NOTICE, MOD_PROXY_VERSION
+      ": ProxyReverseConnectionPool not supported with the PROXY protocol, "
+      "ignoring");
+    return NULL;
+  }
+
+  backends = proxy_reverse_vhost_backends(p, s);
+  if (backends == NULL ||
+      backends->nelts == 0) {
+    return NULL;
+  }
+
+  cv = pcalloc(p, sizeof(struct connpool_vhost));
+  cv->vhost_id = s->sid;
+  cv->size = size;
+  cv->max_idle = *((int *) c->argv[1]);
+
+  cv->backends = pcalloc(p,
+    backends->nelts * sizeof(struct connpool_backend));
+  for (i = 0; i < backends->nelts; i++) {
+    const struct proxy_conn *pconn;
+    const char *uri;
+
+    pconn = ((const struct proxy_conn **) backends->elts)[i];
+    uri = proxy_conn_get_uri(pconn);
+
+    /* There is no FTP control connection to pool for SFTP backends. */
+    if (strncmp(uri, "sftp:", 5) == 0 ||
+        strlen(uri) >= CONNPOOL_MAX_URI_LEN) {
+      continue;
+    }
+
+    cv->backends[cv->nbackends].pconn = pconn;
+    cv->backends[cv->nbackends].uri = uri;
+    cv->backends[cv->nbackends].idle = pcalloc(p,
+      size * sizeof(struct connpool_idle *));
+    cv->backends[cv->nbackends].login = -1;
+    cv->nbackends++;
+  }
+
+  if (cv->nbackends == 0) {
+    return NULL;
+  }
+
+  cv->timeout = CONNPOOL_DEFAULT_TIMEOUT;
+  c = find_config(s->conf, CONF_PARAM, "ProxyTimeoutConnect", FALSE);
+  if (c != NULL &&
+      *((int *) c->argv[0]) > 0) {
+    cv->timeout = *((int *) c->argv[0]);
+  }
+
+#if defined(PR_USE_OPENSSL)
+  cv->tls_engine = PROXY_TLS_ENGINE_AUTO;
+  c = find_config(s->conf, CONF_PARAM, "ProxyTLSEngine", FALSE);
+  if (c != NULL) {
+    cv->tls_engine = *((int *) c->argv[0]);
+  }
+#else
+  cv->tls_engine = PROXY_TLS_ENGINE_OFF;
+#endif /* PR_USE_OPENSSL */
+
+  c = find_config(s->conf, CONF_PARAM, "ProxySourceAddress", FALSE);
+  if (c != NULL) {
+    cv->src_addr = c->argv[0];
+  }
+
+  return cv;
+}
+
+int proxy_reverse_connpool_init(pool *p) {
+  server_rec *s;
+  array_header *vhosts;
+  pid_t pid;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Each inetd-run session process is its own daemon; there is no one to
+   * share a pool with.
+   */
+  if (ServerType == SERVER_INETD) {
+    return 0;
+  }
+
+  vhosts = make_array(p, 0, sizeof(struct connpool_vhost *));
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    struct connpool_vhost *cv;
+
+    cv = connpool_get_vhost(p, s);
+    if (cv != NULL) {
+      *((struct connpool_vhost **) push_array(vhosts)) = cv;
+    }
+  }
+
+  if (vhosts->nelts == 0) {
+    pr_trace_msg(trace_channel, 9,
+      "no vhosts configured for connection pooling, skipping keeper");
+    return 0;
+  }
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, connpool_fds) < 0) {
+    return -1;
+  }
+
+  pid = fork();
+  switch (pid) {
+    case -1: {
+      int xerrno = errno;
+
+      (void) close(connpool_fds[0]);
+      (void) close(connpool_fds[1]);
+      connpool_fds[0] = connpool_fds[1] = -1;
+
+      errno = xerrno;
+      return -1;
+    }
+
+    case 0:
+      (void) close(connpool_fds[1]);
+      connpool_fds[1] = -1;
+
+      connpool_keeper(p, vhosts);
+
+      /* Not reached. */
+      _exit(0);
+
+    default:
+      (void) close(connpool_fds[0]);
+      connpool_fds[0] = -1;
+
+      connpool_pid = pid;
+      break;
+  }
+
+  pr_trace_msg(trace_channel, 7, "started connection pool keeper (PID %lu)",
+    (unsigned long) connpool_pid);
+  return 0;
+}
+
+int proxy_reverse_connpool_free(pool *p) {
+  if (connpool_fds[1] >= 0) {
+    (void) close(connpool_fds[1]);
+    connpool_fds[1] = -1;
+  }
+
+  if (connpool_pid > 0) {
+    pr_trace_msg(trace_channel, 7,
+      "stopping connection pool keeper (PID %lu)",
+      (unsigned long) connpool_pid);
+    (void) kill(connpool_pid, SIGTERM);
+    connpool_pid = 0;
+  }
+
+  return 0;
+}
+
+int proxy_reverse_connpool_sess_init(void) {
+  config_rec *c;
+  int fds[2], register_channel = FALSE;
+  char data = 0;
+
+  if (connpool_fds[1] < 0) {
+    return 0;
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "ProxyReverseConnectionPool",
+    FALSE);
+  if (c != NULL &&
+      *((int *) c->argv[0]) > 0) {
+    register_channel = TRUE;
+  }
+
+  if (register_channel == TRUE) {
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) {
+      pr_trace_msg(trace_channel, 3,
+        "error creating connection pool channel: %s", strerror(errno));
+
+    } else {
+      if (connpool_send_fd(connpool_fds[1], &data, sizeof(data),
+          fds[1]) < 0) {
+        pr_trace_msg(trace_channel, 3,
+          "error registering connection pool channel: %s", strerror(errno));
+        (void) close(fds[0]);
+
+      } else {
+        connpool_sess_fd = fds[0];
+        (void) fcntl(connpool_sess_fd, F_SETFD, FD_CLOEXEC);
+      }
+
+      (void) close(fds[1]);
+    }
+  }
+
+  /* Only the daemon keeps the keeper alive, and stops it. */
+  (void) close(connpool_fds[1]);
+  connpool_fds[1] = -1;
+  connpool_pid = 0;
+
+  return 0;
+}
+
+struct proxy_reverse_connpool_conn *proxy_reverse_connpool_get(pool *p,
+    unsigned int vhost_id, const struct proxy_conn *pconn) {
+  struct connpool_request req;
+  struct connpool_reply reply;
+  struct proxy_reverse_connpool_conn *pooled;
+  struct sockaddr_storage ss;
+  socklen_t sslen;
+  pr_netaddr_t *remote_addr;
+  conn_t *ctrl_conn;
+  pr_response_t *resps[CONNPOOL_MSG_COUNT];
+  unsigned int nlines[CONNPOOL_MSG_COUNT];
+  const char *uri;
+  char *buf;
+  ssize_t len;
+  uint64_t start_ms;
+  int fd = -1;
+
+  if (p == NULL ||
+      pconn == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (connpool_sess_fd < 0) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  uri = proxy_conn_get_uri(pconn);
+  if (strlen(uri) >= sizeof(req.uri)) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.seqno = ++connpool_seqno;
+  req.vhost_id = vhost_id;
+  sstrncpy(req.uri, uri, sizeof(req.uri));
+
+  if (connpool_send_fd(connpool_sess_fd, &req, sizeof(req), -1) < 0) {
+    pr_trace_msg(trace_channel, 3,
+      "error requesting pooled connection: %s", strerror(errno));
+    (void) close(connpool_sess_fd);
+    connpool_sess_fd = -1;
+
+    errno = ENOENT;
+    return NULL;
+  }
+
+  buf = palloc(p, CONNPOOL_MAX_MSG_LEN);
+  pr_gettimeofday_millis(&start_ms);
+
+  while (TRUE) {
+    uint64_t now_ms;
+    int res, timeout_ms;
+
+    pr_signals_handle();
+
+    pr_gettimeofday_millis(&now_ms);
+    timeout_ms = CONNPOOL_REPLY_TIMEOUT_MS - (int) (now_ms - start_ms);
+    if (timeout_ms < 0) {
+      timeout_ms = 0;
+    }
+
+    res = proxy_evloop_poll_fd(connpool_sess_fd, PROXY_EVLOOP_EV_READ,
+      timeout_ms);
+    if (res < 0 &&
+        errno == EINTR) {
+      continue;
+    }
+
+    if (res <= 0) {
+      pr_trace_msg(trace_channel, 3,
+        "no reply from connection pool keeper for '%.100s'", uri);
+
+      /* A late reply would hold its connection in our channel, unused, until
+       * our next request; closing the channel drops the reply, and its
+       * connection, at once.
+       */
+      (void) close(connpool_sess_fd);
+      connpool_sess_fd = -1;
+
+      errno = ENOENT;
+      return NULL;
+    }
+
+    len = connpool_recv_fd(connpool_sess_fd, buf, CONNPOOL_MAX_MSG_LEN, &fd);
+    if (len <= 0) {
+      if (len < 0 &&
+          (errno == EAGAIN || errno == EMSGSIZE)) {
+        continue;
+      }
+
+      /* The keeper went away. */
+      (void) close(connpool_sess_fd);
+      connpool_sess_fd = -1;
+
+      errno = ENOENT;
+      return NULL;
+    }
+
+    if ((size_t) len < sizeof(reply)) {
+      if (fd >= 0) {
+        (void) close(fd);
+        fd = -1;
+      }
+
+      continue;
+    }
+
+    memcpy(&reply, buf, sizeof(reply));
+    if (reply.seqno == req.seqno) {
+      break;
+    }
+
+    /* A late reply to an earlier request, which we stopped waiting for. */
+    pr_trace_msg(trace_channel, 14,
+      "ignoring reply #%lu from connection pool keeper, expected #%lu",
+      (unsigned long) reply.seqno, (unsigned long) req.seqno);
+    if (fd >= 0) {
+      (void) close(fd);
+      fd = -1;
+    }
+  }
+
+  if (reply.status != 0 ||
+      fd < 0) {
+    if (fd >= 0) {
+      (void) close(fd);
+    }
+
+    pr_trace_msg(trace_channel, 12, "no pooled connection for '%.100s': %s",
+      uri, strerror(reply.status != 0 ? reply.status : ENOENT));
+    errno = ENOENT;
+    return NULL;
+  }
+
+  if (connpool_parse_reply(p, buf, len, &reply, resps, nlines) < 0) {
+    pr_trace_msg(trace_channel, 3,
+      "malformed reply from connection pool keeper, ignoring");
+    (void) close(fd);
+
+    errno = ENOENT;
+    return NULL;
+  }
+
+  /* The connection is already established; wrap it up as our own. */
+  memset(&ss, 0, sizeof(ss));
+  sslen = sizeof(ss);
+  if (getpeername(fd, (struct sockaddr *) &ss, &sslen) < 0) {
+    pr_trace_msg(trace_channel, 3,
+      "error obtaining peer address of pooled connection: %s",
+      strerror(errno));
+    (void) close(fd);
+
+    errno = ENOENT;
+    return NULL;
+  }
+
+  remote_addr = pr_netaddr_alloc(p);
+  pr_netaddr_set_family(remote_addr, ss.ss_family);
+  pr_netaddr_set_sockaddr(remote_addr, (struct sockaddr *) &ss);
+
+  ctrl_conn = proxy_inet_openrw(p, session.c, remote_addr, PR_NETIO_STRM_CTRL,
+    fd, -1, -1, FALSE);
+  if (ctrl_conn == NULL) {
+    int xerrno = errno;
+
+    pr_trace_msg(trace_channel, 3,
+      "error opening pooled connection: %s", strerror(xerrno));
+    (void) close(fd);
+
+    errno = ENOENT;
+    return NULL;
+  }
+
+  ctrl_conn->remote_name = pr_netaddr_get_ipstr(ctrl_conn->remote_addr);
+  ctrl_conn->remote_port = ntohs(pr_netaddr_get_port(remote_addr));
+  (void) pr_inet_get_conn_info(ctrl_conn, ctrl_conn->rfd);
+
+  pooled = pcalloc(p, sizeof(struct proxy_reverse_connpool_conn));
+  pooled->ctrl_conn = ctrl_conn;
+  pooled->connect_ms = reply.connect_ms;
+  pooled->banner_ms = reply.banner_ms;
+
+  pooled->banner = resps[CONNPOOL_MSG_BANNER];
+  pooled->banner_nlines = nlines[CONNPOOL_MSG_BANNER];
+
+  if (resps[CONNPOOL_MSG_FEAT] != NULL) {
+    pooled->feats = resps[CONNPOOL_MSG_FEAT]->msg;
+  }
+
+  pooled->user_resp = resps[CONNPOOL_MSG_USER];
+  pooled->user_nlines = nlines[CONNPOOL_MSG_USER];
+  pooled->pass_resp = resps[CONNPOOL_MSG_PASS];
+  pooled->pass_nlines = nlines[CONNPOOL_MSG_PASS];
+
+  /* Both responses are needed to replay a login. */
+  if (pooled->user_resp == NULL ||
+      pooled->pass_resp == NULL) {
+    pooled->user_resp = pooled->pass_resp = NULL;
+  }
+
+  pr_trace_msg(trace_channel, 9, "using pooled connection to '%.100s'%s",
+    uri, pooled->pass_resp != NULL ? ", already logged in" : "");
+  return pooled;
+}
@@ -37,7 +37,7 @@
 extern xaset_t *server_list;
 
 #define PROXY_REVERSE_DB_SCHEMA_NAME		"proxy_reverse"
-#define PROXY_REVERSE_DB_SCHEMA_VERSION		6
+#define PROXY_REVERSE_DB_SCHEMA_VERSION		11
 
 /* PerHost/PerUser/PerGroup table limits */
 #define PROXY_REVERSE_DB_PERHOST_MAX_ENTRIES		8192
@@ -46,6 +46,27 @@ extern xaset_t *server_list;
 
 static array_header *db_backends = NULL;
 
+/* Extra flags for opening the database, e.g. for WAL mode. */
+static int db_open_flags = 0;
+
+/* Connection count updates are not written immediately; they are coalesced
+ * per backend, and written, in a single transaction along with the next
+ * write, or before the next read.
+ */
+struct reverse_db_update {
+  unsigned int vhost_id;
+  int backend_id;
+  int conn_incr;
+  long connect_ms;
+};
+
+static array_header *db_pending_updates = NULL;
+#define PROXY_REVERSE_DB_MAX_PENDING_UPDATES		32
+
+static int reverse_db_flush(pool *p, void *dbh);
+static int reverse_db_reclaim_leases(pool *p, void *dbh,
+  unsigned int vhost_id);
+
 static const char *trace_channel = "proxy.reverse.db";
 
 static unsigned int str2hash(const void *key, size_t keysz) {
@@ -72,10 +93,14 @@ static int reverse_db_add_schema(pool *p, struct proxy_dbh *dbh,
 
   /* CREATE TABLE proxy_vhosts (
    *   vhost_id INTEGER NOT NULL PRIMARY KEY,
-   *   vhost_name TEXT NOT NULL
+   *   vhost_name TEXT NOT NULL,
+   *   reclaim_ms INTEGER NOT NULL DEFAULT 0
    * );
+   *
+   * Note: reclaim_ms is the time (in millisecs since the epoch) when the
+   * leases of this vhost were last checked for dead holders.
    */
-  stmt = "CREATE TABLE IF NOT EXISTS proxy_vhosts (vhost_id INTEGER NOT NULL PRIMARY KEY, vhost_name TEXT NOT NULL);";
+  stmt = "CREATE TABLE IF NOT EXISTS proxy_vhosts (vhost_id INTEGER NOT NULL PRIMARY KEY, vhost_name TEXT NOT NULL, reclaim_ms INTEGER NOT NULL DEFAULT 0);";
   res = proxy_db_exec_stmt(p, dbh, stmt, &errstr);
   if (res < 0) {
     (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
@@ -84,27 +109,35 @@ static int reverse_db_add_schema(pool *p, struct proxy_dbh *dbh,
     return -1;
   }
 
-  /* TODO: Add these columns:
-   *  unhealthy BOOLEAN,
-   *  unhealthy_ms BIGINT,
-   *  unhealthy_reason TEXT
-   */
-
   /* CREATE TABLE proxy_vhost_backends (
    *   vhost_id INTEGER NOT NULL,
    *   backend_id INTEGER NOT NULL,
    *   backend_uri TEXT NOT NULL,
    *   conn_count INTEGER NOT NULL,
-   *   connect_ms INTEGER
+   *   connect_ms INTEGER,
+   *   unhealthy BOOLEAN NOT NULL DEFAULT 0,
+   *   unhealthy_ms INTEGER NOT NULL DEFAULT 0,
+   *   xfer_count INTEGER NOT NULL DEFAULT 0,
+   *   xfer_window INTEGER NOT NULL DEFAULT 0,
+   *   xfer_bytes INTEGER NOT NULL DEFAULT 0,
+   *   xfer_prev_bytes INTEGER NOT NULL DEFAULT 0
    * );
    *
+   * Note: unhealthy_ms is the time (in millisecs since the epoch) until
+   * which an unhealthy backend is not selected.
+   *
+   * Note: xfer_count is the number of data transfers in flight; xfer_bytes
+   * are the bytes transferred in the window numbered xfer_window, and
+   * xfer_prev_bytes those transferred in the window before it.  See
+   * proxy_reverse_xfer_rate().
+   *
    * Note: while it might be tempting to have a FOREIGN KEY constraint on
    * vhost_id to the proxy_vhosts.vhost_id column, doing so also means that
    * vhost_id MUST be unique.  And there will be vhosts that have MULTIPLE
    * backend URIs, which would violate that uniqueness constraint.  Thus we
    * create our own separate index on the vhost_id column.
    */
-  stmt = "CREATE TABLE IF NOT EXISTS proxy_vhost_backends (vhost_id INTEGER NOT NULL, backend_id INTEGER NOT NULL, backend_uri TEXT NOT NULL, conn_count INTEGER NOT NULL, connect_ms INTEGER);";
+  stmt = "CREATE TABLE IF NOT EXISTS proxy_vhost_backends (vhost_id INTEGER NOT NULL, backend_id INTEGER NOT NULL, backend_uri TEXT NOT NULL, conn_count INTEGER NOT NULL, connect_ms INTEGER, unhealthy BOOLEAN NOT NULL DEFAULT 0, unhealthy_ms INTEGER NOT NULL DEFAULT 0, xfer_count INTEGER NOT NULL DEFAULT 0, xfer_window INTEGER NOT NULL DEFAULT 0, xfer_bytes INTEGER NOT NULL DEFAULT 0, xfer_prev_bytes INTEGER NOT NULL DEFAULT 0);";
   res = proxy_db_exec_stmt(p, dbh, stmt, &errstr);
   if (res < 0) {
     (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
@@ -123,6 +156,64 @@ static int reverse_db_add_schema(pool *p, struct proxy_dbh *dbh,
     return -1;
   }
 
+  /* CREATE TABLE proxy_vhost_backend_leases (
+   *   vhost_id INTEGER NOT NULL,
+   *   backend_id INTEGER NOT NULL,
+   *   lease TEXT NOT NULL,
+   *   xfers INTEGER NOT NULL DEFAULT 0,
+   *   UNIQUE (vhost_id, backend_id, lease)
+   * );
+   *
+   * Note: there is one row for each session connected to a backend; the
+   * lease is the "pid:start" text of that session process, per
+   * proxy_reverse_lease_text().  The proxy_vhost_backends.conn_count column
+   * is the number of leases for that backend, and its xfer_count column is
+   * the sum of their in-flight transfers.
+   */
+  stmt = "CREATE TABLE IF NOT EXISTS proxy_vhost_backend_leases (vhost_id INTEGER NOT NULL, backend_id INTEGER NOT NULL, lease TEXT NOT NULL, xfers INTEGER NOT NULL DEFAULT 0, UNIQUE (vhost_id, backend_id, lease));";
+  res = proxy_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
+  /* CREATE INDEX proxy_vhost_backend_leases_vhost_id_idx */
+  stmt = "CREATE INDEX IF NOT EXISTS proxy_vhost_backend_leases_vhost_id_idx ON proxy_vhost_backend_leases (vhost_id);";
+  res = proxy_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
+  /* CREATE TABLE proxy_vhost_backend_latency (
+   *   vhost_id INTEGER NOT NULL,
+   *   backend_id INTEGER NOT NULL,
+   *   phase INTEGER NOT NULL,
+   *   ewma_ms REAL NOT NULL DEFAULT 0,
+   *   samples INTEGER NOT NULL DEFAULT 0,
+   *   bucket0 INTEGER NOT NULL DEFAULT 0,
+   *   ...
+   *   bucket7 INTEGER NOT NULL DEFAULT 0,
+   *   UNIQUE (vhost_id, backend_id, phase)
+   * );
+   *
+   * Note: there is one row per backend for each latency phase (connect,
+   * banner, login); the bucket columns are the latency histogram, per
+   * proxy_reverse_latency_bucket().
+   */
+  stmt = "CREATE TABLE IF NOT EXISTS proxy_vhost_backend_latency (vhost_id INTEGER NOT NULL, backend_id INTEGER NOT NULL, phase INTEGER NOT NULL, ewma_ms REAL NOT NULL DEFAULT 0, samples INTEGER NOT NULL DEFAULT 0, bucket0 INTEGER NOT NULL DEFAULT 0, bucket1 INTEGER NOT NULL DEFAULT 0, bucket2 INTEGER NOT NULL DEFAULT 0, bucket3 INTEGER NOT NULL DEFAULT 0, bucket4 INTEGER NOT NULL DEFAULT 0, bucket5 INTEGER NOT NULL DEFAULT 0, bucket6 INTEGER NOT NULL DEFAULT 0, bucket7 INTEGER NOT NULL DEFAULT 0, UNIQUE (vhost_id, backend_id, phase));";
+  res = proxy_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
   /* CREATE TABLE proxy_vhost_reverse_roundrobin (
    *   vhost_id INTEGER NOT NULL,
    *   current_backend_id INTEGER NOT NULL,
@@ -139,6 +230,23 @@ static int reverse_db_add_schema(pool *p, struct proxy_dbh *dbh,
     return -1;
   }
 
+  /* CREATE TABLE proxy_vhost_reverse_weighted (
+   *   vhost_id INTEGER NOT NULL PRIMARY KEY,
+   *   position INTEGER NOT NULL DEFAULT 0
+   * );
+   *
+   * Note: position is the next position to claim in the smooth weighted
+   * round-robin schedule of the vhost, per proxy_reverse_wrr_schedule().
+   */
+  stmt = "CREATE TABLE IF NOT EXISTS proxy_vhost_reverse_weighted (vhost_id INTEGER NOT NULL PRIMARY KEY, position INTEGER NOT NULL DEFAULT 0);";
+  res = proxy_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
   /* CREATE TABLE proxy_vhost_reverse_shuffle (
    *   vhost_id INTEGER NOT NULL,
    *   avail_backend_id INTEGER NOT NULL,
@@ -216,6 +324,9 @@ static int reverse_db_add_schema(pool *p, struct proxy_dbh *dbh,
    *   FOREIGN KEY (vhost_id) REFERENCES proxy_vhosts (vhost_id),
    *   UNIQUE (vhost_id, ip_addr)
    * );
+   *
+   * Note that ip_addr may be an address prefix, e.g. "10.0.0.0/24", per
+   * ProxyReversePerHostPrefix.
    */
   stmt = "CREATE TABLE IF NOT EXISTS proxy_vhost_reverse_per_host (vhost_id INTEGER NOT NULL, ip_addr TEXT NOT NULL, backend_uri TEXT, FOREIGN KEY (vhost_id) REFERENCES proxy_vhosts (vhost_id), UNIQUE (vhost_id, ip_addr));";
   res = proxy_db_exec_stmt(p, dbh, stmt, &errstr);
@@ -261,6 +372,24 @@ static int reverse_db_truncate_tables(pool *p, struct proxy_dbh *dbh) {
     return -1;
   }
 
+  stmt = "DELETE FROM proxy_vhost_backend_leases;";
+  res = proxy_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
+  stmt = "DELETE FROM proxy_vhost_backend_latency;";
+  res = proxy_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
   stmt = "DELETE FROM proxy_vhost_reverse_roundrobin;";
   res = proxy_db_exec_stmt(p, dbh, stmt, &errstr);
   if (res < 0) {
@@ -270,6 +399,15 @@ static int reverse_db_truncate_tables(pool *p, struct proxy_dbh *dbh) {
     return -1;
   }
 
+  stmt = "DELETE FROM proxy_vhost_reverse_weighted;";
+  res = proxy_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
   stmt = "DELETE FROM proxy_vhost_reverse_shuffle;";
   res = proxy_db_exec_stmt(p, dbh, stmt, &errstr);
   if (res < 0) {
@@ -317,6 +455,15 @@ static int reverse_db_truncate_tables(pool *p, struct proxy_dbh *dbh) {
     return -1;
   }
 
+  index_name = "proxy_vhost_backend_leases_vhost_id_idx";
+  res = proxy_db_reindex(p, dbh, index_name, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error reindexing '%s': %s", index_name, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
   index_name = "proxy_vhost_reverse_per_user_name_idx";
   res = proxy_db_reindex(p, dbh, index_name, &errstr);
   if (res < 0) {
@@ -385,6 +532,53 @@ static int reverse_db_add_vhost(pool *p, struct proxy_dbh *dbh, server_rec *s) {
   return 0;
 }
 
+static int reverse_db_add_latency(pool *p, struct proxy_dbh *dbh,
+    unsigned int vhost_id, int backend_id) {
+  register int phase;
+  int res;
+  const char *stmt, *errstr = NULL;
+  array_header *results;
+
+  stmt = "INSERT INTO proxy_vhost_backend_latency (vhost_id, backend_id, phase) VALUES (?, ?, ?);";
+
+  for (phase = PROXY_REVERSE_LATENCY_CONNECT;
+       phase <= PROXY_REVERSE_LATENCY_LOGIN;
+       phase++) {
+    res = proxy_db_prepare_stmt(p, dbh, stmt);
+    if (res < 0) {
+      return -1;
+    }
+
+    res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_INT,
+      (void *) &vhost_id);
+    if (res < 0) {
+      return -1;
+    }
+
+    res = proxy_db_bind_stmt(p, dbh, stmt, 2, PROXY_DB_BIND_TYPE_INT,
+      (void *) &backend_id);
+    if (res < 0) {
+      return -1;
+    }
+
+    res = proxy_db_bind_stmt(p, dbh, stmt, 3, PROXY_DB_BIND_TYPE_INT,
+      (void *) &phase);
+    if (res < 0) {
+      return -1;
+    }
+
+    results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+    if (results == NULL) {
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error executing '%s': %s", stmt, errstr ? errstr : strerror(errno));
+      errno = EPERM;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
 static int reverse_db_add_backend(pool *p, struct proxy_dbh *dbh,
     unsigned int vhost_id, const char *backend_uri, int backend_id) {
   int res;
@@ -427,7 +621,7 @@ static int reverse_db_add_backend(pool *p, struct proxy_dbh *dbh,
     return -1;
   }
 
-  return 0;
+  return reverse_db_add_latency(p, dbh, vhost_id, backend_id);
 }
 
 static int reverse_db_add_backends(pool *p, struct proxy_dbh *dbh,
@@ -459,6 +653,144 @@ static int reverse_db_add_backends(pool *p, struct proxy_dbh *dbh,
   return 0;
 }
 
+/* Backend health */
+
+static array_header *reverse_db_get_unhealthy(pool *p, struct proxy_dbh *dbh,
+    unsigned int vhost_id) {
+  register unsigned int i;
+  int res;
+  const char *stmt, *errstr = NULL;
+  array_header *results, *backend_ids;
+  uint64_t now_ms;
+  long cutoff_ms;
+
+  stmt = "SELECT backend_id FROM proxy_vhost_backends WHERE vhost_id = ? AND unhealthy = 1 AND unhealthy_ms > ?;";
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return NULL;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_INT,
+    (void *) &vhost_id);
+  if (res < 0) {
+    return NULL;
+  }
+
+  pr_gettimeofday_millis(&now_ms);
+  cutoff_ms = (long) now_ms;
+  res = proxy_db_bind_stmt(p, dbh, stmt, 2, PROXY_DB_BIND_TYPE_LONG,
+    (void *) &cutoff_ms);
+  if (res < 0) {
+    return NULL;
+  }
+
+  results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  if (results == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(errno));
+    errno = EPERM;
+    return NULL;
+  }
+
+  backend_ids = make_array(p, results->nelts, sizeof(int));
+  for (i = 0; i < results->nelts; i++) {
+    *((int *) push_array(backend_ids)) = atoi(((char **) results->elts)[i]);
+  }
+
+  return backend_ids;
+}
+
+static int reverse_db_backend_usable(array_header *unhealthy, int backend_id) {
+  register unsigned int i;
+
+  if (unhealthy == NULL) {
+    return TRUE;
+  }
+
+  for (i = 0; i < unhealthy->nelts; i++) {
+    if (((int *) unhealthy->elts)[i] == backend_id) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Returns the first usable backend ID, starting from the given ID and
+ * wrapping around; if no backends are usable, the given ID is returned.
+ */
+static int reverse_db_next_usable(array_header *unhealthy, int backend_id,
+    int nelts) {
+  register int i;
+
+  for (i = 0; i < nelts; i++) {
+    int idx;
+
+    idx = (backend_id + i) % nelts;
+    if (reverse_db_backend_usable(unhealthy, idx) == TRUE) {
+      if (idx != backend_id) {
+        pr_trace_msg(trace_channel, 15,
+          "skipping unhealthy backend ID %d for backend ID %d", backend_id,
+          idx);
+      }
+
+      return idx;
+    }
+  }
+
+  return backend_id;
+}
+
+static int reverse_db_health_update(pool *p, struct proxy_dbh *dbh,
+    unsigned int vhost_id, int backend_id, uint64_t unhealthy_until_ms) {
+  int res, unhealthy;
+  long unhealthy_ms;
+  const char *stmt, *errstr = NULL;
+  array_header *results;
+
+  stmt = "UPDATE proxy_vhost_backends SET unhealthy = ?, unhealthy_ms = ? WHERE vhost_id = ? AND backend_id = ?;";
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return -1;
+  }
+
+  unhealthy = (unhealthy_until_ms > 0 ? 1 : 0);
+  res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_INT,
+    (void *) &unhealthy);
+  if (res < 0) {
+    return -1;
+  }
+
+  unhealthy_ms = (long) unhealthy_until_ms;
+  res = proxy_db_bind_stmt(p, dbh, stmt, 2, PROXY_DB_BIND_TYPE_LONG,
+    (void *) &unhealthy_ms);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 3, PROXY_DB_BIND_TYPE_INT,
+    (void *) &vhost_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 4, PROXY_DB_BIND_TYPE_INT,
+    (void *) &backend_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  if (results == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(errno));
+    errno = EPERM;
+    return -1;
+  }
+
+  return 0;
+}
+
 /* ProxyReverseConnectPolicy: Shuffle */
 
 static int reverse_db_add_shuffle(pool *p, struct proxy_dbh *dbh,
@@ -518,7 +850,7 @@ static int reverse_db_shuffle_init(pool *p, struct proxy_dbh *dbh,
 }
 
 static int reverse_db_shuffle_next(pool *p, struct proxy_dbh *dbh,
-    unsigned int vhost_id) {
+    unsigned int vhost_id, array_header *unhealthy) {
   int backend_id = -1, res;
   const char *stmt, *errstr = NULL;
   array_header *results;
@@ -563,7 +895,7 @@ static int reverse_db_shuffle_next(pool *p, struct proxy_dbh *dbh,
   }
 
   backend_id = (int) proxy_random_next(0, nrows-1);
-  return backend_id;
+  return reverse_db_next_usable(unhealthy, backend_id, db_backends->nelts);
 }
 
 static int reverse_db_shuffle_used(pool *p, struct proxy_dbh *dbh,
@@ -678,7 +1010,7 @@ static int reverse_db_roundrobin_init(pool *p, struct proxy_dbh *dbh,
 }
 
 static int reverse_db_roundrobin_next(pool *p, struct proxy_dbh *dbh,
-    unsigned int vhost_id) {
+    unsigned int vhost_id, array_header *unhealthy) {
   int backend_id = 0, res;
   const char *stmt, *errstr = NULL;
   array_header *results;
@@ -721,7 +1053,7 @@ static int reverse_db_roundrobin_next(pool *p, struct proxy_dbh *dbh,
     backend_id++;
   }
 
-  return backend_id;
+  return reverse_db_next_usable(unhealthy, backend_id, db_backends->nelts);
 }
 
 static int reverse_db_roundrobin_used(pool *p, struct proxy_dbh *dbh,
@@ -729,15 +1061,36 @@ static int reverse_db_roundrobin_used(pool *p, struct proxy_dbh *dbh,
   return reverse_db_roundrobin_update(p, dbh, vhost_id, backend_id);
 }
 
-/* ProxyReverseConnectPolicy: LeastConns */
+/* ProxyReverseConnectPolicy: WeightedRandom */
 
-static int reverse_db_leastconns_next(pool *p, struct proxy_dbh *dbh,
+static int reverse_db_weightedrandom_next(pool *p, array_header *backends,
+    array_header *unhealthy) {
+  register unsigned int i;
+  int *usable;
+
+  if (backends == NULL ||
+      backends->nelts == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  usable = palloc(p, backends->nelts * sizeof(int));
+  for (i = 0; i < backends->nelts; i++) {
+    usable[i] = reverse_db_backend_usable(unhealthy, i);
+  }
+
+  return proxy_reverse_weighted_random(backends, usable);
+}
+
+/* ProxyReverseConnectPolicy: WeightedRoundRobin */
+
+static int reverse_db_wrr_init(pool *p, struct proxy_dbh *dbh,
     unsigned int vhost_id) {
-  int backend_id = 0, res;
+  int res;
   const char *stmt, *errstr = NULL;
   array_header *results;
 
-  stmt = "SELECT backend_id FROM proxy_vhost_backends WHERE vhost_id = ? ORDER BY conn_count ASC LIMIT 1;";
+  stmt = "INSERT INTO proxy_vhost_reverse_weighted (vhost_id, position) VALUES (?, 0);";
   res = proxy_db_prepare_stmt(p, dbh, stmt);
   if (res < 0) {
     return -1;
@@ -757,43 +1110,126 @@ static int reverse_db_leastconns_next(pool *p, struct proxy_dbh *dbh,
     return -1;
   }
 
-  if (results->nelts == 0) {
-    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-      "expected results from statement '%s', got %d", stmt,
-      results->nelts);
-    errno = EINVAL;
-    return -1;
-  }
-
-  /* Just pick the first index/backend returned. */
-  backend_id = atoi(((char **) results->elts)[0]);
-  return backend_id;
-}
-
-static int reverse_db_leastconns_used(pool *p, struct proxy_dbh *dbh,
-    unsigned int vhost_id, int backend_id) {
-  /* TODO: anything to do here? */
   return 0;
 }
 
-/* ProxyReverseConnectPolicy: LeastResponseTime */
-
-/* Note: "least response time" is determined by calculating the following
- * for each backend server:
- *
- *  N = connection count * connect time (ms)
- *
- * and choosing the backend with the lowest value for N.  If there are no
- * backend servers with connect time values, choose the one with the lowest
- * connection count.
- */
-static int reverse_db_leastresponsetime_next(pool *p, struct proxy_dbh *dbh,
+/* Claims the next position in the schedule, returning its previous value. */
+static long reverse_db_wrr_claim(pool *p, struct proxy_dbh *dbh,
     unsigned int vhost_id) {
-  int backend_id = 0, res;
+  int res;
+  long position;
+  const char *stmt, *errstr = NULL;
+  array_header *results;
+
+  if (proxy_db_begin(p, dbh) < 0) {
+    return -1;
+  }
+
+  stmt = "UPDATE proxy_vhost_reverse_weighted SET position = position + 1 WHERE vhost_id = ?;";
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    (void) proxy_db_rollback(p, dbh);
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_INT,
+    (void *) &vhost_id);
+  if (res < 0) {
+    (void) proxy_db_rollback(p, dbh);
+    return -1;
+  }
+
+  results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  if (results == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(errno));
+    (void) proxy_db_rollback(p, dbh);
+    errno = EPERM;
+    return -1;
+  }
+
+  stmt = "SELECT position FROM proxy_vhost_reverse_weighted WHERE vhost_id = ?;";
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    (void) proxy_db_rollback(p, dbh);
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_INT,
+    (void *) &vhost_id);
+  if (res < 0) {
+    (void) proxy_db_rollback(p, dbh);
+    return -1;
+  }
+
+  results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  if (results == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(errno));
+    (void) proxy_db_rollback(p, dbh);
+    errno = EPERM;
+    return -1;
+  }
+
+  if (results->nelts != 1) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "expected 1 result from statement '%s', got %d", stmt,
+      results->nelts);
+    (void) proxy_db_rollback(p, dbh);
+    errno = EINVAL;
+    return -1;
+  }
+
+  position = atol(((char **) results->elts)[0]) - 1;
+
+  if (proxy_db_commit(p, dbh) < 0) {
+    int xerrno = errno;
+
+    (void) proxy_db_rollback(p, dbh);
+    errno = xerrno;
+    return -1;
+  }
+
+  return position;
+}
+
+static int reverse_db_wrr_next(pool *p, struct proxy_dbh *dbh,
+    unsigned int vhost_id, array_header *backends, array_header *unhealthy) {
+  long position;
+  int backend_id;
+  array_header *schedule;
+
+  schedule = proxy_reverse_wrr_get_schedule(backends);
+  if (schedule == NULL) {
+    return -1;
+  }
+
+  position = reverse_db_wrr_claim(p, dbh, vhost_id);
+  if (position < 0) {
+    return -1;
+  }
+
+  backend_id = ((int *) schedule->elts)[position % schedule->nelts];
+  if (reverse_db_backend_usable(unhealthy, backend_id) == TRUE) {
+    return backend_id;
+  }
+
+  /* The turn of an unhealthy backend goes to a healthy one, in proportion to
+   * their weights; see proxy_reverse_wrr_get_schedule().
+   */
+  return reverse_db_weightedrandom_next(p, backends, unhealthy);
+}
+
+/* ProxyReverseConnectPolicy: LeastConns */
+
+static int reverse_db_leastconns_next(pool *p, struct proxy_dbh *dbh,
+    unsigned int vhost_id, array_header *unhealthy) {
+  register unsigned int i;
+  int backend_id = 0, res;
   const char *stmt, *errstr = NULL;
   array_header *results;
 
-  stmt = "SELECT backend_id FROM proxy_vhost_backends WHERE vhost_id = ? ORDER BY (conn_count * connect_ms) ASC LIMIT 1;";
+  stmt = "SELECT backend_id FROM proxy_vhost_backends WHERE vhost_id = ? ORDER BY conn_count ASC;";
   res = proxy_db_prepare_stmt(p, dbh, stmt);
   if (res < 0) {
     return -1;
@@ -821,17 +1257,175 @@ static int reverse_db_leastresponsetime_next(pool *p, struct proxy_dbh *dbh,
     return -1;
   }
 
-  /* Just pick the first index/backend returned. */
+  /* Pick the first usable index/backend returned, if any. */
   backend_id = atoi(((char **) results->elts)[0]);
+  for (i = 0; i < results->nelts; i++) {
+    int idx;
+
+    idx = atoi(((char **) results->elts)[i]);
+    if (reverse_db_backend_usable(unhealthy, idx) == TRUE) {
+      backend_id = idx;
+      break;
+    }
+  }
+
   return backend_id;
 }
 
+static int reverse_db_leastconns_used(pool *p, struct proxy_dbh *dbh,
+    unsigned int vhost_id, int backend_id) {
+  /* TODO: anything to do here? */
+  return 0;
+}
+
+/* ProxyReverseConnectPolicy: LeastResponseTime */
+
+/* Note: "least response time" is determined by the power of two choices over
+ * each backend server's connection count and latency averages; see
+ * proxy_reverse_latency_choose().  Backend servers without any latency
+ * samples yet are preferred, so that they are measured.
+ */
+static int reverse_db_leastresponsetime_next(pool *p, struct proxy_dbh *dbh,
+    unsigned int vhost_id, array_header *unhealthy) {
+  register unsigned int i;
+  int idx, res;
+  unsigned int nrows;
+  const char *stmt, *errstr = NULL;
+  array_header *results;
+  struct proxy_reverse_backend_load *loads;
+
+  stmt = "SELECT b.backend_id, b.conn_count, COALESCE(SUM(l.ewma_ms), 0) FROM proxy_vhost_backends b LEFT JOIN proxy_vhost_backend_latency l ON l.vhost_id = b.vhost_id AND l.backend_id = b.backend_id AND l.samples > 0 WHERE b.vhost_id = ? GROUP BY b.backend_id;";
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_INT,
+    (void *) &vhost_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  if (results == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(errno));
+    errno = EPERM;
+    return -1;
+  }
+
+  nrows = results->nelts / 3;
+  if (nrows == 0) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "expected results from statement '%s', got %d", stmt,
+      results->nelts);
+    errno = EINVAL;
+    return -1;
+  }
+
+  loads = pcalloc(p, nrows * sizeof(struct proxy_reverse_backend_load));
+  for (i = 0; i < nrows; i++) {
+    char **row;
+
+    row = ((char **) results->elts) + (i * 3);
+    loads[i].backend_id = atoi(row[0]);
+    loads[i].conn_count = atol(row[1]);
+    loads[i].latency_ms = row[2] != NULL ? atof(row[2]) : 0.0;
+    loads[i].usable = reverse_db_backend_usable(unhealthy,
+      loads[i].backend_id);
+  }
+
+  idx = proxy_reverse_latency_choose(loads, nrows);
+  if (idx < 0) {
+    return -1;
+  }
+
+  return loads[idx].backend_id;
+}
+
 static int reverse_db_leastresponsetime_used(pool *p, struct proxy_dbh *dbh,
     unsigned int vhost_id, int backend_id) {
   /* TODO: anything to do here? */
   return 0;
 }
 
+/* ProxyReverseConnectPolicy: LeastTransfers */
+
+/* Note: the transfer counts are kept per lease, so that the transfers of
+ * dead sessions are reclaimed along with their leases; the transfer rates are
+ * estimated from the bytes counted in the current and previous windows.  See
+ * proxy_reverse_xfer_choose().
+ */
+static int reverse_db_leasttransfers_next(pool *p, struct proxy_dbh *dbh,
+    unsigned int vhost_id, array_header *unhealthy) {
+  register unsigned int i;
+  int idx, res;
+  unsigned int nrows;
+  uint64_t now_ms;
+  const char *stmt, *errstr = NULL;
+  array_header *results;
+  struct proxy_reverse_backend_xfers *xfers;
+
+  stmt = "SELECT backend_id, conn_count, xfer_count, xfer_window, xfer_bytes, xfer_prev_bytes FROM proxy_vhost_backends WHERE vhost_id = ?;";
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_INT,
+    (void *) &vhost_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  if (results == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(errno));
+    errno = EPERM;
+    return -1;
+  }
+
+  nrows = results->nelts / 6;
+  if (nrows == 0) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "expected results from statement '%s', got %d", stmt,
+      results->nelts);
+    errno = EINVAL;
+    return -1;
+  }
+
+  pr_gettimeofday_millis(&now_ms);
+
+  xfers = pcalloc(p, nrows * sizeof(struct proxy_reverse_backend_xfers));
+  for (i = 0; i < nrows; i++) {
+    char **row;
+
+    row = ((char **) results->elts) + (i * 6);
+    xfers[i].backend_id = atoi(row[0]);
+    xfers[i].conn_count = atol(row[1]);
+    xfers[i].xfer_count = atol(row[2]);
+    xfers[i].xfer_rate = proxy_reverse_xfer_rate(now_ms,
+      strtoull(row[3], NULL, 10), strtoull(row[4], NULL, 10),
+      strtoull(row[5], NULL, 10));
+    xfers[i].usable = reverse_db_backend_usable(unhealthy,
+      xfers[i].backend_id);
+  }
+
+  idx = proxy_reverse_xfer_choose(xfers, nrows);
+  if (idx < 0) {
+    return -1;
+  }
+
+  return xfers[idx].backend_id;
+}
+
+static int reverse_db_leasttransfers_used(pool *p, struct proxy_dbh *dbh,
+    unsigned int vhost_id, int backend_id) {
+  /* TODO: anything to do here? */
+  return 0;
+}
+
 /* ProxyReverseConnectPolicy: PerUser */
 
 static array_header *reverse_db_peruser_get(pool *p, struct proxy_dbh *dbh,
@@ -1229,9 +1823,9 @@ static int reverse_db_pergroup_used(pool *p, struct proxy_dbh *dbh,
 /* ProxyReverseConnectPolicy: PerHost */
 
 static array_header *reverse_db_perhost_get(pool *p, struct proxy_dbh *dbh,
-    unsigned int vhost_id, const pr_netaddr_t *addr) {
+    unsigned int vhost_id, const char *host) {
   int res;
-  const char *stmt, *errstr = NULL, *ip;
+  const char *stmt, *errstr = NULL;
   array_header *results;
 
   stmt = "SELECT backend_uri FROM proxy_vhost_reverse_per_host WHERE vhost_id = ? AND ip_addr = ?;";
@@ -1246,9 +1840,8 @@ static array_header *reverse_db_perhost_get(pool *p, struct proxy_dbh *dbh,
     return NULL;
   }
 
-  ip = pr_netaddr_get_ipstr(addr);
   res = proxy_db_bind_stmt(p, dbh, stmt, 2, PROXY_DB_BIND_TYPE_TEXT,
-    (void *) ip);
+    (void *) host);
   if (res < 0) {
     return NULL;
   }
@@ -1266,26 +1859,25 @@ static array_header *reverse_db_perhost_get(pool *p, struct proxy_dbh *dbh,
 
 static const struct proxy_conn *reverse_db_perhost_init(pool *p,
     struct proxy_dbh *dbh, unsigned int vhost_id, array_header *backends,
-    const pr_netaddr_t *addr) {
+    const char *host) {
   const struct proxy_conn *pconn = NULL;
   struct proxy_conn **conns;
   int res;
-  const char *ip, *stmt, *uri, *errstr = NULL;
+  const char *stmt, *uri, *errstr = NULL;
   array_header *results;
 
-  ip = pr_netaddr_get_ipstr(addr);
   conns = backends->elts;
 
   if (backends->nelts == 1) {
     pconn = conns[0];
 
   } else {
-    size_t iplen;
+    size_t hostlen;
     unsigned int h;
     int idx;
 
-    iplen = strlen(ip);
-    h = str2hash(ip, iplen);
+    hostlen = strlen(host);
+    h = str2hash(host, hostlen);
     idx = h % backends->nelts;
 
     pconn = conns[idx];
@@ -1304,7 +1896,7 @@ static const struct proxy_conn *reverse_db_perhost_init(pool *p,
   }
 
   res = proxy_db_bind_stmt(p, dbh, stmt, 2, PROXY_DB_BIND_TYPE_TEXT,
-    (void *) ip);
+    (void *) host);
   if (res < 0) {
     return NULL;
   }
@@ -1328,11 +1920,11 @@ static const struct proxy_conn *reverse_db_perhost_init(pool *p,
 }
 
 static const struct proxy_conn *reverse_db_perhost_next(pool *p,
-    struct proxy_dbh *dbh, unsigned int vhost_id, const pr_netaddr_t *addr) {
+    struct proxy_dbh *dbh, unsigned int vhost_id, const char *host) {
   array_header *results;
   const struct proxy_conn *pconn = NULL;
 
-  results = reverse_db_perhost_get(p, dbh, vhost_id, addr);
+  results = reverse_db_perhost_get(p, dbh, vhost_id, host);
   if (results == NULL) {
     return NULL;
   }
@@ -1342,11 +1934,11 @@ static const struct proxy_conn *reverse_db_perhost_next(pool *p,
      * of the backends for this host, and try again.
      */
  
-    pconn = reverse_db_perhost_init(p, dbh, vhost_id, db_backends, addr);
+    pconn = reverse_db_perhost_init(p, dbh, vhost_id, db_backends, host);
     if (pconn == NULL) {
       (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
         "error preparing database for ProxyReverseConnectPolicy "
-        "PerHost for host '%s': %s", pr_netaddr_get_ipstr(addr),
+        "PerHost for host '%s': %s", host,
         strerror(errno));
       errno = EPERM;
       return NULL;
@@ -1428,14 +2020,28 @@ static int reverse_db_policy_init(pool *p, void *dbh, int policy_id,
 
   switch (policy_id) {
     case PROXY_REVERSE_CONNECT_POLICY_RANDOM:
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_RANDOM:
     case PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS:
     case PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME:
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS:
     case PROXY_REVERSE_CONNECT_POLICY_PER_USER:
     case PROXY_REVERSE_CONNECT_POLICY_PER_HOST:
       /* No preparation needed at this time. */
       res = 0;
       break;
 
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_ROUND_ROBIN:
+      res = reverse_db_wrr_init(p, dbh, vhost_id);
+      if (res < 0) {
+        xerrno = errno;
+        pr_log_debug(DEBUG3, MOD_PROXY_VERSION
+          ": error preparing database for ProxyReverseConnectPolicy "
+          "WeightedRoundRobin: %s", strerror(xerrno));
+
+        errno = xerrno;
+      }
+      break;
+
     case PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN: {
       int backend_id = 0; 
 
@@ -1499,7 +2105,23 @@ static const struct proxy_conn *reverse_db_policy_next_backend(pool *p,
   const struct proxy_conn *pconn = NULL;
   struct proxy_conn **conns = NULL;
   int idx = -1, nelts = 0;
+  array_header *backends, *unhealthy = NULL;
 
+  /* Make sure that we read our own pending updates. */
+  (void) reverse_db_flush(p, dbh);
+
+  if (proxy_reverse_policy_is_sticky(policy_id) != TRUE) {
+    /* Note that the selection can proceed even if the leases could not be
+     * reclaimed; the counts are then just somewhat stale.
+     */
+    if (reverse_db_reclaim_leases(p, dbh, vhost_id) < 0) {
+      pr_trace_msg(trace_channel, 3,
+        "error reclaiming leases for vhost ID %u: %s", vhost_id,
+        strerror(errno));
+    }
+  }
+
+  backends = db_backends;
   if (db_backends != NULL) {
     conns = db_backends->elts;
     nelts = db_backends->nelts;
@@ -1509,15 +2131,22 @@ static const struct proxy_conn *reverse_db_policy_next_backend(pool *p,
     if (conns == NULL &&
         default_backends != NULL &&
         db_backends == NULL) {
+      backends = default_backends;
       conns = default_backends->elts;
       nelts = default_backends->nelts;
     }
+
+    /* Note that if we cannot determine the unhealthy backends, we proceed
+     * as if they were all healthy.
+     */
+    unhealthy = reverse_db_get_unhealthy(p, dbh, vhost_id);
   }
 
   switch (policy_id) {
     case PROXY_REVERSE_CONNECT_POLICY_RANDOM:
       idx = (int) proxy_random_next(0, nelts-1);
       if (idx >= 0) {
+        idx = reverse_db_next_usable(unhealthy, idx, nelts);
         pr_trace_msg(trace_channel, 11, "%s policy: selected index %d of %u",
           proxy_reverse_policy_name(policy_id), idx, nelts-1);
         pconn = conns[idx];
@@ -1525,7 +2154,7 @@ static const struct proxy_conn *reverse_db_policy_next_backend(pool *p,
       break;
 
     case PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN:
-      idx = reverse_db_roundrobin_next(p, dbh, vhost_id);
+      idx = reverse_db_roundrobin_next(p, dbh, vhost_id, unhealthy);
       if (idx >= 0) {
         pr_trace_msg(trace_channel, 11, "%s policy: selected index %d of %u",
           proxy_reverse_policy_name(policy_id), idx, nelts-1);
@@ -1534,7 +2163,25 @@ static const struct proxy_conn *reverse_db_policy_next_backend(pool *p,
       break;
 
     case PROXY_REVERSE_CONNECT_POLICY_SHUFFLE:
-      idx = reverse_db_shuffle_next(p, dbh, vhost_id);
+      idx = reverse_db_shuffle_next(p, dbh, vhost_id, unhealthy);
+      if (idx >= 0) {
+        pr_trace_msg(trace_channel, 11, "%s policy: selected index %d of %u",
+          proxy_reverse_policy_name(policy_id), idx, nelts-1);
+        pconn = conns[idx];
+      }
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_ROUND_ROBIN:
+      idx = reverse_db_wrr_next(p, dbh, vhost_id, backends, unhealthy);
+      if (idx >= 0) {
+        pr_trace_msg(trace_channel, 11, "%s policy: selected index %d of %u",
+          proxy_reverse_policy_name(policy_id), idx, nelts-1);
+        pconn = conns[idx];
+      }
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_RANDOM:
+      idx = reverse_db_weightedrandom_next(p, backends, unhealthy);
       if (idx >= 0) {
         pr_trace_msg(trace_channel, 11, "%s policy: selected index %d of %u",
           proxy_reverse_policy_name(policy_id), idx, nelts-1);
@@ -1543,7 +2190,7 @@ static const struct proxy_conn *reverse_db_policy_next_backend(pool *p,
       break;
 
     case PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS:
-      idx = reverse_db_leastconns_next(p, dbh, vhost_id);
+      idx = reverse_db_leastconns_next(p, dbh, vhost_id, unhealthy);
       if (idx >= 0) {
         pr_trace_msg(trace_channel, 11, "%s policy: selected index %d of %u",
           proxy_reverse_policy_name(policy_id), idx, nelts-1);
@@ -1552,7 +2199,16 @@ static const struct proxy_conn *reverse_db_policy_next_backend(pool *p,
       break;
 
     case PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME:
-      idx = reverse_db_leastresponsetime_next(p, dbh, vhost_id);
+      idx = reverse_db_leastresponsetime_next(p, dbh, vhost_id, unhealthy);
+      if (idx >= 0) {
+        pr_trace_msg(trace_channel, 11, "%s policy: selected index %d of %u",
+          proxy_reverse_policy_name(policy_id), idx, nelts-1);
+        pconn = conns[idx];
+      }
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS:
+      idx = reverse_db_leasttransfers_next(p, dbh, vhost_id, unhealthy);
       if (idx >= 0) {
         pr_trace_msg(trace_channel, 11, "%s policy: selected index %d of %u",
           proxy_reverse_policy_name(policy_id), idx, nelts-1);
@@ -1580,15 +2236,26 @@ static const struct proxy_conn *reverse_db_policy_next_backend(pool *p,
       }
       break;
 
-    case PROXY_REVERSE_CONNECT_POLICY_PER_HOST:
-      pconn = reverse_db_perhost_next(p, dbh, vhost_id, session.c->remote_addr);
+    case PROXY_REVERSE_CONNECT_POLICY_PER_HOST: {
+      const char *host;
+
+      /* The host may be given as an address prefix, per
+       * ProxyReversePerHostPrefix.
+       */
+      host = policy_data;
+      if (host == NULL) {
+        host = pr_netaddr_get_ipstr(session.c->remote_addr);
+      }
+
+      pconn = reverse_db_perhost_next(p, dbh, vhost_id, host);
       if (pconn != NULL) {
         pr_trace_msg(trace_channel, 11,
           "%s policy: selected backend '%.100s' for host '%s'",
           proxy_reverse_policy_name(policy_id), proxy_conn_get_uri(pconn),
-          pr_netaddr_get_ipstr(session.c->remote_addr));
+          host);
       }
       break;
+    }
  
     default:
       errno = ENOSYS;
@@ -1602,72 +2269,690 @@ static const struct proxy_conn *reverse_db_policy_next_backend(pool *p,
   return pconn;
 }
 
-static int reverse_db_policy_update_backend(pool *p, void *dbh, int policy_id,
-    unsigned vhost_id, int backend_id, int conn_incr, long connect_ms) {
-  /* Increment the conn count for this backend ID. */
-  int res, idx = 1;
+/* Recomputes the conn count, and the transfer count, of the given backend
+ * from its leases.
+ */
+static int reverse_db_count_leases(pool *p, void *dbh, unsigned int vhost_id,
+    int backend_id) {
+  int res;
   const char *stmt, *errstr = NULL;
   array_header *results;
 
-  /* If our ReverseConnectPolicy is one of PerUser, PerGroup, or PerHost,
-   * we can skip this step: those policies do not use the connection count/time.
-   * This also helps avoid database contention under load for these policies.
-   */
-  if (proxy_reverse_policy_is_sticky(policy_id) == TRUE) {
-    pr_trace_msg(trace_channel, 17,
-      "sticky policy %s does not require updates, skipping",
-      proxy_reverse_policy_name(policy_id));
-
-    return 0;
-  }
-
-  /* TODO: Right now, we simply overwrite/track the very latest connect ms.
-   * But this could unfairly skew policies such as LeastResponseTime, as when
-   * the server in question had higher latency for that particular connection,
-   * due to e.g. OCSP response cache expiration.
-   *
-   * Another way would to be average the given connect ms with the previous
-   * one (if present), and store that.  Something to ponder for the future.
-   */
-
-  if (connect_ms > 0) {
-    stmt = "UPDATE proxy_vhost_backends SET conn_count = conn_count + ?, connect_ms = ? WHERE vhost_id = ? AND backend_id = ?;";
-  } else {
-    stmt = "UPDATE proxy_vhost_backends SET conn_count = conn_count + ? WHERE vhost_id = ? AND backend_id = ?;";
+  stmt = "UPDATE proxy_vhost_backends SET conn_count = (SELECT COUNT(*) FROM proxy_vhost_backend_leases WHERE vhost_id = ?1 AND backend_id = ?2), xfer_count = (SELECT COALESCE(SUM(xfers), 0) FROM proxy_vhost_backend_leases WHERE vhost_id = ?1 AND backend_id = ?2) WHERE vhost_id = ?1 AND backend_id = ?2;";
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return -1;
   }
 
-  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_INT,
+    (void *) &vhost_id);
   if (res < 0) {
     return -1;
   }
 
-  res = proxy_db_bind_stmt(p, dbh, stmt, idx, PROXY_DB_BIND_TYPE_INT,
-    (void *) &conn_incr);
+  res = proxy_db_bind_stmt(p, dbh, stmt, 2, PROXY_DB_BIND_TYPE_INT,
+    (void *) &backend_id);
   if (res < 0) {
     return -1;
   }
 
-  idx++;
+  results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  if (results == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(errno));
+    errno = EPERM;
+    return -1;
+  }
 
-  if (connect_ms > 0) {
-    res = proxy_db_bind_stmt(p, dbh, stmt, idx, PROXY_DB_BIND_TYPE_LONG,
-      (void *) &connect_ms);
+  return 0;
+}
+
+/* Adds (for a positive conn_incr) or removes (for a negative conn_incr) the
+ * given lease for the given backend.
+ */
+static int reverse_db_update_lease(pool *p, void *dbh, unsigned int vhost_id,
+    int backend_id, int conn_incr, const char *lease) {
+  int res;
+  const char *stmt, *errstr = NULL;
+  array_header *results;
+
+  if (conn_incr > 0) {
+    stmt = "INSERT OR IGNORE INTO proxy_vhost_backend_leases (vhost_id, backend_id, lease) VALUES (?, ?, ?);";
+
+  } else {
+    stmt = "DELETE FROM proxy_vhost_backend_leases WHERE vhost_id = ? AND backend_id = ? AND lease = ?;";
+  }
+
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_INT,
+    (void *) &vhost_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 2, PROXY_DB_BIND_TYPE_INT,
+    (void *) &backend_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 3, PROXY_DB_BIND_TYPE_TEXT,
+    (void *) lease);
+  if (res < 0) {
+    return -1;
+  }
+
+  results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  if (results == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(errno));
+    errno = EPERM;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int reverse_db_exec_update(pool *p, void *dbh, unsigned vhost_id,
+    int backend_id, int conn_incr, long connect_ms) {
+  int res;
+  const char *stmt, *errstr = NULL;
+  array_header *results;
+
+  /* Rather than incrementing/decrementing the conn count for this backend
+   * ID, we take or release our lease, and count the leases; thus a repeated,
+   * or lost, update does not skew the count.
+   */
+  if (conn_incr != 0) {
+    struct proxy_reverse_lease lease;
+    const char *lease_text;
+
+    (void) proxy_reverse_lease_get(&lease);
+    lease_text = proxy_reverse_lease_text(p, &lease);
+
+    res = reverse_db_update_lease(p, dbh, vhost_id, backend_id, conn_incr,
+      lease_text);
+    if (res < 0) {
+      return -1;
+    }
+
+    res = reverse_db_count_leases(p, dbh, vhost_id, backend_id);
+    if (res < 0) {
+      return -1;
+    }
+  }
+
+  /* Note that connect_ms only records the very latest connect time; the
+   * LeastResponseTime policy uses the latency averages instead, which are
+   * recorded via reverse_db_policy_latency_backend().
+   */
+  if (connect_ms <= 0) {
+    return 0;
+  }
+
+  /* A successful connection also means that the backend is healthy. */
+  stmt = "UPDATE proxy_vhost_backends SET connect_ms = ?, unhealthy = 0 WHERE vhost_id = ? AND backend_id = ?;";
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_LONG,
+    (void *) &connect_ms);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 2, PROXY_DB_BIND_TYPE_INT,
+    (void *) &vhost_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 3, PROXY_DB_BIND_TYPE_INT,
+    (void *) &backend_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  if (results == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(errno));
+    errno = EPERM;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Lease reclamation.  At most once per interval, one session checks the
+ * leases of its vhost, and removes those whose holders are no longer
+ * running, e.g. sessions which crashed before releasing their leases.  The
+ * session which gets to do this is the one which first moves the reclaim_ms
+ * of the vhost forward, within its transaction.
+ */
+static int reverse_db_reclaim_due(pool *p, void *dbh, unsigned int vhost_id,
+    long due) {
+  int res;
+  const char *stmt, *errstr = NULL;
+  array_header *results;
+
+  stmt = "SELECT reclaim_ms FROM proxy_vhosts WHERE vhost_id = ?;";
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_INT,
+    (void *) &vhost_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  if (results == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(errno));
+    errno = EPERM;
+    return -1;
+  }
+
+  if (results->nelts != 1 ||
+      ((char **) results->elts)[0] == NULL ||
+      atol(((char **) results->elts)[0]) > due) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static int reverse_db_reclaim_leases(pool *p, void *dbh,
+    unsigned int vhost_id) {
+  register unsigned int i;
+  int res, reclaimed = 0;
+  uint64_t now_ms = 0;
+  long now, due;
+  const char *stmt, *errstr = NULL;
+  array_header *results, *backend_ids;
+
+  pr_gettimeofday_millis(&now_ms);
+  now = (long) now_ms;
+  due = now - PROXY_REVERSE_LEASE_RECLAIM_INTERVAL_MS;
+
+  /* Check first, without taking the write lock, as it is rarely due. */
+  res = reverse_db_reclaim_due(p, dbh, vhost_id, due);
+  if (res != TRUE) {
+    return res;
+  }
+
+  if (proxy_db_begin(p, dbh) < 0) {
+    return -1;
+  }
+
+  /* And check again, now that no other session can claim it. */
+  res = reverse_db_reclaim_due(p, dbh, vhost_id, due);
+  if (res != TRUE) {
+    (void) proxy_db_commit(p, dbh);
+    return res;
+  }
+
+  stmt = "UPDATE proxy_vhosts SET reclaim_ms = ? WHERE vhost_id = ?;";
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    (void) proxy_db_rollback(p, dbh);
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_LONG,
+    (void *) &now);
+  if (res < 0) {
+    (void) proxy_db_rollback(p, dbh);
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 2, PROXY_DB_BIND_TYPE_INT,
+    (void *) &vhost_id);
+  if (res < 0) {
+    (void) proxy_db_rollback(p, dbh);
+    return -1;
+  }
+
+  results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  if (results == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(errno));
+    (void) proxy_db_rollback(p, dbh);
+    errno = EPERM;
+    return -1;
+  }
+
+  stmt = "SELECT backend_id, lease FROM proxy_vhost_backend_leases WHERE vhost_id = ?;";
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    (void) proxy_db_rollback(p, dbh);
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_INT,
+    (void *) &vhost_id);
+  if (res < 0) {
+    (void) proxy_db_rollback(p, dbh);
+    return -1;
+  }
+
+  results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  if (results == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(errno));
+    (void) proxy_db_rollback(p, dbh);
+    errno = EPERM;
+    return -1;
+  }
+
+  backend_ids = make_array(p, 0, sizeof(int));
+
+  for (i = 0; i+1 < results->nelts; i += 2) {
+    register unsigned int j;
+    int backend_id, seen = FALSE;
+    char **row;
+    struct proxy_reverse_lease lease;
+
+    pr_signals_handle();
+
+    row = ((char **) results->elts) + i;
+    if (row[0] == NULL ||
+        row[1] == NULL) {
+      continue;
+    }
+
+    backend_id = atoi(row[0]);
+
+    /* Remove unparseable leases as well. */
+    if (proxy_reverse_lease_parse(row[1], &lease) == 0 &&
+        proxy_reverse_lease_is_live(&lease) == TRUE) {
+      continue;
+    }
+
+    pr_trace_msg(trace_channel, 9,
+      "reclaiming lease '%s' of dead session for vhost ID %u, backend ID %d",
+      row[1], vhost_id, backend_id);
+
+    res = reverse_db_update_lease(p, dbh, vhost_id, backend_id, -1, row[1]);
     if (res < 0) {
+      (void) proxy_db_rollback(p, dbh);
       return -1;
     }
 
-    idx++;
+    reclaimed++;
+
+    for (j = 0; j < backend_ids->nelts; j++) {
+      if (((int *) backend_ids->elts)[j] == backend_id) {
+        seen = TRUE;
+        break;
+      }
+    }
+
+    if (seen == FALSE) {
+      *((int *) push_array(backend_ids)) = backend_id;
+    }
+  }
+
+  for (i = 0; i < backend_ids->nelts; i++) {
+    res = reverse_db_count_leases(p, dbh, vhost_id,
+      ((int *) backend_ids->elts)[i]);
+    if (res < 0) {
+      (void) proxy_db_rollback(p, dbh);
+      return -1;
+    }
+  }
+
+  if (proxy_db_commit(p, dbh) < 0) {
+    int xerrno = errno;
+
+    (void) proxy_db_rollback(p, dbh);
+    errno = xerrno;
+    return -1;
+  }
+
+  if (reclaimed > 0) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "reclaimed %d %s of dead sessions for vhost ID %u", reclaimed,
+      reclaimed != 1 ? "leases" : "lease", vhost_id);
+  }
+
+  return reclaimed;
+}
+
+/* Writes any pending updates.  If there are any, a transaction is started
+ * for them, and TRUE is returned; the caller then adds its own writes to that
+ * transaction, and ends it with reverse_db_flush_end().
+ */
+static int reverse_db_flush_begin(pool *p, void *dbh) {
+  register unsigned int i;
+  struct reverse_db_update *updates;
+  int res = 0;
+
+  if (db_pending_updates == NULL ||
+      db_pending_updates->nelts == 0) {
+    return FALSE;
+  }
+
+  if (proxy_db_begin(p, dbh) < 0) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error starting transaction: %s", strerror(errno));
+    return -1;
+  }
+
+  pr_trace_msg(trace_channel, 17, "writing %d pending backend %s",
+    db_pending_updates->nelts,
+    db_pending_updates->nelts != 1 ? "updates" : "update");
+
+  updates = db_pending_updates->elts;
+  for (i = 0; i < db_pending_updates->nelts; i++) {
+    if (updates[i].conn_incr == 0 &&
+        updates[i].connect_ms <= 0) {
+      continue;
+    }
+
+    res = reverse_db_exec_update(p, dbh, updates[i].vhost_id,
+      updates[i].backend_id, updates[i].conn_incr, updates[i].connect_ms);
+    if (res < 0) {
+      break;
+    }
+  }
+
+  /* Whether or not they were written, these updates are done. */
+  db_pending_updates->nelts = 0;
+
+  if (res < 0) {
+    (void) proxy_db_rollback(p, dbh);
+    errno = EPERM;
+    return -1;
+  }
+
+  return TRUE;
+}
+
+/* Commits the transaction started by reverse_db_flush_begin(), if any.  Note
+ * that the pending updates are committed even if the caller's own write
+ * failed; they are still valid.
+ */
+static int reverse_db_flush_end(pool *p, void *dbh, int in_txn) {
+  if (in_txn != TRUE) {
+    return 0;
+  }
+
+  if (proxy_db_commit(p, dbh) < 0) {
+    int xerrno = errno;
+
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error committing transaction: %s", strerror(xerrno));
+    (void) proxy_db_rollback(p, dbh);
+    errno = xerrno;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int reverse_db_flush(pool *p, void *dbh) {
+  int in_txn;
+
+  in_txn = reverse_db_flush_begin(p, dbh);
+  if (in_txn < 0) {
+    return -1;
+  }
+
+  return reverse_db_flush_end(p, dbh, in_txn);
+}
+
+static int reverse_db_policy_update_backend(pool *p, void *dbh, int policy_id,
+    unsigned vhost_id, int backend_id, int conn_incr, long connect_ms) {
+  register unsigned int i;
+  struct reverse_db_update *updates, *update = NULL;
+
+  /* If our ReverseConnectPolicy is one of PerUser, PerGroup, or PerHost,
+   * we can skip this step: those policies do not use the connection count/time.
+   * This also helps avoid database contention under load for these policies.
+   */
+  if (proxy_reverse_policy_is_sticky(policy_id) == TRUE) {
+    pr_trace_msg(trace_channel, 17,
+      "sticky policy %s does not require updates, skipping",
+      proxy_reverse_policy_name(policy_id));
+
+    return 0;
+  }
+
+  if (db_pending_updates == NULL) {
+    return reverse_db_exec_update(p, dbh, vhost_id, backend_id, conn_incr,
+      connect_ms);
+  }
+
+  updates = db_pending_updates->elts;
+  for (i = 0; i < db_pending_updates->nelts; i++) {
+    if (updates[i].vhost_id == vhost_id &&
+        updates[i].backend_id == backend_id) {
+      update = &(updates[i]);
+      break;
+    }
+  }
+
+  if (update == NULL) {
+    update = push_array(db_pending_updates);
+    update->vhost_id = vhost_id;
+    update->backend_id = backend_id;
+    update->conn_incr = 0;
+    update->connect_ms = -1;
+  }
+
+  update->conn_incr += conn_incr;
+  if (connect_ms > 0) {
+    update->connect_ms = connect_ms;
+  }
+
+  /* A decrement happens as the session ends; nothing else will follow it.
+   * Nor do we let too many updates pile up.
+   */
+  if (conn_incr < 0 ||
+      db_pending_updates->nelts >= PROXY_REVERSE_DB_MAX_PENDING_UPDATES) {
+    return reverse_db_flush(p, dbh);
+  }
+
+  return 0;
+}
+
+static int reverse_db_policy_health_backend(pool *p, void *dbh,
+    int policy_id, unsigned int vhost_id, int backend_id,
+    uint64_t unhealthy_until_ms) {
+  int in_txn, res, xerrno;
+
+  /* The sticky policies do not select backends by ID. */
+  if (proxy_reverse_policy_is_sticky(policy_id) == TRUE) {
+    return 0;
+  }
+
+  in_txn = reverse_db_flush_begin(p, dbh);
+  res = reverse_db_health_update(p, dbh, vhost_id, backend_id,
+    unhealthy_until_ms);
+  xerrno = errno;
+  (void) reverse_db_flush_end(p, dbh, in_txn);
+
+  errno = xerrno;
+  return res;
+}
+
+static int reverse_db_policy_latency_backend(pool *p, void *dbh,
+    int policy_id, unsigned int vhost_id, int backend_id, int phase,
+    long latency_ms) {
+  int in_txn, res;
+  unsigned int bucket;
+  char bucket_col[32], weight[32];
+  const char *stmt, *errstr = NULL;
+  array_header *results;
+
+  /* The sticky policies do not select backends by ID. */
+  if (proxy_reverse_policy_is_sticky(policy_id) == TRUE) {
+    return 0;
+  }
+
+  if (phase < PROXY_REVERSE_LATENCY_CONNECT ||
+      phase > PROXY_REVERSE_LATENCY_LOGIN ||
+      latency_ms < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  bucket = proxy_reverse_latency_bucket(latency_ms);
+  snprintf(bucket_col, sizeof(bucket_col)-1, "bucket%u", bucket);
+  snprintf(weight, sizeof(weight)-1, "%g",
+    PROXY_REVERSE_LATENCY_EWMA_WEIGHT);
+
+  /* Compute the moving average in the statement itself, so that concurrent
+   * sessions do not lose each other's samples.
+   */
+  stmt = pstrcat(p, "UPDATE proxy_vhost_backend_latency SET ewma_ms = CASE WHEN samples = 0 THEN ?1 ELSE ewma_ms + ((?1 - ewma_ms) * ", weight, ") END, samples = samples + 1, ", bucket_col, " = ", bucket_col, " + 1 WHERE vhost_id = ?2 AND backend_id = ?3 AND phase = ?4;", NULL);
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_LONG,
+    (void *) &latency_ms);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 2, PROXY_DB_BIND_TYPE_INT,
+    (void *) &vhost_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 3, PROXY_DB_BIND_TYPE_INT,
+    (void *) &backend_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 4, PROXY_DB_BIND_TYPE_INT,
+    (void *) &phase);
+  if (res < 0) {
+    return -1;
   }
 
-  res = proxy_db_bind_stmt(p, dbh, stmt, idx, PROXY_DB_BIND_TYPE_INT,
+  in_txn = reverse_db_flush_begin(p, dbh);
+  results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  (void) reverse_db_flush_end(p, dbh, in_txn);
+  if (results == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(errno));
+    errno = EPERM;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Adjusts the in-flight transfers of our lease, and recounts them. */
+static int reverse_db_xfer_update(pool *p, void *dbh, unsigned int vhost_id,
+    int backend_id, int xfer_incr) {
+  int res;
+  struct proxy_reverse_lease lease;
+  const char *lease_text, *stmt, *errstr = NULL;
+  array_header *results;
+
+  (void) proxy_reverse_lease_get(&lease);
+  lease_text = proxy_reverse_lease_text(p, &lease);
+
+  stmt = "UPDATE proxy_vhost_backend_leases SET xfers = MAX(xfers + ?1, 0) WHERE vhost_id = ?2 AND backend_id = ?3 AND lease = ?4;";
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_INT,
+    (void *) &xfer_incr);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 2, PROXY_DB_BIND_TYPE_INT,
     (void *) &vhost_id);
   if (res < 0) {
     return -1;
   }
 
-  idx++;
+  res = proxy_db_bind_stmt(p, dbh, stmt, 3, PROXY_DB_BIND_TYPE_INT,
+    (void *) &backend_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 4, PROXY_DB_BIND_TYPE_TEXT,
+    (void *) lease_text);
+  if (res < 0) {
+    return -1;
+  }
+
+  results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  if (results == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(errno));
+    errno = EPERM;
+    return -1;
+  }
+
+  return reverse_db_count_leases(p, dbh, vhost_id, backend_id);
+}
+
+/* Adds the given bytes to the current window of the given backend; if that
+ * window has moved on since the last update, the bytes of the old window
+ * become those of the previous window (or are dropped, if it is older still).
+ * This is done in the statement itself, so that concurrent sessions do not
+ * lose each other's bytes.
+ */
+static int reverse_db_xfer_bytes(pool *p, void *dbh, unsigned int vhost_id,
+    int backend_id, off_t xfer_bytes) {
+  int res;
+  uint64_t now_ms;
+  long window, nbytes;
+  const char *stmt, *errstr = NULL;
+  array_header *results;
+
+  pr_gettimeofday_millis(&now_ms);
+  window = (long) proxy_reverse_xfer_window(now_ms);
+  nbytes = (long) xfer_bytes;
+
+  stmt = "UPDATE proxy_vhost_backends SET xfer_prev_bytes = CASE WHEN xfer_window >= ?1 THEN xfer_prev_bytes WHEN xfer_window = ?1 - 1 THEN xfer_bytes ELSE 0 END, xfer_bytes = CASE WHEN xfer_window >= ?1 THEN xfer_bytes + ?2 ELSE ?2 END, xfer_window = MAX(xfer_window, ?1) WHERE vhost_id = ?3 AND backend_id = ?4;";
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 1, PROXY_DB_BIND_TYPE_LONG,
+    (void *) &window);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 2, PROXY_DB_BIND_TYPE_LONG,
+    (void *) &nbytes);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = proxy_db_bind_stmt(p, dbh, stmt, 3, PROXY_DB_BIND_TYPE_INT,
+    (void *) &vhost_id);
+  if (res < 0) {
+    return -1;
+  }
 
-  res = proxy_db_bind_stmt(p, dbh, stmt, idx, PROXY_DB_BIND_TYPE_INT,
+  res = proxy_db_bind_stmt(p, dbh, stmt, 4, PROXY_DB_BIND_TYPE_INT,
     (void *) &backend_id);
   if (res < 0) {
     return -1;
@@ -1684,12 +2969,79 @@ static int reverse_db_policy_update_backend(pool *p, void *dbh, int policy_id,
   return 0;
 }
 
+static int reverse_db_policy_xfer_backend(pool *p, void *dbh, int policy_id,
+    unsigned int vhost_id, int backend_id, int xfer_incr, off_t xfer_bytes) {
+  int in_txn, res = 0, xerrno = 0;
+
+  if (policy_id != PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS) {
+    return 0;
+  }
+
+  if (xfer_incr == 0 &&
+      xfer_bytes <= 0) {
+    return 0;
+  }
+
+  if (xfer_incr == 0) {
+    /* Progress is reported from within the data transfer; rather than
+     * stalling the transfer on a database locked by another session, skip
+     * this report, leaving its bytes to a later one.  Any pending updates
+     * are left for the next transaction, too.
+     */
+    if (proxy_db_try_begin(p, dbh) < 0) {
+      xerrno = errno;
+
+      pr_trace_msg(trace_channel, 9,
+        "unable to record transfer progress for backend ID %d: %s",
+        backend_id, strerror(xerrno));
+      errno = xerrno;
+      return -1;
+    }
+
+    res = reverse_db_xfer_bytes(p, dbh, vhost_id, backend_id, xfer_bytes);
+    xerrno = errno;
+
+    (void) reverse_db_flush_end(p, dbh, TRUE);
+
+    errno = xerrno;
+    return res;
+  }
+
+  /* Our lease may still be a pending update; it is written first, in the
+   * same transaction.
+   */
+  in_txn = reverse_db_flush_begin(p, dbh);
+
+  if (xfer_incr != 0) {
+    res = reverse_db_xfer_update(p, dbh, vhost_id, backend_id, xfer_incr);
+    xerrno = errno;
+  }
+
+  if (res == 0 &&
+      xfer_bytes > 0) {
+    res = reverse_db_xfer_bytes(p, dbh, vhost_id, backend_id, xfer_bytes);
+    xerrno = errno;
+  }
+
+  (void) reverse_db_flush_end(p, dbh, in_txn);
+
+  errno = xerrno;
+  return res;
+}
+
 static int reverse_db_policy_used_backend(pool *p, void *dbh, int policy_id,
     unsigned int vhost_id, int idx) {
-  int res;
+  int in_txn, res;
+
+  /* Any pending connection count update for this backend is written along
+   * with the policy's own update, in one transaction.
+   */
+  in_txn = reverse_db_flush_begin(p, dbh);
 
   switch (policy_id) {
     case PROXY_REVERSE_CONNECT_POLICY_RANDOM:
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_ROUND_ROBIN:
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_RANDOM:
       res = 0;
       break;
 
@@ -1709,6 +3061,10 @@ static int reverse_db_policy_used_backend(pool *p, void *dbh, int policy_id,
       res = reverse_db_leastresponsetime_used(p, dbh, vhost_id, idx);
       break;
 
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS:
+      res = reverse_db_leasttransfers_used(p, dbh, vhost_id, idx);
+      break;
+
     case PROXY_REVERSE_CONNECT_POLICY_PER_USER:
       res = reverse_db_peruser_used(p, dbh, vhost_id, idx);
       break;
@@ -1722,6 +3078,7 @@ static int reverse_db_policy_used_backend(pool *p, void *dbh, int policy_id,
       break;
 
     default:
+      (void) reverse_db_flush_end(p, dbh, in_txn);
       errno = ENOSYS;
       return -1;
   }
@@ -1729,11 +3086,12 @@ static int reverse_db_policy_used_backend(pool *p, void *dbh, int policy_id,
   if (res < 0) {
     int xerrno = errno;
 
+    (void) reverse_db_flush_end(p, dbh, in_txn);
     errno = xerrno;
     return -1;
   }
 
-  return 0;
+  return reverse_db_flush_end(p, dbh, in_txn);
 }
 
 static void *reverse_db_init(pool *p, const char *tables_path, int flags) {
@@ -1749,7 +3107,7 @@ static void *reverse_db_init(pool *p, const char *tables_path, int flags) {
 
   db_path = pdircat(p, tables_path, "proxy-reverse.db", NULL);
 
-  db_flags = PROXY_DB_OPEN_FL_SCHEMA_VERSION_CHECK|PROXY_DB_OPEN_FL_INTEGRITY_CHECK|PROXY_DB_OPEN_FL_VACUUM;
+  db_flags = PROXY_DB_OPEN_FL_SCHEMA_VERSION_CHECK|PROXY_DB_OPEN_FL_INTEGRITY_CHECK|PROXY_DB_OPEN_FL_VACUUM|db_open_flags;
   if (flags & PROXY_DB_OPEN_FL_SKIP_VACUUM) {
     /* If the caller needs us to skip the vacuum, we will. */
     db_flags &= ~PROXY_DB_OPEN_FL_VACUUM;
@@ -1872,9 +3230,10 @@ static int reverse_db_close(pool *p, void *dbh) {
     return -1;
   }
 
-  /* TODO: Implement any necessary cleanup */
-
   if (dbh != NULL) {
+    (void) reverse_db_flush(p, dbh);
+    db_pending_updates = NULL;
+
     if (proxy_db_close(p, dbh) < 0) {
       (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
         "error detaching database with schema '%s': %s",
@@ -1899,7 +3258,7 @@ static void *reverse_db_open(pool *p, const char *tables_path,
 
   PRIVS_ROOT
   dbh = proxy_db_open_with_version(p, db_path, PROXY_REVERSE_DB_SCHEMA_NAME,
-    PROXY_REVERSE_DB_SCHEMA_VERSION, 0);
+    PROXY_REVERSE_DB_SCHEMA_VERSION, db_open_flags);
   xerrno = errno;
   PRIVS_RELINQUISH
 
@@ -1913,6 +3272,7 @@ static void *reverse_db_open(pool *p, const char *tables_path,
   }
 
   db_backends = backends;
+  db_pending_updates = make_array(p, 4, sizeof(struct reverse_db_update));
   return dbh;
 }
 
@@ -1924,13 +3284,21 @@ int proxy_reverse_db_as_datastore(struct proxy_reverse_datastore *ds,
     return -1;
   }
 
-  (void) ds_data;
   (void) ds_datasz;
 
+  db_open_flags = 0;
+  if (ds_data != NULL &&
+      strcasecmp((const char *) ds_data, "WAL") == 0) {
+    db_open_flags |= PROXY_DB_OPEN_FL_USE_WAL;
+  }
+
   ds->policy_init = reverse_db_policy_init;
   ds->policy_next_backend = reverse_db_policy_next_backend;
   ds->policy_used_backend = reverse_db_policy_used_backend;
   ds->policy_update_backend = reverse_db_policy_update_backend;
+  ds->policy_health_backend = reverse_db_policy_health_backend;
+  ds->policy_latency_backend = reverse_db_policy_latency_backend;
+  ds->policy_xfer_backend = reverse_db_policy_xfer_backend;
   ds->init = reverse_db_init;
   ds->open = reverse_db_open;
   ds->close = reverse_db_close;
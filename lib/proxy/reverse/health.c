@@ -0,0 +1,650 @@
+/*
+ * ProFTPD - mod_proxy reverse health checks
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_proxy.h"
+
+#include "proxy/conn.h"
+#include "proxy/inet.h"
+#include "proxy/netio.h"
+#include "proxy/evloop.h"
+#include "proxy/reverse.h"
+#include "proxy/reverse/health.h"
+#include "proxy/reverse/chash.h"
+#include "proxy/ftp/ctrl.h"
+
+#include <signal.h>
+
+extern xaset_t *server_list;
+
+/* Used when ProxyTimeoutConnect is not configured for the vhost. */
+#define PROXY_REVERSE_HEALTH_DEFAULT_TIMEOUT	5
+
+struct health_vhost {
+  server_rec *server;
+  int policy_id;
+
+  /* ProxyReverseHealthCheck */
+  int interval;
+  const char *cmd;
+
+  int timeout;
+  array_header *backends;
+
+  /* The last known health of each backend: -1 if unknown, else TRUE/FALSE.
+   * Used only to log changes in health.
+   */
+  int *healthy;
+
+  uint64_t next_check_ms;
+};
+
+static pid_t health_pid = 0;
+
+/* The worker watches the read end of this pipe; when the daemon closes the
+ * write end (or exits), the worker exits as well.
+ */
+static int health_fds[2] = { -1, -1 };
+
+static const char *trace_channel = "proxy.reverse.health";
+
+conn_t *proxy_reverse_health_open_backend(pool *p,
+    const struct proxy_conn *pconn, const pr_netaddr_t *src_addr, int timeout,
+    pr_response_t **banner, unsigned int *banner_nlines, long *connect_ms,
+    long *banner_ms) {
+  int res, xerrno = 0, sockerr = 0;
+  socklen_t sockerrlen;
+  const pr_netaddr_t *remote_addr, *bind_addr = NULL;
+  const char *remote_ipstr;
+  unsigned int remote_port, resp_nlines = 0;
+  conn_t *server_conn, *ctrl_conn;
+  pr_response_t *resp;
+  uint64_t connecting_ms, established_ms, connected_ms;
+
+  if (p == NULL ||
+      pconn == NULL ||
+      timeout <= 0 ||
+      connect_ms == NULL ||
+      banner_ms == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  remote_addr = proxy_conn_get_addr(pconn, NULL);
+  if (remote_addr == NULL) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  remote_ipstr = pr_netaddr_get_ipstr(remote_addr);
+  remote_port = ntohs(pr_netaddr_get_port(remote_addr));
+
+  /* Bind to the given source address, if of the same family as the backend,
+   * otherwise to the wildcard address of that family.
+   */
+  if (src_addr != NULL &&
+      pr_netaddr_get_family(src_addr) == pr_netaddr_get_family(remote_addr)) {
+    bind_addr = src_addr;
+
+  } else if (pr_netaddr_get_family(remote_addr) == AF_INET) {
+    bind_addr = pr_netaddr_get_addr(p, "0.0.0.0", NULL);
+
+#if defined(PR_USE_IPV6)
+  } else {
+    bind_addr = pr_netaddr_get_addr(p, "::", NULL);
+#endif /* PR_USE_IPV6 */
+  }
+
+  pr_gettimeofday_millis(&connecting_ms);
+
+  server_conn = pr_inet_create_conn(p, -1, bind_addr, INPORT_ANY, FALSE);
+  if (server_conn == NULL) {
+    return NULL;
+  }
+
+  res = pr_inet_connect_nowait(p, server_conn, remote_addr, remote_port);
+  if (res < 0) {
+    xerrno = errno;
+
+    pr_trace_msg(trace_channel, 9, "error connecting to %s#%u: %s",
+      remote_ipstr, remote_port, strerror(xerrno));
+    pr_inet_close(p, server_conn);
+
+    errno = xerrno;
+    return NULL;
+  }
+
+  if (res == 0) {
+    /* Not yet connected. */
+    res = proxy_evloop_poll_fd(server_conn->listen_fd, PROXY_EVLOOP_EV_WRITE,
+      timeout * 1000);
+    if (res <= 0) {
+      xerrno = (res == 0 ? ETIMEDOUT : errno);
+
+      pr_trace_msg(trace_channel, 9, "error connecting to %s#%u: %s",
+        remote_ipstr, remote_port, strerror(xerrno));
+      pr_inet_close(p, server_conn);
+
+      errno = xerrno;
+      return NULL;
+    }
+
+    sockerrlen = sizeof(sockerr);
+    if (getsockopt(server_conn->listen_fd, SOL_SOCKET, SO_ERROR, &sockerr,
+        &sockerrlen) < 0) {
+      sockerr = errno;
+    }
+
+    if (sockerr != 0) {
+      pr_trace_msg(trace_channel, 9, "error connecting to %s#%u: %s",
+        remote_ipstr, remote_port, strerror(sockerr));
+      pr_inet_close(p, server_conn);
+
+      errno = sockerr;
+      return NULL;
+    }
+
+    server_conn->mode = CM_OPEN;
+  }
+
+  pr_gettimeofday_millis(&established_ms);
+
+  ctrl_conn = proxy_inet_openrw(p, server_conn, NULL, PR_NETIO_STRM_CTRL, -1,
+    -1, -1, FALSE);
+  if (ctrl_conn == NULL) {
+    xerrno = errno;
+
+    pr_inet_close(p, server_conn);
+    errno = xerrno;
+    return NULL;
+  }
+
+  /* The control connection now owns the socket. */
+  server_conn->listen_fd = -1;
+
+  /* Make sure that reading a response, including the rest of any multiline
+   * response, times out.
+   */
+  proxy_netio_set_poll_interval(ctrl_conn->instrm, timeout);
+
+  resp = proxy_ftp_ctrl_recv_resp(p, ctrl_conn, &resp_nlines, 0);
+  if (resp == NULL) {
+    xerrno = errno;
+
+    pr_trace_msg(trace_channel, 9, "error reading banner from %s#%u: %s",
+      remote_ipstr, remote_port, strerror(xerrno));
+    proxy_inet_close(p, ctrl_conn);
+
+    errno = xerrno;
+    return NULL;
+  }
+
+  pr_gettimeofday_millis(&connected_ms);
+
+  if (resp->num[0] != '2') {
+    pr_trace_msg(trace_channel, 9, "received banner from %s#%u: %s %s",
+      remote_ipstr, remote_port, resp->num, resp->msg);
+    proxy_inet_close(p, ctrl_conn);
+
+    errno = EPERM;
+    return NULL;
+  }
+
+  if (banner != NULL) {
+    *banner = resp;
+  }
+
+  if (banner_nlines != NULL) {
+    *banner_nlines = resp_nlines;
+  }
+
+  *connect_ms = (long) (established_ms - connecting_ms);
+  *banner_ms = (long) (connected_ms - established_ms);
+  return ctrl_conn;
+}
+
+int proxy_reverse_health_check_backend(pool *p, const struct proxy_conn *pconn,
+    int timeout, const char *cmd, long *connect_ms, long *banner_ms) {
+  int res, xerrno = 0;
+  unsigned int resp_nlines = 0;
+  conn_t *ctrl_conn;
+  pr_response_t *resp;
+
+  ctrl_conn = proxy_reverse_health_open_backend(p, pconn, NULL, timeout, NULL,
+    NULL, connect_ms, banner_ms);
+  if (ctrl_conn == NULL) {
+    return -1;
+  }
+
+  if (cmd != NULL) {
+    cmd_rec *check_cmd;
+    const char *remote_ipstr;
+    unsigned int remote_port;
+
+    remote_ipstr = pr_netaddr_get_ipstr(ctrl_conn->remote_addr);
+    remote_port = ntohs(pr_netaddr_get_port(ctrl_conn->remote_addr));
+    check_cmd = pr_cmd_alloc(p, 1, pstrdup(p, cmd));
+
+    res = proxy_ftp_ctrl_send_cmd(p, ctrl_conn, check_cmd);
+    if (res < 0) {
+      xerrno = errno;
+
+      proxy_inet_close(p, ctrl_conn);
+      errno = xerrno;
+      return -1;
+    }
+
+    resp = proxy_ftp_ctrl_recv_resp(p, ctrl_conn, &resp_nlines, 0);
+    if (resp == NULL) {
+      xerrno = errno;
+
+      pr_trace_msg(trace_channel, 9, "error reading %s response from %s#%u: %s",
+        cmd, remote_ipstr, remote_port, strerror(xerrno));
+      proxy_inet_close(p, ctrl_conn);
+
+      errno = xerrno;
+      return -1;
+    }
+
+    /* Only a transient negative response, e.g. "421 Service not available",
+     * means that the backend is unhealthy; the backend may not support
+     * the command at all.
+     */
+    if (resp->num[0] == '4') {
+      pr_trace_msg(trace_channel, 9, "received %s response from %s#%u: %s %s",
+        cmd, remote_ipstr, remote_port, resp->num, resp->msg);
+      proxy_inet_close(p, ctrl_conn);
+
+      errno = EPERM;
+      return -1;
+    }
+  }
+
+  /* We do not wait for the QUIT response. */
+  (void) proxy_ftp_ctrl_send_cmd(p, ctrl_conn, pr_cmd_alloc(p, 1, C_QUIT));
+  proxy_inet_close(p, ctrl_conn);
+
+  return 0;
+}
+
+static void health_check_vhost(pool *p, const char *tables_dir,
+    struct proxy_reverse_datastore *ds, struct health_vhost *hv) {
+  register unsigned int i;
+  pool *tmp_pool;
+  void *dsh;
+  struct proxy_conn **conns;
+
+  tmp_pool = make_sub_pool(p);
+
+  dsh = (ds->open)(tmp_pool, tables_dir, hv->backends);
+  if (dsh == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error opening datastore for health checks: %s", strerror(errno));
+    destroy_pool(tmp_pool);
+    return;
+  }
+
+  conns = hv->backends->elts;
+  for (i = 0; i < hv->backends->nelts; i++) {
+    pool *check_pool;
+    const char *backend_uri;
+    long connect_ms = 0, banner_ms = 0, response_ms;
+    int res, xerrno;
+
+    check_pool = make_sub_pool(tmp_pool);
+    backend_uri = proxy_conn_get_uri(conns[i]);
+
+    res = proxy_reverse_health_check_backend(check_pool, conns[i],
+      hv->timeout, hv->cmd, &connect_ms, &banner_ms);
+    xerrno = errno;
+
+    if (res == 0) {
+      if (hv->healthy[i] != TRUE) {
+        (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+          "health check: backend '%.100s' is UP (connect in %ld ms, banner "
+          "in %ld ms)", backend_uri, connect_ms, banner_ms);
+      }
+
+      hv->healthy[i] = TRUE;
+
+      /* Mark the backend as healthy.  Note that the connect time must be
+       * positive, for the datastores to use it.
+       */
+      response_ms = connect_ms + banner_ms;
+      if (response_ms <= 0) {
+        response_ms = 1;
+      }
+
+      if (hv->policy_id == PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH) {
+        /* That policy keeps the backend health in its own shared table. */
+        if (proxy_reverse_chash_health_backend(hv->server->sid, i, 0) < 0) {
+          pr_trace_msg(trace_channel, 3,
+            "error updating health of backend '%.100s': %s", backend_uri,
+            strerror(errno));
+        }
+
+      } else if ((ds->policy_update_backend)(check_pool, dsh, hv->policy_id,
+          hv->server->sid, i, 0, response_ms) < 0) {
+        pr_trace_msg(trace_channel, 3,
+          "error updating backend '%.100s': %s", backend_uri, strerror(errno));
+      }
+
+      /* Publish the latencies, for LeastResponseTime. */
+      if (ds->policy_latency_backend != NULL &&
+          hv->policy_id != PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH) {
+        if ((ds->policy_latency_backend)(check_pool, dsh, hv->policy_id,
+            hv->server->sid, i, PROXY_REVERSE_LATENCY_CONNECT,
+            connect_ms) < 0 ||
+            (ds->policy_latency_backend)(check_pool, dsh, hv->policy_id,
+            hv->server->sid, i, PROXY_REVERSE_LATENCY_BANNER,
+            banner_ms) < 0) {
+          pr_trace_msg(trace_channel, 3,
+            "error recording latency of backend '%.100s': %s", backend_uri,
+            strerror(errno));
+        }
+      }
+
+    } else {
+      uint64_t now_ms, until_ms;
+
+      if (hv->healthy[i] != FALSE) {
+        (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+          "health check: backend '%.100s' is DOWN: %s", backend_uri,
+          strerror(xerrno));
+      }
+
+      hv->healthy[i] = FALSE;
+
+      /* Keep the backend unhealthy at least until our next check of it. */
+      pr_gettimeofday_millis(&now_ms);
+      until_ms = now_ms + ((uint64_t) (hv->interval + hv->timeout) * 1000);
+
+      if (hv->policy_id == PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH) {
+        res = proxy_reverse_chash_health_backend(hv->server->sid, i,
+          until_ms);
+
+      } else {
+        res = (ds->policy_health_backend)(check_pool, dsh, hv->policy_id,
+          hv->server->sid, i, until_ms);
+      }
+
+      if (res < 0) {
+        pr_trace_msg(trace_channel, 3,
+          "error updating health of backend '%.100s': %s", backend_uri,
+          strerror(errno));
+      }
+    }
+
+    destroy_pool(check_pool);
+  }
+
+  (void) (ds->close)(tmp_pool, dsh);
+  destroy_pool(tmp_pool);
+}
+
+static void health_worker(pool *p, const char *tables_dir,
+    struct proxy_reverse_datastore *ds, array_header *vhosts) {
+  struct health_vhost **hvs;
+  config_rec *c;
+
+  /* The signal handlers of the daemon do not apply to us. */
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGUSR2, SIG_IGN);
+
+  /* The ProxyLog is otherwise only opened by session processes. */
+  c = find_config(main_server->conf, CONF_PARAM, "ProxyLog", FALSE);
+  if (c != NULL &&
+      proxy_logfd < 0) {
+    char *logname;
+
+    logname = c->argv[0];
+    if (strncasecmp(logname, "none", 5) != 0) {
+      if (pr_log_openfile(logname, &proxy_logfd, PR_LOG_SYSTEM_MODE) < 0) {
+        proxy_logfd = -1;
+      }
+    }
+  }
+
+  pr_trace_msg(trace_channel, 5,
+    "health check worker (PID %lu) checking backends of %d %s",
+    (unsigned long) getpid(), vhosts->nelts,
+    vhosts->nelts != 1 ? "vhosts" : "vhost");
+
+  hvs = vhosts->elts;
+
+  while (TRUE) {
+    register unsigned int i;
+    uint64_t now_ms, next_ms = 0;
+    int res, timeout_ms = 0;
+
+    for (i = 0; i < vhosts->nelts; i++) {
+      pr_gettimeofday_millis(&now_ms);
+
+      if (hvs[i]->next_check_ms <= now_ms) {
+        health_check_vhost(p, tables_dir, ds, hvs[i]);
+
+        pr_gettimeofday_millis(&now_ms);
+        hvs[i]->next_check_ms = now_ms +
+          ((uint64_t) hvs[i]->interval * 1000);
+      }
+
+      if (next_ms == 0 ||
+          hvs[i]->next_check_ms < next_ms) {
+        next_ms = hvs[i]->next_check_ms;
+      }
+    }
+
+    pr_gettimeofday_millis(&now_ms);
+    if (next_ms > now_ms) {
+      timeout_ms = (int) (next_ms - now_ms);
+    }
+
+    /* Sleep until the next check is due, or until the daemon goes away. */
+    res = proxy_evloop_poll_fd(health_fds[0], PROXY_EVLOOP_EV_READ,
+      timeout_ms);
+    if (res < 0 &&
+        errno == EINTR) {
+      continue;
+    }
+
+    if (res != 0) {
+      break;
+    }
+  }
+
+  pr_trace_msg(trace_channel, 5, "health check worker (PID %lu) exiting",
+    (unsigned long) getpid());
+  _exit(0);
+}
+
+static struct health_vhost *health_get_vhost(pool *p, server_rec *s) {
+  config_rec *c;
+  struct health_vhost *hv;
+  array_header *backends;
+  int interval, policy_id = PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN;
+
+  c = find_config(s->conf, CONF_PARAM, "ProxyEngine", FALSE);
+  if (c == NULL ||
+      *((int *) c->argv[0]) != TRUE) {
+    return NULL;
+  }
+
+  c = find_config(s->conf, CONF_PARAM, "ProxyRole", FALSE);
+  if (c != NULL &&
+      *((int *) c->argv[0]) != PROXY_ROLE_REVERSE) {
+    return NULL;
+  }
+
+  c = find_config(s->conf, CONF_PARAM, "ProxyReverseHealthCheck", FALSE);
+  if (c == NULL) {
+    return NULL;
+  }
+
+  interval = *((int *) c->argv[0]);
+  if (interval <= 0) {
+    return NULL;
+  }
+
+  hv = pcalloc(p, sizeof(struct health_vhost));
+  hv->interval = interval;
+  hv->cmd = c->argv[1];
+
+  c = find_config(s->conf, CONF_PARAM, "ProxyReverseConnectPolicy", FALSE);
+  if (c != NULL) {
+    policy_id = *((int *) c->argv[0]);
+  }
+
+  if (proxy_reverse_policy_is_sticky(policy_id) == TRUE) {
+    pr_log_pri(PR_LOG_NOTICE, MOD_PROXY_VERSION
+      ": ProxyReverseHealthCheck not supported for %s policy, ignoring",
+      proxy_reverse_policy_name(policy_id));
+    return NULL;
+  }
+
+  backends = proxy_reverse_vhost_backends(p, s);
+  if (backends == NULL ||
+      backends->nelts == 0) {
+    return NULL;
+  }
+
+  hv->server = s;
+  hv->policy_id = policy_id;
+  hv->backends = backends;
+  hv->healthy = palloc(p, backends->nelts * sizeof(int));
+  memset(hv->healthy, -1, backends->nelts * sizeof(int));
+
+  hv->timeout = PROXY_REVERSE_HEALTH_DEFAULT_TIMEOUT;
+  c = find_config(s->conf, CONF_PARAM, "ProxyTimeoutConnect", FALSE);
+  if (c != NULL &&
+      *((int *) c->argv[0]) > 0) {
+    hv->timeout = *((int *) c->argv[0]);
+  }
+
+  return hv;
+}
+
+int proxy_reverse_health_init(pool *p, const char *tables_dir,
+    struct proxy_reverse_datastore *ds) {
+  server_rec *s;
+  array_header *vhosts;
+  pid_t pid;
+
+  if (p == NULL ||
+      tables_dir == NULL ||
+      ds == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Each inetd-run session process is its own daemon; a worker is only
+   * useful for a standalone daemon.
+   */
+  if (ServerType == SERVER_INETD) {
+    return 0;
+  }
+
+  vhosts = make_array(p, 0, sizeof(struct health_vhost *));
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    struct health_vhost *hv;
+
+    hv = health_get_vhost(p, s);
+    if (hv != NULL) {
+      *((struct health_vhost **) push_array(vhosts)) = hv;
+    }
+  }
+
+  if (vhosts->nelts == 0) {
+    pr_trace_msg(trace_channel, 9,
+      "no vhosts configured for health checks, skipping worker");
+    return 0;
+  }
+
+  if (pipe(health_fds) < 0) {
+    return -1;
+  }
+
+  pid = fork();
+  switch (pid) {
+    case -1: {
+      int xerrno = errno;
+
+      (void) close(health_fds[0]);
+      (void) close(health_fds[1]);
+      health_fds[0] = health_fds[1] = -1;
+
+      errno = xerrno;
+      return -1;
+    }
+
+    case 0:
+      (void) close(health_fds[1]);
+      health_fds[1] = -1;
+
+      health_worker(p, tables_dir, ds, vhosts);
+
+      /* Not reached. */
+      _exit(0);
+
+    default:
+      (void) close(health_fds[0]);
+      health_fds[0] = -1;
+
+      health_pid = pid;
+      break;
+  }
+
+  pr_trace_msg(trace_channel, 7, "started health check worker (PID %lu)",
+    (unsigned long) health_pid);
+  return 0;
+}
+
+int proxy_reverse_health_free(pool *p) {
+  if (health_fds[1] >= 0) {
+    (void) close(health_fds[1]);
+    health_fds[1] = -1;
+  }
+
+  if (health_pid > 0) {
+    pr_trace_msg(trace_channel, 7, "stopping health check worker (PID %lu)",
+      (unsigned long) health_pid);
+    (void) kill(health_pid, SIGTERM);
+    health_pid = 0;
+  }
+
+  return 0;
+}
+
+int proxy_reverse_health_sess_init(void) {
+  /* Only the daemon keeps the worker alive, and stops it. */
+  if (health_fds[1] >= 0) {
+    (void) close(health_fds[1]);
+    health_fds[1] = -1;
+  }
+
+  health_pid = 0;
+  return 0;
+}
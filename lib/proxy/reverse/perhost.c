@@ -0,0 +1,555 @@
+/*
+ * ProFTPD - mod_proxy PerHost prefix implementation
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_proxy.h"
+#include "json.h"
+
+#include "proxy/conn.h"
+#include "proxy/reverse.h"
+#include "proxy/reverse/perhost.h"
+
+extern xaset_t *server_list;
+
+/* Each node of the tree is one bit further along the address; a node holds
+ * a prefix if one of that length, with those leading bits, was added.
+ */
+struct perhost_node {
+  struct perhost_node *children[2];
+  const struct proxy_reverse_perhost_prefix *prefix;
+};
+
+struct proxy_reverse_perhost_tree {
+  struct perhost_node *ipv4_root;
+  struct perhost_node *ipv6_root;
+};
+
+struct perhost_vhost {
+  int enabled;
+
+  /* Per ProxyReversePerHostMap; NULL if no prefixes are mapped. */
+  struct proxy_reverse_perhost_tree *tree;
+
+  /* Per ProxyReversePerHostPrefix. */
+  unsigned int ipv4_len;
+  unsigned int ipv6_len;
+};
+
+/* Indexed by server ID; not enabled for vhosts not using PerHost. */
+static struct perhost_vhost *perhost_vhosts = NULL;
+static unsigned int perhost_vhost_count = 0;
+
+static const char *trace_channel = "proxy.reverse.perhost";
+
+static unsigned int perhost_max_len(int family) {
+  return family == AF_INET ? 32 : 128;
+}
+
+static int perhost_get_bit(const unsigned char *addr, unsigned int bit) {
+  return (addr[bit / 8] >> (7 - (bit % 8))) & 1;
+}
+
+/* Clears all of the bits of the given address after the first len bits. */
+static void perhost_mask(unsigned char *addr, unsigned int addrsz,
+    unsigned int len) {
+  register unsigned int i;
+
+  for (i = 0; i < addrsz; i++) {
+    if (len >= 8) {
+      len -= 8;
+      continue;
+    }
+
+    addr[i] &= (unsigned char) (0xff << (8 - len));
+    len = 0;
+  }
+}
+
+/* Returns the address bytes, and family, of the given address; IPv4-mapped
+ * IPv6 addresses are treated as IPv4 addresses.
+ */
+static const unsigned char *perhost_get_addr(pool *p, const pr_netaddr_t *addr,
+    int *family) {
+  int addr_family;
+
+  addr_family = pr_netaddr_get_family(addr);
+
+#ifdef PR_USE_IPV6
+  if (addr_family == AF_INET6 &&
+      pr_netaddr_is_v4mappedv6(addr) == TRUE) {
+    addr = pr_netaddr_v6tov4(p, addr);
+    if (addr == NULL) {
+      return NULL;
+    }
+
+    addr_family = AF_INET;
+  }
+#endif /* PR_USE_IPV6 */
+
+  if (addr_family != AF_INET &&
+      addr_family != AF_INET6) {
+    errno = EPERM;
+    return NULL;
+  }
+
+  *family = addr_family;
+  return pr_netaddr_get_inaddr(addr);
+}
+
+int proxy_reverse_perhost_parse_prefix(const char *text,
+    struct proxy_reverse_perhost_prefix *prefix) {
+  char buf[128], *ptr;
+  unsigned int max_len;
+  size_t addrsz;
+
+  if (text == NULL ||
+      prefix == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (strlen(text) >= sizeof(buf)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  sstrncpy(buf, text, sizeof(buf));
+  memset(prefix, 0, sizeof(struct proxy_reverse_perhost_prefix));
+
+  ptr = strchr(buf, '/');
+  if (ptr != NULL) {
+    *ptr++ = '\0';
+  }
+
+  if (strchr(buf, ':') != NULL) {
+#ifdef PR_USE_IPV6
+    prefix->family = AF_INET6;
+    addrsz = 16;
+#else
+    errno = EPERM;
+    return -1;
+#endif /* PR_USE_IPV6 */
+
+  } else {
+    prefix->family = AF_INET;
+    addrsz = 4;
+  }
+
+  if (pr_inet_pton(prefix->family, buf, prefix->addr) <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  max_len = perhost_max_len(prefix->family);
+  prefix->len = max_len;
+
+  if (ptr != NULL) {
+    char *endp = NULL;
+    unsigned long len;
+
+    if (*ptr == '\0' ||
+        !PR_ISDIGIT((int) *ptr)) {
+      errno = EINVAL;
+      return -1;
+    }
+
+    len = strtoul(ptr, &endp, 10);
+    if ((endp != NULL && *endp != '\0') ||
+        len > max_len) {
+      errno = EINVAL;
+      return -1;
+    }
+
+    prefix->len = (unsigned int) len;
+  }
+
+  perhost_mask(prefix->addr, addrsz, prefix->len);
+  return 0;
+}
+
+array_header *proxy_reverse_perhost_json_parse(pool *p, const char *path) {
+  register unsigned int i;
+  int count;
+  array_header *prefixes;
+  pool *tmp_pool;
+  pr_json_array_t *json;
+
+  if (p == NULL ||
+      path == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  json = proxy_reverse_json_read_array(tmp_pool, path);
+  if (json == NULL) {
+    int xerrno = errno;
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return NULL;
+  }
+
+  prefixes = make_array(p, 1, sizeof(struct proxy_reverse_perhost_prefix *));
+
+  count = pr_json_array_count(json);
+  for (i = 0; count > 0 && i < (unsigned int) count; i++) {
+    char *prefix_text = NULL, *uri = NULL;
+    struct proxy_reverse_perhost_prefix *prefix;
+    pr_json_object_t *obj = NULL;
+
+    pr_signals_handle();
+
+    if (pr_json_array_get_object(tmp_pool, json, i, &obj) < 0) {
+      pr_trace_msg(trace_channel, 2,
+        "error getting object from JSON array at index %u: %s", i,
+        strerror(errno));
+      continue;
+    }
+
+    if (pr_json_object_get_string(tmp_pool, obj, "prefix", &prefix_text) < 0 ||
+        pr_json_object_get_string(p, obj, "uri", &uri) < 0) {
+      pr_trace_msg(trace_channel, 2,
+        "skipping item at index %u in file '%s': missing prefix or uri", i,
+        path);
+      (void) pr_json_object_free(obj);
+      continue;
+    }
+
+    (void) pr_json_object_free(obj);
+
+    prefix = pcalloc(p, sizeof(struct proxy_reverse_perhost_prefix));
+    if (proxy_reverse_perhost_parse_prefix(prefix_text, prefix) < 0) {
+      pr_trace_msg(trace_channel, 9,
+        "skipping malformed prefix '%s' found in file '%s'", prefix_text,
+        path);
+      continue;
+    }
+
+    prefix->pconn = proxy_conn_create(p, uri);
+    if (prefix->pconn == NULL) {
+      pr_trace_msg(trace_channel, 9,
+        "skipping malformed URL '%s' found in file '%s'", uri, path);
+      continue;
+    }
+
+    *((struct proxy_reverse_perhost_prefix **) push_array(prefixes)) = prefix;
+  }
+
+  (void) pr_json_array_free(json);
+  destroy_pool(tmp_pool);
+
+  pr_trace_msg(trace_channel, 12,
+    "created prefixes (count %u) from JSON file '%s'", prefixes->nelts, path);
+  return prefixes;
+}
+
+struct proxy_reverse_perhost_tree *proxy_reverse_perhost_tree_create(pool *p) {
+  if (p == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return pcalloc(p, sizeof(struct proxy_reverse_perhost_tree));
+}
+
+int proxy_reverse_perhost_tree_add(pool *p,
+    struct proxy_reverse_perhost_tree *tree,
+    const struct proxy_reverse_perhost_prefix *prefix) {
+  register unsigned int i;
+  struct perhost_node **root, *node;
+  struct proxy_reverse_perhost_prefix *copy;
+
+  if (p == NULL ||
+      tree == NULL ||
+      prefix == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (prefix->family != AF_INET &&
+      prefix->family != AF_INET6) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (prefix->len > perhost_max_len(prefix->family)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  root = prefix->family == AF_INET ? &(tree->ipv4_root) : &(tree->ipv6_root);
+  if (*root == NULL) {
+    *root = pcalloc(p, sizeof(struct perhost_node));
+  }
+
+  node = *root;
+  for (i = 0; i < prefix->len; i++) {
+    int bit;
+
+    bit = perhost_get_bit(prefix->addr, i);
+    if (node->children[bit] == NULL) {
+      node->children[bit] = pcalloc(p, sizeof(struct perhost_node));
+    }
+
+    node = node->children[bit];
+  }
+
+  copy = palloc(p, sizeof(struct proxy_reverse_perhost_prefix));
+  memcpy(copy, prefix, sizeof(struct proxy_reverse_perhost_prefix));
+  node->prefix = copy;
+
+  return 0;
+}
+
+const struct proxy_reverse_perhost_prefix *proxy_reverse_perhost_tree_lookup(
+    pool *p, const struct proxy_reverse_perhost_tree *tree,
+    const pr_netaddr_t *addr) {
+  register unsigned int i;
+  int family = 0;
+  unsigned int max_len;
+  const unsigned char *addr_data;
+  const struct perhost_node *node;
+  const struct proxy_reverse_perhost_prefix *prefix = NULL;
+
+  if (p == NULL ||
+      tree == NULL ||
+      addr == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  addr_data = perhost_get_addr(p, addr, &family);
+  if (addr_data == NULL) {
+    return NULL;
+  }
+
+  node = family == AF_INET ? tree->ipv4_root : tree->ipv6_root;
+  max_len = perhost_max_len(family);
+
+  /* Walk the bits of the address, remembering the last (i.e. longest)
+   * prefix seen along the way.
+   */
+  for (i = 0; node != NULL; i++) {
+    if (node->prefix != NULL) {
+      prefix = node->prefix;
+    }
+
+    if (i == max_len) {
+      break;
+    }
+
+    node = node->children[perhost_get_bit(addr_data, i)];
+  }
+
+  if (prefix == NULL) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  return prefix;
+}
+
+const char *proxy_reverse_perhost_key(pool *p, const pr_netaddr_t *addr,
+    unsigned int ipv4_len, unsigned int ipv6_len) {
+  int family = 0;
+  unsigned int len, max_len;
+  unsigned char addr_data[16];
+  const unsigned char *data;
+  char buf[128], len_text[16];
+
+  if (p == NULL ||
+      addr == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  data = perhost_get_addr(p, addr, &family);
+  if (data == NULL) {
+    return NULL;
+  }
+
+  max_len = perhost_max_len(family);
+  len = family == AF_INET ? ipv4_len : ipv6_len;
+
+  if (len >= max_len) {
+    /* The full address, as the PerHost policy has always used. */
+    return pstrdup(p, pr_netaddr_get_ipstr(addr));
+  }
+
+  memset(addr_data, 0, sizeof(addr_data));
+  memcpy(addr_data, data, max_len / 8);
+  perhost_mask(addr_data, max_len / 8, len);
+
+  memset(buf, '\0', sizeof(buf));
+  if (pr_inet_ntop(family, addr_data, buf, sizeof(buf)-1) == NULL) {
+    return NULL;
+  }
+
+  memset(len_text, '\0', sizeof(len_text));
+  snprintf(len_text, sizeof(len_text)-1, "%u", len);
+
+  return pstrcat(p, buf, "/", len_text, NULL);
+}
+
+int proxy_reverse_perhost_init(pool *p) {
+  unsigned int vhost_count = 0;
+  struct perhost_vhost *vhosts;
+  server_rec *s;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    if (s->sid >= vhost_count) {
+      vhost_count = s->sid + 1;
+    }
+  }
+
+  vhosts = pcalloc(p, vhost_count * sizeof(struct perhost_vhost));
+
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    register unsigned int i;
+    config_rec *c;
+    struct perhost_vhost *vhost;
+    array_header *prefixes;
+
+    c = find_config(s->conf, CONF_PARAM, "ProxyReverseConnectPolicy", FALSE);
+    if (c == NULL ||
+        *((int *) c->argv[0]) != PROXY_REVERSE_CONNECT_POLICY_PER_HOST) {
+      continue;
+    }
+
+    vhost = &(vhosts[s->sid]);
+    vhost->enabled = TRUE;
+    vhost->ipv4_len = 32;
+    vhost->ipv6_len = 128;
+
+    c = find_config(s->conf, CONF_PARAM, "ProxyReversePerHostPrefix", FALSE);
+    if (c != NULL) {
+      vhost->ipv4_len = *((unsigned int *) c->argv[0]);
+      vhost->ipv6_len = *((unsigned int *) c->argv[1]);
+    }
+
+    c = find_config(s->conf, CONF_PARAM, "ProxyReversePerHostMap", FALSE);
+    if (c == NULL) {
+      continue;
+    }
+
+    prefixes = c->argv[0];
+
+    vhost->tree = proxy_reverse_perhost_tree_create(p);
+    for (i = 0; i < prefixes->nelts; i++) {
+      struct proxy_reverse_perhost_prefix *prefix;
+
+      prefix = ((struct proxy_reverse_perhost_prefix **) prefixes->elts)[i];
+      if (proxy_reverse_perhost_tree_add(p, vhost->tree, prefix) < 0) {
+        return -1;
+      }
+    }
+
+    pr_trace_msg(trace_channel, 9,
+      "built tree of %u mapped prefixes for vhost '%s'", prefixes->nelts,
+      s->ServerName);
+  }
+
+  perhost_vhosts = vhosts;
+  perhost_vhost_count = vhost_count;
+
+  return 0;
+}
+
+int proxy_reverse_perhost_free(pool *p) {
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  perhost_vhosts = NULL;
+  perhost_vhost_count = 0;
+
+  return 0;
+}
+
+static struct perhost_vhost *perhost_get_vhost(unsigned int vhost_id) {
+  if (perhost_vhosts == NULL ||
+      vhost_id >= perhost_vhost_count ||
+      perhost_vhosts[vhost_id].enabled == FALSE) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  return &(perhost_vhosts[vhost_id]);
+}
+
+const struct proxy_conn *proxy_reverse_perhost_next_backend(pool *p,
+    unsigned int vhost_id, const pr_netaddr_t *addr) {
+  struct perhost_vhost *vhost;
+  const struct proxy_reverse_perhost_prefix *prefix;
+
+  if (p == NULL ||
+      addr == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  vhost = perhost_get_vhost(vhost_id);
+  if (vhost == NULL ||
+      vhost->tree == NULL) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  prefix = proxy_reverse_perhost_tree_lookup(p, vhost->tree, addr);
+  if (prefix == NULL) {
+    return NULL;
+  }
+
+  pr_trace_msg(trace_channel, 11,
+    "client %s matched mapped prefix of %u bits, using backend '%.100s'",
+    pr_netaddr_get_ipstr(addr), prefix->len,
+    proxy_conn_get_uri(prefix->pconn));
+  return prefix->pconn;
+}
+
+const char *proxy_reverse_perhost_get_key(pool *p, unsigned int vhost_id,
+    const pr_netaddr_t *addr) {
+  unsigned int ipv4_len = 32, ipv6_len = 128;
+  struct perhost_vhost *vhost;
+
+  if (p == NULL ||
+      addr == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  vhost = perhost_get_vhost(vhost_id);
+  if (vhost != NULL) {
+    ipv4_len = vhost->ipv4_len;
+    ipv6_len = vhost->ipv6_len;
+  }
+
+  return proxy_reverse_perhost_key(p, addr, ipv4_len, ipv6_len);
+}
@@ -41,6 +41,9 @@ static array_header *redis_backends = NULL;
 
 static const char *trace_channel = "proxy.reverse.redis";
 
+/* The number of our transfers in flight, as recorded in our lease. */
+static int redis_xfers = 0;
+
 static void *redis_prefix = NULL;
 static size_t redis_prefixsz = 0;
 
@@ -60,7 +63,7 @@ static char *make_key(pool *p, const char *policy, unsigned int vhost_id,
 
   key = pcalloc(p, keysz + 1);
 
-  if (name != NULL) {
+  if (name == NULL) {
     snprintf(key, keysz, "proxy_reverse:%s:vhost#%u", policy, vhost_id);
 
   } else {
@@ -108,6 +111,115 @@ static const char *backend_uri_by_idx(int idx) {
   return proxy_conn_get_uri(pconn);
 }
 
+/* Given a backend URI, return its index into the array_header of backend
+ * pconns, or -1 if not found.
+ */
+static int backend_idx_by_uri(const char *uri) {
+  register unsigned int i;
+
+  if (redis_backends == NULL ||
+      uri == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < redis_backends->nelts; i++) {
+    const struct proxy_conn *pconn;
+
+    pconn = ((struct proxy_conn **) redis_backends->elts)[i];
+    if (strcmp(proxy_conn_get_uri(pconn), uri) == 0) {
+      return (int) i;
+    }
+  }
+
+  return -1;
+}
+
+/* Backend health */
+
+/* The health of the backends of a vhost is kept in a Redis Hash, mapping the
+ * backend URI to the time (in millisecs since the epoch) until which that
+ * backend is not selected.  Once that time has passed, the backend is
+ * selected again, as a probe of its health.
+ */
+static pr_table_t *redis_get_health(pool *p, pr_redis_t *redis,
+    unsigned int vhost_id) {
+  int res;
+  char *key;
+  pr_table_t *health = NULL;
+
+  key = make_key(p, "Health", vhost_id, NULL);
+  res = pr_redis_hash_getall(p, redis, &proxy_module, key, &health);
+  if (res < 0) {
+    if (errno != ENOENT) {
+      pr_trace_msg(trace_channel, 3,
+        "error retrieving Health Redis entries using key '%s': %s", key,
+        strerror(errno));
+    }
+
+    return NULL;
+  }
+
+  return health;
+}
+
+static int redis_backend_usable(pool *p, pr_table_t *health,
+    const char *backend_uri, uint64_t now_ms) {
+  const void *val;
+  size_t valsz = 0;
+  unsigned long long until_ms;
+
+  if (health == NULL) {
+    return TRUE;
+  }
+
+  val = pr_table_kget(health, backend_uri, strlen(backend_uri), &valsz);
+  if (val == NULL) {
+    return TRUE;
+  }
+
+  until_ms = strtoull(pstrndup(p, val, valsz), NULL, 10);
+  if (until_ms == 0 ||
+      until_ms <= now_ms) {
+    return TRUE;
+  }
+
+  pr_trace_msg(trace_channel, 15,
+    "skipping unhealthy backend '%.100s'", backend_uri);
+  return FALSE;
+}
+
+static int redis_set_health(pool *p, pr_redis_t *redis, unsigned int vhost_id,
+    int backend_idx, uint64_t unhealthy_until_ms) {
+  int res, xerrno;
+  pool *tmp_pool;
+  char *key, *val;
+  const char *backend_uri;
+
+  backend_uri = backend_uri_by_idx(backend_idx);
+  if (backend_uri == NULL) {
+    return -1;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, "Health", vhost_id, NULL);
+  val = pcalloc(tmp_pool, 32);
+  snprintf(val, 31, "%llu", (unsigned long long) unhealthy_until_ms);
+
+  res = pr_redis_hash_set(redis, &proxy_module, key, backend_uri, val,
+    strlen(val));
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 6,
+      "error setting Health Redis entry for '%.100s': %s", backend_uri,
+      strerror(xerrno));
+  }
+
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
 /* Redis List helpers */
 static array_header *redis_get_list_backend_uris(pool *p,
     pr_redis_t *redis, const char *policy, unsigned int vhost_id,
@@ -359,7 +471,9 @@ static int reverse_redis_roundrobin_init(pool *p, pr_redis_t *redis,
 }
 
 static const struct proxy_conn *reverse_redis_roundrobin_next(pool *p,
-    pr_redis_t *redis, unsigned int vhost_id) {
+    pr_redis_t *redis, unsigned int vhost_id, pr_table_t *health,
+    uint64_t now_ms, int nelts) {
+  register int i;
   int res, xerrno;
   pool *tmp_pool;
   char *key, *backend_uri = NULL;
@@ -369,21 +483,31 @@ static const struct proxy_conn *reverse_redis_roundrobin_next(pool *p,
   tmp_pool = make_sub_pool(p);
   key = make_key(tmp_pool, "RoundRobin", vhost_id, NULL);
 
-  res = pr_redis_list_rotate(tmp_pool, redis, &proxy_module, key,
-    (void **) &backend_uri, &backend_urisz);
-  xerrno = errno;
+  /* Unhealthy backends use up their turns in the rotation; if all of the
+   * backends are unhealthy, we use the last one rotated.
+   */
+  for (i = 0; i < nelts || i == 0; i++) {
+    res = pr_redis_list_rotate(tmp_pool, redis, &proxy_module, key,
+      (void **) &backend_uri, &backend_urisz);
+    xerrno = errno;
 
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 3,
-      "error rotating RoundRobin Redis list using key '%s': %s", key,
-      strerror(xerrno));
+    if (res < 0) {
+      pr_trace_msg(trace_channel, 3,
+        "error rotating RoundRobin Redis list using key '%s': %s", key,
+        strerror(xerrno));
 
-    destroy_pool(tmp_pool);
-    errno = xerrno;
-    return NULL;
+      destroy_pool(tmp_pool);
+      errno = xerrno;
+      return NULL;
+    }
+
+    backend_uri = pstrndup(tmp_pool, backend_uri, backend_urisz);
+    if (redis_backend_usable(tmp_pool, health, backend_uri, now_ms) == TRUE) {
+      break;
+    }
   }
 
-  pconn = proxy_conn_create(p, pstrndup(tmp_pool, backend_uri, backend_urisz));
+  pconn = proxy_conn_create(p, backend_uri);
   xerrno = errno;
 
   if (pconn == NULL) {
@@ -413,7 +537,8 @@ static int reverse_redis_leastconns_init(pool *p, pr_redis_t *redis,
 }
 
 static const struct proxy_conn *reverse_redis_leastconns_next(pool *p,
-    pr_redis_t *redis, unsigned int vhost_id) {
+    pr_redis_t *redis, unsigned int vhost_id, pr_table_t *health,
+    uint64_t now_ms, int nelts) {
   int res, xerrno;
   pool *tmp_pool;
   char *key;
@@ -423,14 +548,27 @@ static const struct proxy_conn *reverse_redis_leastconns_next(pool *p,
   tmp_pool = make_sub_pool(p);
   key = make_key(tmp_pool, "LeastConns", vhost_id, NULL);
 
-  res = pr_redis_sorted_set_getn(tmp_pool, redis, &proxy_module, key, 0, 1,
-    &vals, &valszs, PR_REDIS_SORTED_SET_FL_ASC);
+  res = pr_redis_sorted_set_getn(tmp_pool, redis, &proxy_module, key, 0,
+    nelts > 0 ? nelts : 1, &vals, &valszs, PR_REDIS_SORTED_SET_FL_ASC);
   xerrno = errno;
 
-  if (res == 0) {
+  if (res == 0 &&
+      vals->nelts > 0) {
+    register unsigned int i;
     char *backend_uri;
 
+    /* Pick the first usable backend, if any. */
     backend_uri = ((char **) vals->elts)[0];
+    for (i = 0; i < vals->nelts; i++) {
+      char *uri;
+
+      uri = ((char **) vals->elts)[i];
+      if (redis_backend_usable(tmp_pool, health, uri, now_ms) == TRUE) {
+        backend_uri = uri;
+        break;
+      }
+    }
+
     pconn = proxy_conn_create(p, backend_uri);
   }
 
@@ -459,103 +597,924 @@ static int reverse_redis_leastconns_update(pool *p, pr_redis_t *redis,
     return -1;
   }
 
-  valsz = strlen(val);
+  valsz = strlen(val);
+
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, "LeastConns", vhost_id, NULL);
+
+  res = pr_redis_sorted_set_incr(redis, &proxy_module, key, (void *) val,
+    valsz, (float) conn_incr, &score);
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 6,
+      "error updating LeastConns Redis entry for '%.100s': %s", val,
+      strerror(xerrno));
+  }
+
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+/* ProxyReverseConnectPolicy: WeightedRandom */
+
+static int reverse_redis_weightedrandom_next(pool *p, array_header *backends,
+    pr_table_t *health, uint64_t now_ms) {
+  register unsigned int i;
+  int *usable;
+  struct proxy_conn **conns;
+
+  if (backends == NULL ||
+      backends->nelts == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  conns = backends->elts;
+  usable = palloc(p, backends->nelts * sizeof(int));
+  for (i = 0; i < backends->nelts; i++) {
+    usable[i] = redis_backend_usable(p, health,
+      proxy_conn_get_uri(conns[i]), now_ms);
+  }
+
+  return proxy_reverse_weighted_random(backends, usable);
+}
+
+/* ProxyReverseConnectPolicy: WeightedRoundRobin */
+
+/* The next position in the smooth weighted round-robin schedule of a vhost,
+ * per proxy_reverse_wrr_schedule(), is claimed by incrementing a Redis
+ * counter.
+ */
+static int reverse_redis_wrr_init(pool *p, pr_redis_t *redis,
+    unsigned int vhost_id) {
+  int res, xerrno = 0;
+  pool *tmp_pool;
+  char *key;
+
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, "WeightedRoundRobin", vhost_id, NULL);
+
+  res = pr_redis_remove(redis, &proxy_module, key);
+  if (res < 0) {
+    xerrno = errno;
+
+    if (xerrno == ENOENT) {
+      res = 0;
+
+    } else {
+      pr_trace_msg(trace_channel, 6,
+        "error removing WeightedRoundRobin Redis entry: %s", strerror(xerrno));
+    }
+  }
+
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+static int reverse_redis_wrr_next(pool *p, pr_redis_t *redis,
+    unsigned int vhost_id, array_header *backends, pr_table_t *health,
+    uint64_t now_ms) {
+  int res, xerrno, backend_idx = -1;
+  pool *tmp_pool;
+  char *key;
+  uint64_t position = 0;
+  array_header *schedule;
+  struct proxy_conn **conns;
+
+  schedule = proxy_reverse_wrr_get_schedule(backends);
+  if (schedule == NULL) {
+    return -1;
+  }
+
+  tmp_pool = make_sub_pool(p);
+
+  key = make_key(tmp_pool, "WeightedRoundRobin", vhost_id, NULL);
+  res = pr_redis_incr(redis, &proxy_module, key, 1, &position);
+  if (res < 0) {
+    xerrno = errno;
+
+    pr_trace_msg(trace_channel, 6,
+      "error incrementing WeightedRoundRobin Redis entry: %s",
+      strerror(xerrno));
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  /* The counter holds the number of positions claimed, including ours. */
+  position--;
+
+  conns = backends->elts;
+  backend_idx = ((int *) schedule->elts)[position % schedule->nelts];
+  if (redis_backend_usable(tmp_pool, health,
+      proxy_conn_get_uri(conns[backend_idx]), now_ms) != TRUE) {
+    /* The turn of an unhealthy backend goes to a healthy one, in proportion
+     * to their weights; see proxy_reverse_wrr_get_schedule().
+     */
+    backend_idx = reverse_redis_weightedrandom_next(tmp_pool, backends, health,
+      now_ms);
+  }
+
+  destroy_pool(tmp_pool);
+  return backend_idx;
+}
+
+/* ProxyReverseConnectPolicy: LeastResponseTime */
+
+/* Note: "least response time" is determined by the power of two choices over
+ * each backend server's connection count and latency averages; see
+ * proxy_reverse_latency_choose().
+ *
+ * The connection counts and latencies of the backends of a vhost are kept in
+ * a Redis Hash, with these fields for each backend URI:
+ *
+ *  <uri>:conns
+ *  <uri>:<phase>:ewma
+ *  <uri>:<phase>:samples
+ *  <uri>:<phase>:bucket<N>
+ *
+ * The counters are incremented atomically; the moving average is read and
+ * then written, thus concurrent samples for the same backend may overwrite
+ * each other, which only loses some smoothing.
+ */
+
+static double redis_latency_get(pool *p, pr_table_t *latency,
+    const char *field) {
+  const void *val;
+  size_t valsz = 0;
+
+  if (latency == NULL) {
+    return 0.0;
+  }
+
+  val = pr_table_kget(latency, field, strlen(field), &valsz);
+  if (val == NULL) {
+    return 0.0;
+  }
+
+  return atof(pstrndup(p, val, valsz));
+}
+
+static int reverse_redis_leastresponsetime_init(pool *p, pr_redis_t *redis,
+    unsigned int vhost_id, array_header *backends) {
+  int res, xerrno = 0;
+  pool *tmp_pool;
+  char *key;
+
+  /* Start over with no connections, and no latency samples. */
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, "Latency", vhost_id, NULL);
+
+  res = pr_redis_remove(redis, &proxy_module, key);
+  if (res < 0) {
+    xerrno = errno;
+
+    if (xerrno == ENOENT) {
+      res = 0;
+
+    } else {
+      pr_trace_msg(trace_channel, 6,
+        "error removing Latency Redis entries: %s", strerror(xerrno));
+    }
+  }
+
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+static const struct proxy_conn *reverse_redis_leastresponsetime_next(pool *p,
+    pr_redis_t *redis, unsigned int vhost_id, pr_table_t *health,
+    uint64_t now_ms) {
+  register unsigned int i;
+  int idx, res;
+  pool *tmp_pool;
+  char *key;
+  pr_table_t *latency = NULL;
+  struct proxy_reverse_backend_load *loads;
+  const struct proxy_conn *pconn = NULL;
+
+  if (redis_backends == NULL ||
+      redis_backends->nelts == 0) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, "Latency", vhost_id, NULL);
+
+  /* Note that if we cannot read the latencies, we proceed as if there were
+   * none yet.
+   */
+  res = pr_redis_hash_getall(tmp_pool, redis, &proxy_module, key, &latency);
+  if (res < 0 &&
+      errno != ENOENT) {
+    pr_trace_msg(trace_channel, 3,
+      "error retrieving Latency Redis entries using key '%s': %s", key,
+      strerror(errno));
+  }
+
+  loads = pcalloc(tmp_pool,
+    redis_backends->nelts * sizeof(struct proxy_reverse_backend_load));
+
+  for (i = 0; i < redis_backends->nelts; i++) {
+    register int phase;
+    const char *backend_uri;
+
+    backend_uri = backend_uri_by_idx(i);
+
+    loads[i].backend_id = i;
+    loads[i].conn_count = (long) redis_latency_get(tmp_pool, latency,
+      pstrcat(tmp_pool, backend_uri, ":conns", NULL));
+    loads[i].usable = redis_backend_usable(tmp_pool, health, backend_uri,
+      now_ms);
+
+    for (phase = PROXY_REVERSE_LATENCY_CONNECT;
+         phase <= PROXY_REVERSE_LATENCY_LOGIN;
+         phase++) {
+      const char *prefix;
+
+      prefix = pstrcat(tmp_pool, backend_uri, ":",
+        proxy_reverse_latency_name(phase), NULL);
+      if (redis_latency_get(tmp_pool, latency,
+          pstrcat(tmp_pool, prefix, ":samples", NULL)) > 0.0) {
+        loads[i].latency_ms += redis_latency_get(tmp_pool, latency,
+          pstrcat(tmp_pool, prefix, ":ewma", NULL));
+      }
+    }
+  }
+
+  idx = proxy_reverse_latency_choose(loads, redis_backends->nelts);
+  if (idx >= 0) {
+    pconn = proxy_conn_create(p, backend_uri_by_idx(idx));
+  }
+
+  destroy_pool(tmp_pool);
+  return pconn;
+}
+
+static int reverse_redis_leastresponsetime_used(pool *p, pr_redis_t *redis,
+    unsigned int vhost_id, int backend_idx) {
+  /* TODO: anything to do here? */
+  return 0;
+}
+
+static int reverse_redis_leastresponsetime_update(pool *p, pr_redis_t *redis,
+    unsigned int vhost_id, int backend_idx, int conn_incr, long connect_ms) {
+  int res, xerrno;
+  pool *tmp_pool;
+  char *key;
+  const char *backend_uri;
+  int64_t conn_count = 0;
+
+  backend_uri = backend_uri_by_idx(backend_idx);
+  if (backend_uri == NULL) {
+    return -1;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, "Latency", vhost_id, NULL);
+
+  res = pr_redis_hash_incr(redis, &proxy_module, key,
+    pstrcat(tmp_pool, backend_uri, ":conns", NULL), conn_incr, &conn_count);
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 6,
+      "error updating Latency Redis entry for '%.100s': %s", backend_uri,
+      strerror(xerrno));
+  }
+
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+/* ProxyReverseConnectPolicy: LeastTransfers */
+
+/* The transfer loads of the backends of a vhost are kept in a Redis Hash,
+ * whose fields are:
+ *
+ *  <uri>:conns
+ *  <uri>:xfers
+ *  <uri>:bytes:<window>
+ *
+ * The bytes are counted per window, per proxy_reverse_xfer_window(); only the
+ * current and the previous windows are needed for the rate, and the older
+ * fields are removed by the first session to count bytes in a new window.
+ */
+
+static double redis_xfers_get(pool *p, pr_table_t *xfers, const char *field) {
+  const void *val;
+  size_t valsz = 0;
+
+  if (xfers == NULL) {
+    return 0.0;
+  }
+
+  val = pr_table_kget(xfers, field, strlen(field), &valsz);
+  if (val == NULL) {
+    return 0.0;
+  }
+
+  return atof(pstrndup(p, val, valsz));
+}
+
+static const char *redis_xfers_bytes_field(pool *p, const char *backend_uri,
+    uint64_t window) {
+  char *field;
+  size_t fieldsz;
+
+  fieldsz = strlen(backend_uri) + 32;
+  field = pcalloc(p, fieldsz);
+  snprintf(field, fieldsz-1, "%s:bytes:%llu", backend_uri,
+    (unsigned long long) window);
+  return field;
+}
+
+static int reverse_redis_leasttransfers_init(pool *p, pr_redis_t *redis,
+    unsigned int vhost_id, array_header *backends) {
+  int res, xerrno = 0;
+  pool *tmp_pool;
+  char *key;
+
+  /* Start over with no connections, and no transfers. */
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, "Transfers", vhost_id, NULL);
+
+  res = pr_redis_remove(redis, &proxy_module, key);
+  if (res < 0) {
+    xerrno = errno;
+
+    if (xerrno == ENOENT) {
+      res = 0;
+
+    } else {
+      pr_trace_msg(trace_channel, 6,
+        "error removing Transfers Redis entries: %s", strerror(xerrno));
+    }
+  }
+
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+static const struct proxy_conn *reverse_redis_leasttransfers_next(pool *p,
+    pr_redis_t *redis, unsigned int vhost_id, pr_table_t *health,
+    uint64_t now_ms) {
+  register unsigned int i;
+  int idx, res;
+  uint64_t window;
+  pool *tmp_pool;
+  char *key;
+  pr_table_t *xfers = NULL;
+  struct proxy_reverse_backend_xfers *loads;
+  const struct proxy_conn *pconn = NULL;
+
+  if (redis_backends == NULL ||
+      redis_backends->nelts == 0) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, "Transfers", vhost_id, NULL);
+
+  /* Note that if we cannot read the transfers, we proceed as if there were
+   * none yet.
+   */
+  res = pr_redis_hash_getall(tmp_pool, redis, &proxy_module, key, &xfers);
+  if (res < 0 &&
+      errno != ENOENT) {
+    pr_trace_msg(trace_channel, 3,
+      "error retrieving Transfers Redis entries using key '%s': %s", key,
+      strerror(errno));
+  }
+
+  window = proxy_reverse_xfer_window(now_ms);
+  loads = pcalloc(tmp_pool,
+    redis_backends->nelts * sizeof(struct proxy_reverse_backend_xfers));
+
+  for (i = 0; i < redis_backends->nelts; i++) {
+    const char *backend_uri;
+    double bytes, prev_bytes;
+
+    backend_uri = backend_uri_by_idx(i);
+
+    loads[i].backend_id = i;
+    loads[i].conn_count = (long) redis_xfers_get(tmp_pool, xfers,
+      pstrcat(tmp_pool, backend_uri, ":conns", NULL));
+    loads[i].xfer_count = (long) redis_xfers_get(tmp_pool, xfers,
+      pstrcat(tmp_pool, backend_uri, ":xfers", NULL));
+
+    /* A reclaimed lease may briefly drive a count below zero. */
+    if (loads[i].xfer_count < 0) {
+      loads[i].xfer_count = 0;
+    }
+
+    bytes = redis_xfers_get(tmp_pool, xfers,
+      redis_xfers_bytes_field(tmp_pool, backend_uri, window));
+    prev_bytes = redis_xfers_get(tmp_pool, xfers,
+      redis_xfers_bytes_field(tmp_pool, backend_uri, window - 1));
+    loads[i].xfer_rate = proxy_reverse_xfer_rate(now_ms, window,
+      (uint64_t) bytes, (uint64_t) prev_bytes);
+
+    loads[i].usable = redis_backend_usable(tmp_pool, health, backend_uri,
+      now_ms);
+  }
+
+  idx = proxy_reverse_xfer_choose(loads, redis_backends->nelts);
+  if (idx >= 0) {
+    pconn = proxy_conn_create(p, backend_uri_by_idx(idx));
+  }
+
+  destroy_pool(tmp_pool);
+  return pconn;
+}
+
+static int reverse_redis_leasttransfers_used(pool *p, pr_redis_t *redis,
+    unsigned int vhost_id, int backend_idx) {
+  /* TODO: anything to do here? */
+  return 0;
+}
+
+static int reverse_redis_leasttransfers_incr(pool *p, pr_redis_t *redis,
+    unsigned int vhost_id, int backend_idx, const char *name, int64_t incr,
+    int64_t *count) {
+  int res, xerrno;
+  pool *tmp_pool;
+  char *key;
+  const char *backend_uri;
+
+  backend_uri = backend_uri_by_idx(backend_idx);
+  if (backend_uri == NULL) {
+    return -1;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, "Transfers", vhost_id, NULL);
+
+  res = pr_redis_hash_incr(redis, &proxy_module, key,
+    pstrcat(tmp_pool, backend_uri, ":", name, NULL), incr, count);
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 6,
+      "error updating Transfers Redis entry for '%.100s': %s", backend_uri,
+      strerror(xerrno));
+  }
+
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+static int reverse_redis_leasttransfers_update(pool *p, pr_redis_t *redis,
+    unsigned int vhost_id, int backend_idx, int conn_incr, long connect_ms) {
+  int64_t conn_count = 0;
+
+  return reverse_redis_leasttransfers_incr(p, redis, vhost_id, backend_idx,
+    "conns", conn_incr, &conn_count);
+}
+
+/* Removes the byte counts of the given backend older than the previous
+ * window.
+ */
+static void redis_xfers_expire(pool *p, pr_redis_t *redis,
+    unsigned int vhost_id, int backend_idx, uint64_t window) {
+  int res;
+  pool *tmp_pool;
+  char *key, *prefix;
+  const void *k;
+  size_t ksz = 0, prefixsz;
+  const char *backend_uri;
+  pr_table_t *xfers = NULL;
+
+  backend_uri = backend_uri_by_idx(backend_idx);
+  if (backend_uri == NULL) {
+    return;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, "Transfers", vhost_id, NULL);
+
+  res = pr_redis_hash_getall(tmp_pool, redis, &proxy_module, key, &xfers);
+  if (res < 0) {
+    destroy_pool(tmp_pool);
+    return;
+  }
+
+  prefix = pstrcat(tmp_pool, backend_uri, ":bytes:", NULL);
+  prefixsz = strlen(prefix);
+
+  pr_table_rewind(xfers);
+  k = pr_table_knext(xfers, &ksz);
+  while (k != NULL) {
+    char *name;
+
+    pr_signals_handle();
+
+    name = pstrndup(tmp_pool, k, ksz);
+    if (strncmp(name, prefix, prefixsz) == 0 &&
+        strtoull(name + prefixsz, NULL, 10) + 1 < window) {
+      (void) pr_redis_hash_remove(redis, &proxy_module, key, name);
+    }
+
+    k = pr_table_knext(xfers, &ksz);
+  }
+
+  destroy_pool(tmp_pool);
+}
+
+static int reverse_redis_leasttransfers_bytes(pool *p, pr_redis_t *redis,
+    unsigned int vhost_id, int backend_idx, off_t xfer_bytes) {
+  int res;
+  uint64_t now_ms, window;
+  pool *tmp_pool;
+  char *name;
+  int64_t count = 0;
+
+  pr_gettimeofday_millis(&now_ms);
+  window = proxy_reverse_xfer_window(now_ms);
+
+  tmp_pool = make_sub_pool(p);
+  name = pcalloc(tmp_pool, 32);
+  snprintf(name, 31, "bytes:%llu", (unsigned long long) window);
+
+  res = reverse_redis_leasttransfers_incr(tmp_pool, redis, vhost_id,
+    backend_idx, name, (int64_t) xfer_bytes, &count);
+  if (res == 0 &&
+      count == (int64_t) xfer_bytes) {
+    /* We are the first to count bytes in this window. */
+    redis_xfers_expire(tmp_pool, redis, vhost_id, backend_idx, window);
+  }
+
+  destroy_pool(tmp_pool);
+  return res;
+}
+
+/* Connection leases */
+
+/* The leases of the sessions connected to the backends of a vhost are kept
+ * in a Redis Hash, mapping the "pid:start" text of each session process to
+ * the index of its backend.  A lease is taken before the connection count
+ * of the backend is incremented, and the count is only decremented by whoever
+ * removes the lease: the session itself, as it ends, or a session which finds
+ * that the lease holder is no longer running.
+ *
+ * For the LeastTransfers policy, a session with transfers in flight appends
+ * their number to its lease, as "<index>:<xfers>", so that the transfers of
+ * a dead session are decremented along with its connection.
+ */
+
+static int redis_update_conns(pool *p, pr_redis_t *redis, int policy_id,
+    unsigned int vhost_id, int backend_idx, int conn_incr) {
+  int res;
+
+  switch (policy_id) {
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS:
+      res = reverse_redis_leastconns_update(p, redis, vhost_id, backend_idx,
+        conn_incr, -1);
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME:
+      res = reverse_redis_leastresponsetime_update(p, redis, vhost_id,
+        backend_idx, conn_incr, -1);
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS:
+      res = reverse_redis_leasttransfers_update(p, redis, vhost_id,
+        backend_idx, conn_incr, -1);
+      break;
+
+    default:
+      res = 0;
+      break;
+  }
+
+  return res;
+}
+
+static int redis_clear_leases(pool *p, pr_redis_t *redis,
+    unsigned int vhost_id) {
+  int res, xerrno = 0;
+  pool *tmp_pool;
+  char *key;
+
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, "Leases", vhost_id, NULL);
+
+  res = pr_redis_remove(redis, &proxy_module, key);
+  if (res < 0) {
+    xerrno = errno;
+
+    if (xerrno == ENOENT) {
+      res = 0;
+
+    } else {
+      pr_trace_msg(trace_channel, 6,
+        "error removing Leases Redis entries: %s", strerror(xerrno));
+    }
+  }
+
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+static int redis_take_lease(pool *p, pr_redis_t *redis, int policy_id,
+    unsigned int vhost_id, int backend_idx) {
+  int res, xerrno;
+  pool *tmp_pool;
+  char *key, *val;
+  const char *lease_text;
+  struct proxy_reverse_lease lease;
+
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, "Leases", vhost_id, NULL);
+
+  (void) proxy_reverse_lease_get(&lease);
+  lease_text = proxy_reverse_lease_text(tmp_pool, &lease);
+
+  val = pcalloc(tmp_pool, 32);
+  snprintf(val, 31, "%d", backend_idx);
+
+  res = pr_redis_hash_set(redis, &proxy_module, key, lease_text, val,
+    strlen(val));
+  if (res < 0) {
+    xerrno = errno;
+
+    pr_trace_msg(trace_channel, 6,
+      "error setting Leases Redis entry for '%s': %s", lease_text,
+      strerror(xerrno));
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  res = redis_update_conns(tmp_pool, redis, policy_id, vhost_id, backend_idx,
+    1);
+  xerrno = errno;
+
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+static int redis_drop_lease(pool *p, pr_redis_t *redis, int policy_id,
+    unsigned int vhost_id, int backend_idx, int xfers,
+    const char *lease_text) {
+  int res, xerrno;
+  pool *tmp_pool;
+  char *key;
+
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, "Leases", vhost_id, NULL);
+
+  res = pr_redis_hash_remove(redis, &proxy_module, key, lease_text);
+  if (res < 0) {
+    xerrno = errno;
+
+    /* If the lease is already gone, so is its connection count. */
+    if (xerrno != ENOENT) {
+      pr_trace_msg(trace_channel, 6,
+        "error removing Leases Redis entry for '%s': %s", lease_text,
+        strerror(xerrno));
+    }
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  res = redis_update_conns(tmp_pool, redis, policy_id, vhost_id, backend_idx,
+    -1);
+  xerrno = errno;
+
+  if (xfers > 0 &&
+      policy_id == PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS) {
+    int64_t xfer_count = 0;
+
+    (void) reverse_redis_leasttransfers_incr(tmp_pool, redis, vhost_id,
+      backend_idx, "xfers", -xfers, &xfer_count);
+  }
+
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+/* Records the number of our transfers in flight in our lease. */
+static int redis_set_lease_xfers(pool *p, pr_redis_t *redis,
+    unsigned int vhost_id, int backend_idx, int xfers) {
+  int res, xerrno;
+  pool *tmp_pool;
+  char *key, *val;
+  const char *lease_text;
+  struct proxy_reverse_lease lease;
+
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, "Leases", vhost_id, NULL);
+
+  (void) proxy_reverse_lease_get(&lease);
+  lease_text = proxy_reverse_lease_text(tmp_pool, &lease);
+
+  val = pcalloc(tmp_pool, 32);
+  if (xfers > 0) {
+    snprintf(val, 31, "%d:%d", backend_idx, xfers);
+
+  } else {
+    snprintf(val, 31, "%d", backend_idx);
+  }
+
+  res = pr_redis_hash_set(redis, &proxy_module, key, lease_text, val,
+    strlen(val));
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 6,
+      "error setting Leases Redis entry for '%s': %s", lease_text,
+      strerror(xerrno));
+  }
+
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+static int redis_release_lease(pool *p, pr_redis_t *redis, int policy_id,
+    unsigned int vhost_id, int backend_idx) {
+  int res;
+  pool *tmp_pool;
+  struct proxy_reverse_lease lease;
 
   tmp_pool = make_sub_pool(p);
-  key = make_key(tmp_pool, "LeastConns", vhost_id, NULL);
+  (void) proxy_reverse_lease_get(&lease);
 
-  score = (float) conn_incr;
-  res = pr_redis_sorted_set_set(redis, &proxy_module, key, (void *) val, valsz,
-    score);
-  xerrno = errno;
+  /* Our transfers have ended before our connection does. */
+  res = redis_drop_lease(tmp_pool, redis, policy_id, vhost_id, backend_idx, 0,
+    proxy_reverse_lease_text(tmp_pool, &lease));
+  if (res < 0 &&
+      errno == ENOENT) {
+    pr_trace_msg(trace_channel, 9,
+      "lease for backend index %d already reclaimed", backend_idx);
+    res = 0;
+  }
 
   destroy_pool(tmp_pool);
-  errno = xerrno;
   return res;
 }
 
-/* ProxyReverseConnectPolicy: LeastResponseTime */
-
-/* Note: "least response time" is determined by calculating the following
- * for each backend server:
- *
- *  N = connection count * connect time (ms)
- *
- * and choosing the backend with the lowest value for N.  If there are no
- * backend servers with connect time values, choose the one with the lowest
- * connection count.
+/* At most once per interval, one session checks the leases of its vhost for
+ * dead holders.  The session which gets to do this is the one which first
+ * increments the field for the current interval, in another Redis Hash.
  */
+static int redis_claim_reclaim(pool *p, pr_redis_t *redis,
+    unsigned int vhost_id, uint64_t now_ms) {
+  int res;
+  char *key, *field;
+  const void *k;
+  size_t ksz = 0;
+  int64_t count = 0;
+  pr_table_t *claims = NULL;
+
+  key = make_key(p, "Leases", vhost_id, "Reclaim");
+  field = pcalloc(p, 32);
+  snprintf(field, 31, "%llu",
+    (unsigned long long) (now_ms / PROXY_REVERSE_LEASE_RECLAIM_INTERVAL_MS));
+
+  res = pr_redis_hash_incr(redis, &proxy_module, key, field, 1, &count);
+  if (res < 0 ||
+      count != 1) {
+    return FALSE;
+  }
 
-static int reverse_redis_leastresponsetime_init(pool *p, pr_redis_t *redis,
-    unsigned int vhost_id, array_header *backends) {
-  return redis_set_sorted_set_backends(p, redis, "LeastResponseTime", vhost_id,
-    backends, 0.0);
+  /* Remove the claims of the previous intervals. */
+  res = pr_redis_hash_getall(p, redis, &proxy_module, key, &claims);
+  if (res < 0) {
+    return TRUE;
+  }
+
+  pr_table_rewind(claims);
+  k = pr_table_knext(claims, &ksz);
+  while (k != NULL) {
+    char *name;
+
+    pr_signals_handle();
+
+    name = pstrndup(p, k, ksz);
+    if (strcmp(name, field) != 0) {
+      (void) pr_redis_hash_remove(redis, &proxy_module, key, name);
+    }
+
+    k = pr_table_knext(claims, &ksz);
+  }
+
+  return TRUE;
 }
 
-static const struct proxy_conn *reverse_redis_leastresponsetime_next(pool *p,
-    pr_redis_t *redis, unsigned int vhost_id) {
-  int res, xerrno;
+static int redis_reclaim_leases(pool *p, pr_redis_t *redis, int policy_id,
+    unsigned int vhost_id, uint64_t now_ms) {
+  int res, reclaimed = 0;
   pool *tmp_pool;
   char *key;
-  array_header *vals = NULL, *valszs = NULL;
-  const struct proxy_conn *pconn = NULL;
+  const void *k;
+  size_t ksz = 0;
+  array_header *dead_leases, *dead_idxs, *dead_xfers;
+  pr_table_t *leases = NULL;
+  register unsigned int i;
 
   tmp_pool = make_sub_pool(p);
-  key = make_key(tmp_pool, "LeastResponseTime", vhost_id, NULL);
 
-  res = pr_redis_sorted_set_getn(tmp_pool, redis, &proxy_module, key, 0, 1,
-    &vals, &valszs, PR_REDIS_SORTED_SET_FL_ASC);
-  xerrno = errno;
+  if (redis_claim_reclaim(tmp_pool, redis, vhost_id, now_ms) != TRUE) {
+    destroy_pool(tmp_pool);
+    return 0;
+  }
 
-  if (res == 0) {
-    char *backend_uri;
+  key = make_key(tmp_pool, "Leases", vhost_id, NULL);
+  res = pr_redis_hash_getall(tmp_pool, redis, &proxy_module, key, &leases);
+  if (res < 0) {
+    int xerrno = errno;
 
-    backend_uri = ((char **) vals->elts)[0];
-    pconn = proxy_conn_create(p, backend_uri);
+    destroy_pool(tmp_pool);
+
+    if (xerrno == ENOENT) {
+      return 0;
+    }
+
+    errno = xerrno;
+    return -1;
   }
 
-  destroy_pool(tmp_pool);
-  errno = xerrno;
-  return pconn;
-}
+  /* Collect the dead leases first, rather than modifying the Hash while
+   * iterating over our copy of it.
+   */
+  dead_leases = make_array(tmp_pool, 0, sizeof(char *));
+  dead_idxs = make_array(tmp_pool, 0, sizeof(int));
+  dead_xfers = make_array(tmp_pool, 0, sizeof(int));
+
+  pr_table_rewind(leases);
+  k = pr_table_knext(leases, &ksz);
+  while (k != NULL) {
+    char *lease_text;
+    const void *v;
+    size_t vsz = 0;
+    struct proxy_reverse_lease lease;
 
-static int reverse_redis_leastresponsetime_used(pool *p, pr_redis_t *redis,
-    unsigned int vhost_id, int backend_idx) {
-  /* TODO: anything to do here? */
-  return 0;
-}
+    pr_signals_handle();
 
-static int reverse_redis_leastresponsetime_update(pool *p, pr_redis_t *redis,
-    unsigned int vhost_id, int backend_idx, int conn_incr, long connect_ms) {
-  int res, xerrno;
-  pool *tmp_pool;
-  char *key;
-  const char *val;
-  float score;
-  size_t valsz;
+    lease_text = pstrndup(tmp_pool, k, ksz);
+    if (proxy_reverse_lease_parse(lease_text, &lease) < 0 ||
+        proxy_reverse_lease_is_live(&lease) == FALSE) {
+      v = pr_table_kget(leases, k, ksz, &vsz);
+      if (v != NULL) {
+        char *val, *ptr;
 
-  val = backend_uri_by_idx(backend_idx);
-  if (val == NULL) {
-    return -1;
+        val = pstrndup(tmp_pool, v, vsz);
+        ptr = strchr(val, ':');
+
+        *((char **) push_array(dead_leases)) = lease_text;
+        *((int *) push_array(dead_idxs)) = atoi(val);
+        *((int *) push_array(dead_xfers)) = ptr != NULL ? atoi(ptr + 1) : 0;
+      }
+    }
+
+    k = pr_table_knext(leases, &ksz);
   }
 
-  valsz = strlen(val);
+  for (i = 0; i < dead_leases->nelts; i++) {
+    char *lease_text;
+    int backend_idx, xfers;
 
-  tmp_pool = make_sub_pool(p);
-  key = make_key(tmp_pool, "LeastResponseTime", vhost_id, NULL);
+    lease_text = ((char **) dead_leases->elts)[i];
+    backend_idx = ((int *) dead_idxs->elts)[i];
+    xfers = ((int *) dead_xfers->elts)[i];
 
-  score = (float) conn_incr;
-  if (connect_ms > 0) {
-    score *= (float) connect_ms;
+    pr_trace_msg(trace_channel, 9,
+      "reclaiming lease '%s' of dead session for vhost ID %u, backend index %d",
+      lease_text, vhost_id, backend_idx);
+
+    /* Only whoever removes the lease decrements the count. */
+    if (redis_drop_lease(tmp_pool, redis, policy_id, vhost_id, backend_idx,
+        xfers, lease_text) == 0) {
+      reclaimed++;
+    }
   }
 
-  res = pr_redis_sorted_set_set(redis, &proxy_module, key, (void *) val, valsz,
-    score);
-  xerrno = errno;
+  if (reclaimed > 0) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "reclaimed %d %s of dead sessions for vhost ID %u", reclaimed,
+      reclaimed != 1 ? "leases" : "lease", vhost_id);
+  }
 
   destroy_pool(tmp_pool);
-  errno = xerrno;
-  return res;
+  return reclaimed;
 }
 
 /* ProxyReverseConnectPolicy: PerUser */
@@ -724,23 +1683,19 @@ static int reverse_redis_pergroup_used(pool *p, pr_redis_t *redis,
 /* ProxyReverseConnectPolicy: PerHost */
 
 static array_header *reverse_redis_perhost_get(pool *p, pr_redis_t *redis,
-    unsigned int vhost_id, const pr_netaddr_t *addr) {
-  return redis_get_list_backend_uris(p, redis, "PerHost", vhost_id,
-    pr_netaddr_get_ipstr(addr));
+    unsigned int vhost_id, const char *host) {
+  return redis_get_list_backend_uris(p, redis, "PerHost", vhost_id, host);
 }
 
 static const struct proxy_conn *reverse_redis_perhost_init(pool *p,
     pr_redis_t *redis, unsigned int vhost_id, array_header *backends,
-    const pr_netaddr_t *addr) {
+    const char *host) {
   int res;
   const struct proxy_conn *pconn = NULL;
   struct proxy_conn **conns;
-  const char *ip;
-
-  ip = pr_netaddr_get_ipstr(addr);
 
   /* Store these backends for later use. */
-  res = redis_set_list_backends(p, redis, "PerHost", vhost_id, ip, backends);
+  res = redis_set_list_backends(p, redis, "PerHost", vhost_id, host, backends);
   if (res < 0) {
     return NULL;
   }
@@ -751,12 +1706,12 @@ static const struct proxy_conn *reverse_redis_perhost_init(pool *p,
     pconn = conns[0];
 
   } else {
-    size_t iplen;
+    size_t hostlen;
     unsigned int h;
     int idx;
 
-    iplen = strlen(ip);
-    h = str2hash(ip, iplen);
+    hostlen = strlen(host);
+    h = str2hash(host, hostlen);
     idx = h % backends->nelts;
 
     pconn = conns[idx];
@@ -766,11 +1721,11 @@ static const struct proxy_conn *reverse_redis_perhost_init(pool *p,
 }
 
 static const struct proxy_conn *reverse_redis_perhost_next(pool *p,
-    pr_redis_t *redis, unsigned int vhost_id, const pr_netaddr_t *addr) {
+    pr_redis_t *redis, unsigned int vhost_id, const char *host) {
   array_header *backend_uris;
   const struct proxy_conn *pconn = NULL;
 
-  backend_uris = reverse_redis_perhost_get(p, redis, vhost_id, addr);
+  backend_uris = reverse_redis_perhost_get(p, redis, vhost_id, host);
   if (backend_uris == NULL &&
       errno == ENOENT) {
 
@@ -778,11 +1733,11 @@ static const struct proxy_conn *reverse_redis_perhost_next(pool *p,
      * of the backends for this host, and try again.
      */
     pconn = reverse_redis_perhost_init(p, redis, vhost_id, redis_backends,
-      addr);
+      host);
     if (pconn == NULL) {
       (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
         "error preparing PerHost Redis entries for host '%s': %s",
-        pr_netaddr_get_ipstr(addr), strerror(errno));
+        host, strerror(errno));
       errno = EPERM;
       return NULL;
     }
@@ -811,11 +1766,23 @@ static int reverse_redis_policy_init(pool *p, void *redis, int policy_id,
 
   switch (policy_id) {
     case PROXY_REVERSE_CONNECT_POLICY_RANDOM:
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_RANDOM:
     case PROXY_REVERSE_CONNECT_POLICY_PER_USER:
     case PROXY_REVERSE_CONNECT_POLICY_PER_HOST:
       /* No preparation needed at this time. */
       break;
 
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_ROUND_ROBIN:
+      res = reverse_redis_wrr_init(p, redis, vhost_id);
+      if (res < 0) {
+        xerrno = errno;
+        pr_log_debug(DEBUG3, MOD_PROXY_VERSION
+          ": error preparing %s Redis entries: %s",
+          proxy_reverse_policy_name(policy_id), strerror(xerrno));
+        errno = xerrno;
+      }
+      break;
+
     case PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN:
       if (backends != NULL) {
         res = reverse_redis_roundrobin_init(p, redis, vhost_id, backends);
@@ -844,6 +1811,9 @@ static int reverse_redis_policy_init(pool *p, void *redis, int policy_id,
 
     case PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS:
       if (backends != NULL) {
+        /* The counts start over, and so do the leases. */
+        (void) redis_clear_leases(p, redis, vhost_id);
+
         res = reverse_redis_leastconns_init(p, redis, vhost_id, backends);
         if (res < 0) {
           xerrno = errno;
@@ -857,6 +1827,8 @@ static int reverse_redis_policy_init(pool *p, void *redis, int policy_id,
 
     case PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME:
       if (backends != NULL) {
+        (void) redis_clear_leases(p, redis, vhost_id);
+
         res = reverse_redis_leastresponsetime_init(p, redis, vhost_id,
           backends);
         if (res < 0) {
@@ -869,6 +1841,21 @@ static int reverse_redis_policy_init(pool *p, void *redis, int policy_id,
       }
       break;
 
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS:
+      if (backends != NULL) {
+        (void) redis_clear_leases(p, redis, vhost_id);
+
+        res = reverse_redis_leasttransfers_init(p, redis, vhost_id, backends);
+        if (res < 0) {
+          xerrno = errno;
+          pr_log_debug(DEBUG3, MOD_PROXY_VERSION
+            ": error preparing %s Redis entries: %s",
+            proxy_reverse_policy_name(policy_id), strerror(xerrno));
+          errno = xerrno;
+        }
+      }
+      break;
+
     case PROXY_REVERSE_CONNECT_POLICY_PER_GROUP:
       if (!(opts & PROXY_OPT_USE_REVERSE_PROXY_AUTH)) {
         pr_log_pri(PR_LOG_NOTICE, MOD_PROXY_VERSION
@@ -894,7 +1881,11 @@ static const struct proxy_conn *reverse_redis_policy_next_backend(pool *p,
   const struct proxy_conn *pconn = NULL;
   struct proxy_conn **conns = NULL;
   int idx = -1, nelts = 0;
+  array_header *backends;
+  pr_table_t *health = NULL;
+  uint64_t now_ms = 0;
 
+  backends = redis_backends;
   if (redis_backends != NULL) {
     conns = redis_backends->elts;
     nelts = redis_backends->nelts;
@@ -904,15 +1895,35 @@ static const struct proxy_conn *reverse_redis_policy_next_backend(pool *p,
     if (conns == NULL &&
         default_backends != NULL &&
         redis_backends == NULL) {
+      backends = default_backends;
       conns = default_backends->elts;
       nelts = default_backends->nelts;
     }
+
+    /* Note that if we cannot determine the health of the backends, we
+     * proceed as if they were all healthy.
+     */
+    health = redis_get_health(p, redis, vhost_id);
+    pr_gettimeofday_millis(&now_ms);
   }
 
   switch (policy_id) {
     case PROXY_REVERSE_CONNECT_POLICY_RANDOM:
       idx = (int) proxy_random_next(0, nelts-1);
       if (idx >= 0) {
+        register int i;
+
+        for (i = 0; i < nelts; i++) {
+          int next_idx;
+
+          next_idx = (idx + i) % nelts;
+          if (redis_backend_usable(p, health,
+              proxy_conn_get_uri(conns[next_idx]), now_ms) == TRUE) {
+            idx = next_idx;
+            break;
+          }
+        }
+
         pr_trace_msg(trace_channel, 11, "%s policy: selected index %d of %u",
           proxy_reverse_policy_name(policy_id), idx, nelts-1);
         pconn = conns[idx];
@@ -920,8 +1931,10 @@ static const struct proxy_conn *reverse_redis_policy_next_backend(pool *p,
       break;
 
     case PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN:
-      pconn = reverse_redis_roundrobin_next(p, redis, vhost_id);
+      pconn = reverse_redis_roundrobin_next(p, redis, vhost_id, health, now_ms,
+        nelts);
       if (pconn != NULL) {
+        idx = backend_idx_by_uri(proxy_conn_get_uri(pconn));
         pr_trace_msg(trace_channel, 11,
           "%s policy: selected backend '%.100s'",
           proxy_reverse_policy_name(policy_id), proxy_conn_get_uri(pconn));
@@ -930,6 +1943,35 @@ static const struct proxy_conn *reverse_redis_policy_next_backend(pool *p,
 
     case PROXY_REVERSE_CONNECT_POLICY_SHUFFLE:
       idx = (int) reverse_redis_shuffle_next(p, redis, vhost_id);
+      if (idx >= 0) {
+        register int i;
+
+        /* Unhealthy backends use up their turns in the shuffle. */
+        for (i = 1; i < nelts; i++) {
+          int next_idx;
+
+          if (redis_backend_usable(p, health, proxy_conn_get_uri(conns[idx]),
+              now_ms) == TRUE) {
+            break;
+          }
+
+          next_idx = (int) reverse_redis_shuffle_next(p, redis, vhost_id);
+          if (next_idx < 0) {
+            break;
+          }
+
+          idx = next_idx;
+        }
+
+        pr_trace_msg(trace_channel, 11, "%s policy: selected index %d of %u",
+          proxy_reverse_policy_name(policy_id), idx, nelts-1);
+        pconn = conns[idx];
+      }
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_ROUND_ROBIN:
+      idx = reverse_redis_wrr_next(p, redis, vhost_id, backends, health,
+        now_ms);
       if (idx >= 0) {
         pr_trace_msg(trace_channel, 11, "%s policy: selected index %d of %u",
           proxy_reverse_policy_name(policy_id), idx, nelts-1);
@@ -937,11 +1979,26 @@ static const struct proxy_conn *reverse_redis_policy_next_backend(pool *p,
       }
       break;
 
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_RANDOM:
+      idx = reverse_redis_weightedrandom_next(p, backends, health, now_ms);
+      if (idx >= 0) {
+        pr_trace_msg(trace_channel, 11, "%s policy: selected index %d of %u",
+          proxy_reverse_policy_name(policy_id), idx, nelts-1);
+        pconn = conns[idx];
+      }
       break;
 
     case PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS:
-      pconn = reverse_redis_leastconns_next(p, redis, vhost_id);
+      if (redis_reclaim_leases(p, redis, policy_id, vhost_id, now_ms) < 0) {
+        pr_trace_msg(trace_channel, 3,
+          "error reclaiming leases for vhost ID %u: %s", vhost_id,
+          strerror(errno));
+      }
+
+      pconn = reverse_redis_leastconns_next(p, redis, vhost_id, health, now_ms,
+        nelts);
       if (pconn != NULL) {
+        idx = backend_idx_by_uri(proxy_conn_get_uri(pconn));
         pr_trace_msg(trace_channel, 11,
           "%s policy: selected backend '%.100s'",
           proxy_reverse_policy_name(policy_id), proxy_conn_get_uri(pconn));
@@ -949,8 +2006,33 @@ static const struct proxy_conn *reverse_redis_policy_next_backend(pool *p,
       break;
 
     case PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME:
-      pconn = reverse_redis_leastresponsetime_next(p, redis, vhost_id);
+      if (redis_reclaim_leases(p, redis, policy_id, vhost_id, now_ms) < 0) {
+        pr_trace_msg(trace_channel, 3,
+          "error reclaiming leases for vhost ID %u: %s", vhost_id,
+          strerror(errno));
+      }
+
+      pconn = reverse_redis_leastresponsetime_next(p, redis, vhost_id, health,
+        now_ms);
+      if (pconn != NULL) {
+        idx = backend_idx_by_uri(proxy_conn_get_uri(pconn));
+        pr_trace_msg(trace_channel, 11,
+          "%s policy: selected backend '%.100s'",
+          proxy_reverse_policy_name(policy_id), proxy_conn_get_uri(pconn));
+      }
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS:
+      if (redis_reclaim_leases(p, redis, policy_id, vhost_id, now_ms) < 0) {
+        pr_trace_msg(trace_channel, 3,
+          "error reclaiming leases for vhost ID %u: %s", vhost_id,
+          strerror(errno));
+      }
+
+      pconn = reverse_redis_leasttransfers_next(p, redis, vhost_id, health,
+        now_ms);
       if (pconn != NULL) {
+        idx = backend_idx_by_uri(proxy_conn_get_uri(pconn));
         pr_trace_msg(trace_channel, 11,
           "%s policy: selected backend '%.100s'",
           proxy_reverse_policy_name(policy_id), proxy_conn_get_uri(pconn));
@@ -977,16 +2059,26 @@ static const struct proxy_conn *reverse_redis_policy_next_backend(pool *p,
       }
       break;
 
-    case PROXY_REVERSE_CONNECT_POLICY_PER_HOST:
-      pconn = reverse_redis_perhost_next(p, redis, vhost_id,
-        session.c->remote_addr);
+    case PROXY_REVERSE_CONNECT_POLICY_PER_HOST: {
+      const char *host;
+
+      /* The host may be given as an address prefix, per
+       * ProxyReversePerHostPrefix.
+       */
+      host = policy_data;
+      if (host == NULL) {
+        host = pr_netaddr_get_ipstr(session.c->remote_addr);
+      }
+
+      pconn = reverse_redis_perhost_next(p, redis, vhost_id, host);
       if (pconn != NULL) {
         pr_trace_msg(trace_channel, 11,
           "%s policy: selected backend '%.100s' for host '%s'",
           proxy_reverse_policy_name(policy_id), proxy_conn_get_uri(pconn),
-          pr_netaddr_get_ipstr(session.c->remote_addr));
+          host);
       }
       break;
+    }
  
     default:
       errno = ENOSYS;
@@ -1017,25 +2109,34 @@ static int reverse_redis_policy_update_backend(pool *p, void *redis,
     return 0;
   }
 
-  /* TODO: Right now, we simply overwrite/track the very latest connect ms.
-   * But this could unfairly skew policies such as LeastResponseTime, as when
-   * the server in question had higher latency for that particular connection,
-   * due to e.g. OCSP response cache expiration.
-   *
-   * Another way would to be average the given connect ms with the previous
-   * one (if present), and store that.  Something to ponder for the future.
+  /* Note that the LeastResponseTime policy uses the latency averages, which
+   * are recorded via reverse_redis_policy_latency_backend(), rather than the
+   * given connect ms.
+   */
+
+  if (connect_ms > 0) {
+    /* A successful connection also means that the backend is healthy. */
+    (void) redis_set_health(p, redis, vhost_id, backend_idx, 0);
+  }
+
+  /* The Redis entries track the connection count, so an update with no
+   * change in that count (e.g. from a health check) has nothing to set.
    */
+  if (conn_incr == 0) {
+    return 0;
+  }
 
   switch (policy_id) {
     case PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS:
-      res = reverse_redis_leastconns_update(p, redis, vhost_id, backend_idx,
-        conn_incr, connect_ms);
-      xerrno = errno;
-      break;
-
     case PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME:
-      res = reverse_redis_leastresponsetime_update(p, redis, vhost_id,
-        backend_idx, conn_incr, connect_ms);
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS:
+      /* The connection counts follow the leases; see redis_take_lease(). */
+      if (conn_incr > 0) {
+        res = redis_take_lease(p, redis, policy_id, vhost_id, backend_idx);
+
+      } else {
+        res = redis_release_lease(p, redis, policy_id, vhost_id, backend_idx);
+      }
       xerrno = errno;
       break;
 
@@ -1048,12 +2149,179 @@ static int reverse_redis_policy_update_backend(pool *p, void *redis,
   return res;
 }
 
+static int reverse_redis_policy_health_backend(pool *p, void *redis,
+    int policy_id, unsigned int vhost_id, int backend_idx,
+    uint64_t unhealthy_until_ms) {
+
+  /* The sticky policies do not select backends by ID. */
+  if (proxy_reverse_policy_is_sticky(policy_id) == TRUE) {
+    return 0;
+  }
+
+  return redis_set_health(p, redis, vhost_id, backend_idx, unhealthy_until_ms);
+}
+
+static int reverse_redis_policy_latency_backend(pool *p, void *redis,
+    int policy_id, unsigned int vhost_id, int backend_idx, int phase,
+    long latency_ms) {
+  int res, xerrno = 0;
+  pool *tmp_pool;
+  char *key, *field, *val;
+  const char *backend_uri, *prefix;
+  void *ewma_val = NULL;
+  size_t ewma_valsz = 0;
+  int64_t nsamples = 0, count = 0;
+  double ewma_ms = 0.0;
+
+  /* The sticky policies do not select backends by ID. */
+  if (proxy_reverse_policy_is_sticky(policy_id) == TRUE) {
+    return 0;
+  }
+
+  if (phase < PROXY_REVERSE_LATENCY_CONNECT ||
+      phase > PROXY_REVERSE_LATENCY_LOGIN ||
+      latency_ms < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  backend_uri = backend_uri_by_idx(backend_idx);
+  if (backend_uri == NULL) {
+    return -1;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, "Latency", vhost_id, NULL);
+  prefix = pstrcat(tmp_pool, backend_uri, ":",
+    proxy_reverse_latency_name(phase), NULL);
+
+  field = pcalloc(tmp_pool, 32);
+  snprintf(field, 31, ":bucket%u", proxy_reverse_latency_bucket(latency_ms));
+  res = pr_redis_hash_incr(redis, &proxy_module, key,
+    pstrcat(tmp_pool, prefix, field, NULL), 1, &count);
+  if (res < 0) {
+    xerrno = errno;
+    pr_trace_msg(trace_channel, 6,
+      "error updating Latency Redis entry for '%.100s': %s", backend_uri,
+      strerror(xerrno));
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  res = pr_redis_hash_incr(redis, &proxy_module, key,
+    pstrcat(tmp_pool, prefix, ":samples", NULL), 1, &nsamples);
+  if (res < 0) {
+    xerrno = errno;
+    pr_trace_msg(trace_channel, 6,
+      "error updating Latency Redis entry for '%.100s': %s", backend_uri,
+      strerror(xerrno));
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  field = pstrcat(tmp_pool, prefix, ":ewma", NULL);
+  if (nsamples > 1) {
+    res = pr_redis_hash_get(tmp_pool, redis, &proxy_module, key, field,
+      &ewma_val, &ewma_valsz);
+    if (res == 0) {
+      ewma_ms = atof(pstrndup(tmp_pool, ewma_val, ewma_valsz));
+
+    } else {
+      /* Without the previous average, this sample seeds it anew. */
+      nsamples = 1;
+    }
+  }
+
+  ewma_ms = proxy_reverse_latency_ewma(ewma_ms,
+    (unsigned long) (nsamples - 1), latency_ms);
+
+  val = pcalloc(tmp_pool, 64);
+  snprintf(val, 63, "%0.3f", ewma_ms);
+
+  res = pr_redis_hash_set(redis, &proxy_module, key, field, val, strlen(val));
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 6,
+      "error setting Latency Redis entry for '%.100s': %s", backend_uri,
+      strerror(xerrno));
+
+  } else {
+    pr_trace_msg(trace_channel, 19,
+      "updated vhost ID %u, backend '%.100s': %s latency %ld ms "
+      "(average %s ms)", vhost_id, backend_uri,
+      proxy_reverse_latency_name(phase), latency_ms, val);
+  }
+
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+static int reverse_redis_policy_xfer_backend(pool *p, void *redis,
+    int policy_id, unsigned int vhost_id, int backend_idx, int xfer_incr,
+    off_t xfer_bytes) {
+  int res = 0, xerrno = 0;
+
+  if (policy_id != PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS) {
+    return 0;
+  }
+
+  if (xfer_incr != 0) {
+    int64_t xfer_count = 0;
+
+    /* The count is incremented before our lease records the transfer, and
+     * decremented after; a session dying in between thus leaves the count
+     * too high, rather than dropping the transfers of other sessions.
+     */
+    redis_xfers += xfer_incr;
+    if (redis_xfers < 0) {
+      redis_xfers = 0;
+    }
+
+    if (xfer_incr > 0) {
+      res = reverse_redis_leasttransfers_incr(p, redis, vhost_id, backend_idx,
+        "xfers", xfer_incr, &xfer_count);
+      xerrno = errno;
+
+      if (res == 0) {
+        (void) redis_set_lease_xfers(p, redis, vhost_id, backend_idx,
+          redis_xfers);
+      }
+
+    } else {
+      (void) redis_set_lease_xfers(p, redis, vhost_id, backend_idx,
+        redis_xfers);
+
+      res = reverse_redis_leasttransfers_incr(p, redis, vhost_id, backend_idx,
+        "xfers", xfer_incr, &xfer_count);
+      xerrno = errno;
+    }
+  }
+
+  if (res == 0 &&
+      xfer_bytes > 0) {
+    res = reverse_redis_leasttransfers_bytes(p, redis, vhost_id, backend_idx,
+      xfer_bytes);
+    xerrno = errno;
+  }
+
+  errno = xerrno;
+  return res;
+}
+
 static int reverse_redis_policy_used_backend(pool *p, void *redis,
     int policy_id, unsigned int vhost_id, int backend_idx) {
   int res, xerrno = 0;
 
   switch (policy_id) {
     case PROXY_REVERSE_CONNECT_POLICY_RANDOM:
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_ROUND_ROBIN:
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_RANDOM:
       res = 0;
       break;
 
@@ -1078,6 +2346,12 @@ static int reverse_redis_policy_used_backend(pool *p, void *redis,
       xerrno = errno;
       break;
 
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS:
+      res = reverse_redis_leasttransfers_used(p, redis, vhost_id,
+        backend_idx);
+      xerrno = errno;
+      break;
+
     case PROXY_REVERSE_CONNECT_POLICY_PER_USER:
       res = reverse_redis_peruser_used(p, redis, vhost_id, backend_idx);
       xerrno = errno;
@@ -1169,6 +2443,9 @@ int proxy_reverse_redis_as_datastore(struct proxy_reverse_datastore *ds,
   ds->policy_next_backend = reverse_redis_policy_next_backend;
   ds->policy_used_backend = reverse_redis_policy_used_backend;
   ds->policy_update_backend = reverse_redis_policy_update_backend;
+  ds->policy_health_backend = reverse_redis_policy_health_backend;
+  ds->policy_latency_backend = reverse_redis_policy_latency_backend;
+  ds->policy_xfer_backend = reverse_redis_policy_xfer_backend;
   ds->init = reverse_redis_init;
   ds->open = reverse_redis_open;
   ds->close = reverse_redis_close;
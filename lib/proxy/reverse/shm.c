@@ -0,0 +1,1256 @@
+/*
+ * ProFTPD - mod_proxy reverse shared memory implementation
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_proxy.h"
+
+#include "proxy/conn.h"
+#include "proxy/reverse.h"
+#include "proxy/reverse/db.h"
+#include "proxy/reverse/shm.h"
+#include "proxy/random.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+extern xaset_t *server_list;
+
+/* The table is a fixed layout, sized once by the daemon process:
+ *
+ *  struct reverse_shm_table
+ *  struct reverse_shm_vhost[vhost_count]  (indexed by server ID)
+ *  struct reverse_shm_backend[backend_count]
+ *
+ * All of the fields which change at runtime are updated using the GCC
+ * __sync atomic builtins, so that no locking is needed between the session
+ * processes sharing the table.
+ */
+
+#define PROXY_REVERSE_SHM_TABLE_MAGIC		0x70727368
+
+/* Per-backend latency, for one phase. */
+struct reverse_shm_latency {
+  /* Moving average, in microsecs; updated using compare-and-swap. */
+  volatile unsigned long long ewma_us;
+  volatile unsigned long samples;
+  volatile unsigned int buckets[PROXY_REVERSE_LATENCY_BUCKET_COUNT];
+};
+
+struct reverse_shm_backend {
+  volatile int conn_count;
+  volatile long connect_ms;
+
+  /* Latency, indexed by PROXY_REVERSE_LATENCY phase (less one). */
+  struct reverse_shm_latency latency[PROXY_REVERSE_LATENCY_LOGIN];
+
+  /* Shuffle: the backend ID at this position of the vhost's permutation, in
+   * the low 32 bits, tagged with the generation of the permutation in the
+   * high 32 bits.
+   */
+  volatile unsigned long long shuffle_entry;
+
+  /* Health: the time (in millisecs since the epoch) until which this backend
+   * is not selected, or zero if healthy.
+   */
+  volatile unsigned long long unhealthy_until_ms;
+
+  /* Transfers: the number in flight, and the bytes counted in the window
+   * numbered xfer_window, and in the window before it.
+   */
+  volatile long xfer_count;
+  volatile unsigned long long xfer_window;
+  volatile unsigned long long xfer_bytes;
+  volatile unsigned long long xfer_prev_bytes;
+};
+
+struct reverse_shm_vhost {
+  int policy_id;
+
+  /* Index of our first backend in the backends table, and the number of
+   * backends (slots) we have there.
+   */
+  unsigned int backend_idx;
+  unsigned int backend_count;
+
+  /* RoundRobin: the cursor is claimed using fetch-and-add. */
+  volatile unsigned int roundrobin_cursor;
+
+  /* Shuffle: the generation of the permutation in the high 32 bits, and the
+   * next position to claim in the low 32 bits; and the time (in millisecs
+   * since the epoch) at which its regeneration was last claimed.
+   */
+  volatile unsigned long long shuffle_state;
+  volatile unsigned long long shuffle_regen_ms;
+};
+
+struct reverse_shm_table {
+  unsigned int magic;
+  unsigned int vhost_count;
+  unsigned int backend_count;
+
+  /* Offset of the backends table, aligned for its 64-bit fields. */
+  size_t backends_offset;
+};
+
+#define PROXY_REVERSE_SHM_ALIGN(sz) \
+  (((sz) + sizeof(long long) - 1) & ~(sizeof(long long) - 1))
+
+/* Session handle */
+struct reverse_shm_handle {
+  pool *pool;
+  const char *tables_path;
+
+  /* SQLite handle, used for the sticky policies. */
+  void *dbh;
+};
+
+static struct reverse_shm_table *shm_table = NULL;
+static size_t shm_tablesz = 0;
+
+/* Do any of our vhosts use a sticky policy, requiring the SQLite datastore? */
+static int shm_use_db = FALSE;
+static struct proxy_reverse_datastore shm_db_ds;
+
+static array_header *shm_backends = NULL;
+
+static const char *trace_channel = "proxy.reverse.shm";
+
+static struct reverse_shm_vhost *shm_get_vhost(unsigned int vhost_id) {
+  struct reverse_shm_vhost *vhosts;
+
+  if (shm_table == NULL ||
+      vhost_id >= shm_table->vhost_count) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  vhosts = (struct reverse_shm_vhost *) (shm_table + 1);
+  return &(vhosts[vhost_id]);
+}
+
+static struct reverse_shm_backend *shm_get_backend(
+    struct reverse_shm_vhost *vhost, int backend_id) {
+  struct reverse_shm_backend *backends;
+
+  if (backend_id < 0 ||
+      (unsigned int) backend_id >= vhost->backend_count) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  backends = (struct reverse_shm_backend *) (((char *) shm_table) +
+    shm_table->backends_offset);
+  return &(backends[vhost->backend_idx + backend_id]);
+}
+
+/* Returns the number of backends usable for selection, i.e. the smaller of
+ * the slots in the table and the backends known to this session.
+ */
+static unsigned int shm_backend_count(struct reverse_shm_vhost *vhost,
+    unsigned int nelts) {
+  if (nelts < vhost->backend_count) {
+    return nelts;
+  }
+
+  return vhost->backend_count;
+}
+
+static unsigned int shm_count_backends(server_rec *s) {
+  config_rec *c;
+  unsigned int count = 0;
+
+  /* Note that this mirrors the handling of ProxyReverseServers URIs in
+   * proxy_reverse_init().
+   */
+  c = find_config(s->conf, CONF_PARAM, "ProxyReverseServers", FALSE);
+  while (c != NULL) {
+    const char *uri;
+
+    pr_signals_handle();
+
+    uri = c->argv[1];
+    if (uri == NULL ||
+        (strncmp(uri, "sql:/", 5) != 0 &&
+         strstr(uri, "%U") == NULL &&
+         strstr(uri, "%g") == NULL)) {
+      count += ((array_header *) c->argv[0])->nelts;
+    }
+
+    c = find_config_next(c, c->next, CONF_PARAM, "ProxyReverseServers", FALSE);
+  }
+
+  return count;
+}
+
+static int shm_db_open(struct reverse_shm_handle *h) {
+  if (h->dbh != NULL) {
+    return 0;
+  }
+
+  h->dbh = (shm_db_ds.open)(h->pool, h->tables_path, shm_backends);
+  if (h->dbh == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Backend health */
+
+/* Once the cool-down of an unhealthy backend has passed, one session claims
+ * the probe of that backend, holding off the others for this long.  A
+ * successful connection marks the backend as healthy again; a failure marks
+ * it unhealthy for another cool-down.
+ */
+#define SHM_HEALTH_PROBE_MS		5000
+
+static int shm_backend_usable(struct reverse_shm_backend *backend,
+    uint64_t now_ms) {
+  unsigned long long until_ms;
+
+  until_ms = backend->unhealthy_until_ms;
+  if (until_ms == 0 ||
+      until_ms <= now_ms) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+static int shm_backend_claim(struct reverse_shm_backend *backend,
+    uint64_t now_ms) {
+  unsigned long long until_ms;
+
+  until_ms = backend->unhealthy_until_ms;
+  if (until_ms == 0) {
+    return TRUE;
+  }
+
+  if (until_ms > now_ms) {
+    return FALSE;
+  }
+
+  return __sync_bool_compare_and_swap(&(backend->unhealthy_until_ms), until_ms,
+    now_ms + SHM_HEALTH_PROBE_MS);
+}
+
+/* Selects the first claimable backend, starting from the given ID; if none
+ * are, the given ID is returned.
+ */
+static int shm_next_claimable(struct reverse_shm_vhost *vhost,
+    unsigned int count, int backend_id, uint64_t now_ms) {
+  register unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    int idx;
+
+    idx = (backend_id + i) % count;
+    if (shm_backend_claim(shm_get_backend(vhost, idx), now_ms) == TRUE) {
+      return idx;
+    }
+  }
+
+  return backend_id;
+}
+
+/* ProxyReverseConnectPolicy: Shuffle */
+
+/* Each vhost has a permutation of its backend IDs; each selection claims the
+ * next position in the permutation by CAS on the shuffle state.  The session
+ * which finds the permutation exhausted claims its regeneration (by CAS to the
+ * REGEN position), writes a new permutation, and publishes it with the next
+ * generation.  Since a claim only succeeds if the generation has not changed,
+ * an entry read from a permutation being rewritten is never used.
+ *
+ * A session may be killed while it holds the REGEN position.  If a
+ * regeneration has been claimed for longer than SHM_SHUFFLE_REGEN_STALE_MS,
+ * the next session takes it over by moving the REGEN position to the next
+ * generation; the original claimant then fails to publish its permutation.
+ *
+ * The original claimant may not be dead, only slow, and so still be writing
+ * its permutation.  Each entry is therefore tagged with the generation it
+ * was written for, and is only ever replaced (by CAS) with an entry of the
+ * same or a later generation; a writer which finds a later generation stops.
+ * Thus a published permutation is never changed by a superseded writer.
+ */
+#define SHM_SHUFFLE_GEN(state)		((unsigned int) ((state) >> 32))
+#define SHM_SHUFFLE_POS(state)		((unsigned int) ((state) & 0xffffffffULL))
+#define SHM_SHUFFLE_STATE(gen, pos)	\
+  ((((unsigned long long) (gen)) << 32) | ((unsigned long long) (pos)))
+#define SHM_SHUFFLE_POS_REGEN		0xffffffffU
+
+/* Permutation entries use the same layout, with the backend ID in place of
+ * the position.
+ */
+#define SHM_SHUFFLE_ENTRY(gen, backend_id) \
+  SHM_SHUFFLE_STATE(gen, backend_id)
+#define SHM_SHUFFLE_ENTRY_ID(entry)	SHM_SHUFFLE_POS(entry)
+
+/* Whether generation a is later than generation b, allowing for wrapping. */
+#define SHM_SHUFFLE_GEN_AFTER(a, b)	((int) ((a) - (b)) > 0)
+
+/* Limit how long we try to claim a position, under contention. */
+#define SHM_SHUFFLE_MAX_ATTEMPTS	64
+
+/* Writing a permutation takes microseconds; a regeneration claimed for longer
+ * than this was abandoned.
+ */
+#define SHM_SHUFFLE_REGEN_STALE_MS	1000
+
+static void reverse_shm_shuffle_init(struct reverse_shm_vhost *vhost,
+    unsigned int count) {
+  register unsigned int i;
+
+  /* Entries of an earlier permutation must not outrank the new ones. */
+  for (i = 0; i < count; i++) {
+    shm_get_backend(vhost, i)->shuffle_entry = SHM_SHUFFLE_ENTRY(0, i);
+  }
+
+  /* Start out exhausted, so that the first selection generates the first
+   * permutation.
+   */
+  vhost->shuffle_state = SHM_SHUFFLE_STATE(0, count);
+  vhost->shuffle_regen_ms = 0;
+}
+
+/* Writes an entry of the given generation.  Returns -1 if a later generation
+ * has been written there, i.e. if our regeneration was superseded.
+ */
+static int reverse_shm_shuffle_put(struct reverse_shm_backend *backend,
+    unsigned int gen, unsigned int backend_id) {
+  while (TRUE) {
+    unsigned long long entry;
+
+    entry = backend->shuffle_entry;
+    if (SHM_SHUFFLE_GEN_AFTER(SHM_SHUFFLE_GEN(entry), gen)) {
+      return -1;
+    }
+
+    if (__sync_bool_compare_and_swap(&(backend->shuffle_entry), entry,
+        SHM_SHUFFLE_ENTRY(gen, backend_id))) {
+      return 0;
+    }
+  }
+}
+
+/* Writes a new permutation of the given generation.  Returns -1 if another
+ * session superseded us meanwhile.
+ */
+static int reverse_shm_shuffle_regen(struct reverse_shm_vhost *vhost,
+    unsigned int count, unsigned int gen) {
+  register unsigned int i;
+
+  /* Fisher-Yates, "inside-out", so that we only read entries which we have
+   * already written.
+   */
+  for (i = 0; i < count; i++) {
+    unsigned long long entry;
+    unsigned int j;
+
+    j = (unsigned int) proxy_random_next(0, i);
+    if (j == i) {
+      if (reverse_shm_shuffle_put(shm_get_backend(vhost, i), gen, i) < 0) {
+        return -1;
+      }
+
+      continue;
+    }
+
+    entry = shm_get_backend(vhost, j)->shuffle_entry;
+    if (SHM_SHUFFLE_GEN(entry) != gen ||
+        reverse_shm_shuffle_put(shm_get_backend(vhost, i), gen,
+          SHM_SHUFFLE_ENTRY_ID(entry)) < 0 ||
+        reverse_shm_shuffle_put(shm_get_backend(vhost, j), gen, i) < 0) {
+      return -1;
+    }
+  }
+
+  __sync_synchronize();
+  return 0;
+}
+
+static int reverse_shm_shuffle_claim(struct reverse_shm_vhost *vhost,
+    unsigned int count, uint64_t now_ms) {
+  register unsigned int i;
+
+  for (i = 0; i < SHM_SHUFFLE_MAX_ATTEMPTS; i++) {
+    unsigned long long state, regen_ms;
+    unsigned int gen, pos;
+    int backend_id;
+
+    state = vhost->shuffle_state;
+    regen_ms = vhost->shuffle_regen_ms;
+    __sync_synchronize();
+
+    gen = SHM_SHUFFLE_GEN(state);
+    pos = SHM_SHUFFLE_POS(state);
+
+    if (pos < count) {
+      unsigned long long entry;
+
+      entry = shm_get_backend(vhost, pos)->shuffle_entry;
+      if (SHM_SHUFFLE_GEN(entry) != gen) {
+        /* The permutation has moved on since we read the state. */
+        continue;
+      }
+
+      if (__sync_bool_compare_and_swap(&(vhost->shuffle_state), state,
+          state + 1)) {
+        return (int) (SHM_SHUFFLE_ENTRY_ID(entry) % count);
+      }
+
+      continue;
+    }
+
+    if (pos == SHM_SHUFFLE_POS_REGEN) {
+      if (now_ms < regen_ms + SHM_SHUFFLE_REGEN_STALE_MS) {
+        /* Another session is writing the next permutation. */
+        break;
+      }
+
+      pr_trace_msg(trace_channel, 9,
+        "Shuffle permutation #%u regeneration claimed %lu ms ago, taking over",
+        gen + 1, (unsigned long) (now_ms - regen_ms));
+
+      /* Take over at the next generation, so that the stale claimant cannot
+       * publish.
+       */
+      gen++;
+    }
+
+    /* Record the claim time before the claim itself, so that a claim is never
+     * seen with the time of an earlier claim.
+     */
+    vhost->shuffle_regen_ms = now_ms;
+    __sync_synchronize();
+
+    if (__sync_bool_compare_and_swap(&(vhost->shuffle_state), state,
+        SHM_SHUFFLE_STATE(gen, SHM_SHUFFLE_POS_REGEN))) {
+      if (reverse_shm_shuffle_regen(vhost, count, gen + 1) < 0) {
+        pr_trace_msg(trace_channel, 9,
+          "Shuffle permutation #%u regeneration taken over", gen + 1);
+        continue;
+      }
+
+      backend_id = (int) SHM_SHUFFLE_ENTRY_ID(
+        shm_get_backend(vhost, 0)->shuffle_entry);
+
+      /* Publish the new permutation, having claimed its first position; this
+       * fails if our claim went stale, and was taken over.
+       */
+      if (__sync_bool_compare_and_swap(&(vhost->shuffle_state),
+          SHM_SHUFFLE_STATE(gen, SHM_SHUFFLE_POS_REGEN),
+          SHM_SHUFFLE_STATE(gen + 1, 1))) {
+        pr_trace_msg(trace_channel, 17,
+          "generated Shuffle permutation #%u of %u backends", gen + 1, count);
+        return backend_id % count;
+      }
+    }
+  }
+
+  /* Rather than waiting on other sessions, fall back to a random backend. */
+  pr_trace_msg(trace_channel, 17,
+    "unable to claim Shuffle position, selecting random backend");
+  return (int) proxy_random_next(0, count-1);
+}
+
+static int reverse_shm_shuffle_next(struct reverse_shm_vhost *vhost,
+    unsigned int count, uint64_t now_ms) {
+  register unsigned int i;
+  int backend_id = 0;
+
+  /* Unhealthy backends use up their positions in the permutation. */
+  for (i = 0; i < count; i++) {
+    backend_id = reverse_shm_shuffle_claim(vhost, count, now_ms);
+    if (shm_backend_claim(shm_get_backend(vhost, backend_id),
+        now_ms) == TRUE) {
+      break;
+    }
+  }
+
+  return backend_id;
+}
+
+/* ProxyReverseConnectPolicy: RoundRobin */
+
+static int reverse_shm_roundrobin_next(struct reverse_shm_vhost *vhost,
+    unsigned int count, uint64_t now_ms) {
+  register unsigned int i;
+  int backend_id = 0;
+
+  for (i = 0; i < count; i++) {
+    unsigned int cursor;
+
+    /* Note that when the cursor wraps around, the rotation may be uneven for
+     * that one selection, unless the number of backends is a power of 2.
+     */
+    cursor = __sync_fetch_and_add(&(vhost->roundrobin_cursor), 1);
+    backend_id = (int) (cursor % count);
+
+    /* Unhealthy backends use up their turns in the rotation. */
+    if (shm_backend_claim(shm_get_backend(vhost, backend_id),
+        now_ms) == TRUE) {
+      break;
+    }
+  }
+
+  return backend_id;
+}
+
+/* ProxyReverseConnectPolicy: WeightedRandom */
+
+static int reverse_shm_weightedrandom_next(pool *p,
+    struct reverse_shm_vhost *vhost, struct proxy_conn **conns,
+    unsigned int count, uint64_t now_ms) {
+  register unsigned int i;
+  int *usable;
+  array_header *backends;
+
+  backends = make_array(p, count, sizeof(struct proxy_conn *));
+  usable = palloc(p, count * sizeof(int));
+  for (i = 0; i < count; i++) {
+    *((struct proxy_conn **) push_array(backends)) = conns[i];
+    usable[i] = shm_backend_usable(shm_get_backend(vhost, i), now_ms);
+  }
+
+  return proxy_reverse_weighted_random(backends, usable);
+}
+
+/* ProxyReverseConnectPolicy: WeightedRoundRobin */
+
+/* The positions in the smooth weighted round-robin schedule, per
+ * proxy_reverse_wrr_get_schedule(), are claimed using the round-robin cursor.
+ */
+static int reverse_shm_wrr_next(pool *p, struct reverse_shm_vhost *vhost,
+    struct proxy_conn **conns, unsigned int count, uint64_t now_ms) {
+  register unsigned int i;
+  int backend_id;
+  unsigned int cursor;
+  array_header *backends, *schedule;
+
+  backends = make_array(p, count, sizeof(struct proxy_conn *));
+  for (i = 0; i < count; i++) {
+    *((struct proxy_conn **) push_array(backends)) = conns[i];
+  }
+
+  schedule = proxy_reverse_wrr_get_schedule(backends);
+  if (schedule == NULL) {
+    return -1;
+  }
+
+  cursor = __sync_fetch_and_add(&(vhost->roundrobin_cursor), 1);
+  backend_id = ((int *) schedule->elts)[cursor % schedule->nelts];
+
+  if (shm_backend_claim(shm_get_backend(vhost, backend_id), now_ms) != TRUE) {
+    /* The turn of an unhealthy backend goes to a healthy one, in proportion
+     * to their weights; see proxy_reverse_wrr_get_schedule().
+     */
+    backend_id = reverse_shm_weightedrandom_next(p, vhost, conns, count,
+      now_ms);
+  }
+
+  return backend_id;
+}
+
+/* ProxyReverseConnectPolicy: LeastConns */
+
+static int reverse_shm_leastconns_next(struct reverse_shm_vhost *vhost,
+    unsigned int count, uint64_t now_ms) {
+  register unsigned int i;
+  int backend_id = -1, least_count = -1;
+
+  for (i = 0; i < count; i++) {
+    struct reverse_shm_backend *backend;
+    int conn_count;
+
+    backend = shm_get_backend(vhost, i);
+    if (now_ms > 0 &&
+        shm_backend_usable(backend, now_ms) == FALSE) {
+      continue;
+    }
+
+    conn_count = backend->conn_count;
+
+    if (least_count < 0 ||
+        conn_count < least_count) {
+      backend_id = i;
+      least_count = conn_count;
+    }
+  }
+
+  return backend_id;
+}
+
+/* ProxyReverseConnectPolicy: LeastResponseTime */
+
+/* Note: as for the SQLite datastore, "least response time" is determined by
+ * the power of two choices over each backend's connection count and latency
+ * averages; see proxy_reverse_latency_choose().
+ *
+ * For both LeastConns and LeastResponseTime, unhealthy backends are skipped
+ * when given the current time; for LeastConns, -1 is returned if no backends
+ * are usable.
+ */
+static double shm_backend_latency(struct reverse_shm_backend *backend) {
+  register unsigned int i;
+  double latency_ms = 0.0;
+
+  for (i = 0; i < PROXY_REVERSE_LATENCY_LOGIN; i++) {
+    if (backend->latency[i].samples > 0) {
+      latency_ms += ((double) backend->latency[i].ewma_us / 1000.0);
+    }
+  }
+
+  return latency_ms;
+}
+
+static int reverse_shm_leastresponsetime_next(pool *p,
+    struct reverse_shm_vhost *vhost, unsigned int count, uint64_t now_ms) {
+  register unsigned int i;
+  int idx;
+  struct proxy_reverse_backend_load *loads;
+
+  if (count == 0) {
+    return -1;
+  }
+
+  loads = pcalloc(p, count * sizeof(struct proxy_reverse_backend_load));
+  for (i = 0; i < count; i++) {
+    struct reverse_shm_backend *backend;
+
+    backend = shm_get_backend(vhost, i);
+    loads[i].backend_id = i;
+    loads[i].conn_count = backend->conn_count;
+    loads[i].latency_ms = shm_backend_latency(backend);
+    loads[i].usable = shm_backend_usable(backend, now_ms);
+  }
+
+  idx = proxy_reverse_latency_choose(loads, count);
+  if (idx >= 0 &&
+      loads[idx].usable == TRUE) {
+    (void) shm_backend_claim(shm_get_backend(vhost, idx), now_ms);
+  }
+
+  return idx;
+}
+
+/* ProxyReverseConnectPolicy: LeastTransfers */
+
+static int reverse_shm_leasttransfers_next(pool *p,
+    struct reverse_shm_vhost *vhost, unsigned int count, uint64_t now_ms) {
+  register unsigned int i;
+  int idx;
+  struct proxy_reverse_backend_xfers *xfers;
+
+  if (count == 0) {
+    return -1;
+  }
+
+  xfers = pcalloc(p, count * sizeof(struct proxy_reverse_backend_xfers));
+  for (i = 0; i < count; i++) {
+    struct reverse_shm_backend *backend;
+
+    backend = shm_get_backend(vhost, i);
+    xfers[i].backend_id = i;
+    xfers[i].conn_count = backend->conn_count;
+    xfers[i].xfer_count = backend->xfer_count;
+    xfers[i].xfer_rate = proxy_reverse_xfer_rate(now_ms, backend->xfer_window,
+      backend->xfer_bytes, backend->xfer_prev_bytes);
+    xfers[i].usable = shm_backend_usable(backend, now_ms);
+  }
+
+  idx = proxy_reverse_xfer_choose(xfers, count);
+  if (idx >= 0 &&
+      xfers[idx].usable == TRUE) {
+    (void) shm_backend_claim(shm_get_backend(vhost, idx), now_ms);
+  }
+
+  return idx;
+}
+
+/* ProxyReverseServers API/handling */
+
+static int reverse_shm_policy_init(pool *p, void *dsh, int policy_id,
+    unsigned int vhost_id, array_header *backends, unsigned long opts) {
+  struct reverse_shm_handle *h;
+  struct reverse_shm_vhost *vhost;
+  unsigned int count = 0;
+
+  h = dsh;
+
+  vhost = shm_get_vhost(vhost_id);
+  if (vhost == NULL) {
+    pr_trace_msg(trace_channel, 3,
+      "no shared memory entry found for vhost ID %u", vhost_id);
+    errno = EINVAL;
+    return -1;
+  }
+
+  vhost->policy_id = policy_id;
+
+  if (backends != NULL) {
+    count = shm_backend_count(vhost, backends->nelts);
+  }
+
+  switch (policy_id) {
+    case PROXY_REVERSE_CONNECT_POLICY_RANDOM:
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_RANDOM:
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS:
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME:
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS:
+      /* No preparation needed at this time. */
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN:
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_ROUND_ROBIN:
+      vhost->roundrobin_cursor = 0;
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_SHUFFLE:
+      reverse_shm_shuffle_init(vhost, count);
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_PER_USER:
+    case PROXY_REVERSE_CONNECT_POLICY_PER_GROUP:
+    case PROXY_REVERSE_CONNECT_POLICY_PER_HOST:
+      return (shm_db_ds.policy_init)(p, h->dbh, policy_id, vhost_id, backends,
+        opts);
+
+    default:
+      errno = EINVAL;
+      return -1;
+  }
+
+  return 0;
+}
+
+static const struct proxy_conn *reverse_shm_policy_next_backend(pool *p,
+    void *dsh, int policy_id, unsigned int vhost_id,
+    array_header *default_backends, const void *policy_data, int *backend_id) {
+  struct reverse_shm_handle *h;
+  struct reverse_shm_vhost *vhost;
+  const struct proxy_conn *pconn = NULL;
+  struct proxy_conn **conns = NULL;
+  int idx = -1;
+  unsigned int count, nelts = 0;
+  uint64_t now_ms = 0;
+
+  h = dsh;
+
+  if (proxy_reverse_policy_is_sticky(policy_id) == TRUE) {
+    if (shm_db_open(h) < 0) {
+      return NULL;
+    }
+
+    return (shm_db_ds.policy_next_backend)(p, h->dbh, policy_id, vhost_id,
+      default_backends, policy_data, backend_id);
+  }
+
+  if (shm_backends != NULL) {
+    conns = shm_backends->elts;
+    nelts = shm_backends->nelts;
+
+  } else if (default_backends != NULL) {
+    conns = default_backends->elts;
+    nelts = default_backends->nelts;
+  }
+
+  vhost = shm_get_vhost(vhost_id);
+  if (vhost == NULL) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  count = shm_backend_count(vhost, nelts);
+  if (count == 0) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  pr_gettimeofday_millis(&now_ms);
+
+  switch (policy_id) {
+    case PROXY_REVERSE_CONNECT_POLICY_RANDOM:
+      idx = (int) proxy_random_next(0, count-1);
+      idx = shm_next_claimable(vhost, count, idx, now_ms);
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN:
+      idx = reverse_shm_roundrobin_next(vhost, count, now_ms);
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_SHUFFLE:
+      idx = reverse_shm_shuffle_next(vhost, count, now_ms);
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_ROUND_ROBIN:
+      idx = reverse_shm_wrr_next(p, vhost, conns, count, now_ms);
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_RANDOM:
+      idx = reverse_shm_weightedrandom_next(p, vhost, conns, count, now_ms);
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS:
+      idx = reverse_shm_leastconns_next(vhost, count, now_ms);
+      if (idx < 0) {
+        /* All of the backends are unhealthy; ignore their health. */
+        idx = reverse_shm_leastconns_next(vhost, count, 0);
+
+      } else {
+        (void) shm_backend_claim(shm_get_backend(vhost, idx), now_ms);
+      }
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME:
+      idx = reverse_shm_leastresponsetime_next(p, vhost, count, now_ms);
+      break;
+
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS:
+      idx = reverse_shm_leasttransfers_next(p, vhost, count, now_ms);
+      break;
+
+    default:
+      errno = ENOSYS;
+      return NULL;
+  }
+
+  if (idx >= 0) {
+    pr_trace_msg(trace_channel, 11, "%s policy: selected index %d of %u",
+      proxy_reverse_policy_name(policy_id), idx, count-1);
+    pconn = conns[idx];
+  }
+
+  if (backend_id != NULL) {
+    *backend_id = idx;
+  }
+
+  return pconn;
+}
+
+static int reverse_shm_policy_update_backend(pool *p, void *dsh, int policy_id,
+    unsigned vhost_id, int backend_id, int conn_incr, long connect_ms) {
+  struct reverse_shm_vhost *vhost;
+  struct reverse_shm_backend *backend;
+  int conn_count;
+
+  /* As with the SQLite datastore, the sticky policies do not use the
+   * connection count/time.
+   */
+  if (proxy_reverse_policy_is_sticky(policy_id) == TRUE) {
+    pr_trace_msg(trace_channel, 17,
+      "sticky policy %s does not require updates, skipping",
+      proxy_reverse_policy_name(policy_id));
+    return 0;
+  }
+
+  vhost = shm_get_vhost(vhost_id);
+  if (vhost == NULL) {
+    return 0;
+  }
+
+  backend = shm_get_backend(vhost, backend_id);
+  if (backend == NULL) {
+    pr_trace_msg(trace_channel, 17,
+      "no shared memory entry for vhost ID %u, backend ID %d, skipping",
+      vhost_id, backend_id);
+    return 0;
+  }
+
+  conn_count = __sync_add_and_fetch(&(backend->conn_count), conn_incr);
+  if (conn_count < 0) {
+    /* Should not happen, but do not let a spurious decrement skew the
+     * LeastConns/LeastResponseTime selections.
+     */
+    (void) __sync_bool_compare_and_swap(&(backend->conn_count), conn_count, 0);
+  }
+
+  if (connect_ms > 0) {
+    (void) __sync_lock_test_and_set(&(backend->connect_ms), connect_ms);
+
+    /* A successful connection also means that the backend is healthy. */
+    (void) __sync_lock_test_and_set(&(backend->unhealthy_until_ms), 0ULL);
+  }
+
+  pr_trace_msg(trace_channel, 19,
+    "updated vhost ID %u, backend ID %d: conn count %d, connect ms %ld",
+    vhost_id, backend_id, conn_count, (long) backend->connect_ms);
+  return 0;
+}
+
+static int reverse_shm_policy_health_backend(pool *p, void *dsh,
+    int policy_id, unsigned int vhost_id, int backend_id,
+    uint64_t unhealthy_until_ms) {
+  struct reverse_shm_vhost *vhost;
+  struct reverse_shm_backend *backend;
+
+  /* The sticky policies do not select backends by ID. */
+  if (proxy_reverse_policy_is_sticky(policy_id) == TRUE) {
+    return 0;
+  }
+
+  vhost = shm_get_vhost(vhost_id);
+  if (vhost == NULL) {
+    return 0;
+  }
+
+  backend = shm_get_backend(vhost, backend_id);
+  if (backend == NULL) {
+    pr_trace_msg(trace_channel, 17,
+      "no shared memory entry for vhost ID %u, backend ID %d, skipping",
+      vhost_id, backend_id);
+    return 0;
+  }
+
+  (void) __sync_lock_test_and_set(&(backend->unhealthy_until_ms),
+    (unsigned long long) unhealthy_until_ms);
+
+  pr_trace_msg(trace_channel, 19,
+    "updated vhost ID %u, backend ID %d: unhealthy until %llu ms", vhost_id,
+    backend_id, (unsigned long long) unhealthy_until_ms);
+  return 0;
+}
+
+static int reverse_shm_policy_latency_backend(pool *p, void *dsh,
+    int policy_id, unsigned int vhost_id, int backend_id, int phase,
+    long latency_ms) {
+  struct reverse_shm_vhost *vhost;
+  struct reverse_shm_backend *backend;
+  struct reverse_shm_latency *latency;
+  unsigned long long ewma_us, new_ewma_us;
+
+  /* The sticky policies do not select backends by ID. */
+  if (proxy_reverse_policy_is_sticky(policy_id) == TRUE) {
+    return 0;
+  }
+
+  if (phase < PROXY_REVERSE_LATENCY_CONNECT ||
+      phase > PROXY_REVERSE_LATENCY_LOGIN ||
+      latency_ms < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  vhost = shm_get_vhost(vhost_id);
+  if (vhost == NULL) {
+    return 0;
+  }
+
+  backend = shm_get_backend(vhost, backend_id);
+  if (backend == NULL) {
+    pr_trace_msg(trace_channel, 17,
+      "no shared memory entry for vhost ID %u, backend ID %d, skipping",
+      vhost_id, backend_id);
+    return 0;
+  }
+
+  latency = &(backend->latency[phase-1]);
+
+  do {
+    ewma_us = latency->ewma_us;
+    new_ewma_us = (unsigned long long) (proxy_reverse_latency_ewma(
+      (double) ewma_us / 1000.0, latency->samples, latency_ms) * 1000.0);
+
+  } while (!__sync_bool_compare_and_swap(&(latency->ewma_us), ewma_us,
+    new_ewma_us));
+
+  (void) __sync_add_and_fetch(&(latency->samples), 1);
+  (void) __sync_add_and_fetch(
+    &(latency->buckets[proxy_reverse_latency_bucket(latency_ms)]), 1);
+
+  pr_trace_msg(trace_channel, 19,
+    "updated vhost ID %u, backend ID %d: %s latency %ld ms (average %0.2f ms)",
+    vhost_id, backend_id, proxy_reverse_latency_name(phase), latency_ms,
+    (double) new_ewma_us / 1000.0);
+  return 0;
+}
+
+static int reverse_shm_policy_xfer_backend(pool *p, void *dsh, int policy_id,
+    unsigned int vhost_id, int backend_id, int xfer_incr, off_t xfer_bytes) {
+  struct reverse_shm_vhost *vhost;
+  struct reverse_shm_backend *backend;
+  long xfer_count;
+
+  if (policy_id != PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS) {
+    return 0;
+  }
+
+  vhost = shm_get_vhost(vhost_id);
+  if (vhost == NULL) {
+    return 0;
+  }
+
+  backend = shm_get_backend(vhost, backend_id);
+  if (backend == NULL) {
+    pr_trace_msg(trace_channel, 17,
+      "no shared memory entry for vhost ID %u, backend ID %d, skipping",
+      vhost_id, backend_id);
+    return 0;
+  }
+
+  xfer_count = __sync_add_and_fetch(&(backend->xfer_count), xfer_incr);
+  if (xfer_count < 0) {
+    (void) __sync_bool_compare_and_swap(&(backend->xfer_count), xfer_count,
+      0);
+  }
+
+  if (xfer_bytes > 0) {
+    uint64_t now_ms;
+    unsigned long long window, old_window;
+
+    pr_gettimeofday_millis(&now_ms);
+    window = proxy_reverse_xfer_window(now_ms);
+
+    /* The session which moves the window forward also moves the bytes of the
+     * old window into the previous window.  Bytes added by other sessions in
+     * the meantime may be counted in the previous window, rather than the
+     * current one, which only smooths the rate a little.
+     */
+    old_window = backend->xfer_window;
+    if (old_window < window &&
+        __sync_bool_compare_and_swap(&(backend->xfer_window), old_window,
+          window)) {
+      unsigned long long old_bytes;
+
+      old_bytes = __sync_lock_test_and_set(&(backend->xfer_bytes), 0ULL);
+      (void) __sync_lock_test_and_set(&(backend->xfer_prev_bytes),
+        old_window + 1 == window ? old_bytes : 0ULL);
+    }
+
+    (void) __sync_add_and_fetch(&(backend->xfer_bytes),
+      (unsigned long long) xfer_bytes);
+  }
+
+  pr_trace_msg(trace_channel, 19,
+    "updated vhost ID %u, backend ID %d: transfer count %ld", vhost_id,
+    backend_id, xfer_count);
+  return 0;
+}
+
+static int reverse_shm_policy_used_backend(pool *p, void *dsh, int policy_id,
+    unsigned int vhost_id, int idx) {
+  struct reverse_shm_handle *h;
+
+  h = dsh;
+
+  if (proxy_reverse_policy_is_sticky(policy_id) == TRUE) {
+    if (shm_db_open(h) < 0) {
+      return -1;
+    }
+
+    return (shm_db_ds.policy_used_backend)(p, h->dbh, policy_id, vhost_id,
+      idx);
+  }
+
+  switch (policy_id) {
+    case PROXY_REVERSE_CONNECT_POLICY_RANDOM:
+    case PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN:
+    case PROXY_REVERSE_CONNECT_POLICY_SHUFFLE:
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS:
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME:
+    case PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS:
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_ROUND_ROBIN:
+    case PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_RANDOM:
+      /* Nothing to do; RoundRobin and Shuffle claim their backends when
+       * selecting them.
+       */
+      break;
+
+    default:
+      errno = ENOSYS;
+      return -1;
+  }
+
+  return 0;
+}
+
+static void *reverse_shm_init(pool *p, const char *tables_path, int flags) {
+  struct reverse_shm_handle *h;
+  struct reverse_shm_table *table;
+  struct reverse_shm_vhost *vhosts;
+  unsigned int backend_count = 0, backend_idx = 0, vhost_count = 0;
+  size_t backends_offset, tablesz;
+  server_rec *s;
+  void *dbh = NULL;
+
+  if (tables_path == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  shm_use_db = FALSE;
+
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    config_rec *c;
+
+    if (s->sid >= vhost_count) {
+      vhost_count = s->sid + 1;
+    }
+
+    backend_count += shm_count_backends(s);
+
+    c = find_config(s->conf, CONF_PARAM, "ProxyReverseConnectPolicy", FALSE);
+    if (c != NULL &&
+        proxy_reverse_policy_is_sticky(*((int *) c->argv[0])) == TRUE) {
+      shm_use_db = TRUE;
+    }
+  }
+
+  backends_offset = PROXY_REVERSE_SHM_ALIGN(sizeof(struct reverse_shm_table) +
+    (vhost_count * sizeof(struct reverse_shm_vhost)));
+  tablesz = backends_offset +
+    (backend_count * sizeof(struct reverse_shm_backend));
+
+  /* An anonymous shared mapping, created before any session processes are
+   * forked, is inherited by all of them.  On restart, a new table is created;
+   * any existing sessions keep using their existing mapping.
+   */
+  table = mmap(NULL, tablesz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS,
+    -1, 0);
+  if (table == MAP_FAILED) {
+    int xerrno = errno;
+
+    pr_log_pri(PR_LOG_NOTICE, MOD_PROXY_VERSION
+      ": error allocating %lu bytes of shared memory: %s",
+      (unsigned long) tablesz, strerror(xerrno));
+    errno = xerrno;
+    return NULL;
+  }
+
+  table->magic = PROXY_REVERSE_SHM_TABLE_MAGIC;
+  table->vhost_count = vhost_count;
+  table->backend_count = backend_count;
+  table->backends_offset = backends_offset;
+
+  vhosts = (struct reverse_shm_vhost *) (table + 1);
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    struct reverse_shm_vhost *vhost;
+
+    vhost = &(vhosts[s->sid]);
+    vhost->backend_idx = backend_idx;
+    vhost->backend_count = shm_count_backends(s);
+    backend_idx += vhost->backend_count;
+  }
+
+  if (shm_use_db == TRUE) {
+    memset(&shm_db_ds, 0, sizeof(shm_db_ds));
+    (void) proxy_reverse_db_as_datastore(&shm_db_ds, NULL, 0);
+
+    dbh = (shm_db_ds.init)(p, tables_path, flags);
+    if (dbh == NULL) {
+      int xerrno = errno;
+
+      (void) munmap(table, tablesz);
+      errno = xerrno;
+      return NULL;
+    }
+  }
+
+  if (shm_table != NULL) {
+    (void) munmap(shm_table, shm_tablesz);
+  }
+
+  shm_table = table;
+  shm_tablesz = tablesz;
+
+  pr_trace_msg(trace_channel, 9,
+    "allocated %lu bytes of shared memory for %u vhosts, %u backends",
+    (unsigned long) tablesz, vhost_count, backend_count);
+
+  h = pcalloc(p, sizeof(struct reverse_shm_handle));
+  h->pool = p;
+  h->tables_path = pstrdup(p, tables_path);
+  h->dbh = dbh;
+
+  return h;
+}
+
+static int reverse_shm_close(pool *p, void *dsh) {
+  struct reverse_shm_handle *h;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Note that we do not unmap the table here; it needs to outlive the
+   * handles in the daemon process, for the sessions to inherit.
+   */
+
+  h = dsh;
+  if (h != NULL &&
+      h->dbh != NULL) {
+    (void) (shm_db_ds.close)(p, h->dbh);
+    h->dbh = NULL;
+  }
+
+  return 0;
+}
+
+static void *reverse_shm_open(pool *p, const char *tables_path,
+    array_header *backends) {
+  struct reverse_shm_handle *h;
+
+  if (shm_table == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "shared memory table not initialized");
+    errno = EPERM;
+    return NULL;
+  }
+
+  h = pcalloc(p, sizeof(struct reverse_shm_handle));
+  h->pool = p;
+  h->tables_path = pstrdup(p, tables_path);
+
+  /* The SQLite handle, if needed for a sticky policy, is opened on demand. */
+  h->dbh = NULL;
+
+  shm_backends = backends;
+  return h;
+}
+
+int proxy_reverse_shm_as_datastore(struct proxy_reverse_datastore *ds,
+    void *ds_data, size_t ds_datasz) {
+
+  if (ds == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  (void) ds_data;
+  (void) ds_datasz;
+
+  ds->policy_init = reverse_shm_policy_init;
+  ds->policy_next_backend = reverse_shm_policy_next_backend;
+  ds->policy_used_backend = reverse_shm_policy_used_backend;
+  ds->policy_update_backend = reverse_shm_policy_update_backend;
+  ds->policy_health_backend = reverse_shm_policy_health_backend;
+  ds->policy_latency_backend = reverse_shm_policy_latency_backend;
+  ds->policy_xfer_backend = reverse_shm_policy_xfer_backend;
+  ds->init = reverse_shm_init;
+  ds->open = reverse_shm_open;
+  ds->close = reverse_shm_close;
+
+  return 0;
+}
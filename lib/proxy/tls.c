@@ -25,11 +25,14 @@
 #include "mod_proxy.h"
 
 #include "proxy/conn.h"
+#include "proxy/metrics.h"
 #include "proxy/netio.h"
+#include "proxy/random.h"
 #include "proxy/session.h"
 #include "proxy/tls.h"
 #include "proxy/tls/db.h"
 #include "proxy/tls/redis.h"
+#include "proxy/tls/shm.h"
 
 /* Define if you have the LibreSSL library.  */
 #if defined(LIBRESSL_VERSION_NUMBER)
@@ -102,6 +105,7 @@ static int handshake_timer_id = -1;
 static int handshake_timed_out = FALSE;
 
 #define PROXY_TLS_SHUTDOWN_BIDIRECTIONAL	0x001
+#define PROXY_TLS_SHUTDOWN_FL_KEEP		0x002
 
 /* Stream notes */
 #define PROXY_TLS_NETIO_NOTE			"mod_proxy.SSL"
@@ -112,17 +116,46 @@ static int handshake_timed_out = FALSE;
 #define PROXY_TLS_MAX_SESSION_AGE		86400
 #define PROXY_TLS_MAX_SESSION_COUNT		1000
 
+/* TLSv1.3 servers typically issue several tickets per connection, each of
+ * which should be used only once; we thus keep several sessions per backend,
+ * under the keys "ftp://host:port", "ftp://host:port#1", etc.
+ */
+#define PROXY_TLS_MAX_SESSIONS_PER_BACKEND	4
+static unsigned int tls_sess_cursor = 0;
+
 static SSL_CTX *ssl_ctx = NULL;
 static pr_netio_t *tls_ctrl_netio = NULL;
 static pr_netio_t *tls_data_netio = NULL;
 static SSL *tls_ctrl_ssl = NULL;
 
+/* Trust stores (CA certificates and CRLs), loaded once by the daemon for each
+ * vhost, and inherited by the session processes.
+ */
+struct tls_trust_store {
+  unsigned int sid;
+  const char *ca_file, *ca_path, *crl_file, *crl_path;
+  X509_STORE *store;
+};
+
+static array_header *tls_trust_stores = NULL;
+
+/* With the ReuseDataSSL ProxyTLSOption, the SSL object of the last backend
+ * data connection is cleared and kept here, for use by the next one.
+ */
+static SSL *tls_data_ssl_idle = NULL;
+
+/* Backend data connection handshakes, for the current backend. */
+static unsigned int tls_data_full_handshakes = 0;
+static unsigned int tls_data_resumed_handshakes = 0;
+static uint64_t tls_data_handshake_ms = 0;
+
 static int netio_install_ctrl(void);
 static int netio_install_data(void);
 
 /* Indices for data stashed in SSL objects */
 #define PROXY_TLS_IDX_TICKET_KEY		2
 #define PROXY_TLS_IDX_HAD_TICKET		3
+#define PROXY_TLS_IDX_SESS_KEY			4
 
 #if !defined(OPENSSL_NO_TLSEXT)
 static void tls_tlsext_cb(SSL *, int, int, unsigned char *, int, void *);
@@ -488,7 +521,26 @@ static void tls_end_sess(SSL *ssl, int strms, int flags) {
     session.total_raw_out += bwritten;
   }
 
-  SSL_free(ssl);
+  if (flags & PROXY_TLS_SHUTDOWN_FL_KEEP) {
+    /* Keep the SSL object, and its buffers, for the next data connection. */
+    if (SSL_clear(ssl) == 1) {
+      if (tls_data_ssl_idle != NULL &&
+          tls_data_ssl_idle != ssl) {
+        SSL_free(tls_data_ssl_idle);
+      }
+
+      tls_data_ssl_idle = ssl;
+      ssl = NULL;
+
+    } else {
+      pr_trace_msg(trace_channel, 9, "error clearing SSL for reuse: %s",
+        proxy_tls_get_errors());
+    }
+  }
+
+  if (ssl != NULL) {
+    SSL_free(ssl);
+  }
 
   if (res >= 0) {
     pr_trace_msg(trace_channel, 17, "TLS session cleanly shut down");
@@ -523,6 +575,47 @@ static int tls_writemore(int wfd) {
   return select(wfd + 1, NULL, &wfds, NULL, &tv);
 }
 
+/* Returns TRUE if the kernel encrypts (PR_NETIO_IO_WR) or decrypts
+ * (PR_NETIO_IO_RD) the records of this SSL connection.
+ */
+static int tls_using_ktls(SSL *ssl, int io) {
+#if defined(PROXY_TLS_HAVE_KTLS)
+  if (io == PR_NETIO_IO_WR) {
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) ? TRUE : FALSE;
+  }
+
+  return BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? TRUE : FALSE;
+#else
+  return FALSE;
+#endif /* PROXY_TLS_HAVE_KTLS */
+}
+
+/* With kTLS, the BIO counters only see the plaintext, not the records on the
+ * wire; thus we estimate the TLS overhead for the given number of plaintext
+ * bytes moved through the socket BIO.  Each record is at most
+ * SSL3_RT_MAX_PLAIN_LENGTH bytes of plaintext, and OpenSSL moves whole
+ * records through the BIO; counting the BIO bytes, rather than those
+ * returned by SSL_read(), means that a record read once but returned by
+ * several SSL_read() calls is only charged once.
+ */
+int proxy_tls_ktls_overhead(int version, size_t len) {
+  size_t nrecords;
+  int record_overhead = PROXY_TLS_KTLS_TLS12_RECORD_OVERHEAD;
+
+  if (len == 0) {
+    return 0;
+  }
+
+#if defined(TLS1_3_VERSION)
+  if (version == TLS1_3_VERSION) {
+    record_overhead = PROXY_TLS_KTLS_TLS13_RECORD_OVERHEAD;
+  }
+#endif /* TLS1_3_VERSION */
+
+  nrecords = (len + SSL3_RT_MAX_PLAIN_LENGTH - 1) / SSL3_RT_MAX_PLAIN_LENGTH;
+  return (int) (nrecords * record_overhead);
+}
+
 static ssize_t tls_read(SSL *ssl, void *buf, size_t len,
     int nstrm_type, pr_table_t *notes) {
   int lineno;
@@ -1219,9 +1312,46 @@ static int tls_verify_cb(int ok, X509_STORE_CTX *ctx) {
   return ok;
 }
 
+static const char *tls_get_sess_key(pool *p, const char *host, int port) {
+  char port_str[32];
+
+  memset(port_str, '\0', sizeof(port_str));
+  snprintf(port_str, sizeof(port_str)-1, "%d", port);
+  return pstrcat(p, "ftp://", host, ":", port_str, NULL);
+}
+
+static const char *tls_get_sess_slot_key(pool *p, const char *sess_key,
+    unsigned int slot) {
+  char slot_str[32];
+
+  if (slot == 0) {
+    return sess_key;
+  }
+
+  memset(slot_str, '\0', sizeof(slot_str));
+  snprintf(slot_str, sizeof(slot_str)-1, "#%u", slot);
+  return pstrcat(p, sess_key, slot_str, NULL);
+}
+
+/* Whether the given session may be resumed only once, as for TLSv1.3
+ * tickets (see RFC 8446, Appendix C.4).
+ */
+static int tls_sess_is_single_use(SSL_SESSION *sess) {
+#if defined(TLS1_3_VERSION)
+  if (SSL_SESSION_get_protocol_version(sess) == TLS1_3_VERSION) {
+    return TRUE;
+  }
+#endif /* TLSv1.3 */
+
+  (void) sess;
+  return FALSE;
+}
+
 static int tls_get_cached_sess(pool *p, SSL *ssl, const char *host, int port) {
-  char port_str[32], *sess_key = NULL;
+  register unsigned int i;
+  const char *sess_key = NULL, *slot_key = NULL;
   SSL_SESSION *sess = NULL;
+  unsigned int start;
 
   if (tls_opts & PROXY_TLS_OPT_NO_SESSION_CACHE) {
     if (tls_opts & PROXY_TLS_OPT_NO_SESSION_TICKETS) {
@@ -1233,56 +1363,90 @@ static int tls_get_cached_sess(pool *p, SSL *ssl, const char *host, int port) {
     }
   }
 
-  memset(port_str, '\0', sizeof(port_str));
-  snprintf(port_str, sizeof(port_str)-1, "%d", port);
-  sess_key = pstrcat(p, "ftp://", host, ":", port_str, NULL);
+  sess_key = tls_get_sess_key(p, host, port);
+
+  /* Remember the key, for caching any sessions/tickets which the server
+   * issues on this connection.
+   */
+  SSL_set_ex_data(ssl, PROXY_TLS_IDX_SESS_KEY, (void *) sess_key);
 
   pr_trace_msg(trace_channel, 19,
     "looking for cached SSL session using key '%s'", sess_key);
 
-  sess = (tls_ds.get_sess)(p, tls_ds.dsh, sess_key);
-  if (sess != NULL) {
+  /* Start at a random slot, so that concurrent sessions are less likely to
+   * pick the same single-use ticket.
+   */
+  start = (unsigned int) proxy_random_next(0,
+    PROXY_TLS_MAX_SESSIONS_PER_BACKEND - 1);
+
+  for (i = 0; i < PROXY_TLS_MAX_SESSIONS_PER_BACKEND; i++) {
     long sess_age;
     time_t now;
 
+    slot_key = tls_get_sess_slot_key(p, sess_key,
+      (start + i) % PROXY_TLS_MAX_SESSIONS_PER_BACKEND);
+
+    sess = (tls_ds.get_sess)(p, tls_ds.dsh, slot_key);
+    if (sess == NULL) {
+      if (errno != ENOENT) {
+        pr_trace_msg(trace_channel, 9,
+          "error getting cached session using key '%s': %s", slot_key,
+          strerror(errno));
+      }
+
+      continue;
+    }
+
     now = time(NULL);
     sess_age = now - SSL_SESSION_get_time(sess);
 
-    if (sess_age >= PROXY_TLS_MAX_SESSION_AGE) {
-      pr_trace_msg(trace_channel, 9, "cached SSL session expired, removing");
-      (void) (tls_ds.remove_sess)(p, tls_ds.dsh, sess_key);
+    if (sess_age >= PROXY_TLS_MAX_SESSION_AGE ||
+        sess_age >= SSL_SESSION_get_timeout(sess)) {
+      pr_trace_msg(trace_channel, 9,
+        "cached SSL session '%s' expired, removing", slot_key);
+      (void) (tls_ds.remove_sess)(p, tls_ds.dsh, slot_key);
 
       SSL_SESSION_free(sess);
-      errno = ENOENT;
       sess = NULL;
+      continue;
     }
-  }
 
-  if (sess == NULL) {
-    if (errno == ENOENT) {
-      pr_trace_msg(trace_channel, 19,
-        "no cached sessions found for key '%s'", sess_key);
+    if (tls_sess_is_single_use(sess) == TRUE) {
+      /* Take the ticket, so that no other session tries to reuse it.  If
+       * another session took it first, try the next slot.
+       */
+      SSL_SESSION_free(sess);
 
-    } else {
-      pr_trace_msg(trace_channel, 9,
-        "error getting cached session using key '%s': %s", sess_key,
-        strerror(errno));
-    } 
+      pr_trace_msg(trace_channel, 17,
+        "consuming single-use SSL session '%s'", slot_key);
+      sess = (tls_ds.take_sess)(p, tls_ds.dsh, slot_key);
+      if (sess == NULL) {
+        pr_trace_msg(trace_channel, 17,
+          "single-use SSL session '%s' already consumed", slot_key);
+        continue;
+      }
+    }
 
+    break;
+  }
+
+  if (sess == NULL) {
+    pr_trace_msg(trace_channel, 19,
+      "no cached sessions found for key '%s'", sess_key);
     return 0;
   }
 
   pr_trace_msg(trace_channel, 12,
-    "found cached SSL session using key '%s'", sess_key);
+    "found cached SSL session using key '%s'", slot_key);
   SSL_set_session(ssl, sess);
   SSL_SESSION_free(sess);
 
   return 0;
 }
 
-static int tls_add_cached_sess(pool *p, SSL *ssl, const char *host, int port) {
-  char port_str[32], *sess_key = NULL;
-  SSL_SESSION *sess = NULL;
+static int tls_add_cached_sess(pool *p, SSL_SESSION *sess,
+    const char *sess_key) {
+  const char *slot_key;
   int res, sess_count, xerrno = 0;
   time_t now, sess_age;
 
@@ -1295,6 +1459,15 @@ static int tls_add_cached_sess(pool *p, SSL *ssl, const char *host, int port) {
     }
   }
 
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && \
+    !defined(HAVE_LIBRESSL)
+  if (SSL_SESSION_is_resumable(sess) == 0) {
+    pr_trace_msg(trace_channel, 19,
+      "SSL session is not resumable, not caching");
+    return 0;
+  }
+#endif /* OpenSSL-1.1.1 and later */
+
   sess_count = (tls_ds.count_sess)(p, tls_ds.dsh);
   if (sess_count < 0) {
     return -1;
@@ -1307,48 +1480,106 @@ static int tls_add_cached_sess(pool *p, SSL *ssl, const char *host, int port) {
     return 0;
   }
 
-  sess = SSL_get1_session(ssl);
-
   /* If this session is already past our expiration policy, ignore it. */
   now = time(NULL);
   sess_age = now - SSL_SESSION_get_time(sess);
   if (sess_age >= PROXY_TLS_MAX_SESSION_AGE) {
     pr_trace_msg(trace_channel, 9,
       "SSL session has already expired, not caching");
-    SSL_SESSION_free(sess);
     return 0;
   }
 
-  memset(port_str, '\0', sizeof(port_str));
-  snprintf(port_str, sizeof(port_str)-1, "%d", port);
-  sess_key = pstrcat(p, "ftp://", host, ":", port_str, NULL);
+  /* Reusable sessions only need the one slot; single-use tickets are spread
+   * across all of the backend's slots.
+   */
+  if (tls_sess_is_single_use(sess) == TRUE) {
+    if (tls_sess_cursor == 0) {
+      tls_sess_cursor = (unsigned int) proxy_random_next(0,
+        PROXY_TLS_MAX_SESSIONS_PER_BACKEND - 1);
+    }
+
+    slot_key = tls_get_sess_slot_key(p, sess_key,
+      tls_sess_cursor++ % PROXY_TLS_MAX_SESSIONS_PER_BACKEND);
+
+  } else {
+    slot_key = sess_key;
+  }
 
   pr_trace_msg(trace_channel, 19,
-    "caching SSL session using key '%s'", sess_key);
+    "caching SSL session using key '%s'", slot_key);
 
-  res = (tls_ds.add_sess)(p, tls_ds.dsh, sess_key, sess);
+  res = (tls_ds.add_sess)(p, tls_ds.dsh, slot_key, sess);
   xerrno = errno;
-  SSL_SESSION_free(sess);
 
   if (res < 0) {
     pr_trace_msg(trace_channel, 9,
-      "error storing cached SSL session using key '%s': %s", sess_key,
+      "error storing cached SSL session using key '%s': %s", slot_key,
       strerror(xerrno));
 
   } else {
     pr_trace_msg(trace_channel, 19,
-      "successfully cached SSL session using key '%s'", sess_key);
+      "successfully cached SSL session using key '%s'", slot_key);
+  }
+
+  return 0;
+}
+
+/* Called by OpenSSL whenever the server establishes a new session with us:
+ * after a full handshake, and for each TLSv1.3 NewSessionTicket message.
+ */
+static int tls_sess_new_cb(SSL *ssl, SSL_SESSION *sess) {
+  const char *sess_key;
+  pool *tmp_pool;
+
+  sess_key = SSL_get_ex_data(ssl, PROXY_TLS_IDX_SESS_KEY);
+  if (sess_key == NULL) {
+    /* Not a control connection; nothing to do. */
+    return 0;
   }
 
+  tmp_pool = make_sub_pool(proxy_pool);
+  (void) tls_add_cached_sess(tmp_pool, sess, sess_key);
+  destroy_pool(tmp_pool);
+
+  /* We did not keep a reference to the session. */
   return 0;
 }
 
+static void tls_log_data_handshakes(void) {
+  const struct proxy_session *proxy_sess;
+  const char *backend_uri = NULL;
+  unsigned int total;
+
+  total = tls_data_full_handshakes + tls_data_resumed_handshakes;
+  if (total == 0) {
+    return;
+  }
+
+  proxy_sess = pr_table_get(session.notes, "mod_proxy.proxy-session", NULL);
+  if (proxy_sess != NULL &&
+      proxy_sess->dst_pconn != NULL) {
+    backend_uri = proxy_conn_get_uri(proxy_sess->dst_pconn);
+  }
+
+  (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+    "backend %s: %u TLS data handshakes (%u resumed, %u full), "
+    "%lu ms total, %lu ms average",
+    backend_uri != NULL ? backend_uri : "(unknown)", total,
+    tls_data_resumed_handshakes, tls_data_full_handshakes,
+    (unsigned long) tls_data_handshake_ms,
+    (unsigned long) (tls_data_handshake_ms / total));
+
+  tls_data_full_handshakes = tls_data_resumed_handshakes = 0;
+  tls_data_handshake_ms = 0;
+}
+
 static int tls_connect(conn_t *conn, const char *host_name,
     pr_netio_stream_t *nstrm) {
   int blocking, res = 0, xerrno = 0;
   char *subj = NULL;
   SSL *ssl = NULL;
   BIO *rbio = NULL, *wbio = NULL;
+  uint64_t start_ms = 0, finish_ms = 0;
 
   if (ssl_ctx == NULL) {
     (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
@@ -1357,12 +1588,38 @@ static int tls_connect(conn_t *conn, const char *host_name,
     return -1;
   }
 
-  ssl = SSL_new(ssl_ctx);
-  if (ssl == NULL) {
-    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-      "error: unable to allocate SSL session: %s", proxy_tls_get_errors());
-    return -2;
+  if (nstrm->strm_type == PR_NETIO_STRM_DATA &&
+      tls_data_ssl_idle != NULL) {
+    pr_trace_msg(trace_channel, 19,
+      "reusing SSL object of previous data connection");
+    ssl = tls_data_ssl_idle;
+    tls_data_ssl_idle = NULL;
+
+  } else {
+    ssl = SSL_new(ssl_ctx);
+    if (ssl == NULL) {
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error: unable to allocate SSL session: %s", proxy_tls_get_errors());
+      return -2;
+    }
+  }
+
+  if (nstrm->strm_type == PR_NETIO_STRM_DATA &&
+      (tls_opts & PROXY_TLS_OPT_REUSE_DATA_SSL)) {
+    /* Keep the read/write buffers across consecutive transfers. */
+    SSL_clear_mode(ssl, SSL_MODE_RELEASE_BUFFERS);
+  }
+
+#if defined(PROXY_TLS_HAVE_KTLS)
+  if (nstrm->strm_type == PR_NETIO_STRM_DATA &&
+      (tls_opts & PROXY_TLS_OPT_ENABLE_KTLS)) {
+    /* OpenSSL enables kTLS, after the handshake, only if the kernel supports
+     * the negotiated cipher; otherwise the records are handled in user space,
+     * as usual.
+     */
+    SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
   }
+#endif /* PROXY_TLS_HAVE_KTLS */
 
   SSL_set_verify(ssl, SSL_VERIFY_PEER, tls_verify_cb);
 
@@ -1403,11 +1660,11 @@ static int tls_connect(conn_t *conn, const char *host_name,
     SSL_copy_session_id(ssl, tls_ctrl_ssl);
 
   } else if (nstrm->strm_type == PR_NETIO_STRM_CTRL) {
-    tls_get_cached_sess(nstrm->strm_pool, ssl, host_name, conn->remote_port);
+    if (tls_opts & PROXY_TLS_OPT_NO_SESSION_TICKETS) {
+      SSL_set_options(ssl, SSL_OP_NO_TICKET);
+    }
 
-# if !defined(PROXY_TLS_USE_SESSION_TICKETS)
-    SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TICKET);
-# endif /* Session ticket support */
+    tls_get_cached_sess(nstrm->strm_pool, ssl, host_name, conn->remote_port);
   }
 
   /* If configured, set a timer for the handshake. */
@@ -1427,6 +1684,8 @@ static int tls_connect(conn_t *conn, const char *host_name,
        strerror(errno));
   }
 
+  pr_gettimeofday_millis(&start_ms);
+
   connect_retry:
 
   blocking = tls_get_block(conn);
@@ -1558,19 +1817,12 @@ static int tls_connect(conn_t *conn, const char *host_name,
       pr_trace_msg(trace_channel, 9,
         "error re-enabling TCP_CORK on data conn: %s", strerror(errno));
     }
-
-  } else if (nstrm->strm_type == PR_NETIO_STRM_CTRL) {
-    int reused;
-
-    /* Only try to cache the new SSL session if we actually did create a
-     * new session.  Otherwise, leave the previously cached session as is.
-     */
-    reused = SSL_session_reused(ssl);
-    if (reused == 0) {
-      tls_add_cached_sess(nstrm->strm_pool, ssl, host_name, conn->remote_port);
-    }
   }
 
+  /* Note that any new sessions/tickets for control connections are cached
+   * by tls_sess_new_cb(), as the server issues them.
+   */
+
   /* Manually update the raw bytes counters with the network IO from the
    * SSL handshake.
    */
@@ -1579,6 +1831,52 @@ static int tls_connect(conn_t *conn, const char *host_name,
   session.total_raw_out += (BIO_number_written(rbio) +
     BIO_number_written(wbio));
 
+  if (nstrm->strm_type == PR_NETIO_STRM_DATA) {
+    int resumed;
+    long handshake_ms;
+
+    pr_gettimeofday_millis(&finish_ms);
+    handshake_ms = (long) (finish_ms - start_ms);
+    resumed = SSL_session_reused(ssl) ? TRUE : FALSE;
+
+    if (resumed) {
+      tls_data_resumed_handshakes++;
+
+    } else {
+      tls_data_full_handshakes++;
+    }
+    tls_data_handshake_ms += handshake_ms;
+
+    pr_trace_msg(trace_channel, 12,
+      "%s TLS handshake for data connection took %ld ms",
+      resumed ? "resumed" : "full", handshake_ms);
+
+    if (tls_opts & PROXY_TLS_OPT_ENABLE_KTLS) {
+      int ktls_send, ktls_recv;
+
+      ktls_send = tls_using_ktls(ssl, PR_NETIO_IO_WR);
+      ktls_recv = tls_using_ktls(ssl, PR_NETIO_IO_RD);
+
+      if (ktls_send == TRUE ||
+          ktls_recv == TRUE) {
+        pr_trace_msg(trace_channel, 12,
+          "using kernel TLS for data connection (send: %s, receive: %s)",
+          ktls_send ? "yes" : "no", ktls_recv ? "yes" : "no");
+
+      } else {
+        pr_trace_msg(trace_channel, 9,
+          "kernel TLS not available for data connection using cipher %s, "
+          "falling back to user-space TLS", SSL_get_cipher_name(ssl));
+      }
+    }
+    (void) proxy_metrics_xfer_set_tls_handshake(resumed, handshake_ms);
+
+    (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_TLS_OVERHEAD_IN,
+      BIO_number_read(rbio) + BIO_number_read(wbio));
+    (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_TLS_OVERHEAD_OUT,
+      BIO_number_written(rbio) + BIO_number_written(wbio));
+  }
+
   /* Stash the SSL pointer in BOTH input and output streams for this
    * connection.
    */
@@ -1689,28 +1987,30 @@ static int netio_close_cb(pr_netio_stream_t *nstrm) {
   if (ssl != NULL) {
     if (nstrm->strm_type == PR_NETIO_STRM_CTRL &&
         nstrm->strm_mode == PR_NETIO_IO_WR) {
-      const struct proxy_session *proxy_sess;
-      const char *host_name;
-      int remote_port;
-
-      proxy_sess = pr_table_get(session.notes, "mod_proxy.proxy-session", NULL);
-      host_name = proxy_conn_get_host(proxy_sess->dst_pconn);
-      remote_port = proxy_conn_get_port(proxy_sess->dst_pconn);
-
-      /* Cache the SSL session here, as it may have changed (e.g. due to
-       * renegotiations) during the lifetime of the control connection.
+      /* Any sessions established during the lifetime of the control
+       * connection (e.g. due to renegotiations) have already been cached, by
+       * tls_sess_new_cb().
        */
-      tls_add_cached_sess(nstrm->strm_pool, ssl, host_name, remote_port);
-
       pr_table_remove(nstrm->notes, PROXY_TLS_NETIO_NOTE, NULL);
       tls_end_sess(ssl, nstrm->strm_type, 0);
       proxy_sess_state &= ~PROXY_SESS_STATE_BACKEND_HAS_CTRL_TLS;
+
+      tls_log_data_handshakes();
     }
 
     if (nstrm->strm_type == PR_NETIO_STRM_DATA &&
         nstrm->strm_mode == PR_NETIO_IO_WR) {
       pr_table_remove(nstrm->notes, PROXY_TLS_NETIO_NOTE, NULL);
 
+      /* SSL objects whose records were handled by the kernel are not
+       * reused; their record layer state is tied to that socket.
+       */
+      if ((tls_opts & PROXY_TLS_OPT_REUSE_DATA_SSL) &&
+          tls_using_ktls(ssl, PR_NETIO_IO_WR) == FALSE &&
+          tls_using_ktls(ssl, PR_NETIO_IO_RD) == FALSE) {
+        tls_end_sess(ssl, nstrm->strm_type, PROXY_TLS_SHUTDOWN_FL_KEEP);
+      }
+
       if (tls_data_netio != NULL &&
           tls_required_on_frontend_data == FALSE) {
         pr_netio_t *using_netio = NULL;
@@ -1897,6 +2197,11 @@ static int netio_read_cb(pr_netio_stream_t *nstrm, char *buf, size_t buflen) {
     bwritten = (BIO_number_written(rbio) - rbio_wbytes) +
       (BIO_number_written(wbio) - wbio_wbytes);
 
+    if (bread > 0 &&
+        tls_using_ktls(ssl, PR_NETIO_IO_RD) == TRUE) {
+      bread += proxy_tls_ktls_overhead(SSL_version(ssl), bread);
+    }
+
     /* Manually update session.total_raw_in with the difference between
      * the raw bytes read in versus the non-SSL bytes read in, in order to
      * have %I be accurately represented for the raw traffic.
@@ -1912,6 +2217,18 @@ static int netio_read_cb(pr_netio_stream_t *nstrm, char *buf, size_t buflen) {
       session.total_raw_out += bwritten;
     }
 
+    if (nstrm->strm_type == PR_NETIO_STRM_DATA) {
+      if (res > 0) {
+        (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_TLS_OVERHEAD_IN,
+          bread - res);
+      }
+
+      if (bwritten > 0) {
+        (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_TLS_OVERHEAD_OUT,
+          bwritten);
+      }
+    }
+
     return res;
   }
 
@@ -2029,6 +2346,11 @@ static int netio_write_cb(pr_netio_stream_t *nstrm, char *buf, size_t buflen) {
     bwritten = (BIO_number_written(rbio) - rbio_wbytes) +
       (BIO_number_written(wbio) - wbio_wbytes);
 
+    if (bwritten > 0 &&
+        tls_using_ktls(ssl, PR_NETIO_IO_WR) == TRUE) {
+      bwritten += proxy_tls_ktls_overhead(SSL_version(ssl), bwritten);
+    }
+
     /* Manually update session.total_raw_in, in order to have %I be
      * accurately represented for the raw traffic.
      */
@@ -2044,6 +2366,18 @@ static int netio_write_cb(pr_netio_stream_t *nstrm, char *buf, size_t buflen) {
       session.total_raw_out += (bwritten - res);
     }
 
+    if (nstrm->strm_type == PR_NETIO_STRM_DATA) {
+      if (bread > 0) {
+        (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_TLS_OVERHEAD_IN,
+          bread);
+      }
+
+      if (res > 0) {
+        (void) proxy_metrics_xfer_incr(PROXY_METRICS_XFER_TLS_OVERHEAD_OUT,
+          bwritten - res);
+      }
+    }
+
     return res;
   }
 
@@ -2308,9 +2642,12 @@ static int init_ssl_ctx(void) {
   }
 
   /* Note that we explicitly do NOT use OpenSSL's internal cache for
-   * client session caching; we'll use our own.
+   * client session caching; we'll use our own.  We do want to be told of
+   * every new session, though, including each TLSv1.3 ticket.
    */
-  SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_OFF);
+  SSL_CTX_set_session_cache_mode(ssl_ctx,
+    SSL_SESS_CACHE_CLIENT|SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ssl_ctx, tls_sess_new_cb);
 
 #if OPENSSL_VERSION_NUMBER > 0x000906000L
   /* The SSL_MODE_AUTO_RETRY mode was added in 0.9.6. */
@@ -2406,6 +2743,228 @@ int proxy_tls_using_tls(void) {
 #endif /* PR_USE_OPENSSL */
 }
 
+static void tls_get_trust_paths(pool *p, server_rec *s, const char **ca_file,
+    const char **ca_path, const char **crl_file, const char **crl_path) {
+  config_rec *c;
+
+  *ca_file = *ca_path = *crl_file = *crl_path = NULL;
+
+  c = find_config(s->conf, CONF_PARAM, "ProxyTLSCACertificateFile", FALSE);
+  if (c != NULL) {
+    *ca_file = c->argv[0];
+
+  } else {
+    *ca_file = PR_CONFIG_DIR "/cacerts.pem";
+    if (!file_exists2(p, *ca_file)) {
+      pr_trace_msg(trace_channel, 9,
+        "warning: no default ProxyTLSCACertificateFile found at '%s'",
+        *ca_file);
+      *ca_file = NULL;
+    }
+  }
+
+  c = find_config(s->conf, CONF_PARAM, "ProxyTLSCACertificatePath", FALSE);
+  if (c != NULL) {
+    *ca_path = c->argv[0];
+  }
+
+  c = find_config(s->conf, CONF_PARAM, "ProxyTLSCARevocationFile", FALSE);
+  if (c != NULL) {
+    *crl_file = c->argv[0];
+  }
+
+  c = find_config(s->conf, CONF_PARAM, "ProxyTLSCARevocationPath", FALSE);
+  if (c != NULL) {
+    *crl_path = c->argv[0];
+  }
+}
+
+static X509_STORE *tls_load_trust_store(const char *ca_file,
+    const char *ca_path, const char *crl_file, const char *crl_path) {
+  X509_STORE *store;
+  int res;
+
+  store = X509_STORE_new();
+  if (store == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error allocating X509 store: %s", proxy_tls_get_errors());
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if (ca_file != NULL ||
+      ca_path != NULL) {
+    /* Set the locations used for verifying certificates. */
+    PRIVS_ROOT
+    res = X509_STORE_load_locations(store, ca_file, ca_path);
+    PRIVS_RELINQUISH
+
+    if (res != 1) {
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "unable to set CA verification using file '%s' or "
+        "directory '%s': %s", ca_file ? ca_file : "(none)",
+        ca_path ? ca_path : "(none)", proxy_tls_get_errors());
+      X509_STORE_free(store);
+      errno = EPERM;
+      return NULL;
+    }
+
+  } else {
+    /* Default to using locations set in the OpenSSL config file. */
+    pr_trace_msg(trace_channel, 9,
+      "using default OpenSSL CA verification locations (see $SSL_CERT_DIR "
+      "environment variable)");
+
+    if (X509_STORE_set_default_paths(store) != 1) {
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error setting default CA verification locations: %s",
+        proxy_tls_get_errors());
+    }
+  }
+
+  if (crl_file != NULL ||
+      crl_path != NULL) {
+    PRIVS_ROOT
+    res = X509_STORE_load_locations(store, crl_file, crl_path);
+    PRIVS_RELINQUISH
+
+    if (res != 1) {
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "error loading ProxyTLSCARevocation files: %s", proxy_tls_get_errors());
+    }
+  }
+
+  return store;
+}
+
+static int tls_trust_store_ref(X509_STORE *store) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && \
+    !defined(HAVE_LIBRESSL)
+  return X509_STORE_up_ref(store);
+#else
+  CRYPTO_add(&(store->references), 1, CRYPTO_LOCK_X509_STORE);
+  return 1;
+#endif /* OpenSSL-1.1.x and later */
+}
+
+static int tls_trust_paths_eq(const char *a, const char *b) {
+  if (a == NULL ||
+      b == NULL) {
+    return (a == b);
+  }
+
+  return (strcmp(a, b) == 0);
+}
+
+/* Load the trust stores for all vhosts which may use TLS to their backends.
+ * Vhosts with the same CA/CRL locations share the same store.
+ */
+static void tls_init_trust_stores(pool *p) {
+  server_rec *s;
+
+  tls_trust_stores = make_array(p, 0, sizeof(struct tls_trust_store));
+
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    register unsigned int i;
+    config_rec *c;
+    struct tls_trust_store *stores, *ts;
+    const char *ca_file, *ca_path, *crl_file, *crl_path;
+    X509_STORE *store = NULL;
+
+    pr_signals_handle();
+
+    c = find_config(s->conf, CONF_PARAM, "ProxyEngine", FALSE);
+    if (c == NULL ||
+        *((int *) c->argv[0]) != TRUE) {
+      continue;
+    }
+
+    c = find_config(s->conf, CONF_PARAM, "ProxyTLSEngine", FALSE);
+    if (c != NULL &&
+        *((int *) c->argv[0]) == PROXY_TLS_ENGINE_OFF) {
+      continue;
+    }
+
+    tls_get_trust_paths(p, s, &ca_file, &ca_path, &crl_file, &crl_path);
+
+    stores = tls_trust_stores->elts;
+    for (i = 0; i < tls_trust_stores->nelts; i++) {
+      if (tls_trust_paths_eq(stores[i].ca_file, ca_file) &&
+          tls_trust_paths_eq(stores[i].ca_path, ca_path) &&
+          tls_trust_paths_eq(stores[i].crl_file, crl_file) &&
+          tls_trust_paths_eq(stores[i].crl_path, crl_path)) {
+        if (tls_trust_store_ref(stores[i].store) == 1) {
+          store = stores[i].store;
+        }
+        break;
+      }
+    }
+
+    if (store == NULL) {
+      store = tls_load_trust_store(ca_file, ca_path, crl_file, crl_path);
+      if (store == NULL) {
+        /* The session process will try again, and fail, on its own. */
+        continue;
+      }
+
+      pr_trace_msg(trace_channel, 9,
+        "loaded trust store (CA file '%s', CA path '%s', CRL file '%s', "
+        "CRL path '%s') for <VirtualHost> '%s'", ca_file ? ca_file : "(none)",
+        ca_path ? ca_path : "(none)", crl_file ? crl_file : "(none)",
+        crl_path ? crl_path : "(none)", s->ServerName);
+    }
+
+    ts = push_array(tls_trust_stores);
+    ts->sid = s->sid;
+    ts->ca_file = ca_file;
+    ts->ca_path = ca_path;
+    ts->crl_file = crl_file;
+    ts->crl_path = crl_path;
+    ts->store = store;
+  }
+}
+
+static void tls_free_trust_stores(void) {
+  register unsigned int i;
+  struct tls_trust_store *stores;
+
+  if (tls_trust_stores == NULL) {
+    return;
+  }
+
+  stores = tls_trust_stores->elts;
+  for (i = 0; i < tls_trust_stores->nelts; i++) {
+    X509_STORE_free(stores[i].store);
+  }
+
+  tls_trust_stores = NULL;
+}
+
+X509_STORE *proxy_tls_get_trust_store(unsigned int sid) {
+  register unsigned int i;
+  struct tls_trust_store *stores;
+
+  if (tls_trust_stores == NULL) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  stores = tls_trust_stores->elts;
+  for (i = 0; i < tls_trust_stores->nelts; i++) {
+    if (stores[i].sid == sid) {
+      if (tls_trust_store_ref(stores[i].store) != 1) {
+        errno = ENOMEM;
+        return NULL;
+      }
+
+      return stores[i].store;
+    }
+  }
+
+  errno = ENOENT;
+  return NULL;
+}
+
 int proxy_tls_init(pool *p, const char *tables_path, int flags) {
 #ifdef PR_USE_OPENSSL
   int res;
@@ -2423,6 +2982,11 @@ int proxy_tls_init(pool *p, const char *tables_path, int flags) {
         proxy_datastore_datasz);
       break;
 
+    case PROXY_DATASTORE_SHM:
+      res = proxy_tls_shm_as_datastore(&tls_ds, proxy_datastore_data,
+        proxy_datastore_datasz);
+      break;
+
     default:
       res = -1;
       errno = EINVAL;
@@ -2453,6 +3017,11 @@ int proxy_tls_init(pool *p, const char *tables_path, int flags) {
     return -1;
   }
 
+  /* Parse the CA certificates and CRLs here, once, rather than in every
+   * session process; this is redone when the daemon is restarted.
+   */
+  tls_init_trust_stores(p);
+
   tls_tables_path = pstrdup(proxy_pool, tables_path);
 
   pr_event_register(&proxy_module, "core.shutdown", proxy_tls_shutdown_ev,
@@ -2474,6 +3043,8 @@ int proxy_tls_free(pool *p) {
     ssl_ctx = NULL;
   }
 
+  tls_free_trust_stores();
+
   if (tls_ds.dsh != NULL) {
     int res;
 
@@ -4333,8 +4904,10 @@ int proxy_tls_sess_init(pool *p, int flags) {
   unsigned int enabled_proto_count = 0, tls_protocol = PROXY_TLS_PROTO_DEFAULT;
   int disabled_proto, res, xerrno = 0;
   const char *enabled_proto_str = NULL;
-  char *ca_file = NULL, *ca_path = NULL, *cert_file = NULL, *key_file = NULL,
-    *crl_file = NULL, *crl_path = NULL;
+  char *cert_file = NULL, *key_file = NULL;
+  long verify_flags = 0;
+  X509_STORE *store;
+  X509_VERIFY_PARAM *verify_param;
 
   c = find_config(main_server->conf, CONF_PARAM, "ProxyTLSEngine", FALSE);
   if (c != NULL) {
@@ -4443,45 +5016,23 @@ int proxy_tls_sess_init(pool *p, int flags) {
     handshake_timeout = *((unsigned int *) c->argv[0]);
   }
 
-  c = find_config(main_server->conf, CONF_PARAM, "ProxyTLSCACertificateFile",
-    FALSE);
-  if (c != NULL) {
-    ca_file = c->argv[0];
-
-  } else {
-    ca_file = PR_CONFIG_DIR "/cacerts.pem";
-    if (!file_exists2(p, ca_file)) {
-      pr_trace_msg(trace_channel, 9,
-        "warning: no default ProxyTLSCACertificateFile found at '%s'", ca_file);
-      ca_file = NULL;
-    }
-  }
-
-  c = find_config(main_server->conf, CONF_PARAM, "ProxyTLSCACertificatePath",
-    FALSE);
-  if (c != NULL) {
-    ca_path = c->argv[0];
-  }
-
-  if (ca_file != NULL ||
-      ca_path != NULL) {
-    long verify_flags = 0;
-    X509_VERIFY_PARAM *verify_param;
+  store = proxy_tls_get_trust_store(main_server->sid);
+  if (store == NULL) {
+    const char *ca_file, *ca_path, *crl_file, *crl_path;
 
-    /* Set the locations used for verifying certificates. */
-    PRIVS_ROOT
-    if (SSL_CTX_load_verify_locations(ssl_ctx, ca_file, ca_path) != 1) {
-      PRIVS_RELINQUISH
-      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-        "unable to set CA verification using file '%s' or "
-        "directory '%s': %s", ca_file ? ca_file : "(none)",
-        ca_path ? ca_path : "(none)", proxy_tls_get_errors());
+    /* Not loaded by the daemon (e.g. when run from inetd); load it now. */
+    tls_get_trust_paths(p, main_server, &ca_file, &ca_path, &crl_file,
+      &crl_path);
+    store = tls_load_trust_store(ca_file, ca_path, crl_file, crl_path);
+    if (store == NULL) {
       errno = EPERM;
       return -1;
     }
-    PRIVS_RELINQUISH
+  }
+
+  SSL_CTX_set_cert_store(ssl_ctx, store);
 
-    verify_param = X509_VERIFY_PARAM_new();
+  verify_param = X509_VERIFY_PARAM_new();
 
 #if 0
 /* NOTE: Many server certs may not have a CRL provider configured; such certs
@@ -4489,78 +5040,34 @@ int proxy_tls_sess_init(pool *p, int flags) {
  * disabled, for now.
  */
 # if defined(X509_V_FLAG_CRL_CHECK)
-    verify_flags |= X509_V_FLAG_CRL_CHECK;
+  verify_flags |= X509_V_FLAG_CRL_CHECK;
 # endif
 # if defined(X509_V_FLAG_CRL_CHECK_ALL)
-    verify_flags |= X509_V_FLAG_CRL_CHECK_ALL;
+  verify_flags |= X509_V_FLAG_CRL_CHECK_ALL;
 # endif
 #endif
 
-# if defined(X509_V_FLAG_TRUSTED_FIRST)
-    verify_flags |= X509_V_FLAG_TRUSTED_FIRST;
-# endif
-# if defined(X509_V_FLAG_PARTIAL_CHAIN)
-    verify_flags |= X509_V_FLAG_PARTIAL_CHAIN;
-# endif
-
-    if (X509_VERIFY_PARAM_set_flags(verify_param, verify_flags) != 1) {
-      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-        "error preparing X509 verification parameters: %s",
-        proxy_tls_get_errors());
+#if defined(X509_V_FLAG_TRUSTED_FIRST)
+  verify_flags |= X509_V_FLAG_TRUSTED_FIRST;
+#endif
+#if defined(X509_V_FLAG_PARTIAL_CHAIN)
+  verify_flags |= X509_V_FLAG_PARTIAL_CHAIN;
+#endif
 
-    } else {
-      if (SSL_CTX_set1_param(ssl_ctx, verify_param) != 1) {
-        (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-          "error setting X509 verification parameters: %s",
-          proxy_tls_get_errors());
-      }
-    }
+  if (X509_VERIFY_PARAM_set_flags(verify_param, verify_flags) != 1) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error preparing X509 verification parameters: %s",
+      proxy_tls_get_errors());
 
   } else {
-    /* Default to using locations set in the OpenSSL config file. */
-    pr_trace_msg(trace_channel, 9,
-      "using default OpenSSL CA verification locations (see $SSL_CERT_DIR "
-      "environment variable)");
-
-    if (SSL_CTX_set_default_verify_paths(ssl_ctx) != 1) {
+    if (SSL_CTX_set1_param(ssl_ctx, verify_param) != 1) {
       (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-        "error setting default CA verification locations: %s",
+        "error setting X509 verification parameters: %s",
         proxy_tls_get_errors());
     }
   }
 
-  c = find_config(main_server->conf, CONF_PARAM, "ProxyTLSCARevocationFile",
-    FALSE);
-  if (c != NULL) {
-    crl_file = c->argv[0];
-  }
-
-  c = find_config(main_server->conf, CONF_PARAM, "ProxyTLSCARevocationPath",
-    FALSE);
-  if (c != NULL) {
-    crl_path = c->argv[0];
-  }
-
-  if (crl_file != NULL ||
-      crl_path != NULL) {
-    X509_STORE *crl_store;
-
-    crl_store = X509_STORE_new();
-    if (crl_store == NULL) {
-      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-        "error allocating CRL store: %s", proxy_tls_get_errors());
-      errno = EPERM;
-      return -1;
-    }
-
-    if (X509_STORE_load_locations(crl_store, crl_file, crl_path) != 1) {
-      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-        "error loading ProxyTLSCARevocation files: %s", proxy_tls_get_errors());
-
-    } else {
-      SSL_CTX_set_cert_store(ssl_ctx, crl_store);
-    }
-  }
+  X509_VERIFY_PARAM_free(verify_param);
 
   c = find_config(main_server->conf, CONF_PARAM, "ProxyTLSVerifyServer", FALSE);
   if (c != NULL) {
@@ -4727,6 +5234,11 @@ int proxy_tls_sess_free(pool *p) {
       tls_ds.dsh = NULL;
     }
 
+    if (tls_data_ssl_idle != NULL) {
+      SSL_free(tls_data_ssl_idle);
+      tls_data_ssl_idle = NULL;
+    }
+
     if (ssl_ctx != NULL) {
       if (init_ssl_ctx() < 0) {
         return -1;
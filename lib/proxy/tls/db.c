@@ -39,6 +39,9 @@ static const char *trace_channel = "proxy.tls.db";
 
 static unsigned long db_opts = 0UL;
 
+/* Extra flags for opening the database, e.g. for WAL mode. */
+static int db_open_flags = 0;
+
 static int tls_db_add_sess(pool *p, void *dbh, const char *key,
     SSL_SESSION *sess) {
   int res, vhost_id, xerrno = 0;
@@ -245,6 +248,39 @@ static SSL_SESSION *tls_db_get_sess(pool *p, void *dbh, const char *key) {
   return sess;
 }
 
+static SSL_SESSION *tls_db_take_sess(pool *p, void *dbh, const char *key) {
+  int xerrno;
+  SSL_SESSION *sess;
+
+  /* The transaction holds the write lock, so no other session can get the
+   * session between our reading and deleting it.
+   */
+  if (proxy_db_begin(p, dbh) < 0) {
+    return NULL;
+  }
+
+  sess = tls_db_get_sess(p, dbh, key);
+  if (sess == NULL) {
+    xerrno = errno;
+
+    (void) proxy_db_rollback(p, dbh);
+    errno = xerrno;
+    return NULL;
+  }
+
+  if (tls_db_remove_sess(p, dbh, key) < 0 ||
+      proxy_db_commit(p, dbh) < 0) {
+    (void) proxy_db_rollback(p, dbh);
+
+    SSL_SESSION_free(sess);
+    errno = ENOENT;
+    return NULL;
+  }
+
+  pr_trace_msg(trace_channel, 17, "took cached SSL session for key '%s'", key);
+  return sess;
+}
+
 static int tls_db_count_sess(pool *p, void *dbh) {
   int count = 0, res;
   const char *stmt, *errstr = NULL;
@@ -392,7 +428,7 @@ static int tls_db_init(pool *p, const char *tables_path, int flags) {
 
   PRIVS_ROOT
   dbh = proxy_db_open_with_version(p, db_path, PROXY_TLS_DB_SCHEMA_NAME,
-    PROXY_TLS_DB_SCHEMA_VERSION, db_flags);
+    PROXY_TLS_DB_SCHEMA_VERSION, db_flags|db_open_flags);
   xerrno = errno;
   PRIVS_RELINQUISH
 
@@ -462,7 +498,7 @@ static void *tls_db_open(pool *p, const char *tables_dir, unsigned long opts) {
 
   PRIVS_ROOT
   dbh = proxy_db_open_with_version(p, db_path, PROXY_TLS_DB_SCHEMA_NAME,
-    PROXY_TLS_DB_SCHEMA_VERSION, 0);
+    PROXY_TLS_DB_SCHEMA_VERSION, db_open_flags);
   xerrno = errno;
   PRIVS_RELINQUISH
 
@@ -491,9 +527,16 @@ int proxy_tls_db_as_datastore(struct proxy_tls_datastore *ds, void *ds_data,
   (void) ds_datasz;
 
 #ifdef PR_USE_OPENSSL
+  db_open_flags = 0;
+  if (ds_data != NULL &&
+      strcasecmp((const char *) ds_data, "WAL") == 0) {
+    db_open_flags |= PROXY_DB_OPEN_FL_USE_WAL;
+  }
+
   ds->add_sess = tls_db_add_sess;
   ds->remove_sess = tls_db_remove_sess;
   ds->get_sess = tls_db_get_sess;
+  ds->take_sess = tls_db_take_sess;
   ds->count_sess = tls_db_count_sess;
 
   ds->init = tls_db_init;
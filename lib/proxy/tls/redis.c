@@ -204,6 +204,39 @@ static SSL_SESSION *tls_redis_get_sess(pool *p, void *redis,
   return sess;
 }
 
+static SSL_SESSION *tls_redis_take_sess(pool *p, void *redis,
+    const char *sess_key) {
+  int res;
+  pool *tmp_pool;
+  char *key;
+  SSL_SESSION *sess;
+
+  sess = tls_redis_get_sess(p, redis, sess_key);
+  if (sess == NULL) {
+    return NULL;
+  }
+
+  /* HDEL only deletes the field once; whoever deletes it has taken the
+   * session.
+   */
+  tmp_pool = make_sub_pool(p);
+  key = make_key(tmp_pool, main_server->sid);
+  res = pr_redis_hash_delete(redis, &proxy_module, key, sess_key);
+  destroy_pool(tmp_pool);
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 17,
+      "cached SSL session for key '%s' already taken", sess_key);
+    SSL_SESSION_free(sess);
+    errno = ENOENT;
+    return NULL;
+  }
+
+  pr_trace_msg(trace_channel, 17, "took cached SSL session for key '%s'",
+    sess_key);
+  return sess;
+}
+
 static int tls_redis_count_sess(pool *p, void *redis) {
   int res, xerrno;
   uint64_t count = 0;
@@ -363,6 +396,7 @@ int proxy_tls_redis_as_datastore(struct proxy_tls_datastore *ds, void *ds_data,
   ds->add_sess = tls_redis_add_sess;
   ds->remove_sess = tls_redis_remove_sess;
   ds->get_sess = tls_redis_get_sess;
+  ds->take_sess = tls_redis_take_sess;
   ds->count_sess = tls_redis_count_sess;
 
   ds->init = tls_redis_init;
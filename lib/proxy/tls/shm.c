@@ -0,0 +1,489 @@
+/*
+ * ProFTPD - mod_proxy TLS shared memory implementation
+ * Copyright (c) 2020 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_proxy.h"
+
+#include "proxy/tls.h"
+#include "proxy/tls/shm.h"
+
+#ifdef PR_USE_OPENSSL
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+/* The table is a fixed number of slots, each holding one DER-encoded
+ * session, keyed by vhost and session key.  A key hashes to a run of
+ * TLS_SHM_PROBE_COUNT slots; when all of those are taken, the first is
+ * replaced.
+ *
+ * Each slot is guarded by a sequence number: writers make it odd while
+ * updating the slot (and give up, rather than wait, if another writer holds
+ * it), and readers retry if it changed while they were copying the slot.
+ * Thus lookups never block, and the session count is kept in the table
+ * header, rather than counted.
+ */
+
+#define PROXY_TLS_SHM_TABLE_MAGIC	0x70747373
+
+#define TLS_SHM_SLOT_COUNT		1024
+#define TLS_SHM_PROBE_COUNT		4
+#define TLS_SHM_MAX_KEYLEN		128
+
+/* Sessions larger than this, once DER-encoded, are not cached. */
+#define TLS_SHM_MAX_SESSLEN		4096
+
+struct tls_shm_slot {
+  volatile uint32_t seqno;
+  volatile int in_use;
+
+  unsigned int vhost_id;
+  char key[TLS_SHM_MAX_KEYLEN];
+
+  unsigned int sesslen;
+  unsigned char sess[TLS_SHM_MAX_SESSLEN];
+};
+
+struct tls_shm_table {
+  uint32_t magic;
+  volatile int sess_count;
+
+  struct tls_shm_slot slots[TLS_SHM_SLOT_COUNT];
+};
+
+static struct tls_shm_table *shm_table = NULL;
+static size_t shm_tablesz = 0;
+static unsigned long shm_opts = 0UL;
+
+static const char *trace_channel = "proxy.tls.shm";
+
+static unsigned int shm_hash(unsigned int vhost_id, const char *key) {
+  const unsigned char *ptr;
+  uint32_t h = 2166136261U;
+
+  /* FNV-1a */
+  h ^= vhost_id;
+  h *= 16777619U;
+
+  for (ptr = (const unsigned char *) key; *ptr; ptr++) {
+    h ^= *ptr;
+    h *= 16777619U;
+  }
+
+  return (unsigned int) (h % TLS_SHM_SLOT_COUNT);
+}
+
+static int shm_slot_matches(struct tls_shm_slot *slot, unsigned int vhost_id,
+    const char *key) {
+  return (slot->in_use == TRUE &&
+    slot->vhost_id == vhost_id &&
+    strncmp(slot->key, key, sizeof(slot->key)) == 0);
+}
+
+static int shm_lock_slot(struct tls_shm_slot *slot, uint32_t *seqno) {
+  uint32_t current;
+
+  current = slot->seqno;
+  if (current & 1) {
+    return -1;
+  }
+
+  if (!__sync_bool_compare_and_swap(&(slot->seqno), current, current + 1)) {
+    return -1;
+  }
+
+  *seqno = current + 2;
+  return 0;
+}
+
+static void shm_unlock_slot(struct tls_shm_slot *slot, uint32_t seqno) {
+  __sync_synchronize();
+  slot->seqno = seqno;
+}
+
+static int tls_shm_add_sess(pool *p, void *dsh, const char *sess_key,
+    SSL_SESSION *sess) {
+  register unsigned int i;
+  struct tls_shm_slot *slot = NULL;
+  unsigned int idx, vhost_id;
+  unsigned char *ptr;
+  int sesslen, was_used;
+  uint32_t seqno;
+
+  (void) p;
+  (void) dsh;
+
+  if (strlen(sess_key) >= TLS_SHM_MAX_KEYLEN) {
+    pr_trace_msg(trace_channel, 9, "key '%s' too long, not caching", sess_key);
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  sesslen = i2d_SSL_SESSION(sess, NULL);
+  if (sesslen <= 0 ||
+      sesslen > TLS_SHM_MAX_SESSLEN) {
+    pr_trace_msg(trace_channel, 9,
+      "SSL session (%d bytes) too large, not caching", sesslen);
+    errno = ENOSPC;
+    return -1;
+  }
+
+  vhost_id = main_server->sid;
+  idx = shm_hash(vhost_id, sess_key);
+
+  /* Prefer the slot already holding this key, then an empty slot, then the
+   * first slot of the run.
+   */
+  for (i = 0; i < TLS_SHM_PROBE_COUNT; i++) {
+    struct tls_shm_slot *candidate;
+
+    candidate = &(shm_table->slots[(idx + i) % TLS_SHM_SLOT_COUNT]);
+    if (shm_slot_matches(candidate, vhost_id, sess_key)) {
+      slot = candidate;
+      break;
+    }
+
+    if (slot == NULL &&
+        candidate->in_use == FALSE) {
+      slot = candidate;
+    }
+  }
+
+  if (slot == NULL) {
+    slot = &(shm_table->slots[idx]);
+  }
+
+  if (shm_lock_slot(slot, &seqno) < 0) {
+    /* Another process is updating this slot; let it. */
+    errno = EAGAIN;
+    return -1;
+  }
+
+  was_used = slot->in_use;
+
+  ptr = slot->sess;
+  slot->sesslen = i2d_SSL_SESSION(sess, &ptr);
+  slot->vhost_id = vhost_id;
+  sstrncpy(slot->key, sess_key, sizeof(slot->key));
+  slot->in_use = TRUE;
+
+  shm_unlock_slot(slot, seqno);
+
+  if (was_used == FALSE) {
+    (void) __sync_add_and_fetch(&(shm_table->sess_count), 1);
+  }
+
+  if (shm_opts & PROXY_TLS_OPT_ENABLE_DIAGS) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "[tls.shm] cached SSL session (%d bytes) in slot %u", sesslen,
+      (unsigned int) (slot - shm_table->slots));
+  }
+
+  pr_trace_msg(trace_channel, 17, "cached SSL session (%d bytes) for key '%s'",
+    sesslen, sess_key);
+  return 0;
+}
+
+static int tls_shm_remove_sess(pool *p, void *dsh, const char *sess_key) {
+  register unsigned int i;
+  unsigned int idx, vhost_id;
+
+  (void) p;
+  (void) dsh;
+
+  vhost_id = main_server->sid;
+  idx = shm_hash(vhost_id, sess_key);
+
+  for (i = 0; i < TLS_SHM_PROBE_COUNT; i++) {
+    struct tls_shm_slot *slot;
+    uint32_t seqno;
+
+    slot = &(shm_table->slots[(idx + i) % TLS_SHM_SLOT_COUNT]);
+    if (!shm_slot_matches(slot, vhost_id, sess_key)) {
+      continue;
+    }
+
+    if (shm_lock_slot(slot, &seqno) < 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+
+    /* Check again, now that no one else can change it. */
+    if (!shm_slot_matches(slot, vhost_id, sess_key)) {
+      shm_unlock_slot(slot, seqno);
+      break;
+    }
+
+    slot->in_use = FALSE;
+    slot->sesslen = 0;
+    shm_unlock_slot(slot, seqno);
+
+    (void) __sync_sub_and_fetch(&(shm_table->sess_count), 1);
+
+    pr_trace_msg(trace_channel, 17, "removed cached SSL session for key '%s'",
+      sess_key);
+    return 0;
+  }
+
+  errno = ENOENT;
+  return -1;
+}
+
+static SSL_SESSION *tls_shm_get_sess(pool *p, void *dsh,
+    const char *sess_key) {
+  register unsigned int i;
+  unsigned int idx, vhost_id;
+  unsigned char *buf;
+
+  (void) dsh;
+
+  vhost_id = main_server->sid;
+  idx = shm_hash(vhost_id, sess_key);
+  buf = palloc(p, TLS_SHM_MAX_SESSLEN);
+
+  for (i = 0; i < TLS_SHM_PROBE_COUNT; i++) {
+    register unsigned int j;
+    struct tls_shm_slot *slot;
+
+    slot = &(shm_table->slots[(idx + i) % TLS_SHM_SLOT_COUNT]);
+
+    /* Copy the session out, retrying if a writer got in the way. */
+    for (j = 0; j < 3; j++) {
+      uint32_t seqno;
+      unsigned int sesslen;
+      const unsigned char *ptr;
+      SSL_SESSION *sess;
+
+      seqno = slot->seqno;
+      if (seqno & 1) {
+        continue;
+      }
+
+      __sync_synchronize();
+      if (!shm_slot_matches(slot, vhost_id, sess_key)) {
+        break;
+      }
+
+      sesslen = slot->sesslen;
+      if (sesslen > TLS_SHM_MAX_SESSLEN) {
+        continue;
+      }
+
+      memcpy(buf, slot->sess, sesslen);
+      __sync_synchronize();
+
+      if (slot->seqno != seqno) {
+        continue;
+      }
+
+      ptr = buf;
+      sess = d2i_SSL_SESSION(NULL, &ptr, sesslen);
+      if (sess == NULL) {
+        pr_trace_msg(trace_channel, 3,
+          "error converting cached data to SSL session: %s",
+          proxy_tls_get_errors());
+        errno = ENOENT;
+        return NULL;
+      }
+
+      pr_trace_msg(trace_channel, 17,
+        "retrieved cached SSL session (%u bytes) for key '%s'", sesslen,
+        sess_key);
+      return sess;
+    }
+  }
+
+  errno = ENOENT;
+  return NULL;
+}
+
+static SSL_SESSION *tls_shm_take_sess(pool *p, void *dsh,
+    const char *sess_key) {
+  register unsigned int i;
+  unsigned int idx, vhost_id;
+  unsigned char *buf;
+
+  (void) dsh;
+
+  vhost_id = main_server->sid;
+  idx = shm_hash(vhost_id, sess_key);
+  buf = palloc(p, TLS_SHM_MAX_SESSLEN);
+
+  for (i = 0; i < TLS_SHM_PROBE_COUNT; i++) {
+    struct tls_shm_slot *slot;
+    unsigned int sesslen;
+    const unsigned char *ptr;
+    uint32_t seqno;
+    SSL_SESSION *sess;
+
+    slot = &(shm_table->slots[(idx + i) % TLS_SHM_SLOT_COUNT]);
+    if (!shm_slot_matches(slot, vhost_id, sess_key)) {
+      continue;
+    }
+
+    /* Holding the slot is our claim on its session; if another process
+     * holds it, that process may be taking the same session, so we let it.
+     */
+    if (shm_lock_slot(slot, &seqno) < 0) {
+      errno = ENOENT;
+      return NULL;
+    }
+
+    /* Check again, now that no one else can change it. */
+    if (!shm_slot_matches(slot, vhost_id, sess_key)) {
+      shm_unlock_slot(slot, seqno);
+      break;
+    }
+
+    sesslen = slot->sesslen;
+    if (sesslen > TLS_SHM_MAX_SESSLEN) {
+      sesslen = 0;
+    }
+
+    memcpy(buf, slot->sess, sesslen);
+    slot->in_use = FALSE;
+    slot->sesslen = 0;
+    shm_unlock_slot(slot, seqno);
+
+    (void) __sync_sub_and_fetch(&(shm_table->sess_count), 1);
+
+    ptr = buf;
+    sess = d2i_SSL_SESSION(NULL, &ptr, sesslen);
+    if (sess == NULL) {
+      pr_trace_msg(trace_channel, 3,
+        "error converting cached data to SSL session: %s",
+        proxy_tls_get_errors());
+      errno = ENOENT;
+      return NULL;
+    }
+
+    pr_trace_msg(trace_channel, 17,
+      "took cached SSL session (%u bytes) for key '%s'", sesslen, sess_key);
+    return sess;
+  }
+
+  errno = ENOENT;
+  return NULL;
+}
+
+static int tls_shm_count_sess(pool *p, void *dsh) {
+  (void) p;
+  (void) dsh;
+
+  return shm_table->sess_count;
+}
+
+/* Initialization routines */
+
+static int tls_shm_init(pool *p, const char *tables_path, int flags) {
+  struct tls_shm_table *table;
+  size_t tablesz;
+
+  (void) p;
+  (void) tables_path;
+  (void) flags;
+
+  tablesz = sizeof(struct tls_shm_table);
+
+  /* As for the Reverse shared memory table, the anonymous mapping created
+   * before any session processes are forked is inherited by all of them.
+   */
+  table = mmap(NULL, tablesz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS,
+    -1, 0);
+  if (table == MAP_FAILED) {
+    int xerrno = errno;
+
+    pr_log_pri(PR_LOG_NOTICE, MOD_PROXY_VERSION
+      ": error allocating %lu bytes of shared memory: %s",
+      (unsigned long) tablesz, strerror(xerrno));
+    errno = xerrno;
+    return -1;
+  }
+
+  table->magic = PROXY_TLS_SHM_TABLE_MAGIC;
+
+  if (shm_table != NULL) {
+    (void) munmap(shm_table, shm_tablesz);
+  }
+
+  shm_table = table;
+  shm_tablesz = tablesz;
+
+  pr_trace_msg(trace_channel, 9,
+    "allocated %lu bytes of shared memory for %u SSL sessions",
+    (unsigned long) tablesz, (unsigned int) TLS_SHM_SLOT_COUNT);
+  return 0;
+}
+
+static int tls_shm_close(pool *p, void *dsh) {
+  (void) p;
+  (void) dsh;
+
+  /* Note that we do not unmap the table here; it needs to outlive the
+   * handles in the daemon process, for the sessions to inherit.
+   */
+  return 0;
+}
+
+static void *tls_shm_open(pool *p, const char *tables_dir,
+    unsigned long opts) {
+  (void) p;
+  (void) tables_dir;
+
+  if (shm_table == NULL) {
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "shared memory table not initialized");
+    errno = EPERM;
+    return NULL;
+  }
+
+  shm_opts = opts;
+  return shm_table;
+}
+#endif /* PR_USE_OPENSSL */
+
+int proxy_tls_shm_as_datastore(struct proxy_tls_datastore *ds, void *ds_data,
+    size_t ds_datasz) {
+  if (ds == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  (void) ds_data;
+  (void) ds_datasz;
+
+#ifdef PR_USE_OPENSSL
+  ds->add_sess = tls_shm_add_sess;
+  ds->remove_sess = tls_shm_remove_sess;
+  ds->get_sess = tls_shm_get_sess;
+  ds->take_sess = tls_shm_take_sess;
+  ds->count_sess = tls_shm_count_sess;
+
+  ds->init = tls_shm_init;
+  ds->open = tls_shm_open;
+  ds->close = tls_shm_close;
+#endif /* PR_USE_OPENSSL */
+
+  return 0;
+}
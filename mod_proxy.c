@@ -29,13 +29,20 @@
 #include "mod_proxy.h"
 #include "proxy/random.h"
 #include "proxy/db.h"
+#include "proxy/evloop.h"
+#include "proxy/metrics.h"
 #include "proxy/session.h"
 #include "proxy/conn.h"
+#include "proxy/dns.h"
 #include "proxy/netio.h"
 #include "proxy/inet.h"
 #include "proxy/tls.h"
 #include "proxy/forward.h"
 #include "proxy/reverse.h"
+#include "proxy/reverse/health.h"
+#include "proxy/reverse/connpool.h"
+#include "proxy/reverse/chash.h"
+#include "proxy/reverse/perhost.h"
 #include "proxy/ftp/conn.h"
 #include "proxy/ftp/ctrl.h"
 #include "proxy/ftp/data.h"
@@ -44,16 +51,22 @@
 #include "proxy/ftp/msg.h"
 #include "proxy/ftp/xfer.h"
 
-/* Proxy role */
-#define PROXY_ROLE_REVERSE		1
-#define PROXY_ROLE_FORWARD		2
-
 /* How long (in secs) to wait to connect to real server? */
 #define PROXY_CONNECT_DEFAULT_TIMEOUT	5
 
 /* How long (in secs) to wait for the end-of-data-transfer response? */
 #define PROXY_LINGER_DEFAULT_TIMEOUT	3
 
+/* Size of the buffer for data read from, but not yet written to, the data
+ * connections during a transfer.
+ */
+#define PROXY_DATA_RING_SIZE		(128 * 1024)
+
+/* Largest buffer for reading data from the data connections, when using
+ * "ProxyDataTransferBufferSize auto".
+ */
+#define PROXY_DATA_AUTO_MAX_BUFSZ	(1024 * 1024)
+
 extern xaset_t *server_list;
 extern module xfer_module;
 
@@ -474,6 +487,57 @@ static void proxy_restrict_session(void) {
 /* Configuration handlers
  */
 
+/* usage: ProxyDataTransferBufferSize size [units]|"auto" */
+MODRET set_proxydataxferbufsz(cmd_rec *cmd) {
+  config_rec *c;
+  size_t bufsz;
+
+  if (cmd->argc < 2 ||
+      cmd->argc > 3) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  if (cmd->argc == 2 &&
+      strcasecmp(cmd->argv[1], "auto") == 0) {
+    bufsz = PROXY_FTP_CONN_XFER_BUFSZ_AUTO;
+
+  } else {
+    off_t nbytes = 0;
+
+    if (pr_str_get_nbytes(cmd->argv[1], cmd->argc == 3 ? cmd->argv[2] : NULL,
+        &nbytes) < 0) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid buffer size '",
+        (char *) cmd->argv[1], "': ", strerror(errno), NULL));
+    }
+
+    if (nbytes <= 0) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid buffer size '",
+        (char *) cmd->argv[1], "'", NULL));
+    }
+
+    if (nbytes > PROXY_FTP_CONN_XFER_MAX_BUFSZ) {
+      char max_text[32];
+
+      memset(max_text, '\0', sizeof(max_text));
+      snprintf(max_text, sizeof(max_text)-1, "%lu",
+        (unsigned long) PROXY_FTP_CONN_XFER_MAX_BUFSZ);
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "buffer size '",
+        (char *) cmd->argv[1], "' exceeds maximum of ", max_text, " bytes",
+        NULL));
+    }
+
+    bufsz = (size_t) nbytes;
+  }
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(size_t));
+  *((size_t *) c->argv[0]) = bufsz;
+
+  return PR_HANDLED(cmd);
+}
+
 /* usage: ProxyDataTransferPolicy "active"|"passive"|"pasv"|"epsv"|"port"|
  *          "eprt"|"client"
  */
@@ -535,6 +599,21 @@ MODRET set_proxydatastore(cmd_rec *cmd) {
     ds_data = NULL;
     ds_datasz = 0;
 
+    if (cmd->argc == 3) {
+      if (strcasecmp(cmd->argv[2], "WAL") != 0) {
+        CONF_ERROR(cmd, pstrcat(cmd->tmp_pool,
+          "unsupported SQLite journal mode: ", cmd->argv[2], NULL));
+      }
+
+      ds_data = pstrdup(proxy_pool, "WAL");
+      ds_datasz = strlen(ds_data);
+    }
+
+  } else if (strcasecmp(ds_name, "shm") == 0) {
+    ds = PROXY_DATASTORE_SHM;
+    ds_data = NULL;
+    ds_datasz = 0;
+
 #ifdef PR_USE_REDIS
   } else if (strcasecmp(ds_name, "redis") == 0) {
     if (cmd->argc != 3) {
@@ -604,6 +683,28 @@ MODRET set_proxydirlistpolicy(cmd_rec *cmd) {
   return PR_HANDLED(cmd);
 }
 
+/* usage: ProxyDNSCacheTTL ttl|"off" */
+MODRET set_proxydnscachettl(cmd_rec *cmd) {
+  int ttl = 0;
+  config_rec *c;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT);
+
+  if (strcasecmp(cmd->argv[1], "off") != 0) {
+    if (pr_str_get_duration(cmd->argv[1], &ttl) < 0) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "error parsing TTL value '",
+        (char *) cmd->argv[1], "': ", strerror(errno), NULL));
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = ttl;
+
+  return PR_HANDLED(cmd);
+}
+
 /* usage: ProxyEngine on|off */
 MODRET set_proxyengine(cmd_rec *cmd) {
   int engine = 1;
@@ -782,6 +883,12 @@ MODRET set_proxyoptions(cmd_rec *cmd) {
     } else if (strcmp(cmd->argv[i], "IgnoreConfigPerms") == 0) {
       opts |= PROXY_OPT_IGNORE_CONFIG_PERMS;
 
+    } else if (strcmp(cmd->argv[i], "LogTransferMetrics") == 0) {
+      opts |= PROXY_OPT_LOG_XFER_METRICS;
+
+    } else if (strcmp(cmd->argv[i], "UseSpeculativeConnect") == 0) {
+      opts |= PROXY_OPT_USE_SPECULATIVE_CONNECT;
+
     } else {
       CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, ": unknown ProxyOption '",
         (char *) cmd->argv[i], "'", NULL));
@@ -814,12 +921,16 @@ MODRET set_proxyretrycount(cmd_rec *cmd) {
   return PR_HANDLED(cmd);
 }
 
-/* usage: ProxyReverseConnectPolicy [policy] */
+/* usage: ProxyReverseConnectPolicy [policy] [key] */
 MODRET set_proxyreverseconnectpolicy(cmd_rec *cmd) {
   config_rec *c;
-  int connect_policy = -1;
+  int connect_policy = -1, key_type = PROXY_REVERSE_CHASH_KEY_HOST;
+
+  if (cmd->argc < 2 ||
+      cmd->argc > 3) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
 
-  CHECK_ARGS(cmd, 1);
   CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
 
   connect_policy = proxy_reverse_connect_get_policy(cmd->argv[1]);
@@ -828,9 +939,212 @@ MODRET set_proxyreverseconnectpolicy(cmd_rec *cmd) {
       "unknown/unsupported connect policy: ", (char *) cmd->argv[1], NULL));
   }
 
-  c = add_config_param(cmd->argv[0], 1, NULL);
+  if (cmd->argc == 3) {
+    /* Only the ConsistentHash policy takes a key. */
+    if (connect_policy != PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool,
+        "connect policy ", (char *) cmd->argv[1], " does not take a key",
+        NULL));
+    }
+
+    key_type = proxy_reverse_chash_get_key(cmd->argv[2]);
+    if (key_type < 0) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool,
+        "unknown/unsupported ConsistentHash key: ", (char *) cmd->argv[2],
+        NULL));
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
   c->argv[0] = palloc(c->pool, sizeof(int));
   *((int *) c->argv[0]) = connect_policy;
+  c->argv[1] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[1]) = key_type;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: ProxyReverseHealthCooldown secs */
+MODRET set_proxyreversehealthcooldown(cmd_rec *cmd) {
+  int cooldown = -1;
+  config_rec *c = NULL;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  if (pr_str_get_duration(cmd->argv[1], &cooldown) < 0) {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "error parsing cooldown value '",
+      (char *) cmd->argv[1], "': ", strerror(errno), NULL));
+  }
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = cooldown;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: ProxyReverseHealthCheck off|interval [NOOP|FEAT] */
+MODRET set_proxyreversehealthcheck(cmd_rec *cmd) {
+  config_rec *c;
+  int interval = 0;
+  char *check_cmd = NULL;
+
+  if (cmd->argc-1 < 1 ||
+      cmd->argc-1 > 2) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  if (pr_config_get_bool(cmd->argv[1]) != FALSE) {
+    if (pr_str_get_duration(cmd->argv[1], &interval) < 0) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "error parsing interval value '",
+        (char *) cmd->argv[1], "': ", strerror(errno), NULL));
+    }
+
+    if (interval <= 0) {
+      CONF_ERROR(cmd, "interval must be greater than zero");
+    }
+  }
+
+  if (cmd->argc-1 == 2) {
+    check_cmd = cmd->argv[2];
+
+    if (strcasecmp(check_cmd, C_NOOP) == 0) {
+      check_cmd = C_NOOP;
+
+    } else if (strcasecmp(check_cmd, C_FEAT) == 0) {
+      check_cmd = C_FEAT;
+
+    } else {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool,
+        "unknown/unsupported health check command: ", check_cmd, NULL));
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = interval;
+  c->argv[1] = check_cmd;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: ProxyReverseConnectionPool off|size [max-idle] */
+MODRET set_proxyreverseconnectionpool(cmd_rec *cmd) {
+  config_rec *c;
+  int size = 0, max_idle = PROXY_REVERSE_CONNPOOL_DEFAULT_MAX_IDLE;
+
+  if (cmd->argc-1 < 1 ||
+      cmd->argc-1 > 2) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  if (pr_config_get_bool(cmd->argv[1]) != FALSE) {
+    size = atoi(cmd->argv[1]);
+    if (size <= 0) {
+      CONF_ERROR(cmd, "size must be greater than zero");
+    }
+  }
+
+  if (cmd->argc-1 == 2) {
+    if (pr_str_get_duration(cmd->argv[2], &max_idle) < 0) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "error parsing max-idle value '",
+        (char *) cmd->argv[2], "': ", strerror(errno), NULL));
+    }
+
+    if (max_idle <= 0) {
+      CONF_ERROR(cmd, "max-idle must be greater than zero");
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = size;
+  c->argv[1] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[1]) = max_idle;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: ProxyReversePerHostMap /path/to/map.json */
+MODRET set_proxyreverseperhostmap(cmd_rec *cmd) {
+  config_rec *c;
+  array_header *prefixes;
+  char *path;
+  int xerrno;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  path = cmd->argv[1];
+  if (*path != '/') {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "must be a full path: '", path,
+      "'", NULL));
+  }
+
+  PRIVS_ROOT
+  prefixes = proxy_reverse_perhost_json_parse(cmd->server->pool, path);
+  xerrno = errno;
+  PRIVS_RELINQUISH
+
+  if (prefixes == NULL) {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool,
+      "error reading ProxyReversePerHostMap file '", path, "': ",
+      strerror(xerrno), NULL));
+  }
+
+  if (prefixes->nelts == 0) {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool,
+      "no usable prefixes found in file '", path, "'", NULL));
+  }
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = prefixes;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: ProxyReversePerHostPrefix ipv4-len [ipv6-len] */
+MODRET set_proxyreverseperhostprefix(cmd_rec *cmd) {
+  config_rec *c;
+  char *ptr = NULL;
+  long ipv4_len, ipv6_len = 128;
+
+  if (cmd->argc-1 < 1 ||
+      cmd->argc-1 > 2) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  ipv4_len = strtol(cmd->argv[1], &ptr, 10);
+  if ((ptr != NULL && *ptr) ||
+      ipv4_len < 0 ||
+      ipv4_len > 32) {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid IPv4 prefix length '",
+      (char *) cmd->argv[1], "': must be between 0 and 32", NULL));
+  }
+
+  if (cmd->argc-1 == 2) {
+    ptr = NULL;
+    ipv6_len = strtol(cmd->argv[2], &ptr, 10);
+    if ((ptr != NULL && *ptr) ||
+        ipv6_len < 0 ||
+        ipv6_len > 128) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid IPv6 prefix length '",
+        (char *) cmd->argv[2], "': must be between 0 and 128", NULL));
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[0]) = (unsigned int) ipv4_len;
+  c->argv[1] = palloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[1]) = (unsigned int) ipv6_len;
 
   return PR_HANDLED(cmd);
 }
@@ -1487,12 +1801,25 @@ MODRET set_proxytlsoptions(cmd_rec *cmd) {
     } else if (strcmp(cmd->argv[i], "EnableDiags") == 0) {
       opts |= PROXY_TLS_OPT_ENABLE_DIAGS;
 
+    } else if (strcmp(cmd->argv[i], "EnableKTLS") == 0) {
+#if defined(PROXY_TLS_HAVE_KTLS)
+      opts |= PROXY_TLS_OPT_ENABLE_KTLS;
+#else
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "The ", cmd->argv[i],
+        " option cannot be used on this system, as your OpenSSL does not "
+        "support kernel TLS; requires OpenSSL-3.0 or later, built with KTLS "
+        "support", NULL));
+#endif /* PROXY_TLS_HAVE_KTLS */
+
     } else if (strcmp(cmd->argv[i], "NoSessionCache") == 0) {
       opts |= PROXY_TLS_OPT_NO_SESSION_CACHE;
 
     } else if (strcmp(cmd->argv[i], "NoSessionTickets") == 0) {
       opts |= PROXY_TLS_OPT_NO_SESSION_TICKETS;
 
+    } else if (strcmp(cmd->argv[i], "ReuseDataSSL") == 0) {
+      opts |= PROXY_TLS_OPT_REUSE_DATA_SSL;
+
     } else {
       CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, ": unknown ProxyTLSOption '",
         cmd->argv[i], "'", NULL));
@@ -2283,9 +2610,189 @@ static int proxy_data_prepare_conns(struct proxy_session *proxy_sess,
   return 0;
 }
 
-MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
+/* Determine whether we can relay the data for this transfer using splice(2),
+ * avoiding the copy through userspace buffers.  We can only do so when
+ * nothing needs to see (or modify) the data in userspace: no TLS on either
+ * side, no TransferRate throttling, and no listeners for the data-read or
+ * data-write events (as used e.g. for directory list translation).
+ *
+ * Returns the pipe to use for splicing, or NULL if the data are to be copied.
+ */
+static int *proxy_data_get_splice_pipe(struct proxy_session *proxy_sess,
+    cmd_rec *cmd) {
+  int *pipe_fds;
+
+  /* Even with kTLS, the records of a backend data connection are read via
+   * OpenSSL, which handles any non-data records (e.g. TLS 1.3 post-handshake
+   * messages) that splice(2) cannot.
+   */
+  if (proxy_sess_state & PROXY_SESS_STATE_BACKEND_HAS_DATA_TLS) {
+    pr_trace_msg(trace_channel, 19,
+      "backend data connection uses TLS, not splicing data");
+    return NULL;
+  }
+
+  /* We do not know whether the frontend negotiated protection of its data
+   * connections, only that it negotiated TLS; assume the worst.
+   */
+  if (session.rfc2228_mech != NULL) {
+    pr_trace_msg(trace_channel, 19,
+      "frontend control connection uses %s, not splicing data",
+      session.rfc2228_mech);
+    return NULL;
+  }
+
+  if (pr_throttle_have_rate() == TRUE) {
+    pr_trace_msg(trace_channel, 19,
+      "TransferRate in effect, not splicing data");
+    return NULL;
+  }
+
+  if (proxy_sess->dirlist_ctx != NULL ||
+      pr_event_listening("mod_proxy.data-read") > 0 ||
+      pr_event_listening("mod_proxy.data-write") > 0) {
+    pr_trace_msg(trace_channel, 19,
+      "data event listeners present, not splicing data");
+    return NULL;
+  }
+
+  pipe_fds = proxy_ftp_data_splice_open(cmd->tmp_pool);
+  if (pipe_fds == NULL) {
+    if (errno != ENOSYS) {
+      (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+        "unable to splice data for %s, copying data instead: %s",
+        (char *) cmd->argv[0], strerror(errno));
+    }
+
+    return NULL;
+  }
+
+  pr_trace_msg(trace_channel, 9, "splicing data for %s",
+    (char *) cmd->argv[0]);
+  return pipe_fds;
+}
+
+/* Register the control/data connections for this transfer with the session's
+ * event loop.  We watch the source data connection for readability.  The
+ * backend control connection is only watched for readability once the
+ * transfer ends; until then, only edge-triggered errors are reported for it.
+ * We do not (yet) read any commands from the frontend control connection
+ * during the transfer, so we use edge-triggered readiness for it, lest
+ * we wake up continually for data we will not read.
+ */
+static struct proxy_evloop *proxy_data_get_evloop(
+    struct proxy_session *proxy_sess, int xfer_direction) {
+  conn_t *src_data_conn, *dst_data_conn;
+
+  if (proxy_sess->evloop == NULL) {
+    proxy_sess->evloop = proxy_evloop_create(proxy_sess->pool, 0);
+    if (proxy_sess->evloop == NULL) {
+      return NULL;
+    }
+
+    pr_trace_msg(trace_channel, 9, "using %s for data transfers",
+      proxy_evloop_get_name(proxy_sess->evloop));
+  }
+
+  (void) proxy_evloop_clear(proxy_sess->evloop);
+
+  if (xfer_direction == PR_NETIO_IO_RD) {
+    src_data_conn = proxy_sess->backend_data_conn;
+    dst_data_conn = proxy_sess->frontend_data_conn;
+
+  } else {
+    src_data_conn = proxy_sess->frontend_data_conn;
+    dst_data_conn = proxy_sess->backend_data_conn;
+  }
+
+  if (proxy_evloop_add(proxy_sess->evloop,
+      PR_NETIO_FD(proxy_sess->frontend_ctrl_conn->instrm),
+      PROXY_EVLOOP_EV_READ|PROXY_EVLOOP_EV_EDGE,
+      proxy_sess->frontend_ctrl_conn) < 0 ||
+      proxy_evloop_add(proxy_sess->evloop,
+      PR_NETIO_FD(proxy_sess->backend_ctrl_conn->instrm),
+      PROXY_EVLOOP_EV_EDGE, proxy_sess->backend_ctrl_conn) < 0 ||
+      proxy_evloop_add(proxy_sess->evloop, PR_NETIO_FD(src_data_conn->instrm),
+      PROXY_EVLOOP_EV_READ, src_data_conn) < 0 ||
+      proxy_evloop_add(proxy_sess->evloop, PR_NETIO_FD(dst_data_conn->outstrm),
+      PROXY_EVLOOP_EV_EDGE, dst_data_conn) < 0) {
+    int xerrno = errno;
+
+    (void) proxy_evloop_clear(proxy_sess->evloop);
+
+    errno = xerrno;
+    return NULL;
+  }
+
+  return proxy_sess->evloop;
+}
+
+/* Close the frontend or backend data connection. */
+static void proxy_data_close_conn(struct proxy_session *proxy_sess,
+    int frontend) {
+  if (frontend == TRUE) {
+    if (session.d != NULL) {
+      pr_inet_close(session.pool, proxy_sess->frontend_data_conn);
+      proxy_sess->frontend_data_conn = session.d = NULL;
+    }
+
+  } else {
+    if (proxy_sess->backend_data_conn != NULL) {
+      proxy_inet_close(session.pool, proxy_sess->backend_data_conn);
+      proxy_sess->backend_data_conn = NULL;
+    }
+  }
+}
+
+static void proxy_data_close_conns(struct proxy_session *proxy_sess) {
+  proxy_data_close_conn(proxy_sess, FALSE);
+  proxy_data_close_conn(proxy_sess, TRUE);
+
+  proxy_sess->frontend_sess_flags &= ~SF_XFER;
+  proxy_sess->backend_sess_flags &= ~SF_XFER;
+}
+
+/* Update the events we wait for on the given data connection, if changed. */
+static void proxy_data_watch_conn(struct proxy_evloop *evloop, conn_t *conn,
+    int events, int *watched_events) {
+  int fd;
+
+  if (events == *watched_events) {
+    return;
+  }
+
+  if (events & PROXY_EVLOOP_EV_READ) {
+    fd = PR_NETIO_FD(conn->instrm);
+
+  } else if (events & PROXY_EVLOOP_EV_WRITE) {
+    fd = PR_NETIO_FD(conn->outstrm);
+
+  } else {
+    fd = *watched_events & PROXY_EVLOOP_EV_READ ?
+      PR_NETIO_FD(conn->instrm) : PR_NETIO_FD(conn->outstrm);
+
+    /* When not interested in any events, use edge-triggered readiness, so
+     * that a hangup by the peer is reported only once.
+     */
+    events = PROXY_EVLOOP_EV_EDGE;
+  }
+
+  if (proxy_evloop_modify(evloop, fd, events, conn) < 0) {
+    pr_trace_msg(trace_channel, 3, "error watching fd %d: %s", fd,
+      strerror(errno));
+  }
+
+  *watched_events = events & (PROXY_EVLOOP_EV_READ|PROXY_EVLOOP_EV_WRITE);
+}
+
+MODRET proxy_data_xfer(struct proxy_session *proxy_sess, cmd_rec *cmd) {
   int data_eof = FALSE, dst_xerrno = 0, res, xerrno;
-  int xfer_direction, xfer_ok = TRUE;
+  int xfer_direction, xfer_ok = TRUE, watching_backend_ctrl = FALSE;
+  int *splice_fds = NULL, ring_flags = 0;
+  int src_events = PROXY_EVLOOP_EV_READ, dst_events = 0;
+  size_t read_max = 0;
+  struct proxy_evloop *evloop;
+  struct proxy_ftp_data_ring *ring = NULL;
   unsigned int resp_nlines = 0;
   pr_response_t *resp;
   conn_t *frontend_conn = NULL, *backend_conn = NULL;
@@ -2341,6 +2848,21 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
     return PR_ERROR(cmd);
   }
 
+  evloop = proxy_data_get_evloop(proxy_sess, xfer_direction);
+  if (evloop == NULL) {
+    xerrno = errno;
+    (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+      "error watching frontend/backend connections: %s", strerror(xerrno));
+
+    pr_response_block(TRUE);
+    pr_response_add_err(R_425, _("%s: %s"), (char *) cmd->argv[0],
+      strerror(xerrno));
+    pr_response_flush(&resp_err_list);
+
+    errno = xerrno;
+    return PR_ERROR(cmd);
+  }
+
   /* Allow aborts -- set the current NetIO stream to allow interrupted
    * syscalls, so our SIGURG handler can interrupt it
    */
@@ -2362,6 +2884,48 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
   /* Honor TransferRate directives. */
   pr_throttle_init(cmd);
 
+  splice_fds = proxy_data_get_splice_pipe(proxy_sess, cmd);
+
+  /* If the destination does not use TLS, we can write to it without
+   * waiting for it to drain; otherwise, the TLS layer waits for us.
+   */
+  if (xfer_direction == PR_NETIO_IO_RD) {
+    if (session.rfc2228_mech == NULL) {
+      ring_flags |= PROXY_FTP_DATA_FL_NONBLOCKING;
+    }
+
+  } else {
+    if (!(proxy_sess_state & PROXY_SESS_STATE_BACKEND_HAS_DATA_TLS)) {
+      ring_flags |= PROXY_FTP_DATA_FL_NONBLOCKING;
+    }
+  }
+
+  /* Honor ProxyDataTransferBufferSize for reading from the source data
+   * connection; the ring buffer is sized accordingly.
+   */
+  if (proxy_sess->dataxfer_bufsz > 0) {
+    size_t bufsz;
+
+    bufsz = proxy_ftp_conn_get_xfer_bufsz(proxy_sess->backend_ctrl_conn,
+      proxy_sess->dataxfer_bufsz);
+    if (proxy_sess->dataxfer_bufsz == PROXY_FTP_CONN_XFER_BUFSZ_AUTO &&
+        bufsz > PROXY_DATA_AUTO_MAX_BUFSZ) {
+      bufsz = PROXY_DATA_AUTO_MAX_BUFSZ;
+    }
+
+    if (bufsz > 0) {
+      conn_t *src_conn;
+
+      src_conn = (xfer_direction == PR_NETIO_IO_RD) ? backend_conn :
+        frontend_conn;
+      if (proxy_ftp_data_set_bufsz(src_conn, bufsz) < 0) {
+        pr_trace_msg(trace_channel, 3,
+          "error setting %lu byte data transfer buffer: %s",
+          (unsigned long) bufsz, strerror(errno));
+      }
+    }
+  }
+
   if (pr_data_get_timeout(PR_DATA_TIMEOUT_NO_TRANSFER) > 0) {
     pr_timer_reset(PR_TIMER_NOXFER, ANY_MODULE);
   }
@@ -2381,26 +2945,24 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
    */
 
   while (TRUE) {
-    fd_set rfds;
-    struct timeval tv;
-    int backend_ctrlfd = -1, frontend_ctrlfd = -1, datafd = -1, maxfd = -1;
+    register int i;
+    struct proxy_evloop_event events[4];
+    struct timeval wait_start;
+    int timeout_ms, backend_ctrlfd = -1, datafd = -1, dst_datafd = -1;
+    int backend_ctrl_ready = FALSE, data_ready = FALSE, dst_ready = FALSE;
     int frontend_data = FALSE;
     conn_t *src_data_conn = NULL, *dst_data_conn = NULL;
 
     if (data_eof == TRUE ||
         xfer_ok == FALSE) {
-      tv.tv_sec = proxy_sess->linger_timeout;
+      timeout_ms = proxy_sess->linger_timeout * 1000;
 
     } else {
-      tv.tv_sec = 15;
+      timeout_ms = 15 * 1000;
     }
 
-    tv.tv_usec = 0;
-
     pr_signals_handle();
 
-    FD_ZERO(&rfds);
-
     /* The source/origin data connection depends on our direction:
      * downloads (IO_RD) from the backend, uploads (IO_WR) to the backend.
      */
@@ -2425,29 +2987,86 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
     if (data_eof == TRUE ||
         xfer_ok == FALSE) {
       backend_ctrlfd = PR_NETIO_FD(proxy_sess->backend_ctrl_conn->instrm);
-      FD_SET(backend_ctrlfd, &rfds);
-      if (backend_ctrlfd > maxfd) {
-        maxfd = backend_ctrlfd;
-      }
-    }
 
-    frontend_ctrlfd = PR_NETIO_FD(proxy_sess->frontend_ctrl_conn->instrm);
-    FD_SET(frontend_ctrlfd, &rfds);
-    if (frontend_ctrlfd > maxfd) {
-      maxfd = frontend_ctrlfd;
+      if (watching_backend_ctrl == FALSE) {
+        if (proxy_evloop_modify(evloop, backend_ctrlfd, PROXY_EVLOOP_EV_READ,
+            proxy_sess->backend_ctrl_conn) < 0) {
+          (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+            "error watching backend control connection: %s", strerror(errno));
+        }
+
+        watching_backend_ctrl = TRUE;
+      }
     }
 
     if (src_data_conn != NULL) {
       datafd = PR_NETIO_FD(src_data_conn->instrm);
-      FD_SET(datafd, &rfds);
-      if (datafd > maxfd) {
-        maxfd = datafd;
+    }
+
+    if (dst_data_conn != NULL) {
+      dst_datafd = PR_NETIO_FD(dst_data_conn->outstrm);
+    }
+
+    /* Apply backpressure: stop reading from the source while there is no
+     * room left for another read, and only wait for the destination to be
+     * writable while we have data for it.
+     */
+    if (splice_fds == NULL) {
+      if (src_data_conn != NULL) {
+        int want_events = 0;
+
+        if (ring == NULL ||
+            proxy_ftp_data_ring_space(ring) >= read_max) {
+          want_events = PROXY_EVLOOP_EV_READ;
+
+        } else if (src_events != 0) {
+          pr_trace_msg(trace_channel, 19,
+            "destination data connection not keeping up, pausing reads from "
+            "source data connection");
+        }
+
+        proxy_data_watch_conn(evloop, src_data_conn, want_events, &src_events);
+      }
+
+      if (dst_data_conn != NULL) {
+        proxy_data_watch_conn(evloop, dst_data_conn,
+          proxy_ftp_data_ring_len(ring) > 0 ? PROXY_EVLOOP_EV_WRITE : 0,
+          &dst_events);
+      }
+    }
+
+    gettimeofday(&wait_start, NULL);
+    res = proxy_evloop_wait(evloop, events, 4, timeout_ms);
+    xerrno = errno;
+
+    /* Account the time spent waiting to the data connection we were waiting
+     * for, if it was only the one.
+     */
+    if (data_eof == FALSE &&
+        xfer_ok == TRUE) {
+      int waiting_src, waiting_dst;
+
+      waiting_src = (src_data_conn != NULL && src_events != 0);
+      waiting_dst = (dst_data_conn != NULL && dst_events != 0);
+
+      if (waiting_src != waiting_dst) {
+        int counter;
+
+        if (waiting_src) {
+          counter = frontend_data ? PROXY_METRICS_XFER_FRONTEND_STALL_MS :
+            PROXY_METRICS_XFER_BACKEND_STALL_MS;
+
+        } else {
+          counter = frontend_data ? PROXY_METRICS_XFER_BACKEND_STALL_MS :
+            PROXY_METRICS_XFER_FRONTEND_STALL_MS;
+        }
+
+        (void) proxy_metrics_xfer_incr(counter,
+          proxy_metrics_elapsed_ms(&wait_start));
       }
     }
 
-    res = select(maxfd + 1, &rfds, NULL, NULL, &tv);
     if (res < 0) {
-      xerrno = errno;
 
       if (xerrno == EINTR) {
         pr_signals_handle();
@@ -2455,8 +3074,8 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
       }
 
       (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
-        "error calling select(2) while transferring data: %s",
-        strerror(xerrno));
+        "error waiting for events (%s) while transferring data: %s",
+        proxy_evloop_get_name(evloop), strerror(xerrno));
 
       if (session.d != NULL) {
         pr_inet_close(session.pool, proxy_sess->frontend_data_conn);
@@ -2468,6 +3087,7 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
         proxy_sess->backend_data_conn = NULL;
       }
 
+      (void) proxy_evloop_clear(evloop);
       pr_timer_remove(PR_TIMER_STALLED, ANY_MODULE);
       proxy_sess->frontend_sess_flags &= ~SF_XFER;
       proxy_sess->backend_sess_flags &= ~SF_XFER;
@@ -2494,6 +3114,7 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
             "server, terminating transfer");
         }
 
+        (void) proxy_evloop_clear(evloop);
         pr_timer_remove(PR_TIMER_STALLED, ANY_MODULE);
         proxy_sess->frontend_sess_flags &= ~SF_XFER;
         proxy_sess->backend_sess_flags &= ~SF_XFER;
@@ -2515,6 +3136,18 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
       continue;
     }
 
+    for (i = 0; i < res; i++) {
+      if (events[i].fd == datafd) {
+        data_ready = TRUE;
+
+      } else if (events[i].fd == dst_datafd) {
+        dst_ready = TRUE;
+
+      } else if (events[i].fd == backend_ctrlfd) {
+        backend_ctrl_ready = TRUE;
+      }
+    }
+
 #if 0
     /* Any commands from the frontend client take priority */
 
@@ -2522,16 +3155,17 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
      * ABOR command on the frontend control connection whilst in the middle
      * of a data transfer.
      */
-    if (frontend_ctrlfd >= 0 &&
-        FD_ISSET(frontend_ctrlfd, &rfds)) {
-      proxy_process_cmd();
-      pr_response_block(FALSE);
+    for (i = 0; i < res; i++) {
+      if (events[i].data == proxy_sess->frontend_ctrl_conn) {
+        proxy_process_cmd();
+        pr_response_block(FALSE);
+      }
     }
 #endif
 
     if (src_data_conn != NULL &&
-        datafd >= 0 &&
-        FD_ISSET(datafd, &rfds)) {
+        data_ready == TRUE &&
+        src_events != 0) {
       /* Some data arrived on the data connection... */
       pr_buffer_t *pbuf = NULL;
 
@@ -2539,7 +3173,53 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
         "handling data connection during data transfer");
 
       pr_timer_reset(PR_TIMER_IDLE, ANY_MODULE);
- 
+
+      if (splice_fds != NULL) {
+        res = proxy_ftp_data_splice(cmd->tmp_pool, src_data_conn,
+          dst_data_conn, splice_fds);
+        if (res < 0) {
+          xerrno = errno;
+
+          if (xerrno == EAGAIN ||
+              xerrno == EINTR) {
+            pr_signals_handle();
+            continue;
+          }
+
+          (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+            "error splicing data between frontend/backend, "
+            "closing data connections: %s", strerror(xerrno));
+
+          proxy_data_close_conns(proxy_sess);
+          xfer_ok = FALSE;
+          dst_xerrno = xerrno;
+
+        } else if (res == 0) {
+          pr_trace_msg(trace_channel, 19,
+            "read EOF on data connection, closing frontend/backend data "
+            "connections");
+
+          proxy_data_close_conns(proxy_sess);
+          data_eof = TRUE;
+
+        } else {
+          pr_trace_msg(trace_channel, 9,
+            "spliced %d bytes of data from source data connection", res);
+          (void) proxy_metrics_xfer_incr(frontend_data ?
+            PROXY_METRICS_XFER_FRONTEND_BYTES_IN :
+            PROXY_METRICS_XFER_BACKEND_BYTES_IN, res);
+          (void) proxy_metrics_xfer_incr(frontend_data ?
+            PROXY_METRICS_XFER_BACKEND_BYTES_OUT :
+            PROXY_METRICS_XFER_FRONTEND_BYTES_OUT, res);
+          session.xfer.total_bytes += res;
+          bytes_transferred += res;
+          (void) proxy_reverse_xfer_progress(cmd->tmp_pool,
+            session.xfer.total_bytes);
+        }
+
+        continue;
+      }
+
       pbuf = proxy_ftp_data_recv(cmd->tmp_pool, src_data_conn, frontend_data);
       if (pbuf == NULL) {
         xerrno = errno;
@@ -2564,31 +3244,30 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
         nread = pbuf->current - pbuf->buf;
 
         if (nread == 0) {
-          /* EOF on the data connection; close BOTH of them.  In many
-           * cases, closing these connections causes any buffered data to
-           * be flushed out to the waiting peer.
+          /* EOF on the source data connection.  We close the destination
+           * data connection once we have written all of the buffered data
+           * to it; in many cases, closing these connections causes any
+           * buffered data to be flushed out to the waiting peer.
            */
+          if (proxy_ftp_data_ring_len(ring) == 0) {
+            pr_trace_msg(trace_channel, 19,
+              "read EOF on data connection, closing frontend/backend data "
+              "connections");
 
-          pr_trace_msg(trace_channel, 19,
-            "read EOF on data connection, closing frontend/backend data "
-            "connections");
+            proxy_data_close_conns(proxy_sess);
+            data_eof = TRUE;
 
-          proxy_inet_close(session.pool, proxy_sess->backend_data_conn);
-          proxy_sess->backend_data_conn = NULL;
+          } else {
+            pr_trace_msg(trace_channel, 19,
+              "read EOF on data connection, closing source data connection "
+              "(%lu bytes left to write)",
+              (unsigned long) proxy_ftp_data_ring_len(ring));
 
-          if (session.d != NULL) {
-            pr_inet_close(session.pool, proxy_sess->frontend_data_conn);
-            proxy_sess->frontend_data_conn = session.d = NULL;
+            proxy_data_close_conn(proxy_sess, frontend_data);
+            src_data_conn = NULL;
           }
 
-          proxy_sess->frontend_sess_flags &= ~SF_XFER;
-          proxy_sess->backend_sess_flags &= ~SF_XFER;
-          data_eof = TRUE;
-
         } else {
-          size_t nwrote = 0;
-          char *ptr;
-
           pr_trace_msg(trace_channel, 9,
             "received %lu bytes of data from source data connection",
             (unsigned long) nread);
@@ -2596,50 +3275,42 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
 
           bytes_transferred += nread;
           pr_throttle_pause(bytes_transferred, FALSE);
+          (void) proxy_reverse_xfer_progress(cmd->tmp_pool,
+            session.xfer.total_bytes);
 
-          /* We use a loop in order to properly handle short writes.
-           *
-           * Since we are writing the pbuf from the head, we need to advance
-           * that pointer for every write.  So we store a pointer to the
-           * original buffer here, to be restored after the writes.
+          /* Make sure that the ring can always hold a full read buffer, so
+           * that we only need to pause reading when the ring is full.
            */
-          ptr = pbuf->buf;
-
-          while (nwrote != nread) {
-            int len;
+          read_max = pbuf->buflen;
+          if (ring == NULL) {
+            ring = proxy_ftp_data_ring_alloc(cmd->tmp_pool,
+              read_max > PROXY_DATA_RING_SIZE / 2 ?
+                read_max * 2 : PROXY_DATA_RING_SIZE);
+          }
 
-            len = proxy_ftp_data_send(cmd->tmp_pool, dst_data_conn, pbuf,
-              !frontend_data);
-            if (len < 0) {
-              xerrno = errno;
+          res = proxy_ftp_data_ring_put(ring, pbuf);
+          if (res < 0) {
+            xerrno = errno;
 
-              if (xerrno == EINTR) {
-                errno = EINTR;
-                pr_signals_handle();
-                continue;
-              }
+          } else {
+            /* Try to write the data now, rather than waiting for the next
+             * writability event; the destination usually has room.
+             */
+            res = proxy_ftp_data_ring_send(cmd->tmp_pool, dst_data_conn, ring,
+              !frontend_data, ring_flags);
+            xerrno = errno;
 
-              errno = xerrno;
-              res = -1;
-              break;
+            if (res < 0 &&
+                xerrno == EAGAIN) {
+              res = 0;
             }
-
-            nwrote += len;
-            pbuf->buf += len;
-            res = len;
           }
 
-          /* Restore the pbuf. */
-          pbuf->buf = ptr;
-
-          if (nwrote == nread) {
-            pbuf->current = pbuf->buf;
-            pbuf->remaining = pbuf->buflen;
-          }
+          /* Reset the pbuf for the next read. */
+          pbuf->current = pbuf->buf;
+          pbuf->remaining = pbuf->buflen;
 
           if (res < 0) {
-            xerrno = errno;
-
             (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
               "error writing %lu bytes of data to destination data "
               "connection: %s", (unsigned long) nread, strerror(xerrno));
@@ -2652,16 +3323,7 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
               "unable to proxy data between frontend/backend, "
               "closing data connections");
 
-            proxy_inet_close(session.pool, proxy_sess->backend_data_conn);
-            proxy_sess->backend_data_conn = NULL;
-
-            if (session.d != NULL) {
-              pr_inet_close(session.pool, proxy_sess->frontend_data_conn);
-              proxy_sess->frontend_data_conn = session.d = NULL;
-            }
-
-            proxy_sess->frontend_sess_flags &= ~SF_XFER;
-            proxy_sess->backend_sess_flags &= ~SF_XFER;
+            proxy_data_close_conns(proxy_sess);
             xfer_ok = FALSE;
             dst_xerrno = xerrno;
           }
@@ -2669,6 +3331,48 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
       }
     }
 
+    /* Write any buffered data once the destination data connection is
+     * writable again.
+     */
+    if (dst_data_conn != NULL &&
+        dst_ready == TRUE &&
+        data_eof == FALSE &&
+        xfer_ok == TRUE &&
+        proxy_ftp_data_ring_len(ring) > 0) {
+      res = proxy_ftp_data_ring_send(cmd->tmp_pool, dst_data_conn, ring,
+        !frontend_data, ring_flags);
+      if (res < 0 &&
+          errno != EAGAIN) {
+        xerrno = errno;
+
+        (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+          "error writing %lu bytes of data to destination data connection: %s",
+          (unsigned long) proxy_ftp_data_ring_len(ring), strerror(xerrno));
+        (void) pr_log_writefile(proxy_logfd, MOD_PROXY_VERSION,
+          "unable to proxy data between frontend/backend, "
+          "closing data connections");
+
+        proxy_data_close_conns(proxy_sess);
+        xfer_ok = FALSE;
+        dst_xerrno = xerrno;
+      }
+    }
+
+    /* Once the source is done, and we have written everything it sent,
+     * we are done with the data.
+     */
+    if (src_data_conn == NULL &&
+        dst_data_conn != NULL &&
+        data_eof == FALSE &&
+        xfer_ok == TRUE &&
+        proxy_ftp_data_ring_len(ring) == 0) {
+      pr_trace_msg(trace_channel, 19,
+        "wrote all buffered data, closing destination data connection");
+
+      proxy_data_close_conns(proxy_sess);
+      data_eof = TRUE;
+    }
+
     /* Look for a response on the backend control connection if we've received
      * EOF on the data connection.
      *
@@ -2681,8 +3385,7 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
      */
 
     if ((data_eof == TRUE || xfer_ok == FALSE) &&
-        backend_ctrlfd >= 0 &&
-        FD_ISSET(backend_ctrlfd, &rfds)) {
+        backend_ctrl_ready == TRUE) {
 
       /* Some data arrived on the ctrl connection... */
       pr_timer_reset(PR_TIMER_IDLE, ANY_MODULE);
@@ -2766,6 +3469,7 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
             strerror(xerrno));
           pr_response_flush(&resp_err_list);
 
+          (void) proxy_evloop_clear(evloop);
           pr_timer_remove(PR_TIMER_STALLED, ANY_MODULE);
           errno = xerrno;
           return PR_ERROR(cmd);
@@ -2792,6 +3496,7 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
   }
 
   pr_throttle_pause(bytes_transferred, TRUE);
+  (void) proxy_evloop_clear(evloop);
 
   proxy_sess->frontend_sess_flags &= ~SF_XFER;
   proxy_sess->backend_sess_flags &= ~SF_XFER;
@@ -2801,6 +3506,57 @@ MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
   return (xfer_ok ? PR_HANDLED(cmd) : PR_ERROR(cmd));
 }
 
+/* Handle the data transfer, collecting its metrics. */
+MODRET proxy_data(struct proxy_session *proxy_sess, cmd_rec *cmd) {
+  modret_t *mr;
+  int direction = PR_NETIO_IO_RD, flags = 0, xerrno = 0;
+  const char *backend_uri = NULL;
+
+  if (pr_cmd_cmp(cmd, PR_CMD_APPE_ID) == 0 ||
+      pr_cmd_cmp(cmd, PR_CMD_STOR_ID) == 0 ||
+      pr_cmd_cmp(cmd, PR_CMD_STOU_ID) == 0) {
+    direction = PR_NETIO_IO_WR;
+  }
+
+  if (proxy_sess->dst_pconn != NULL) {
+    backend_uri = proxy_conn_get_uri(proxy_sess->dst_pconn);
+  }
+
+  if (proxy_metrics_xfer_start(cmd->pool, (char *) cmd->argv[0], direction,
+      backend_uri) < 0) {
+    pr_trace_msg(trace_channel, 3,
+      "error collecting metrics for data transfer: %s", strerror(errno));
+  }
+
+  /* Report the transfer, for the reverse connect policies which balance on
+   * the data transfers of the backends.
+   */
+  if (proxy_role == PROXY_ROLE_REVERSE) {
+    (void) proxy_reverse_xfer_start(cmd->tmp_pool);
+  }
+
+  mr = proxy_data_xfer(proxy_sess, cmd);
+  if (MODRET_ISERROR(mr)) {
+    xerrno = errno;
+  }
+
+  if (proxy_role == PROXY_ROLE_REVERSE) {
+    (void) proxy_reverse_xfer_end(cmd->tmp_pool, session.xfer.total_bytes);
+  }
+
+  if (proxy_opts & PROXY_OPT_LOG_XFER_METRICS) {
+    flags |= PROXY_METRICS_FL_LOG_JSON;
+  }
+
+  (void) proxy_metrics_xfer_finish(cmd->pool, xerrno, flags);
+
+  if (xerrno != 0) {
+    errno = xerrno;
+  }
+
+  return mr;
+}
+
 static void proxy_dirlist_data_ev(const void *event_data, void *user_data) {
   int res;
   pr_buffer_t *pbuf;
@@ -4485,7 +5241,7 @@ static void proxy_mod_unload_ev(const void *event_data, void *user_data) {
 #endif
 
 static void proxy_postparse_ev(const void *event_data, void *user_data) {
-  int engine = FALSE;
+  int engine = FALSE, dns_ttl;
   config_rec *c;
 
   c = find_config(main_server->conf, CONF_PARAM, "ProxyEngine", FALSE);
@@ -4523,6 +5279,21 @@ static void proxy_postparse_ev(const void *event_data, void *user_data) {
 
   proxy_tables_dir = c->argv[0];
 
+  /* Not fatal; sessions then simply try addresses in the resolver's order. */
+  (void) proxy_conn_prefs_init(proxy_pool);
+
+  dns_ttl = PROXY_DNS_DEFAULT_TTL;
+  c = find_config(main_server->conf, CONF_PARAM, "ProxyDNSCacheTTL", FALSE);
+  if (c != NULL) {
+    dns_ttl = *((int *) c->argv[0]);
+  }
+
+  /* Not fatal either; sessions then resolve backend names themselves. */
+  if (proxy_dns_init(proxy_pool, dns_ttl) < 0) {
+    pr_log_pri(PR_LOG_NOTICE, MOD_PROXY_VERSION
+      ": unable to initialize DNS cache: %s", strerror(errno));
+  }
+
   if (proxy_forward_init(proxy_pool, proxy_tables_dir) < 0) {
     pr_log_pri(PR_LOG_WARNING, MOD_PROXY_VERSION
       ": unable to initialize forward proxy, failing to start up: %s",
@@ -4555,6 +5326,8 @@ static void proxy_restart_ev(const void *event_data, void *user_data) {
   proxy_forward_free(proxy_pool);
   proxy_reverse_free(proxy_pool);
   proxy_tls_free(proxy_pool);
+  proxy_conn_prefs_free(proxy_pool);
+  proxy_dns_free(proxy_pool);
 
   /* Do NOT close the database connection/handle here; we may have session
    * processes that have their own handles to that same file.
@@ -4617,6 +5390,8 @@ static void proxy_shutdown_ev(const void *event_data, void *user_data) {
   proxy_forward_free(proxy_pool);
   proxy_reverse_free(proxy_pool);
   proxy_tls_free(proxy_pool);
+  proxy_conn_prefs_free(proxy_pool);
+  proxy_dns_free(proxy_pool);
 
   res = proxy_db_close(proxy_pool, NULL);
   if (res < 0) {
@@ -4722,6 +5497,13 @@ static int proxy_sess_init(void) {
   pr_event_register(&proxy_module, "core.session-reinit",
     proxy_sess_reinit_ev, NULL);
 
+  /* Regardless of ProxyEngine, release the daemon's health check and
+   * connection pool resources.
+   */
+  (void) proxy_dns_sess_init();
+  (void) proxy_reverse_health_sess_init();
+  (void) proxy_reverse_connpool_sess_init();
+
   c = find_config(main_server->conf, CONF_PARAM, "ProxyEngine", FALSE);
   if (c != NULL) {
     proxy_engine = *((int *) c->argv[0]);
@@ -4832,6 +5614,12 @@ static int proxy_sess_init(void) {
     proxy_sess->dataxfer_policy = *((int *) c->argv[0]);
   }
 
+  c = find_config(main_server->conf, CONF_PARAM,
+    "ProxyDataTransferBufferSize", FALSE);
+  if (c != NULL) {
+    proxy_sess->dataxfer_bufsz = *((size_t *) c->argv[0]);
+  }
+
   c = find_config(main_server->conf, CONF_PARAM, "ProxyDirectoryListPolicy",
     FALSE);
   if (c != NULL) {
@@ -4927,9 +5715,11 @@ static int proxy_sess_init(void) {
  */
 
 static conftable proxy_conftab[] = {
+  { "ProxyDataTransferBufferSize",set_proxydataxferbufsz,	NULL },
   { "ProxyDataTransferPolicy",	set_proxydataxferpolicy,	NULL },
   { "ProxyDatastore",		set_proxydatastore,		NULL },
   { "ProxyDirectoryListPolicy",	set_proxydirlistpolicy,		NULL },
+  { "ProxyDNSCacheTTL",		set_proxydnscachettl,		NULL },
   { "ProxyEngine",		set_proxyengine,		NULL },
   { "ProxyForwardEnabled",	set_proxyforwardenabled,	NULL },
   { "ProxyForwardMethod",	set_proxyforwardmethod,		NULL },
@@ -4938,6 +5728,11 @@ static conftable proxy_conftab[] = {
   { "ProxyOptions",		set_proxyoptions,		NULL },
   { "ProxyRetryCount",		set_proxyretrycount,		NULL },
   { "ProxyReverseConnectPolicy",set_proxyreverseconnectpolicy,	NULL },
+  { "ProxyReverseConnectionPool",set_proxyreverseconnectionpool,	NULL },
+  { "ProxyReverseHealthCheck",	set_proxyreversehealthcheck,	NULL },
+  { "ProxyReverseHealthCooldown",set_proxyreversehealthcooldown,	NULL },
+  { "ProxyReversePerHostMap",	set_proxyreverseperhostmap,	NULL },
+  { "ProxyReversePerHostPrefix",set_proxyreverseperhostprefix,	NULL },
   { "ProxyReverseServers",	set_proxyreverseservers,	NULL },
   { "ProxyRole",		set_proxyrole,			NULL },
   { "ProxySourceAddress",	set_proxysourceaddress,		NULL },
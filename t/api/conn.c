@@ -98,6 +98,48 @@ START_TEST (conn_create_test) {
 }
 END_TEST
 
+START_TEST (conn_get_weight_test) {
+  unsigned int weight;
+  const struct proxy_conn *pconn;
+  const char *url;
+
+  weight = proxy_conn_get_weight(NULL);
+  fail_unless(weight == PROXY_CONN_DEFAULT_WEIGHT, "Expected %u, got %u",
+    PROXY_CONN_DEFAULT_WEIGHT, weight);
+
+  url = "ftp://127.0.0.1:21";
+  pconn = proxy_conn_create(p, url);
+  fail_if(pconn == NULL, "Failed to create pconn for URL '%s'", url);
+  weight = proxy_conn_get_weight(pconn);
+  fail_unless(weight == PROXY_CONN_DEFAULT_WEIGHT, "Expected %u, got %u",
+    PROXY_CONN_DEFAULT_WEIGHT, weight);
+  proxy_conn_free(pconn);
+
+  url = "ftp://127.0.0.1:21?weight=4";
+  pconn = proxy_conn_create(p, url);
+  fail_if(pconn == NULL, "Failed to create pconn for URL '%s'", url);
+  weight = proxy_conn_get_weight(pconn);
+  fail_unless(weight == 4, "Expected 4, got %u", weight);
+  fail_unless(proxy_conn_get_port(pconn) == 21, "Expected port 21, got %d",
+    proxy_conn_get_port(pconn));
+  fail_unless(strcmp(proxy_conn_get_uri(pconn), "ftp://127.0.0.1:21") == 0,
+    "Expected URI without parameters, got '%s'", proxy_conn_get_uri(pconn));
+  proxy_conn_free(pconn);
+
+  url = "ftp://127.0.0.1:21?weight=0";
+  pconn = proxy_conn_create(p, url);
+  fail_unless(pconn == NULL, "Failed to reject URL '%s'", url);
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  url = "ftp://127.0.0.1:21?foo=bar";
+  pconn = proxy_conn_create(p, url);
+  fail_unless(pconn == NULL, "Failed to reject URL '%s'", url);
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+}
+END_TEST
+
 START_TEST (conn_get_addr_test) {
   const struct proxy_conn *pconn;
   const char *ipstr, *url;
@@ -342,6 +384,156 @@ START_TEST (conn_get_server_conn_test) {
 }
 END_TEST
 
+START_TEST (conn_connect_start_test) {
+  struct proxy_conn_connect *pcc;
+  struct proxy_session *proxy_sess;
+  conn_t *conn;
+
+  mark_point();
+  pcc = proxy_conn_connect_start(NULL, NULL, NULL);
+  fail_unless(pcc == NULL, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  proxy_sess = (struct proxy_session *) proxy_session_alloc(p);
+
+  pcc = proxy_conn_connect_start(p, proxy_sess, NULL);
+  fail_unless(pcc == NULL, "Failed to handle null pconn");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  conn = proxy_conn_connect_finish(NULL, NULL, NULL);
+  fail_unless(conn == NULL, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  conn = proxy_conn_connect_finish(p, proxy_sess, NULL);
+  fail_unless(conn == NULL, "Failed to handle null connect");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  proxy_conn_connect_abort(NULL);
+
+  proxy_session_free(p, proxy_sess);
+}
+END_TEST
+
+START_TEST (conn_connect_finish_test) {
+  struct proxy_conn_connect *pcc;
+  struct proxy_session *proxy_sess;
+  const struct proxy_conn *pconn;
+  conn_t *conn;
+
+  proxy_sess = (struct proxy_session *) proxy_session_alloc(p);
+  proxy_sess->connect_timeout = 1;
+
+  /* Nothing should be listening on this port. */
+  pconn = proxy_conn_create(p, "ftp://127.0.0.1:1");
+  fail_unless(pconn != NULL, "Failed to create pconn: %s", strerror(errno));
+
+  mark_point();
+  pcc = proxy_conn_connect_start(p, proxy_sess, pconn);
+  if (pcc != NULL) {
+    conn = proxy_conn_connect_finish(p, proxy_sess, pcc);
+    fail_unless(conn == NULL, "Connected unexpectedly");
+    fail_unless(errno == ECONNREFUSED || errno == ETIMEDOUT,
+      "Expected ECONNREFUSED (%d) or ETIMEDOUT (%d), got '%s' (%d)",
+      ECONNREFUSED, ETIMEDOUT, strerror(errno), errno);
+  }
+
+  mark_point();
+  pcc = proxy_conn_connect_start(p, proxy_sess, pconn);
+  if (pcc != NULL) {
+    proxy_conn_connect_abort(pcc);
+  }
+
+  proxy_conn_free(pconn);
+  proxy_session_free(p, proxy_sess);
+}
+END_TEST
+
+START_TEST (conn_connect_finish_speculative_test) {
+  int fd, res;
+  struct sockaddr_in sin;
+  socklen_t sinlen;
+  char *uri;
+  struct proxy_conn_connect *pcc;
+  struct proxy_session *proxy_sess;
+  const struct proxy_conn *pconn;
+  conn_t *conn;
+
+  proxy_sess = (struct proxy_session *) proxy_session_alloc(p);
+  proxy_sess->connect_timeout = 1;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  fail_unless(fd >= 0, "Failed to create socket: %s", strerror(errno));
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = 0;
+  res = bind(fd, (struct sockaddr *) &sin, sizeof(sin));
+  fail_unless(res == 0, "Failed to bind socket: %s", strerror(errno));
+
+  res = listen(fd, 5);
+  fail_unless(res == 0, "Failed to listen on socket: %s", strerror(errno));
+
+  sinlen = sizeof(sin);
+  res = getsockname(fd, (struct sockaddr *) &sin, &sinlen);
+  fail_unless(res == 0, "Failed to get socket name: %s", strerror(errno));
+
+  uri = pcalloc(p, 64);
+  snprintf(uri, 63, "ftp://127.0.0.1:%u", ntohs(sin.sin_port));
+  pconn = proxy_conn_create(p, uri);
+  fail_unless(pconn != NULL, "Failed to create pconn: %s", strerror(errno));
+
+  mark_point();
+  pcc = proxy_conn_connect_start(p, proxy_sess, pconn);
+  fail_unless(pcc != NULL, "Failed to start connect to '%s': %s", uri,
+    strerror(errno));
+
+  /* The speculative attempt has long since connected, by the time the
+   * session asks for it, e.g. after a slow login; it is not timed out.
+   */
+  sleep(proxy_sess->connect_timeout + 1);
+
+  mark_point();
+  conn = proxy_conn_connect_finish(p, proxy_sess, pcc);
+  fail_unless(conn != NULL, "Failed to finish connect to '%s': %s", uri,
+    strerror(errno));
+
+  pr_inet_close(p, conn);
+  (void) close(fd);
+  proxy_conn_free(pconn);
+  proxy_session_free(p, proxy_sess);
+}
+END_TEST
+
+START_TEST (conn_prefs_init_test) {
+  int res;
+
+  mark_point();
+  res = proxy_conn_prefs_init(NULL);
+  fail_unless(res < 0, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = proxy_conn_prefs_init(p);
+  fail_unless(res == 0, "Failed to init prefs: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_conn_prefs_init(p);
+  fail_unless(res == 0, "Failed to init prefs again: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_conn_prefs_free(p);
+  fail_unless(res == 0, "Failed to free prefs: %s", strerror(errno));
+}
+END_TEST
+
 START_TEST (conn_clear_username_test) {
   const char *username, *url, *expected;
   const struct proxy_conn *pconn;
@@ -597,6 +789,7 @@ Suite *tests_get_conn_suite(void) {
   tcase_add_checked_fixture(testcase, set_up, tear_down);
 
   tcase_add_test(testcase, conn_create_test);
+  tcase_add_test(testcase, conn_get_weight_test);
   tcase_add_test(testcase, conn_get_addr_test);
   tcase_add_test(testcase, conn_get_host_test);
   tcase_add_test(testcase, conn_get_port_test);
@@ -606,6 +799,10 @@ Suite *tests_get_conn_suite(void) {
   tcase_add_test(testcase, conn_get_password_test);
   tcase_add_test(testcase, conn_get_tls_test);
   tcase_add_test(testcase, conn_get_server_conn_test);
+  tcase_add_test(testcase, conn_connect_start_test);
+  tcase_add_test(testcase, conn_connect_finish_test);
+  tcase_add_test(testcase, conn_connect_finish_speculative_test);
+  tcase_add_test(testcase, conn_prefs_init_test);
   tcase_add_test(testcase, conn_clear_username_test);
   tcase_add_test(testcase, conn_clear_password_test);
   tcase_add_test(testcase, conn_timeout_cb_test);
@@ -550,6 +550,167 @@ START_TEST (db_exec_prepared_stmt_test) {
 }
 END_TEST
 
+START_TEST (db_txn_test) {
+  int res;
+  const char *table_path, *schema_name, *stmt, *errstr = NULL;
+  struct proxy_dbh *dbh;
+  array_header *results;
+
+  mark_point();
+  res = proxy_db_begin(p, NULL);
+  fail_unless(res < 0, "Failed to handle null dbh");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = proxy_db_commit(p, NULL);
+  fail_unless(res < 0, "Failed to handle null dbh");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = proxy_db_rollback(p, NULL);
+  fail_unless(res < 0, "Failed to handle null dbh");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  (void) unlink(db_test_table);
+  table_path = db_test_table;
+  schema_name = "proxy_test";
+
+  dbh = proxy_db_open(p, table_path, schema_name);
+  fail_unless(dbh != NULL, "Failed to open table '%s': %s", table_path,
+    strerror(errno));
+
+  res = create_table(p, dbh, "foo");
+  fail_unless(res == 0, "Failed to create table 'foo': %s", strerror(errno));
+
+  /* A rolled-back insert is not seen. */
+  res = proxy_db_begin(p, dbh);
+  fail_unless(res == 0, "Failed to begin transaction: %s", strerror(errno));
+
+  stmt = "INSERT INTO foo (id, name) VALUES (1, 'one');";
+  res = proxy_db_exec_stmt(p, dbh, stmt, &errstr);
+  fail_unless(res == 0, "Failed to execute '%s': %s", stmt, errstr);
+
+  res = proxy_db_rollback(p, dbh);
+  fail_unless(res == 0, "Failed to roll back transaction: %s",
+    strerror(errno));
+
+  /* A committed insert is. */
+  res = proxy_db_begin(p, dbh);
+  fail_unless(res == 0, "Failed to begin transaction: %s", strerror(errno));
+
+  stmt = "INSERT INTO foo (id, name) VALUES (2, 'two');";
+  res = proxy_db_exec_stmt(p, dbh, stmt, &errstr);
+  fail_unless(res == 0, "Failed to execute '%s': %s", stmt, errstr);
+
+  res = proxy_db_commit(p, dbh);
+  fail_unless(res == 0, "Failed to commit transaction: %s", strerror(errno));
+
+  stmt = "SELECT id FROM foo;";
+  res = proxy_db_prepare_stmt(p, dbh, stmt);
+  fail_unless(res == 0, "Failed to prepare '%s': %s", stmt, strerror(errno));
+
+  results = proxy_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  fail_unless(results != NULL, "Failed to execute '%s': %s", stmt, errstr);
+  fail_unless(results->nelts == 1, "Expected 1 result, got %d",
+    results->nelts);
+  fail_unless(strcmp(((char **) results->elts)[0], "2") == 0,
+    "Expected '2', got '%s'", ((char **) results->elts)[0]);
+
+  res = proxy_db_close(p, dbh);
+  fail_unless(res == 0, "Failed to close database: %s", strerror(errno));
+
+  (void) unlink(db_test_table);
+}
+END_TEST
+
+START_TEST (db_try_begin_test) {
+  int res;
+  const char *table_path, *schema_name;
+  struct proxy_dbh *dbh, *dbh2;
+
+  mark_point();
+  res = proxy_db_try_begin(p, NULL);
+  fail_unless(res < 0, "Failed to handle null dbh");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  (void) unlink(db_test_table);
+  table_path = db_test_table;
+  schema_name = "proxy_test";
+
+  dbh = proxy_db_open(p, table_path, schema_name);
+  fail_unless(dbh != NULL, "Failed to open table '%s': %s", table_path,
+    strerror(errno));
+
+  res = create_table(p, dbh, "foo");
+  fail_unless(res == 0, "Failed to create table 'foo': %s", strerror(errno));
+
+  dbh2 = proxy_db_open(p, table_path, schema_name);
+  fail_unless(dbh2 != NULL, "Failed to open table '%s': %s", table_path,
+    strerror(errno));
+
+  /* While another handle holds the write lock, we fail rather than wait. */
+  res = proxy_db_begin(p, dbh);
+  fail_unless(res == 0, "Failed to begin transaction: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_db_try_begin(p, dbh2);
+  fail_unless(res < 0, "Failed to handle locked database");
+  fail_unless(errno == EAGAIN, "Expected EAGAIN (%d), got '%s' (%d)", EAGAIN,
+    strerror(errno), errno);
+
+  res = proxy_db_commit(p, dbh);
+  fail_unless(res == 0, "Failed to commit transaction: %s", strerror(errno));
+
+  res = proxy_db_try_begin(p, dbh2);
+  fail_unless(res == 0, "Failed to begin transaction: %s", strerror(errno));
+
+  res = proxy_db_commit(p, dbh2);
+  fail_unless(res == 0, "Failed to commit transaction: %s", strerror(errno));
+
+  res = proxy_db_close(p, dbh2);
+  fail_unless(res == 0, "Failed to close database: %s", strerror(errno));
+
+  res = proxy_db_close(p, dbh);
+  fail_unless(res == 0, "Failed to close database: %s", strerror(errno));
+
+  (void) unlink(db_test_table);
+}
+END_TEST
+
+START_TEST (db_open_wal_test) {
+  int res;
+  const char *table_path, *schema_name, *stmt, *errstr = NULL;
+  struct proxy_dbh *dbh;
+
+  (void) unlink(db_test_table);
+  table_path = db_test_table;
+  schema_name = "proxy_test";
+
+  mark_point();
+  dbh = proxy_db_open_with_version(p, table_path, schema_name, 0,
+    PROXY_DB_OPEN_FL_USE_WAL);
+  fail_unless(dbh != NULL, "Failed to open table '%s': %s", table_path,
+    strerror(errno));
+
+  /* Even if the filesystem does not support WAL, the database is usable. */
+  res = create_table(p, dbh, "foo");
+  fail_unless(res == 0, "Failed to create table 'foo': %s", strerror(errno));
+
+  stmt = "INSERT INTO foo (id, name) VALUES (1, 'one');";
+  res = proxy_db_exec_stmt(p, dbh, stmt, &errstr);
+  fail_unless(res == 0, "Failed to execute '%s': %s", stmt, errstr);
+
+  res = proxy_db_close(p, dbh);
+  fail_unless(res == 0, "Failed to close database: %s", strerror(errno));
+
+  (void) unlink(db_test_table);
+  (void) unlink(pstrcat(p, db_test_table, "-wal", NULL));
+  (void) unlink(pstrcat(p, db_test_table, "-shm", NULL));
+}
+END_TEST
+
 START_TEST (db_reindex_test) {
   int res;
   const char *table_path, *schema_name, *index_name, *errstr = NULL;
@@ -609,6 +770,9 @@ Suite *tests_get_db_suite(void) {
   tcase_add_test(testcase, db_finish_stmt_test);
   tcase_add_test(testcase, db_bind_stmt_test);
   tcase_add_test(testcase, db_exec_prepared_stmt_test);
+  tcase_add_test(testcase, db_txn_test);
+  tcase_add_test(testcase, db_try_begin_test);
+  tcase_add_test(testcase, db_open_wal_test);
   tcase_add_test(testcase, db_reindex_test);
 
   suite_add_tcase(suite, testcase);
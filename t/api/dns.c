@@ -0,0 +1,216 @@
+/*
+ * ProFTPD - mod_proxy testsuite
+ * Copyright (c) 2020 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* DNS cache API tests. */
+
+#include "tests.h"
+
+static pool *p = NULL;
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("proxy.dns", 1, 20);
+  }
+}
+
+static void tear_down(void) {
+  (void) proxy_dns_free(p);
+
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("proxy.dns", 0, 0);
+  }
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+START_TEST (dns_init_test) {
+  int res;
+
+  mark_point();
+  res = proxy_dns_init(NULL, 0);
+  fail_unless(res < 0, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = proxy_dns_init(p, 0);
+  fail_unless(res == 0, "Failed to init disabled cache: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_dns_free(p);
+  fail_unless(res == 0, "Failed to free cache: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_dns_init(p, PROXY_DNS_DEFAULT_TTL);
+  fail_unless(res == 0, "Failed to init cache: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_dns_sess_init();
+  fail_unless(res == 0, "Failed to init session: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_dns_free(p);
+  fail_unless(res == 0, "Failed to free cache: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (dns_add_test) {
+  int res;
+
+  mark_point();
+  res = proxy_dns_add(NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = proxy_dns_add(p, NULL);
+  fail_unless(res < 0, "Failed to handle null name");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* Without a cache, adding is a no-op. */
+  mark_point();
+  res = proxy_dns_add(p, "localhost");
+  fail_unless(res == 0, "Failed to add 'localhost': %s", strerror(errno));
+
+  res = proxy_dns_init(p, PROXY_DNS_DEFAULT_TTL);
+  fail_unless(res == 0, "Failed to init cache: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_dns_add(p, "localhost");
+  fail_unless(res == 0, "Failed to add 'localhost': %s", strerror(errno));
+
+  mark_point();
+  res = proxy_dns_add(p, "127.0.0.1");
+  fail_unless(res == 0, "Failed to add '127.0.0.1': %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (dns_add_addrs_test) {
+  int res;
+  const pr_netaddr_t *addr;
+  pr_netaddr_t *resolved;
+
+  mark_point();
+  res = proxy_dns_add_addrs(NULL, NULL, NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = proxy_dns_add_addrs(p, "localhost", NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null addr");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = proxy_dns_init(p, PROXY_DNS_DEFAULT_TTL);
+  fail_unless(res == 0, "Failed to init cache: %s", strerror(errno));
+
+  /* A name which cannot resolve is served from the given addresses; the
+   * port of the given address is not cached.
+   */
+  resolved = pr_netaddr_dup(p, pr_netaddr_get_addr(p, "127.0.0.1", NULL));
+  fail_unless(resolved != NULL, "Failed to get address: %s", strerror(errno));
+  pr_netaddr_set_port2(resolved, 2121);
+
+  mark_point();
+  res = proxy_dns_add_addrs(p, "backend.invalid", resolved, NULL);
+  fail_unless(res == 0, "Failed to add addresses: %s", strerror(errno));
+
+  mark_point();
+  addr = proxy_dns_get_addr(p, "backend.invalid", NULL);
+  fail_unless(addr != NULL, "Failed to get cached address: %s",
+    strerror(errno));
+  fail_unless(pr_netaddr_is_loopback(addr) == TRUE,
+    "Expected loopback address, got %s", pr_netaddr_get_ipstr(addr));
+  fail_unless(ntohs(pr_netaddr_get_port(addr)) == 0,
+    "Expected port 0, got %u", ntohs(pr_netaddr_get_port(addr)));
+}
+END_TEST
+
+START_TEST (dns_get_addr_test) {
+  int res;
+  const pr_netaddr_t *addr;
+  array_header *addrs = NULL;
+
+  mark_point();
+  addr = proxy_dns_get_addr(NULL, NULL, NULL);
+  fail_unless(addr == NULL, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  addr = proxy_dns_get_addr(p, NULL, NULL);
+  fail_unless(addr == NULL, "Failed to handle null name");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  addr = proxy_dns_get_addr(p, "127.0.0.1", NULL);
+  fail_unless(addr != NULL, "Failed to get address for '127.0.0.1': %s",
+    strerror(errno));
+
+  res = proxy_dns_init(p, PROXY_DNS_DEFAULT_TTL);
+  fail_unless(res == 0, "Failed to init cache: %s", strerror(errno));
+
+  /* The first lookup populates the cache, the second is served from it. */
+  mark_point();
+  addr = proxy_dns_get_addr(p, "localhost", &addrs);
+  fail_unless(addr != NULL, "Failed to get address for 'localhost': %s",
+    strerror(errno));
+
+  mark_point();
+  addr = proxy_dns_get_addr(p, "localhost", &addrs);
+  fail_unless(addr != NULL, "Failed to get cached address for 'localhost': %s",
+    strerror(errno));
+  fail_unless(pr_netaddr_is_loopback(addr) == TRUE,
+    "Expected loopback address, got %s", pr_netaddr_get_ipstr(addr));
+}
+END_TEST
+
+Suite *tests_get_dns_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("dns");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, dns_init_test);
+  tcase_add_test(testcase, dns_add_test);
+  tcase_add_test(testcase, dns_add_addrs_test);
+  tcase_add_test(testcase, dns_get_addr_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
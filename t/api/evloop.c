@@ -0,0 +1,256 @@
+/*
+ * ProFTPD - mod_proxy testsuite
+ * Copyright (c) 2020 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Event loop API tests. */
+
+#include "tests.h"
+
+static pool *p = NULL;
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+    session.c = NULL;
+    session.notes = NULL;
+  }
+
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("proxy.evloop", 1, 20);
+  }
+}
+
+static void tear_down(void) {
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("proxy.evloop", 0, 0);
+  }
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+    session.c = NULL;
+    session.notes = NULL;
+  }
+}
+
+static void test_evloop_readiness(int flags) {
+  int res, fds[2];
+  struct proxy_evloop *loop;
+  struct proxy_evloop_event events[4];
+
+  loop = proxy_evloop_create(p, flags);
+  fail_unless(loop != NULL, "Failed to create event loop: %s",
+    strerror(errno));
+
+  res = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  fail_unless(res == 0, "Failed to create socketpair: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_evloop_add(loop, fds[0], PROXY_EVLOOP_EV_READ, &fds[0]);
+  fail_unless(res == 0, "Failed to add fd %d: %s", fds[0], strerror(errno));
+
+  mark_point();
+  res = proxy_evloop_wait(loop, events, 4, 0);
+  fail_unless(res == 0, "Expected 0 events, got %d (%s)", res,
+    strerror(errno));
+
+  res = write(fds[1], "a", 1);
+  fail_unless(res == 1, "Failed to write: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_evloop_wait(loop, events, 4, 1000);
+  fail_unless(res == 1, "Expected 1 event, got %d (%s)", res,
+    strerror(errno));
+  fail_unless(events[0].fd == fds[0], "Expected fd %d, got %d", fds[0],
+    events[0].fd);
+  fail_unless(events[0].data == &fds[0], "Expected data %p, got %p",
+    &fds[0], events[0].data);
+  fail_unless(events[0].events & PROXY_EVLOOP_EV_READ,
+    "Expected READ event, got %#x", events[0].events);
+
+  mark_point();
+  res = proxy_evloop_modify(loop, fds[0],
+    PROXY_EVLOOP_EV_READ|PROXY_EVLOOP_EV_WRITE, NULL);
+  fail_unless(res == 0, "Failed to modify fd %d: %s", fds[0], strerror(errno));
+
+  mark_point();
+  res = proxy_evloop_wait(loop, events, 4, 1000);
+  fail_unless(res == 1, "Expected 1 event, got %d (%s)", res,
+    strerror(errno));
+  fail_unless(events[0].events & PROXY_EVLOOP_EV_WRITE,
+    "Expected WRITE event, got %#x", events[0].events);
+  fail_unless(events[0].data == NULL, "Expected null data, got %p",
+    events[0].data);
+
+  mark_point();
+  res = proxy_evloop_remove(loop, fds[0]);
+  fail_unless(res == 0, "Failed to remove fd %d: %s", fds[0], strerror(errno));
+
+  mark_point();
+  res = proxy_evloop_remove(loop, fds[0]);
+  fail_unless(res < 0, "Removed fd %d unexpectedly", fds[0]);
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  res = proxy_evloop_wait(loop, events, 4, 0);
+  fail_unless(res == 0, "Expected 0 events, got %d (%s)", res,
+    strerror(errno));
+
+  (void) close(fds[0]);
+  (void) close(fds[1]);
+
+  res = proxy_evloop_destroy(loop);
+  fail_unless(res == 0, "Failed to destroy event loop: %s", strerror(errno));
+}
+
+START_TEST (evloop_create_test) {
+  struct proxy_evloop *loop;
+  const char *name;
+
+  mark_point();
+  loop = proxy_evloop_create(NULL, 0);
+  fail_unless(loop == NULL, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  loop = proxy_evloop_create(p, PROXY_EVLOOP_FL_USE_POLL);
+  fail_unless(loop != NULL, "Failed to create event loop: %s",
+    strerror(errno));
+
+  name = proxy_evloop_get_name(loop);
+  fail_unless(strcmp(name, "poll") == 0, "Expected 'poll', got '%s'", name);
+
+  mark_point();
+  loop = proxy_evloop_create(p, 0);
+  fail_unless(loop != NULL, "Failed to create event loop: %s",
+    strerror(errno));
+
+  name = proxy_evloop_get_name(loop);
+#if defined(HAVE_SYS_EPOLL_H)
+  fail_unless(strcmp(name, "epoll") == 0, "Expected 'epoll', got '%s'", name);
+#else
+  fail_unless(strcmp(name, "poll") == 0, "Expected 'poll', got '%s'", name);
+#endif /* HAVE_SYS_EPOLL_H */
+
+  mark_point();
+  (void) proxy_evloop_destroy(loop);
+}
+END_TEST
+
+START_TEST (evloop_add_test) {
+  int res;
+  struct proxy_evloop *loop;
+
+  mark_point();
+  res = proxy_evloop_add(NULL, -1, 0, NULL);
+  fail_unless(res < 0, "Failed to handle null loop");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  loop = proxy_evloop_create(p, 0);
+
+  mark_point();
+  res = proxy_evloop_add(loop, -1, 0, NULL);
+  fail_unless(res < 0, "Failed to handle invalid fd");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = proxy_evloop_modify(loop, 7, 0, NULL);
+  fail_unless(res < 0, "Failed to handle unknown fd");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  res = proxy_evloop_clear(loop);
+  fail_unless(res == 0, "Failed to clear event loop: %s", strerror(errno));
+
+  (void) proxy_evloop_destroy(loop);
+}
+END_TEST
+
+START_TEST (evloop_wait_test) {
+  int res;
+
+  mark_point();
+  res = proxy_evloop_wait(NULL, NULL, 0, 0);
+  fail_unless(res < 0, "Failed to handle null loop");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  test_evloop_readiness(0);
+
+  mark_point();
+  test_evloop_readiness(PROXY_EVLOOP_FL_USE_POLL);
+}
+END_TEST
+
+START_TEST (evloop_poll_fd_test) {
+  int res, fds[2];
+
+  mark_point();
+  res = proxy_evloop_poll_fd(-1, PROXY_EVLOOP_EV_READ, 0);
+  fail_unless(res < 0, "Failed to handle invalid fd");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  fail_unless(res == 0, "Failed to create socketpair: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_evloop_poll_fd(fds[0], PROXY_EVLOOP_EV_READ, 0);
+  fail_unless(res == 0, "Expected 0, got %d (%s)", res, strerror(errno));
+
+  res = write(fds[1], "a", 1);
+  fail_unless(res == 1, "Failed to write: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_evloop_poll_fd(fds[0], PROXY_EVLOOP_EV_READ, 0);
+  fail_unless(res == PROXY_EVLOOP_EV_READ, "Expected READ, got %d (%s)", res,
+    strerror(errno));
+
+  (void) close(fds[0]);
+  (void) close(fds[1]);
+}
+END_TEST
+
+Suite *tests_get_evloop_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("evloop");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, evloop_create_test);
+  tcase_add_test(testcase, evloop_add_test);
+  tcase_add_test(testcase, evloop_wait_test);
+  tcase_add_test(testcase, evloop_poll_fd_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -256,6 +256,24 @@ START_TEST (listen_test) {
 }
 END_TEST
 
+START_TEST (get_xfer_bufsz_test) {
+  size_t res;
+
+  mark_point();
+  res = proxy_ftp_conn_get_xfer_bufsz(NULL, 0);
+  fail_unless(res == 0, "Expected 0, got %lu", (unsigned long) res);
+
+  mark_point();
+  res = proxy_ftp_conn_get_xfer_bufsz(NULL, 8192);
+  fail_unless(res == 8192, "Expected 8192, got %lu", (unsigned long) res);
+
+  mark_point();
+  res = proxy_ftp_conn_get_xfer_bufsz(NULL, PROXY_FTP_CONN_XFER_BUFSZ_AUTO);
+  fail_unless(res == 0, "Expected 0 for null conn, got %lu",
+    (unsigned long) res);
+}
+END_TEST
+
 Suite *tests_get_ftp_conn_suite(void) {
   Suite *suite;
   TCase *testcase;
@@ -268,6 +286,7 @@ Suite *tests_get_ftp_conn_suite(void) {
   tcase_add_test(testcase, accept_test);
   tcase_add_test(testcase, connect_test);
   tcase_add_test(testcase, listen_test);
+  tcase_add_test(testcase, get_xfer_bufsz_test);
 
   suite_add_tcase(suite, testcase);
   return suite;
@@ -108,6 +108,49 @@ START_TEST (recv_test) {
 }
 END_TEST
 
+START_TEST (set_bufsz_test) {
+  int res;
+  conn_t *conn;
+  pr_buffer_t *pbuf;
+
+  mark_point();
+  res = proxy_ftp_data_set_bufsz(NULL, 0);
+  fail_unless(res < 0, "Failed to handle null conn");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  conn = pr_inet_create_conn(p, -2, NULL, INPORT_ANY, FALSE);
+  fail_unless(conn != NULL, "Failed to create conn: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_ftp_data_set_bufsz(conn, 1024);
+  fail_unless(res < 0, "Failed to handle missing instream");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  conn->instrm = pr_netio_open(p, PR_NETIO_STRM_DATA, -1, PR_NETIO_IO_RD);
+  fail_unless(conn->instrm != NULL, "Failed open data stream: %s",
+    strerror(errno));
+
+  mark_point();
+  res = proxy_ftp_data_set_bufsz(conn, 0);
+  fail_unless(res < 0, "Failed to handle zero size");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = proxy_ftp_data_set_bufsz(conn, 1024);
+  fail_unless(res == 0, "Failed to set buffer size: %s", strerror(errno));
+
+  pbuf = conn->instrm->strm_buf;
+  fail_unless(pbuf != NULL, "Expected stream buffer");
+  fail_unless(pbuf->buflen == 1024, "Expected 1024, got %lu",
+    (unsigned long) pbuf->buflen);
+
+  pr_inet_close(p, conn);
+}
+END_TEST
+
 START_TEST (send_test) {
   int res;
   pr_buffer_t *pbuf;
@@ -165,6 +208,170 @@ START_TEST (send_test) {
 }
 END_TEST
 
+START_TEST (ring_test) {
+  int res, fds[2];
+  pr_buffer_t *pbuf;
+  struct proxy_ftp_data_ring *ring;
+  conn_t *conn;
+  char buf[32];
+
+  mark_point();
+  ring = proxy_ftp_data_ring_alloc(NULL, 0);
+  fail_unless(ring == NULL, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  ring = proxy_ftp_data_ring_alloc(p, 8);
+  fail_unless(ring != NULL, "Failed to allocate ring: %s", strerror(errno));
+  fail_unless(proxy_ftp_data_ring_len(ring) == 0, "Expected empty ring");
+  fail_unless(proxy_ftp_data_ring_space(ring) == 8, "Expected 8 bytes space");
+
+  mark_point();
+  res = proxy_ftp_data_ring_put(ring, NULL);
+  fail_unless(res < 0, "Failed to handle null buffer");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  pbuf = pcalloc(p, sizeof(pr_buffer_t));
+  pbuf->buflen = 16;
+  pbuf->buf = pstrdup(p, "abcdefghijklmno");
+
+  pbuf->current = pbuf->buf + 6;
+  res = proxy_ftp_data_ring_put(ring, pbuf);
+  fail_unless(res == 6, "Expected 6, got %d (%s)", res, strerror(errno));
+  fail_unless(proxy_ftp_data_ring_len(ring) == 6, "Expected 6 bytes buffered");
+
+  mark_point();
+  res = proxy_ftp_data_ring_put(ring, pbuf);
+  fail_unless(res < 0, "Buffered too much data unexpectedly");
+  fail_unless(errno == ENOSPC, "Expected ENOSPC (%d), got %s (%d)", ENOSPC,
+    strerror(errno), errno);
+
+  res = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  fail_unless(res == 0, "Failed to create socketpair: %s", strerror(errno));
+
+  conn = pr_inet_create_conn(p, -2, NULL, INPORT_ANY, FALSE);
+  fail_unless(conn != NULL, "Failed to create conn: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_ftp_data_ring_send(p, conn, ring, TRUE, 0);
+  fail_unless(res < 0, "Failed to handle null stream");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  conn->outstrm = pr_netio_open(p, PR_NETIO_STRM_DATA, fds[0],
+    PR_NETIO_IO_WR);
+
+  mark_point();
+  res = proxy_ftp_data_ring_send(p, conn, ring, TRUE,
+    PROXY_FTP_DATA_FL_NONBLOCKING);
+  fail_unless(res == 6, "Expected 6, got %d (%s)", res, strerror(errno));
+  fail_unless(proxy_ftp_data_ring_len(ring) == 0, "Expected empty ring");
+
+  /* Buffer more data, after the ring was drained. */
+  pbuf->current = pbuf->buf + 4;
+  res = proxy_ftp_data_ring_put(ring, pbuf);
+  fail_unless(res == 4, "Expected 4, got %d (%s)", res, strerror(errno));
+
+  mark_point();
+  res = proxy_ftp_data_ring_send(p, conn, ring, TRUE,
+    PROXY_FTP_DATA_FL_NONBLOCKING);
+  fail_unless(res == 4, "Expected 4, got %d (%s)", res, strerror(errno));
+
+  memset(buf, '\0', sizeof(buf));
+  res = read(fds[1], buf, sizeof(buf)-1);
+  fail_unless(res == 10, "Expected 10, got %d (%s)", res, strerror(errno));
+  fail_unless(strcmp(buf, "abcdefabcd") == 0,
+    "Expected 'abcdefabcd', got '%s'", buf);
+
+  mark_point();
+  res = proxy_ftp_data_ring_send(p, conn, ring, TRUE,
+    PROXY_FTP_DATA_FL_NONBLOCKING);
+  fail_unless(res == 0, "Expected 0, got %d (%s)", res, strerror(errno));
+
+  (void) close(fds[1]);
+  pr_inet_close(p, conn);
+}
+END_TEST
+
+START_TEST (splice_test) {
+  int res, *pipe_fds, src_fds[2], dst_fds[2];
+  conn_t *src_conn, *dst_conn;
+  char buf[32];
+
+  mark_point();
+  pipe_fds = proxy_ftp_data_splice_open(p);
+#if defined(HAVE_SPLICE)
+  fail_unless(pipe_fds != NULL, "Failed to open splice pipe: %s",
+    strerror(errno));
+#else
+  fail_unless(pipe_fds == NULL, "Opened splice pipe unexpectedly");
+  fail_unless(errno == ENOSYS, "Expected ENOSYS (%d), got %s (%d)", ENOSYS,
+    strerror(errno), errno);
+  return;
+#endif /* HAVE_SPLICE */
+
+  mark_point();
+  res = proxy_ftp_data_splice(NULL, NULL, NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = proxy_ftp_data_splice(p, NULL, NULL, pipe_fds);
+  fail_unless(res < 0, "Failed to handle null conns");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = socketpair(AF_UNIX, SOCK_STREAM, 0, src_fds);
+  fail_unless(res == 0, "Failed to create socketpair: %s", strerror(errno));
+
+  res = socketpair(AF_UNIX, SOCK_STREAM, 0, dst_fds);
+  fail_unless(res == 0, "Failed to create socketpair: %s", strerror(errno));
+
+  (void) fcntl(src_fds[0], F_SETFL, O_NONBLOCK);
+
+  src_conn = pr_inet_create_conn(p, -2, NULL, INPORT_ANY, FALSE);
+  fail_unless(src_conn != NULL, "Failed to create conn: %s", strerror(errno));
+  src_conn->instrm = pr_netio_open(p, PR_NETIO_STRM_DATA, src_fds[0],
+    PR_NETIO_IO_RD);
+
+  dst_conn = pr_inet_create_conn(p, -2, NULL, INPORT_ANY, FALSE);
+  fail_unless(dst_conn != NULL, "Failed to create conn: %s", strerror(errno));
+  dst_conn->outstrm = pr_netio_open(p, PR_NETIO_STRM_DATA, dst_fds[0],
+    PR_NETIO_IO_WR);
+
+  mark_point();
+  res = proxy_ftp_data_splice(p, src_conn, dst_conn, pipe_fds);
+  fail_unless(res < 0, "Spliced data unexpectedly");
+  fail_unless(errno == EAGAIN, "Expected EAGAIN (%d), got %s (%d)", EAGAIN,
+    strerror(errno), errno);
+
+  res = write(src_fds[1], "foobar", 6);
+  fail_unless(res == 6, "Failed to write data: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_ftp_data_splice(p, src_conn, dst_conn, pipe_fds);
+  fail_unless(res == 6, "Expected 6, got %d (%s)", res, strerror(errno));
+
+  memset(buf, '\0', sizeof(buf));
+  res = read(dst_fds[1], buf, sizeof(buf)-1);
+  fail_unless(res == 6, "Expected 6, got %d (%s)", res, strerror(errno));
+  fail_unless(strcmp(buf, "foobar") == 0, "Expected 'foobar', got '%s'", buf);
+
+  (void) close(src_fds[1]);
+
+  mark_point();
+  res = proxy_ftp_data_splice(p, src_conn, dst_conn, pipe_fds);
+  fail_unless(res == 0, "Expected EOF, got %d (%s)", res, strerror(errno));
+
+  (void) close(dst_fds[1]);
+  pr_inet_close(p, src_conn);
+  pr_inet_close(p, dst_conn);
+}
+END_TEST
+
 Suite *tests_get_ftp_data_suite(void) {
   Suite *suite;
   TCase *testcase;
@@ -175,7 +382,10 @@ Suite *tests_get_ftp_data_suite(void) {
   tcase_add_checked_fixture(testcase, set_up, tear_down);
 
   tcase_add_test(testcase, recv_test);
+  tcase_add_test(testcase, set_bufsz_test);
   tcase_add_test(testcase, send_test);
+  tcase_add_test(testcase, ring_test);
+  tcase_add_test(testcase, splice_test);
 
   suite_add_tcase(suite, testcase);
   return suite;
@@ -81,6 +81,42 @@ START_TEST (get_feat_test) {
 }
 END_TEST
 
+START_TEST (set_feat_test) {
+  int res;
+  const struct proxy_session *proxy_sess = NULL;
+  const char *val;
+
+  res = proxy_ftp_sess_set_feat(NULL, NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  proxy_sess = proxy_session_alloc(p);
+
+  res = proxy_ftp_sess_set_feat(p, proxy_sess, NULL);
+  fail_unless(res < 0, "Failed to handle null text");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = proxy_ftp_sess_set_feat(p, proxy_sess,
+    "-Features:\r\n AUTH TLS\r\n MDTM\r\n");
+  fail_unless(res == 0, "Failed to set features: %s", strerror(errno));
+
+  val = pr_table_get(proxy_sess->backend_features, "AUTH", NULL);
+  fail_unless(val != NULL, "Expected AUTH feature");
+  fail_unless(strcmp(val, "TLS") == 0, "Expected 'TLS', got '%s'", val);
+
+  val = pr_table_get(proxy_sess->backend_features, "MDTM", NULL);
+  fail_unless(val != NULL, "Expected MDTM feature");
+
+  val = pr_table_get(proxy_sess->backend_features, "-Features:", NULL);
+  fail_unless(val == NULL, "Unexpected non-feature line");
+
+  proxy_session_free(p, proxy_sess);
+}
+END_TEST
+
 START_TEST (send_auth_tls_test) {
   int res;
   const struct proxy_session *proxy_sess = NULL;
@@ -168,6 +204,7 @@ Suite *tests_get_ftp_sess_suite(void) {
   tcase_add_checked_fixture(testcase, set_up, tear_down);
 
   tcase_add_test(testcase, get_feat_test);
+  tcase_add_test(testcase, set_feat_test);
   tcase_add_test(testcase, send_auth_tls_test);
   tcase_add_test(testcase, send_host_test);
   tcase_add_test(testcase, send_pbsz_prot_test);
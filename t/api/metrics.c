@@ -0,0 +1,241 @@
+/*
+ * ProFTPD - mod_proxy testsuite
+ * Copyright (c) 2020 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Metrics API tests. */
+
+#include "tests.h"
+
+static pool *p = NULL;
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("proxy.metrics", 1, 20);
+  }
+}
+
+static void tear_down(void) {
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("proxy.metrics", 0, 0);
+  }
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+START_TEST (xfer_start_test) {
+  int res;
+  const struct proxy_metrics_xfer *metrics;
+
+  mark_point();
+  res = proxy_metrics_xfer_start(NULL, NULL, 0, NULL);
+  fail_unless(res < 0, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = proxy_metrics_xfer_start(p, NULL, 0, NULL);
+  fail_unless(res < 0, "Failed to handle null command");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = proxy_metrics_xfer_start(p, "RETR", PR_NETIO_IO_RD,
+    "ftp://127.0.0.1:21");
+  fail_unless(res == 0, "Failed to start metrics: %s", strerror(errno));
+
+  metrics = proxy_metrics_xfer_get();
+  fail_unless(metrics != NULL, "Failed to get metrics: %s", strerror(errno));
+  fail_unless(strcmp(metrics->cmd, "RETR") == 0, "Expected 'RETR', got '%s'",
+    metrics->cmd);
+  fail_unless(metrics->ttfb_ms == -1, "Expected TTFB -1, got %ld",
+    metrics->ttfb_ms);
+
+  res = proxy_metrics_xfer_finish(p, 0, 0);
+  fail_unless(res == 0, "Failed to finish metrics: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (xfer_incr_test) {
+  int res;
+  const struct proxy_metrics_xfer *metrics;
+
+  mark_point();
+  metrics = proxy_metrics_xfer_get();
+  fail_unless(metrics == NULL, "Failed to handle missing metrics");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  errno = EBADF;
+  res = proxy_metrics_xfer_incr(PROXY_METRICS_XFER_READ_CALLS, 1);
+  fail_unless(res == 0, "Failed to ignore missing metrics: %s",
+    strerror(errno));
+  fail_unless(errno == EBADF, "Expected errno EBADF (%d), got %s (%d)", EBADF,
+    strerror(errno), errno);
+
+  res = proxy_metrics_xfer_start(p, "STOR", PR_NETIO_IO_WR, NULL);
+  fail_unless(res == 0, "Failed to start metrics: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_metrics_xfer_incr(-1, 1);
+  fail_unless(res < 0, "Failed to handle unknown counter");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = proxy_metrics_xfer_incr(PROXY_METRICS_XFER_BACKEND_BYTES_IN, 10);
+  fail_unless(res == 0, "Failed to increment counter: %s", strerror(errno));
+
+  res = proxy_metrics_xfer_incr(PROXY_METRICS_XFER_BACKEND_BYTES_IN, 5);
+  fail_unless(res == 0, "Failed to increment counter: %s", strerror(errno));
+
+  res = proxy_metrics_xfer_incr(PROXY_METRICS_XFER_EAGAIN, 2);
+  fail_unless(res == 0, "Failed to increment counter: %s", strerror(errno));
+
+  metrics = proxy_metrics_xfer_get();
+  fail_unless(metrics != NULL, "Failed to get metrics: %s", strerror(errno));
+  fail_unless(metrics->backend_bytes_in == 15, "Expected 15, got %lu",
+    (unsigned long) metrics->backend_bytes_in);
+  fail_unless(metrics->eagain_count == 2, "Expected 2, got %lu",
+    metrics->eagain_count);
+  fail_unless(metrics->ttfb_ms >= 0, "Expected TTFB, got %ld",
+    metrics->ttfb_ms);
+
+  mark_point();
+  res = proxy_metrics_xfer_finish(NULL, 0, 0);
+  fail_unless(res < 0, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = proxy_metrics_xfer_finish(p, 0, 0);
+  fail_unless(res == 0, "Failed to finish metrics: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_metrics_xfer_finish(p, 0, 0);
+  fail_unless(res < 0, "Failed to handle missing metrics");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+}
+END_TEST
+
+START_TEST (xfer_set_tls_handshake_test) {
+  int res;
+  const struct proxy_metrics_xfer *metrics;
+  char *text;
+
+  mark_point();
+  res = proxy_metrics_xfer_set_tls_handshake(TRUE, 5);
+  fail_unless(res == 0, "Failed to ignore missing metrics: %s",
+    strerror(errno));
+
+  res = proxy_metrics_xfer_start(p, "RETR", PR_NETIO_IO_RD, NULL);
+  fail_unless(res == 0, "Failed to start metrics: %s", strerror(errno));
+
+  metrics = proxy_metrics_xfer_get();
+  fail_unless(metrics != NULL, "Failed to get metrics: %s", strerror(errno));
+  fail_unless(metrics->tls_resumed == -1, "Expected -1, got %d",
+    metrics->tls_resumed);
+  fail_unless(metrics->tls_handshake_ms == -1, "Expected -1, got %ld",
+    metrics->tls_handshake_ms);
+
+  text = proxy_metrics_xfer_to_json(p, metrics);
+  fail_unless(text != NULL, "Failed to get JSON text: %s", strerror(errno));
+  fail_unless(strstr(text, "\"tls_resumed\"") == NULL,
+    "Expected no tls_resumed in '%s'", text);
+
+  mark_point();
+  res = proxy_metrics_xfer_set_tls_handshake(TRUE, -1);
+  fail_unless(res < 0, "Failed to handle negative handshake time");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = proxy_metrics_xfer_set_tls_handshake(TRUE, 7);
+  fail_unless(res == 0, "Failed to set TLS handshake: %s", strerror(errno));
+  fail_unless(metrics->tls_resumed == TRUE, "Expected TRUE, got %d",
+    metrics->tls_resumed);
+  fail_unless(metrics->tls_handshake_ms == 7, "Expected 7, got %ld",
+    metrics->tls_handshake_ms);
+
+  text = proxy_metrics_xfer_to_json(p, metrics);
+  fail_unless(text != NULL, "Failed to get JSON text: %s", strerror(errno));
+  fail_unless(strstr(text, "\"tls_resumed\":true") != NULL,
+    "Expected tls_resumed in '%s'", text);
+  fail_unless(strstr(text, "\"tls_handshake_ms\":7") != NULL,
+    "Expected tls_handshake_ms in '%s'", text);
+
+  res = proxy_metrics_xfer_finish(p, 0, 0);
+  fail_unless(res == 0, "Failed to finish metrics: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (xfer_to_json_test) {
+  char *text;
+  struct proxy_metrics_xfer metrics;
+
+  mark_point();
+  text = proxy_metrics_xfer_to_json(NULL, NULL);
+  fail_unless(text == NULL, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  memset(&metrics, 0, sizeof(metrics));
+  metrics.cmd = "RETR";
+  metrics.direction = PR_NETIO_IO_RD;
+  metrics.backend_bytes_in = 1024;
+
+  mark_point();
+  text = proxy_metrics_xfer_to_json(p, &metrics);
+  fail_unless(text != NULL, "Failed to get JSON text: %s", strerror(errno));
+  fail_unless(strstr(text, "\"command\":\"RETR\"") != NULL,
+    "Expected command in '%s'", text);
+  fail_unless(strstr(text, "\"backend_bytes_in\":1024") != NULL,
+    "Expected backend_bytes_in in '%s'", text);
+  fail_unless(strstr(text, "\"error\"") == NULL,
+    "Expected no error in '%s'", text);
+}
+END_TEST
+
+Suite *tests_get_metrics_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("metrics");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, xfer_start_test);
+  tcase_add_test(testcase, xfer_incr_test);
+  tcase_add_test(testcase, xfer_set_tls_handshake_test);
+  tcase_add_test(testcase, xfer_to_json_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -903,6 +903,48 @@ START_TEST (reverse_json_parse_uris_usable_test) {
 }
 END_TEST
 
+START_TEST (reverse_json_parse_uris_weighted_test) {
+  array_header *uris;
+  const struct proxy_conn *pconn;
+  const char *uri;
+  FILE *fh = NULL;
+  int res;
+  unsigned int expected;
+
+  test_cleanup(p);
+  fh = test_prep();
+
+  /* Only the first object has a usable weight. */
+  fprintf(fh, "[ { \"uri\": \"ftp://127.0.0.1:2121\", \"weight\": 4 },\n");
+  fprintf(fh, "{ \"uri\": \"ftp://127.0.0.1:2122\", \"weight\": 2.5 },\n");
+  fprintf(fh, "{ \"uri\": \"ftp://127.0.0.1:2123\", \"weight\": 1e20 },\n");
+  fprintf(fh, "{ \"uri\": \"ftp://127.0.0.1:2124\", \"weight\": 0 } ]\n");
+
+  res = fclose(fh);
+  fail_if(res < 0, "Failed to write file '%s': %s", test_file,
+    strerror(errno));
+
+  mark_point();
+  uris = proxy_reverse_json_parse_uris(p, test_file);
+  fail_unless(uris != NULL, "Did not receive parsed list as expected");
+
+  expected = 1;
+  fail_unless(uris->nelts == expected, "Expected %d elements, found %d",
+    expected, uris->nelts);
+
+  pconn = ((const struct proxy_conn **) uris->elts)[0];
+  fail_unless(proxy_conn_get_weight(pconn) == 4, "Expected weight 4, got %u",
+    proxy_conn_get_weight(pconn));
+
+  /* The weight is not part of the backend's URI. */
+  uri = proxy_conn_get_uri(pconn);
+  fail_unless(strcmp(uri, "ftp://127.0.0.1:2121") == 0,
+    "Expected URI 'ftp://127.0.0.1:2121', got '%s'", uri);
+
+  test_cleanup(p);
+}
+END_TEST
+
 START_TEST (reverse_connect_get_policy_test) {
   int res;
   const char *policy;
@@ -963,6 +1005,341 @@ START_TEST (reverse_connect_get_policy_test) {
   res = proxy_reverse_connect_get_policy(policy);
   fail_unless(res == PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME,
     "Failed to handle supported policy '%s'", policy);
+
+  policy = "weightedroundrobin";
+  res = proxy_reverse_connect_get_policy(policy);
+  fail_unless(res == PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_ROUND_ROBIN,
+    "Failed to handle supported policy '%s'", policy);
+
+  policy = "weightedrandom";
+  res = proxy_reverse_connect_get_policy(policy);
+  fail_unless(res == PROXY_REVERSE_CONNECT_POLICY_WEIGHTED_RANDOM,
+    "Failed to handle supported policy '%s'", policy);
+
+  policy = "consistenthash";
+  res = proxy_reverse_connect_get_policy(policy);
+  fail_unless(res == PROXY_REVERSE_CONNECT_POLICY_CONSISTENT_HASH,
+    "Failed to handle supported policy '%s'", policy);
+
+  policy = "leasttransfers";
+  res = proxy_reverse_connect_get_policy(policy);
+  fail_unless(res == PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS,
+    "Failed to handle supported policy '%s'", policy);
+}
+END_TEST
+
+START_TEST (reverse_weighted_test) {
+  register unsigned int i;
+  int idx, *ids, usable[3], counts[3];
+  array_header *backends, *schedule, *cached;
+  const struct proxy_conn *pconn;
+
+  mark_point();
+  schedule = proxy_reverse_wrr_schedule(p, NULL);
+  fail_unless(schedule == NULL, "Failed to handle null backends");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  idx = proxy_reverse_weighted_random(NULL, NULL);
+  fail_unless(idx < 0, "Failed to handle null backends");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  backends = make_array(p, 3, sizeof(struct proxy_conn *));
+
+  pconn = proxy_conn_create(p, "ftp://127.0.0.1:2121?weight=5");
+  fail_unless(pconn != NULL, "Failed to create pconn: %s", strerror(errno));
+  *((const struct proxy_conn **) push_array(backends)) = pconn;
+
+  pconn = proxy_conn_create(p, "ftp://127.0.0.1:2122");
+  fail_unless(pconn != NULL, "Failed to create pconn: %s", strerror(errno));
+  *((const struct proxy_conn **) push_array(backends)) = pconn;
+
+  pconn = proxy_conn_create(p, "ftp://127.0.0.1:2123");
+  fail_unless(pconn != NULL, "Failed to create pconn: %s", strerror(errno));
+  *((const struct proxy_conn **) push_array(backends)) = pconn;
+
+  /* The nginx smooth weighted round-robin sequence for weights 5, 1, 1 is:
+   * a, a, b, a, c, a, a.
+   */
+  schedule = proxy_reverse_wrr_schedule(p, backends);
+  fail_unless(schedule != NULL, "Failed to get schedule: %s", strerror(errno));
+  fail_unless(schedule->nelts == 7, "Expected 7 entries, got %u",
+    schedule->nelts);
+
+  ids = schedule->elts;
+  fail_unless(ids[0] == 0 && ids[1] == 0 && ids[2] == 1 && ids[3] == 0 &&
+    ids[4] == 2 && ids[5] == 0 && ids[6] == 0,
+    "Unexpected schedule %d,%d,%d,%d,%d,%d,%d", ids[0], ids[1], ids[2],
+    ids[3], ids[4], ids[5], ids[6]);
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < 100; i++) {
+    idx = proxy_reverse_weighted_random(backends, NULL);
+    fail_unless(idx >= 0 && idx < 3, "Unexpected index %d", idx);
+    counts[idx]++;
+  }
+
+  fail_unless(counts[0] > counts[1] && counts[0] > counts[2],
+    "Expected heaviest backend to be chosen most (%d, %d, %d)", counts[0],
+    counts[1], counts[2]);
+
+  /* Unusable backends are skipped... */
+  usable[0] = FALSE;
+  usable[1] = TRUE;
+  usable[2] = FALSE;
+  for (i = 0; i < 10; i++) {
+    idx = proxy_reverse_weighted_random(backends, usable);
+    fail_unless(idx == 1, "Expected index 1, got %d", idx);
+  }
+
+  /* ...unless none of them are usable. */
+  usable[1] = FALSE;
+  idx = proxy_reverse_weighted_random(backends, usable);
+  fail_unless(idx >= 0 && idx < 3, "Unexpected index %d", idx);
+
+  mark_point();
+  schedule = proxy_reverse_wrr_get_schedule(NULL);
+  fail_unless(schedule == NULL, "Failed to handle null backends");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* The schedule is computed once, and reused while the weights are the
+   * same...
+   */
+  cached = proxy_reverse_wrr_get_schedule(backends);
+  fail_unless(cached != NULL, "Failed to get schedule: %s", strerror(errno));
+  fail_unless(cached->nelts == 7, "Expected 7 entries, got %u", cached->nelts);
+
+  schedule = proxy_reverse_wrr_get_schedule(backends);
+  fail_unless(schedule == cached, "Expected cached schedule");
+
+  /* ...and recomputed when they change. */
+  pconn = proxy_conn_create(p, "ftp://127.0.0.1:2123?weight=3");
+  fail_unless(pconn != NULL, "Failed to create pconn: %s", strerror(errno));
+  ((const struct proxy_conn **) backends->elts)[2] = pconn;
+
+  schedule = proxy_reverse_wrr_get_schedule(backends);
+  fail_unless(schedule != NULL, "Failed to get schedule: %s", strerror(errno));
+  fail_unless(schedule->nelts == 9, "Expected 9 entries, got %u",
+    schedule->nelts);
+}
+END_TEST
+
+START_TEST (reverse_chash_test) {
+  register unsigned int i;
+  int res, idx, mapped[100], usable[3];
+  long conn_counts[3];
+  array_header *backends;
+  const struct proxy_conn *pconn;
+  struct proxy_reverse_chash_ring *ring;
+
+  mark_point();
+  res = proxy_reverse_chash_get_key(NULL);
+  fail_unless(res < 0, "Failed to handle null key name");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = proxy_reverse_chash_get_key("foo");
+  fail_unless(res < 0, "Failed to handle unknown key name");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got '%s' (%d)", ENOENT,
+    strerror(errno), errno);
+
+  res = proxy_reverse_chash_get_key("User");
+  fail_unless(res == PROXY_REVERSE_CHASH_KEY_USER,
+    "Expected user key (%d), got %d", PROXY_REVERSE_CHASH_KEY_USER, res);
+
+  ring = proxy_reverse_chash_ring_create(p, NULL);
+  fail_unless(ring == NULL, "Failed to handle null backends");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  backends = make_array(p, 3, sizeof(struct proxy_conn *));
+
+  pconn = proxy_conn_create(p, "ftp://127.0.0.1:2121");
+  fail_unless(pconn != NULL, "Failed to create pconn: %s", strerror(errno));
+  *((const struct proxy_conn **) push_array(backends)) = pconn;
+
+  pconn = proxy_conn_create(p, "ftp://127.0.0.1:2122");
+  fail_unless(pconn != NULL, "Failed to create pconn: %s", strerror(errno));
+  *((const struct proxy_conn **) push_array(backends)) = pconn;
+
+  pconn = proxy_conn_create(p, "ftp://127.0.0.1:2123");
+  fail_unless(pconn != NULL, "Failed to create pconn: %s", strerror(errno));
+  *((const struct proxy_conn **) push_array(backends)) = pconn;
+
+  ring = proxy_reverse_chash_ring_create(p, backends);
+  fail_unless(ring != NULL, "Failed to create ring: %s", strerror(errno));
+  fail_unless(ring->point_count == 3 * PROXY_REVERSE_CHASH_POINTS_PER_WEIGHT,
+    "Unexpected point count %u", ring->point_count);
+
+  for (i = 0; i < 100; i++) {
+    const char *key;
+
+    key = pstrcat(p, "user", pr_ltoa(i), NULL);
+    mapped[i] = proxy_reverse_chash_ring_lookup(p, ring, key, NULL, NULL);
+    fail_unless(mapped[i] >= 0 && mapped[i] < 3, "Unexpected index %d",
+      mapped[i]);
+
+    idx = proxy_reverse_chash_ring_lookup(p, ring, key, NULL, NULL);
+    fail_unless(idx == mapped[i], "Expected index %d for key '%s', got %d",
+      mapped[i], key, idx);
+  }
+
+  /* Removing a backend only remaps the keys which mapped to it. */
+  backends->nelts = 2;
+  ring = proxy_reverse_chash_ring_create(p, backends);
+  fail_unless(ring != NULL, "Failed to create ring: %s", strerror(errno));
+
+  for (i = 0; i < 100; i++) {
+    const char *key;
+
+    key = pstrcat(p, "user", pr_ltoa(i), NULL);
+    idx = proxy_reverse_chash_ring_lookup(p, ring, key, NULL, NULL);
+    if (mapped[i] != 2) {
+      fail_unless(idx == mapped[i], "Expected index %d for key '%s', got %d",
+        mapped[i], key, idx);
+    }
+  }
+
+  backends->nelts = 3;
+  ring = proxy_reverse_chash_ring_create(p, backends);
+  fail_unless(ring != NULL, "Failed to create ring: %s", strerror(errno));
+
+  /* An overloaded backend passes its keys on... */
+  conn_counts[0] = 10;
+  conn_counts[1] = conn_counts[2] = 0;
+  for (i = 0; i < 100; i++) {
+    const char *key;
+
+    key = pstrcat(p, "user", pr_ltoa(i), NULL);
+    idx = proxy_reverse_chash_ring_lookup(p, ring, key, conn_counts, NULL);
+    fail_unless(idx == 1 || idx == 2, "Expected index 1 or 2, got %d", idx);
+    if (mapped[i] != 0) {
+      fail_unless(idx == mapped[i], "Expected index %d for key '%s', got %d",
+        mapped[i], key, idx);
+    }
+  }
+
+  /* ...as does an unusable backend, unless none of them are usable. */
+  usable[0] = usable[2] = FALSE;
+  usable[1] = TRUE;
+  idx = proxy_reverse_chash_ring_lookup(p, ring, "user0", NULL, usable);
+  fail_unless(idx == 1, "Expected index 1, got %d", idx);
+
+  usable[1] = FALSE;
+  idx = proxy_reverse_chash_ring_lookup(p, ring, "user0", NULL, usable);
+  fail_unless(idx == mapped[0], "Expected index %d, got %d", mapped[0], idx);
+}
+END_TEST
+
+START_TEST (reverse_perhost_test) {
+  int res;
+  struct proxy_reverse_perhost_prefix prefix;
+  struct proxy_reverse_perhost_tree *tree;
+  const struct proxy_reverse_perhost_prefix *found;
+  const struct proxy_conn *pconn8, *pconn16;
+  const pr_netaddr_t *addr;
+  const char *key;
+
+  mark_point();
+  res = proxy_reverse_perhost_parse_prefix(NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null text");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = proxy_reverse_perhost_parse_prefix("foo", &prefix);
+  fail_unless(res < 0, "Failed to handle invalid address");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = proxy_reverse_perhost_parse_prefix("10.0.0.0/33", &prefix);
+  fail_unless(res < 0, "Failed to handle invalid prefix length");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = proxy_reverse_perhost_parse_prefix("10.1.2.3", &prefix);
+  fail_unless(res == 0, "Failed to parse address: %s", strerror(errno));
+  fail_unless(prefix.len == 32, "Expected length 32, got %u", prefix.len);
+
+  /* Host bits beyond the prefix length are cleared. */
+  res = proxy_reverse_perhost_parse_prefix("10.1.2.3/8", &prefix);
+  fail_unless(res == 0, "Failed to parse prefix: %s", strerror(errno));
+  fail_unless(prefix.family == AF_INET, "Expected AF_INET, got %d",
+    prefix.family);
+  fail_unless(prefix.len == 8, "Expected length 8, got %u", prefix.len);
+  fail_unless(prefix.addr[0] == 10 && prefix.addr[1] == 0,
+    "Expected host bits to be cleared");
+
+  tree = proxy_reverse_perhost_tree_create(p);
+  fail_unless(tree != NULL, "Failed to create tree: %s", strerror(errno));
+
+  res = proxy_reverse_perhost_tree_add(p, tree, NULL);
+  fail_unless(res < 0, "Failed to handle null prefix");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  pconn8 = proxy_conn_create(p, "ftp://127.0.0.1:2121");
+  fail_unless(pconn8 != NULL, "Failed to create pconn: %s", strerror(errno));
+  prefix.pconn = pconn8;
+
+  res = proxy_reverse_perhost_tree_add(p, tree, &prefix);
+  fail_unless(res == 0, "Failed to add prefix: %s", strerror(errno));
+
+  res = proxy_reverse_perhost_parse_prefix("10.1.0.0/16", &prefix);
+  fail_unless(res == 0, "Failed to parse prefix: %s", strerror(errno));
+
+  pconn16 = proxy_conn_create(p, "ftp://127.0.0.1:2122");
+  fail_unless(pconn16 != NULL, "Failed to create pconn: %s", strerror(errno));
+  prefix.pconn = pconn16;
+
+  res = proxy_reverse_perhost_tree_add(p, tree, &prefix);
+  fail_unless(res == 0, "Failed to add prefix: %s", strerror(errno));
+
+  /* The longest matching prefix wins. */
+  addr = pr_netaddr_get_addr(p, "10.1.2.3", NULL);
+  fail_unless(addr != NULL, "Failed to get addr: %s", strerror(errno));
+
+  found = proxy_reverse_perhost_tree_lookup(p, tree, addr);
+  fail_unless(found != NULL, "Failed to find prefix: %s", strerror(errno));
+  fail_unless(found->pconn == pconn16, "Expected /16 prefix, got /%u",
+    found->len);
+
+  addr = pr_netaddr_get_addr(p, "10.2.3.4", NULL);
+  fail_unless(addr != NULL, "Failed to get addr: %s", strerror(errno));
+
+  found = proxy_reverse_perhost_tree_lookup(p, tree, addr);
+  fail_unless(found != NULL, "Failed to find prefix: %s", strerror(errno));
+  fail_unless(found->pconn == pconn8, "Expected /8 prefix, got /%u",
+    found->len);
+
+  addr = pr_netaddr_get_addr(p, "192.168.0.1", NULL);
+  fail_unless(addr != NULL, "Failed to get addr: %s", strerror(errno));
+
+  found = proxy_reverse_perhost_tree_lookup(p, tree, addr);
+  fail_unless(found == NULL, "Found unexpected prefix");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got '%s' (%d)", ENOENT,
+    strerror(errno), errno);
+
+  key = proxy_reverse_perhost_key(p, addr, 24, 64);
+  fail_unless(key != NULL, "Failed to get key: %s", strerror(errno));
+  fail_unless(strcmp(key, "192.168.0.0/24") == 0,
+    "Expected '192.168.0.0/24', got '%s'", key);
+
+  key = proxy_reverse_perhost_key(p, addr, 32, 128);
+  fail_unless(key != NULL, "Failed to get key: %s", strerror(errno));
+  fail_unless(strcmp(key, "192.168.0.1") == 0,
+    "Expected '192.168.0.1', got '%s'", key);
+
+#ifdef PR_USE_IPV6
+  addr = pr_netaddr_get_addr(p, "2001:db8:1:2:3:4:5:6", NULL);
+  fail_unless(addr != NULL, "Failed to get addr: %s", strerror(errno));
+
+  key = proxy_reverse_perhost_key(p, addr, 24, 64);
+  fail_unless(key != NULL, "Failed to get key: %s", strerror(errno));
+  fail_unless(strcmp(key, "2001:db8:1:2::/64") == 0,
+    "Expected '2001:db8:1:2::/64', got '%s'", key);
+#endif /* PR_USE_IPV6 */
 }
 END_TEST
 
@@ -989,6 +1366,743 @@ START_TEST (reverse_have_authenticated_test) {
 }
 END_TEST
 
+START_TEST (reverse_latency_test) {
+  int idx;
+  unsigned int bucket;
+  long max_ms;
+  double ewma_ms;
+  const char *name;
+  struct proxy_reverse_backend_load loads[3];
+
+  name = proxy_reverse_latency_name(PROXY_REVERSE_LATENCY_LOGIN);
+  fail_unless(strcmp(name, "login") == 0, "Expected 'login', got '%s'", name);
+
+  bucket = proxy_reverse_latency_bucket(10);
+  fail_unless(bucket == 0, "Expected bucket 0, got %u", bucket);
+
+  bucket = proxy_reverse_latency_bucket(11);
+  fail_unless(bucket == 1, "Expected bucket 1, got %u", bucket);
+
+  bucket = proxy_reverse_latency_bucket(60000);
+  fail_unless(bucket == PROXY_REVERSE_LATENCY_BUCKET_COUNT-1,
+    "Expected bucket %u, got %u", PROXY_REVERSE_LATENCY_BUCKET_COUNT-1, bucket);
+
+  max_ms = proxy_reverse_latency_bucket_max(0);
+  fail_unless(max_ms == 10, "Expected 10, got %ld", max_ms);
+
+  max_ms = proxy_reverse_latency_bucket_max(PROXY_REVERSE_LATENCY_BUCKET_COUNT-1);
+  fail_unless(max_ms == -1, "Expected -1, got %ld", max_ms);
+
+  /* The first sample seeds the average. */
+  ewma_ms = proxy_reverse_latency_ewma(0.0, 0, 100);
+  fail_unless(ewma_ms == 100.0, "Expected 100.0, got %0.2f", ewma_ms);
+
+  ewma_ms = proxy_reverse_latency_ewma(ewma_ms, 1, 500);
+  fail_unless(ewma_ms == 200.0, "Expected 200.0, got %0.2f", ewma_ms);
+
+  mark_point();
+  idx = proxy_reverse_latency_choose(NULL, 0);
+  fail_unless(idx < 0, "Failed to handle null loads");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  memset(loads, 0, sizeof(loads));
+  loads[0].backend_id = 0;
+  loads[0].usable = TRUE;
+  loads[0].conn_count = 1;
+  loads[0].latency_ms = 100.0;
+  loads[1].backend_id = 1;
+  loads[1].usable = TRUE;
+  loads[1].conn_count = 4;
+  loads[1].latency_ms = 10.0;
+
+  idx = proxy_reverse_latency_choose(loads, 2);
+  fail_unless(idx == 1, "Expected index 1, got %d", idx);
+
+  /* Unmeasured backends are preferred. */
+  loads[0].latency_ms = 0.0;
+  idx = proxy_reverse_latency_choose(loads, 2);
+  fail_unless(idx == 0, "Expected index 0, got %d", idx);
+
+  /* Unusable backends are not chosen... */
+  loads[0].usable = FALSE;
+  idx = proxy_reverse_latency_choose(loads, 2);
+  fail_unless(idx == 1, "Expected index 1, got %d", idx);
+
+  loads[2].backend_id = 2;
+  loads[2].usable = FALSE;
+  idx = proxy_reverse_latency_choose(loads, 3);
+  fail_unless(idx == 1, "Expected index 1, got %d", idx);
+
+  /* ...unless none of them are usable. */
+  loads[1].usable = FALSE;
+  idx = proxy_reverse_latency_choose(loads, 2);
+  fail_unless(idx == 0, "Expected index 0, got %d", idx);
+}
+END_TEST
+
+START_TEST (reverse_xfer_test) {
+  int idx;
+  uint64_t window;
+  double rate;
+  struct proxy_reverse_backend_xfers xfers[3];
+
+  window = proxy_reverse_xfer_window(25000);
+  fail_unless(window == 2, "Expected window 2, got %llu",
+    (unsigned long long) window);
+
+  /* At the start of a window, the previous window counts in full... */
+  rate = proxy_reverse_xfer_rate(20000, 2, 0, 100000);
+  fail_unless(rate == 10000.0, "Expected 10000.00, got %0.2f", rate);
+
+  /* ...and then less, as the window moves on. */
+  rate = proxy_reverse_xfer_rate(25000, 2, 50000, 100000);
+  fail_unless(rate == 10000.0, "Expected 10000.00, got %0.2f", rate);
+
+  rate = proxy_reverse_xfer_rate(35000, 2, 50000, 100000);
+  fail_unless(rate == 2500.0, "Expected 2500.00, got %0.2f", rate);
+
+  /* Bytes counted long ago do not count. */
+  rate = proxy_reverse_xfer_rate(45000, 2, 50000, 100000);
+  fail_unless(rate == 0.0, "Expected 0.00, got %0.2f", rate);
+
+  mark_point();
+  idx = proxy_reverse_xfer_choose(NULL, 0);
+  fail_unless(idx < 0, "Failed to handle null transfers");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  memset(xfers, 0, sizeof(xfers));
+  xfers[0].backend_id = 0;
+  xfers[0].usable = TRUE;
+  xfers[0].conn_count = 1;
+  xfers[0].xfer_count = 2;
+  xfers[1].backend_id = 1;
+  xfers[1].usable = TRUE;
+  xfers[1].conn_count = 100;
+  xfers[1].xfer_count = 1;
+  xfers[1].xfer_rate = 1000.0;
+
+  /* Fewer transfers in flight win over fewer connections... */
+  idx = proxy_reverse_xfer_choose(xfers, 2);
+  fail_unless(idx == 1, "Expected index 1, got %d", idx);
+
+  /* ...and then a lower rate. */
+  xfers[0].xfer_count = 1;
+  xfers[0].xfer_rate = 10.0;
+  idx = proxy_reverse_xfer_choose(xfers, 2);
+  fail_unless(idx == 0, "Expected index 0, got %d", idx);
+
+  /* Unusable backends are not chosen... */
+  xfers[0].usable = FALSE;
+  idx = proxy_reverse_xfer_choose(xfers, 2);
+  fail_unless(idx == 1, "Expected index 1, got %d", idx);
+
+  xfers[2].backend_id = 2;
+  xfers[2].usable = FALSE;
+  idx = proxy_reverse_xfer_choose(xfers, 3);
+  fail_unless(idx == 1, "Expected index 1, got %d", idx);
+
+  /* ...unless none of them are usable. */
+  xfers[1].usable = FALSE;
+  idx = proxy_reverse_xfer_choose(xfers, 3);
+  fail_unless(idx == 2, "Expected index 2, got %d", idx);
+}
+END_TEST
+
+START_TEST (reverse_lease_test) {
+  int res;
+  pid_t pid;
+  const char *text;
+  struct proxy_reverse_lease lease, parsed;
+
+  mark_point();
+  res = proxy_reverse_lease_get(NULL);
+  fail_unless(res < 0, "Failed to handle null lease");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = proxy_reverse_lease_get(&lease);
+  fail_unless(res == 0, "Failed to get lease: %s", strerror(errno));
+  fail_unless(lease.pid == getpid(), "Expected pid %lu, got %lu",
+    (unsigned long) getpid(), (unsigned long) lease.pid);
+
+  res = proxy_reverse_lease_is_live(&lease);
+  fail_unless(res == TRUE, "Expected our own lease to be live");
+
+  text = proxy_reverse_lease_text(p, &lease);
+  fail_unless(text != NULL, "Failed to format lease: %s", strerror(errno));
+
+  memset(&parsed, 0, sizeof(parsed));
+  res = proxy_reverse_lease_parse(text, &parsed);
+  fail_unless(res == 0, "Failed to parse lease '%s': %s", text,
+    strerror(errno));
+  fail_unless(parsed.pid == lease.pid, "Expected pid %lu, got %lu",
+    (unsigned long) lease.pid, (unsigned long) parsed.pid);
+  fail_unless(parsed.start == lease.start, "Expected start %llu, got %llu",
+    (unsigned long long) lease.start, (unsigned long long) parsed.start);
+
+  res = proxy_reverse_lease_parse("foo", &parsed);
+  fail_unless(res < 0, "Failed to handle malformed lease");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = proxy_reverse_lease_parse("123:foo", &parsed);
+  fail_unless(res < 0, "Failed to handle malformed lease");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* A lease whose holder has exited is not live. */
+  pid = fork();
+  fail_unless(pid >= 0, "Failed to fork: %s", strerror(errno));
+  if (pid == 0) {
+    _exit(0);
+  }
+
+  (void) waitpid(pid, NULL, 0);
+
+  lease.pid = pid;
+  lease.start = 0;
+  res = proxy_reverse_lease_is_live(&lease);
+  fail_unless(res == FALSE, "Expected lease of exited process to be dead");
+
+  /* Nor is the lease of an earlier process with our process ID. */
+  res = proxy_reverse_lease_get(&lease);
+  fail_unless(res == 0, "Failed to get lease: %s", strerror(errno));
+  if (lease.start > 0) {
+    lease.start--;
+    res = proxy_reverse_lease_is_live(&lease);
+    fail_unless(res == FALSE, "Expected lease with other start to be dead");
+  }
+}
+END_TEST
+
+START_TEST (reverse_shm_datastore_test) {
+  int backend_id, res, flags = PROXY_DB_OPEN_FL_SKIP_VACUUM;
+  struct proxy_reverse_datastore ds;
+  config_rec *c;
+  array_header *backends;
+  const struct proxy_conn *pconn;
+  void *dsh;
+  FILE *fh;
+
+  mark_point();
+  res = proxy_reverse_shm_as_datastore(NULL, NULL, 0);
+  fail_unless(res < 0, "Failed to handle null datastore");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  memset(&ds, 0, sizeof(ds));
+  res = proxy_reverse_shm_as_datastore(&ds, NULL, 0);
+  fail_unless(res == 0, "Failed to get SHM datastore: %s", strerror(errno));
+
+  fh = test_prep();
+  fclose(fh);
+
+  main_server->sid = 1;
+
+  c = add_config_param("ProxyReverseServers", 2, NULL, NULL);
+  backends = make_array(c->pool, 2, sizeof(struct proxy_conn *));
+  pconn = proxy_conn_create(c->pool, "ftp://127.0.0.1:21");
+  *((const struct proxy_conn **) push_array(backends)) = pconn;
+  pconn = proxy_conn_create(c->pool, "ftp://127.0.0.1:2121");
+  *((const struct proxy_conn **) push_array(backends)) = pconn;
+  c->argv[0] = backends;
+
+  mark_point();
+  dsh = (ds.init)(p, NULL, flags);
+  fail_unless(dsh == NULL, "Failed to handle null tables dir");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dsh = (ds.init)(p, test_dir, flags);
+  fail_unless(dsh != NULL, "Failed to init SHM datastore: %s",
+    strerror(errno));
+
+  res = (ds.policy_init)(p, dsh, PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1,
+    backends, 0);
+  fail_unless(res == 0, "Failed to init LeastConns policy: %s",
+    strerror(errno));
+
+  res = (ds.close)(p, dsh);
+  fail_unless(res == 0, "Failed to close SHM datastore: %s", strerror(errno));
+
+  mark_point();
+  dsh = (ds.open)(p, test_dir, backends);
+  fail_unless(dsh != NULL, "Failed to open SHM datastore: %s",
+    strerror(errno));
+
+  /* LeastConns */
+  backend_id = -1;
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 0, "Expected backend ID 0, got %d", backend_id);
+
+  res = (ds.policy_update_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, backend_id, 1, 10);
+  fail_unless(res == 0, "Failed to update backend: %s", strerror(errno));
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 1, "Expected backend ID 1, got %d", backend_id);
+
+  res = (ds.policy_update_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, 1, 1, 20);
+  fail_unless(res == 0, "Failed to update backend: %s", strerror(errno));
+
+  res = (ds.policy_update_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, 0, -1, -1);
+  fail_unless(res == 0, "Failed to update backend: %s", strerror(errno));
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 0, "Expected backend ID 0, got %d", backend_id);
+
+  /* LeastResponseTime: backend 0 has no connections, backend 1 has one. */
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME, 1, NULL, NULL,
+    &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 0, "Expected backend ID 0, got %d", backend_id);
+
+  /* LeastResponseTime: backend 1 has one connection, but is much faster. */
+  res = (ds.policy_latency_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME, 1, 0,
+    PROXY_REVERSE_LATENCY_CONNECT, 2000);
+  fail_unless(res == 0, "Failed to record latency: %s", strerror(errno));
+
+  res = (ds.policy_latency_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME, 1, 1,
+    PROXY_REVERSE_LATENCY_CONNECT, 10);
+  fail_unless(res == 0, "Failed to record latency: %s", strerror(errno));
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME, 1, NULL, NULL,
+    &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 1, "Expected backend ID 1, got %d", backend_id);
+
+  /* One slow sample does not outweigh the average. */
+  res = (ds.policy_latency_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME, 1, 1,
+    PROXY_REVERSE_LATENCY_CONNECT, 1000);
+  fail_unless(res == 0, "Failed to record latency: %s", strerror(errno));
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME, 1, NULL, NULL,
+    &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 1, "Expected backend ID 1, got %d", backend_id);
+
+  res = (ds.policy_latency_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_RESPONSE_TIME, 1, 1, 0, 10);
+  fail_unless(res < 0, "Failed to handle invalid latency phase");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* LeastTransfers: backend 0 has no connections, backend 1 has one. */
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 0, "Expected backend ID 0, got %d", backend_id);
+
+  /* LeastTransfers: backend 0 now has a transfer in flight. */
+  res = (ds.policy_xfer_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS, 1, 0, 1, 0);
+  fail_unless(res == 0, "Failed to record transfer: %s", strerror(errno));
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 1, "Expected backend ID 1, got %d", backend_id);
+
+  /* LeastTransfers: backend 1 has a transfer in flight too, but a busier
+   * one.
+   */
+  res = (ds.policy_xfer_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS, 1, 1, 1, 1048576);
+  fail_unless(res == 0, "Failed to record transfer: %s", strerror(errno));
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 0, "Expected backend ID 0, got %d", backend_id);
+
+  res = (ds.policy_xfer_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS, 1, 0, -1, 0);
+  fail_unless(res == 0, "Failed to record transfer: %s", strerror(errno));
+
+  res = (ds.policy_xfer_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS, 1, 1, -1, 0);
+  fail_unless(res == 0, "Failed to record transfer: %s", strerror(errno));
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_TRANSFERS, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 0, "Expected backend ID 0, got %d", backend_id);
+
+  /* RoundRobin */
+  res = (ds.policy_init)(p, dsh, PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN, 1,
+    backends, 0);
+  fail_unless(res == 0, "Failed to init RoundRobin policy: %s",
+    strerror(errno));
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 0, "Expected backend ID 0, got %d", backend_id);
+
+  res = (ds.policy_used_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN, 1, backend_id);
+  fail_unless(res == 0, "Failed to use backend: %s", strerror(errno));
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 1, "Expected backend ID 1, got %d", backend_id);
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 0, "Expected backend ID 0, got %d", backend_id);
+
+  /* Shuffle: both backends are used once per cycle. */
+  res = (ds.policy_init)(p, dsh, PROXY_REVERSE_CONNECT_POLICY_SHUFFLE, 1,
+    backends, 0);
+  fail_unless(res == 0, "Failed to init Shuffle policy: %s", strerror(errno));
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_SHUFFLE, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+
+  res = (ds.policy_used_backend)(p, dsh, PROXY_REVERSE_CONNECT_POLICY_SHUFFLE,
+    1, backend_id);
+  fail_unless(res == 0, "Failed to use backend: %s", strerror(errno));
+
+  res = backend_id;
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_SHUFFLE, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id != res, "Expected backend ID other than %d", res);
+
+  /* The next cycle uses a new permutation, again of both backends. */
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_SHUFFLE, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+
+  res = backend_id;
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_SHUFFLE, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id != res, "Expected backend ID other than %d", res);
+
+  /* Health: unhealthy backends are skipped, until their cool-down passes. */
+  res = (ds.policy_health_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, 0, (uint64_t) -1);
+  fail_unless(res == 0, "Failed to mark backend unhealthy: %s",
+    strerror(errno));
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 1, "Expected backend ID 1, got %d", backend_id);
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 1, "Expected backend ID 1, got %d", backend_id);
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_ROUND_ROBIN, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 1, "Expected backend ID 1, got %d", backend_id);
+
+  /* If all backends are unhealthy, their health is ignored. */
+  res = (ds.policy_health_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, 1, (uint64_t) -1);
+  fail_unless(res == 0, "Failed to mark backend unhealthy: %s",
+    strerror(errno));
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 0, "Expected backend ID 0, got %d", backend_id);
+
+  /* A successful connection marks the backend healthy again. */
+  res = (ds.policy_update_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, 1, 0, 20);
+  fail_unless(res == 0, "Failed to update backend: %s", strerror(errno));
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 1, "Expected backend ID 1, got %d", backend_id);
+
+  /* Once its cool-down has passed, one selection probes the backend. */
+  res = (ds.policy_health_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, 0, 1);
+  fail_unless(res == 0, "Failed to mark backend unhealthy: %s",
+    strerror(errno));
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 0, "Expected backend ID 0, got %d", backend_id);
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 1, "Expected backend ID 1, got %d", backend_id);
+
+  res = (ds.policy_health_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, 0, 0);
+  fail_unless(res == 0, "Failed to mark backend healthy: %s",
+    strerror(errno));
+
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 1, NULL, NULL, &backend_id);
+  fail_unless(pconn != NULL, "Failed to get backend: %s", strerror(errno));
+  fail_unless(backend_id == 0, "Expected backend ID 0, got %d", backend_id);
+
+  /* Unknown vhost */
+  pconn = (ds.policy_next_backend)(p, dsh,
+    PROXY_REVERSE_CONNECT_POLICY_LEAST_CONNS, 7, NULL, NULL, &backend_id);
+  fail_unless(pconn == NULL, "Failed to handle unknown vhost ID");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got '%s' (%d)", ENOENT,
+    strerror(errno), errno);
+
+  res = (ds.close)(p, dsh);
+  fail_unless(res == 0, "Failed to close SHM datastore: %s", strerror(errno));
+
+  test_cleanup(p);
+}
+END_TEST
+
+START_TEST (reverse_health_test) {
+  int fd, res;
+  long connect_ms = 0, banner_ms = 0;
+  struct proxy_reverse_datastore ds;
+  struct sockaddr_in sin;
+  socklen_t sinlen;
+  const struct proxy_conn *pconn;
+  char *uri;
+
+  mark_point();
+  res = proxy_reverse_health_init(NULL, NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* With no vhosts configured for health checks, no worker is started. */
+  memset(&ds, 0, sizeof(ds));
+  res = proxy_reverse_shm_as_datastore(&ds, NULL, 0);
+  fail_unless(res == 0, "Failed to get SHM datastore: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_reverse_health_init(p, test_dir, &ds);
+  fail_unless(res == 0, "Failed to init health checks: %s", strerror(errno));
+
+  res = proxy_reverse_health_free(p);
+  fail_unless(res == 0, "Failed to free health checks: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_reverse_health_check_backend(NULL, NULL, 0, NULL, NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* Find a local port with nothing listening on it. */
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  fail_unless(fd >= 0, "Failed to create socket: %s", strerror(errno));
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = 0;
+  res = bind(fd, (struct sockaddr *) &sin, sizeof(sin));
+  fail_unless(res == 0, "Failed to bind socket: %s", strerror(errno));
+
+  sinlen = sizeof(sin);
+  res = getsockname(fd, (struct sockaddr *) &sin, &sinlen);
+  fail_unless(res == 0, "Failed to get socket name: %s", strerror(errno));
+  (void) close(fd);
+
+  uri = pcalloc(p, 64);
+  snprintf(uri, 63, "ftp://127.0.0.1:%u", ntohs(sin.sin_port));
+  pconn = proxy_conn_create(p, uri);
+  fail_unless(pconn != NULL, "Failed to create conn for '%s': %s", uri,
+    strerror(errno));
+
+  mark_point();
+  res = proxy_reverse_health_check_backend(p, pconn, 1, NULL, &connect_ms,
+    &banner_ms);
+  fail_unless(res < 0, "Failed to handle unreachable backend '%s'", uri);
+  fail_unless(errno == ECONNREFUSED, "Expected ECONNREFUSED (%d), got '%s' (%d)",
+    ECONNREFUSED, strerror(errno), errno);
+}
+END_TEST
+
+START_TEST (reverse_connpool_test) {
+  int res;
+  struct proxy_reverse_connpool_conn *pooled;
+  const struct proxy_conn *pconn;
+
+  mark_point();
+  res = proxy_reverse_connpool_init(NULL);
+  fail_unless(res < 0, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* With no vhosts configured for pooling, no keeper is started. */
+  mark_point();
+  res = proxy_reverse_connpool_init(p);
+  fail_unless(res == 0, "Failed to init connection pool: %s", strerror(errno));
+
+  mark_point();
+  res = proxy_reverse_connpool_sess_init();
+  fail_unless(res == 0, "Failed to init session connection pool: %s",
+    strerror(errno));
+
+  mark_point();
+  pooled = proxy_reverse_connpool_get(NULL, 0, NULL);
+  fail_unless(pooled == NULL, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  pooled = proxy_reverse_connpool_get(p, 0, NULL);
+  fail_unless(pooled == NULL, "Failed to handle null conn");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  pconn = proxy_conn_create(p, "ftp://127.0.0.1:21");
+  fail_unless(pconn != NULL, "Failed to create conn: %s", strerror(errno));
+
+  /* Without a keeper, there are no pooled connections. */
+  mark_point();
+  pooled = proxy_reverse_connpool_get(p, main_server->sid, pconn);
+  fail_unless(pooled == NULL, "Got pooled connection unexpectedly");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got '%s' (%d)", ENOENT,
+    strerror(errno), errno);
+
+  res = proxy_reverse_connpool_free(p);
+  fail_unless(res == 0, "Failed to free connection pool: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (reverse_connpool_stalled_refill_test) {
+  int fd, res, status = 0;
+  struct sockaddr_in sin;
+  socklen_t sinlen;
+  char *uri;
+  config_rec *c;
+  array_header *backends;
+  const struct proxy_conn *pconn;
+  pid_t pid;
+
+  /* A backend which accepts connections, but never sends its banner, so that
+   * opening a pooled connection to it stalls for ProxyTimeoutConnect.
+   */
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  fail_unless(fd >= 0, "Failed to create socket: %s", strerror(errno));
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = 0;
+  res = bind(fd, (struct sockaddr *) &sin, sizeof(sin));
+  fail_unless(res == 0, "Failed to bind socket: %s", strerror(errno));
+
+  res = listen(fd, 5);
+  fail_unless(res == 0, "Failed to listen on socket: %s", strerror(errno));
+
+  sinlen = sizeof(sin);
+  res = getsockname(fd, (struct sockaddr *) &sin, &sinlen);
+  fail_unless(res == 0, "Failed to get socket name: %s", strerror(errno));
+
+  uri = pcalloc(p, 64);
+  snprintf(uri, 63, "ftp://127.0.0.1:%u", ntohs(sin.sin_port));
+
+  c = add_config_param("ProxyEngine", 1, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = TRUE;
+
+  c = add_config_param("ProxyRole", 1, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = PROXY_ROLE_REVERSE;
+
+  c = add_config_param("ProxyReverseConnectionPool", 2, NULL, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = 1;
+  c->argv[1] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[1]) = 30;
+
+  c = add_config_param("ProxyTimeoutConnect", 1, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = 5;
+
+  c = add_config_param("ProxyReverseServers", 2, NULL, NULL);
+  backends = make_array(c->pool, 1, sizeof(struct proxy_conn *));
+  pconn = proxy_conn_create(c->pool, uri);
+  fail_unless(pconn != NULL, "Failed to create conn for '%s': %s", uri,
+    strerror(errno));
+  *((const struct proxy_conn **) push_array(backends)) = pconn;
+  c->argv[0] = backends;
+
+  mark_point();
+  res = proxy_reverse_connpool_init(p);
+  fail_unless(res == 0, "Failed to init connection pool: %s", strerror(errno));
+
+  /* The session asks for a connection while the keeper's refill is stalled;
+   * it is told at once that there is none, rather than waiting for a reply.
+   */
+  pid = fork();
+  fail_unless(pid >= 0, "Failed to fork: %s", strerror(errno));
+
+  if (pid == 0) {
+    struct proxy_reverse_connpool_conn *pooled;
+    uint64_t start_ms, end_ms;
+
+    (void) proxy_reverse_connpool_sess_init();
+
+    /* Give the keeper time to start the refill. */
+    (void) pr_timer_usleep(250 * 1000);
+
+    pr_gettimeofday_millis(&start_ms);
+    pooled = proxy_reverse_connpool_get(p, main_server->sid, pconn);
+    pr_gettimeofday_millis(&end_ms);
+
+    if (pooled != NULL ||
+        errno != ENOENT) {
+      _exit(1);
+    }
+
+    if (end_ms - start_ms >= 250) {
+      _exit(2);
+    }
+
+    _exit(0);
+  }
+
+  (void) waitpid(pid, &status, 0);
+
+  res = proxy_reverse_connpool_free(p);
+  fail_unless(res == 0, "Failed to free connection pool: %s", strerror(errno));
+  (void) close(fd);
+
+  fail_unless(WIFEXITED(status), "Session process did not exit");
+  fail_unless(WEXITSTATUS(status) != 1,
+    "Expected no pooled connection for stalled backend");
+  fail_unless(WEXITSTATUS(status) != 2,
+    "Request waited on the stalled refill");
+  fail_unless(WEXITSTATUS(status) == 0, "Unexpected exit status %d",
+    WEXITSTATUS(status));
+}
+END_TEST
+
 Suite *tests_get_reverse_suite(void) {
   Suite *suite;
   TCase *testcase;
@@ -1027,9 +2141,20 @@ Suite *tests_get_reverse_suite(void) {
   tcase_add_test(testcase, reverse_json_parse_uris_empty_test);
   tcase_add_test(testcase, reverse_json_parse_uris_malformed_test);
   tcase_add_test(testcase, reverse_json_parse_uris_usable_test);
+  tcase_add_test(testcase, reverse_json_parse_uris_weighted_test);
   tcase_add_test(testcase, reverse_connect_get_policy_test);
+  tcase_add_test(testcase, reverse_weighted_test);
+  tcase_add_test(testcase, reverse_chash_test);
+  tcase_add_test(testcase, reverse_perhost_test);
   tcase_add_test(testcase, reverse_use_proxy_auth_test);
   tcase_add_test(testcase, reverse_have_authenticated_test);
+  tcase_add_test(testcase, reverse_latency_test);
+  tcase_add_test(testcase, reverse_xfer_test);
+  tcase_add_test(testcase, reverse_lease_test);
+  tcase_add_test(testcase, reverse_shm_datastore_test);
+  tcase_add_test(testcase, reverse_health_test);
+  tcase_add_test(testcase, reverse_connpool_test);
+  tcase_add_test(testcase, reverse_connpool_stalled_refill_test);
 
   suite_add_tcase(suite, testcase);
   return suite;
@@ -31,6 +31,7 @@ int ServerUseReverseDNS = FALSE;
 server_rec *main_server = NULL;
 pid_t mpid = 1;
 unsigned char is_master = TRUE;
+char ServerType = SERVER_STANDALONE;
 volatile unsigned int recvd_signal_flags = 0;
 module *static_modules[] = { NULL };
 module *loaded_modules = NULL;
@@ -31,7 +31,10 @@ struct testsuite_info {
 
 static struct testsuite_info suites[] = {
   { "db",		tests_get_db_suite },
+  { "evloop",		tests_get_evloop_suite },
+  { "metrics",		tests_get_metrics_suite },
   { "conn", 		tests_get_conn_suite },
+  { "dns",		tests_get_dns_suite },
   { "netio",		tests_get_netio_suite },
   { "inet",		tests_get_inet_suite },
   { "random", 		tests_get_random_suite },
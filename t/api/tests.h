@@ -31,7 +31,10 @@
 
 #include "proxy/random.h"
 #include "proxy/db.h"
+#include "proxy/evloop.h"
+#include "proxy/metrics.h"
 #include "proxy/conn.h"
+#include "proxy/dns.h"
 #include "proxy/netio.h"
 #include "proxy/inet.h"
 #include "proxy/str.h"
@@ -39,10 +42,16 @@
 #include "proxy/tls.h"
 #include "proxy/tls/db.h"
 #include "proxy/tls/redis.h"
+#include "proxy/tls/shm.h"
 #include "proxy/session.h"
 #include "proxy/reverse.h"
 #include "proxy/reverse/db.h"
 #include "proxy/reverse/redis.h"
+#include "proxy/reverse/shm.h"
+#include "proxy/reverse/health.h"
+#include "proxy/reverse/connpool.h"
+#include "proxy/reverse/chash.h"
+#include "proxy/reverse/perhost.h"
 #include "proxy/forward.h"
 #include "proxy/ftp/msg.h"
 #include "proxy/ftp/conn.h"
@@ -64,7 +73,10 @@ int tests_stubs_set_next_cmd(cmd_rec *cmd);
 
 Suite *tests_get_conn_suite(void);
 Suite *tests_get_db_suite(void);
+Suite *tests_get_dns_suite(void);
+Suite *tests_get_evloop_suite(void);
 Suite *tests_get_inet_suite(void);
+Suite *tests_get_metrics_suite(void);
 Suite *tests_get_netio_suite(void);
 Suite *tests_get_random_suite(void);
 Suite *tests_get_reverse_suite(void);
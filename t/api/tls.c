@@ -60,6 +60,39 @@ static void create_main_server(void) {
   main_server->ServerPort = 21;
 }
 
+#ifdef PR_USE_OPENSSL
+static server_rec *create_proxy_vhost(unsigned int sid, const char *ca_path) {
+  server_rec *s;
+  config_rec *c;
+
+  if (sid == main_server->sid) {
+    s = main_server;
+
+  } else {
+    s = (server_rec *) pcalloc(main_server->pool, sizeof(server_rec));
+    xaset_insert(server_list, (xasetmember_t *) s);
+
+    s->pool = main_server->pool;
+    s->conf = xaset_create(main_server->pool, NULL);
+    s->set = server_list;
+    s->sid = sid;
+    s->ServerName = "Test VirtualHost";
+  }
+
+  c = add_config_param_set(&(s->conf), "ProxyEngine", 1, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = TRUE;
+
+  if (ca_path != NULL) {
+    c = add_config_param_set(&(s->conf), "ProxyTLSCACertificatePath", 1,
+      NULL);
+    c->argv[0] = pstrdup(c->pool, ca_path);
+  }
+
+  return s;
+}
+#endif /* PR_USE_OPENSSL */
+
 static int create_test_dir(void) {
   int res;
   mode_t perms;
@@ -159,6 +192,415 @@ START_TEST (tls_init_test) {
 }
 END_TEST
 
+START_TEST (tls_trust_store_test) {
+#ifdef PR_USE_OPENSSL
+  int res, flags = PROXY_DB_OPEN_FL_SKIP_VACUUM;
+  X509_STORE *store, *store2, *store3, *store4;
+
+  mark_point();
+  store = proxy_tls_get_trust_store(main_server->sid);
+  fail_unless(store == NULL, "Found unexpected trust store");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got '%s' (%d)", ENOENT,
+    strerror(errno), errno);
+
+  /* Two vhosts with the same CA locations, and one with its own. */
+  (void) create_proxy_vhost(main_server->sid, NULL);
+  (void) create_proxy_vhost(2, NULL);
+  (void) create_proxy_vhost(3, test_dir);
+
+  mark_point();
+  res = proxy_tls_init(p, test_dir, flags);
+  fail_unless(res == 0, "Failed to init TLS API resources: %s",
+    strerror(errno));
+
+  store = proxy_tls_get_trust_store(main_server->sid);
+  fail_unless(store != NULL, "Failed to get trust store: %s", strerror(errno));
+
+  /* The store is loaded once, and handed out again, rather than reloaded. */
+  store2 = proxy_tls_get_trust_store(main_server->sid);
+  fail_unless(store2 == store, "Expected same trust store %p, got %p",
+    store, store2);
+  X509_STORE_free(store2);
+
+  /* Vhosts with the same CA locations share the same store. */
+  store2 = proxy_tls_get_trust_store(2);
+  fail_unless(store2 == store, "Expected shared trust store %p, got %p",
+    store, store2);
+
+  store3 = proxy_tls_get_trust_store(3);
+  fail_unless(store3 != NULL, "Failed to get trust store: %s", strerror(errno));
+  fail_unless(store3 != store, "Expected separate trust store, got shared %p",
+    store3);
+
+  store4 = proxy_tls_get_trust_store(4);
+  fail_unless(store4 == NULL, "Found unexpected trust store for unknown vhost");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got '%s' (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  res = proxy_tls_free(p);
+  fail_unless(res == 0, "Failed to free TLS API resources: %s",
+    strerror(errno));
+
+  /* Our references outlive the module's own. */
+  mark_point();
+  X509_STORE_free(store);
+  X509_STORE_free(store2);
+  X509_STORE_free(store3);
+
+  store = proxy_tls_get_trust_store(main_server->sid);
+  fail_unless(store == NULL, "Found trust store after free");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got '%s' (%d)", ENOENT,
+    strerror(errno), errno);
+#endif /* PR_USE_OPENSSL */
+}
+END_TEST
+
+START_TEST (tls_ktls_overhead_test) {
+#ifdef PR_USE_OPENSSL
+  int overhead;
+
+  overhead = proxy_tls_ktls_overhead(TLS1_2_VERSION, 0);
+  fail_unless(overhead == 0, "Expected 0 bytes of overhead, got %d",
+    overhead);
+
+  /* Less than a full record is still one record. */
+  overhead = proxy_tls_ktls_overhead(TLS1_2_VERSION, 1);
+  fail_unless(overhead == PROXY_TLS_KTLS_TLS12_RECORD_OVERHEAD,
+    "Expected %d bytes of overhead, got %d",
+    PROXY_TLS_KTLS_TLS12_RECORD_OVERHEAD, overhead);
+
+  overhead = proxy_tls_ktls_overhead(TLS1_2_VERSION, 512);
+  fail_unless(overhead == PROXY_TLS_KTLS_TLS12_RECORD_OVERHEAD,
+    "Expected %d bytes of overhead, got %d",
+    PROXY_TLS_KTLS_TLS12_RECORD_OVERHEAD, overhead);
+
+  /* Exactly one full record. */
+  overhead = proxy_tls_ktls_overhead(TLS1_2_VERSION, SSL3_RT_MAX_PLAIN_LENGTH);
+  fail_unless(overhead == PROXY_TLS_KTLS_TLS12_RECORD_OVERHEAD,
+    "Expected %d bytes of overhead, got %d",
+    PROXY_TLS_KTLS_TLS12_RECORD_OVERHEAD, overhead);
+
+  /* Multiple records, the last of them partial. */
+  overhead = proxy_tls_ktls_overhead(TLS1_2_VERSION,
+    SSL3_RT_MAX_PLAIN_LENGTH + 1);
+  fail_unless(overhead == 2 * PROXY_TLS_KTLS_TLS12_RECORD_OVERHEAD,
+    "Expected %d bytes of overhead, got %d",
+    2 * PROXY_TLS_KTLS_TLS12_RECORD_OVERHEAD, overhead);
+
+  overhead = proxy_tls_ktls_overhead(TLS1_2_VERSION,
+    (3 * SSL3_RT_MAX_PLAIN_LENGTH) + 100);
+  fail_unless(overhead == 4 * PROXY_TLS_KTLS_TLS12_RECORD_OVERHEAD,
+    "Expected %d bytes of overhead, got %d",
+    4 * PROXY_TLS_KTLS_TLS12_RECORD_OVERHEAD, overhead);
+
+  /* Multiple full records. */
+  overhead = proxy_tls_ktls_overhead(TLS1_2_VERSION,
+    3 * SSL3_RT_MAX_PLAIN_LENGTH);
+  fail_unless(overhead == 3 * PROXY_TLS_KTLS_TLS12_RECORD_OVERHEAD,
+    "Expected %d bytes of overhead, got %d",
+    3 * PROXY_TLS_KTLS_TLS12_RECORD_OVERHEAD, overhead);
+
+# if defined(TLS1_3_VERSION)
+  overhead = proxy_tls_ktls_overhead(TLS1_3_VERSION, 1);
+  fail_unless(overhead == PROXY_TLS_KTLS_TLS13_RECORD_OVERHEAD,
+    "Expected %d bytes of overhead, got %d",
+    PROXY_TLS_KTLS_TLS13_RECORD_OVERHEAD, overhead);
+
+  overhead = proxy_tls_ktls_overhead(TLS1_3_VERSION, SSL3_RT_MAX_PLAIN_LENGTH);
+  fail_unless(overhead == PROXY_TLS_KTLS_TLS13_RECORD_OVERHEAD,
+    "Expected %d bytes of overhead, got %d",
+    PROXY_TLS_KTLS_TLS13_RECORD_OVERHEAD, overhead);
+
+  overhead = proxy_tls_ktls_overhead(TLS1_3_VERSION,
+    (2 * SSL3_RT_MAX_PLAIN_LENGTH) + 1);
+  fail_unless(overhead == 3 * PROXY_TLS_KTLS_TLS13_RECORD_OVERHEAD,
+    "Expected %d bytes of overhead, got %d",
+    3 * PROXY_TLS_KTLS_TLS13_RECORD_OVERHEAD, overhead);
+# endif /* TLS1_3_VERSION */
+#endif /* PR_USE_OPENSSL */
+}
+END_TEST
+
+START_TEST (tls_shm_datastore_test) {
+  int res;
+  struct proxy_tls_datastore ds;
+  void *dsh;
+#ifdef PR_USE_OPENSSL
+  SSL_SESSION *sess, *cached_sess;
+  const char *key = "ftp://127.0.0.1:21";
+#endif /* PR_USE_OPENSSL */
+
+  mark_point();
+  res = proxy_tls_shm_as_datastore(NULL, NULL, 0);
+  fail_unless(res < 0, "Failed to handle null datastore");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  memset(&ds, 0, sizeof(ds));
+  res = proxy_tls_shm_as_datastore(&ds, NULL, 0);
+  fail_unless(res == 0, "Failed to get SHM datastore: %s", strerror(errno));
+
+#ifdef PR_USE_OPENSSL
+  mark_point();
+  res = (ds.init)(p, test_dir, 0);
+  fail_unless(res == 0, "Failed to init SHM datastore: %s", strerror(errno));
+
+  dsh = (ds.open)(p, test_dir, 0UL);
+  fail_unless(dsh != NULL, "Failed to open SHM datastore: %s",
+    strerror(errno));
+
+  res = (ds.count_sess)(p, dsh);
+  fail_unless(res == 0, "Expected 0 sessions, got %d", res);
+
+  mark_point();
+  cached_sess = (ds.get_sess)(p, dsh, key);
+  fail_unless(cached_sess == NULL, "Found unexpected session");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got '%s' (%d)", ENOENT,
+    strerror(errno), errno);
+
+  sess = SSL_SESSION_new();
+  fail_unless(sess != NULL, "Failed to allocate SSL session");
+  SSL_SESSION_set_time(sess, time(NULL));
+
+  mark_point();
+  res = (ds.add_sess)(p, dsh, key, sess);
+  fail_unless(res == 0, "Failed to add session: %s", strerror(errno));
+
+  /* Replacing the session for the same key does not change the count. */
+  res = (ds.add_sess)(p, dsh, key, sess);
+  fail_unless(res == 0, "Failed to add session: %s", strerror(errno));
+
+  res = (ds.count_sess)(p, dsh);
+  fail_unless(res == 1, "Expected 1 session, got %d", res);
+
+  mark_point();
+  cached_sess = (ds.get_sess)(p, dsh, key);
+  fail_unless(cached_sess != NULL, "Failed to get session: %s",
+    strerror(errno));
+  SSL_SESSION_free(cached_sess);
+
+  mark_point();
+  res = (ds.remove_sess)(p, dsh, key);
+  fail_unless(res == 0, "Failed to remove session: %s", strerror(errno));
+
+  res = (ds.count_sess)(p, dsh);
+  fail_unless(res == 0, "Expected 0 sessions, got %d", res);
+
+  res = (ds.remove_sess)(p, dsh, key);
+  fail_unless(res < 0, "Failed to handle already-removed session");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got '%s' (%d)", ENOENT,
+    strerror(errno), errno);
+
+  SSL_SESSION_free(sess);
+
+  res = (ds.close)(p, dsh);
+  fail_unless(res == 0, "Failed to close SHM datastore: %s", strerror(errno));
+#else
+  (void) dsh;
+#endif /* PR_USE_OPENSSL */
+}
+END_TEST
+
+START_TEST (tls_shm_datastore_take_sess_test) {
+#ifdef PR_USE_OPENSSL
+  register unsigned int i;
+  int res, taken = 0;
+  struct proxy_tls_datastore ds;
+  void *dsh;
+  SSL_SESSION *sess, *cached_sess;
+  const char *key = "ftp://127.0.0.1:21#1";
+  pid_t pids[4];
+
+  memset(&ds, 0, sizeof(ds));
+  res = proxy_tls_shm_as_datastore(&ds, NULL, 0);
+  fail_unless(res == 0, "Failed to get SHM datastore: %s", strerror(errno));
+
+  res = (ds.init)(p, test_dir, 0);
+  fail_unless(res == 0, "Failed to init SHM datastore: %s", strerror(errno));
+
+  dsh = (ds.open)(p, test_dir, 0UL);
+  fail_unless(dsh != NULL, "Failed to open SHM datastore: %s",
+    strerror(errno));
+
+  mark_point();
+  cached_sess = (ds.take_sess)(p, dsh, key);
+  fail_unless(cached_sess == NULL, "Took unexpected session");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got '%s' (%d)", ENOENT,
+    strerror(errno), errno);
+
+  sess = SSL_SESSION_new();
+  fail_unless(sess != NULL, "Failed to allocate SSL session");
+  SSL_SESSION_set_time(sess, time(NULL));
+
+  res = (ds.add_sess)(p, dsh, key, sess);
+  fail_unless(res == 0, "Failed to add session: %s", strerror(errno));
+
+  /* Of several processes taking the same session at once, only one gets
+   * it.
+   */
+  mark_point();
+  for (i = 0; i < 4; i++) {
+    pids[i] = fork();
+    fail_unless(pids[i] >= 0, "Failed to fork: %s", strerror(errno));
+
+    if (pids[i] == 0) {
+      cached_sess = (ds.take_sess)(p, dsh, key);
+      if (cached_sess == NULL) {
+        _exit(1);
+      }
+
+      SSL_SESSION_free(cached_sess);
+      _exit(0);
+    }
+  }
+
+  for (i = 0; i < 4; i++) {
+    int status = 0;
+
+    (void) waitpid(pids[i], &status, 0);
+    if (WIFEXITED(status) &&
+        WEXITSTATUS(status) == 0) {
+      taken++;
+    }
+  }
+
+  fail_unless(taken == 1, "Expected session to be taken once, got %d", taken);
+
+  res = (ds.count_sess)(p, dsh);
+  fail_unless(res == 0, "Expected 0 sessions, got %d", res);
+
+  cached_sess = (ds.take_sess)(p, dsh, key);
+  fail_unless(cached_sess == NULL, "Took already-taken session");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got '%s' (%d)", ENOENT,
+    strerror(errno), errno);
+
+  /* A session added again can be taken again. */
+  res = (ds.add_sess)(p, dsh, key, sess);
+  fail_unless(res == 0, "Failed to add session: %s", strerror(errno));
+
+  cached_sess = (ds.take_sess)(p, dsh, key);
+  fail_unless(cached_sess != NULL, "Failed to take session: %s",
+    strerror(errno));
+  SSL_SESSION_free(cached_sess);
+
+  cached_sess = (ds.get_sess)(p, dsh, key);
+  fail_unless(cached_sess == NULL, "Found taken session");
+
+  SSL_SESSION_free(sess);
+
+  res = (ds.close)(p, dsh);
+  fail_unless(res == 0, "Failed to close SHM datastore: %s", strerror(errno));
+#endif /* PR_USE_OPENSSL */
+}
+END_TEST
+
+START_TEST (tls_shm_datastore_take_sess_race_test) {
+#ifdef PR_USE_OPENSSL
+  register unsigned int i;
+  int res;
+  struct proxy_tls_datastore ds;
+  void *dsh;
+  SSL_SESSION *sess, *cached_sess;
+  const char *key = "ftp://127.0.0.1:21#2";
+
+  memset(&ds, 0, sizeof(ds));
+  res = proxy_tls_shm_as_datastore(&ds, NULL, 0);
+  fail_unless(res == 0, "Failed to get SHM datastore: %s", strerror(errno));
+
+  res = (ds.init)(p, test_dir, 0);
+  fail_unless(res == 0, "Failed to init SHM datastore: %s", strerror(errno));
+
+  dsh = (ds.open)(p, test_dir, 0UL);
+  fail_unless(dsh != NULL, "Failed to open SHM datastore: %s",
+    strerror(errno));
+
+  sess = SSL_SESSION_new();
+  fail_unless(sess != NULL, "Failed to allocate SSL session");
+  SSL_SESSION_set_time(sess, time(NULL));
+
+  /* Two claimants, released at the same moment, race to take the same slot;
+   * in every round, exactly one of them gets the session.
+   */
+  for (i = 0; i < 50; i++) {
+    register unsigned int j;
+    int ready_fds[2], go_fds[2], taken = 0;
+    pid_t pids[2];
+    char c;
+
+    res = (ds.add_sess)(p, dsh, key, sess);
+    fail_unless(res == 0, "Failed to add session: %s", strerror(errno));
+
+    res = pipe(ready_fds);
+    fail_unless(res == 0, "Failed to open pipe: %s", strerror(errno));
+    res = pipe(go_fds);
+    fail_unless(res == 0, "Failed to open pipe: %s", strerror(errno));
+
+    mark_point();
+    for (j = 0; j < 2; j++) {
+      pids[j] = fork();
+      fail_unless(pids[j] >= 0, "Failed to fork: %s", strerror(errno));
+
+      if (pids[j] == 0) {
+        (void) close(ready_fds[0]);
+        (void) close(go_fds[1]);
+
+        /* Tell the parent we are ready, then wait until it closes the pipe,
+         * which wakes both of us at once.
+         */
+        if (write(ready_fds[1], "r", 1) != 1 ||
+            read(go_fds[0], &c, 1) != 0) {
+          _exit(2);
+        }
+
+        cached_sess = (ds.take_sess)(p, dsh, key);
+        if (cached_sess == NULL) {
+          _exit(errno == ENOENT ? 1 : 2);
+        }
+
+        SSL_SESSION_free(cached_sess);
+        _exit(0);
+      }
+    }
+
+    (void) close(ready_fds[1]);
+    (void) close(go_fds[0]);
+
+    for (j = 0; j < 2; j++) {
+      fail_unless(read(ready_fds[0], &c, 1) == 1,
+        "Failed to wait for claimant: %s", strerror(errno));
+    }
+
+    (void) close(go_fds[1]);
+    (void) close(ready_fds[0]);
+
+    for (j = 0; j < 2; j++) {
+      int status = 0;
+
+      (void) waitpid(pids[j], &status, 0);
+      fail_unless(WIFEXITED(status) && WEXITSTATUS(status) != 2,
+        "Claimant failed unexpectedly (status %d)", status);
+
+      if (WEXITSTATUS(status) == 0) {
+        taken++;
+      }
+    }
+
+    fail_unless(taken == 1,
+      "Expected session to be taken once in round %u, got %d", i + 1, taken);
+
+    res = (ds.count_sess)(p, dsh);
+    fail_unless(res == 0, "Expected 0 sessions, got %d", res);
+  }
+
+  SSL_SESSION_free(sess);
+
+  res = (ds.close)(p, dsh);
+  fail_unless(res == 0, "Failed to close SHM datastore: %s", strerror(errno));
+#endif /* PR_USE_OPENSSL */
+}
+END_TEST
+
 START_TEST (tls_sess_free_test) {
   int res;
 
@@ -287,6 +729,11 @@ Suite *tests_get_tls_suite(void) {
 
   tcase_add_test(testcase, tls_free_test);
   tcase_add_test(testcase, tls_init_test);
+  tcase_add_test(testcase, tls_trust_store_test);
+  tcase_add_test(testcase, tls_ktls_overhead_test);
+  tcase_add_test(testcase, tls_shm_datastore_test);
+  tcase_add_test(testcase, tls_shm_datastore_take_sess_test);
+  tcase_add_test(testcase, tls_shm_datastore_take_sess_race_test);
   tcase_add_test(testcase, tls_sess_free_test);
   tcase_add_test(testcase, tls_sess_init_test);
   tcase_add_test(testcase, tls_using_tls_test);